@@ -0,0 +1,252 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Microbenchmark of the reply parser. Feeds ReplyParser_execute synthetic reply streams and reports MB/s and replies/s,
+ * no Redis server needed.
+ * The parser does not look at the payload of bulk replies, it only skips it, so for large bulks only replies/s is
+ * reported (MB/s would mostly reflect the size of the bulks).
+ * usage: ./bench [min seconds per stream]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libredis/module.h"
+#include "libredis/buffer.h"
+#include "libredis/parser.h"
+#include "libredis/reply.h"
+
+#define STREAM_SIZE (1024 * 1024 * 4)
+
+typedef void (*StreamGenerator)(Buffer *buffer, size_t *count);
+
+static void write_bulk(Buffer *buffer, size_t len)
+{
+	char header[32];
+	Buffer_write(buffer, header, snprintf(header, sizeof(header), "$%zu\r\n", len));
+	Byte *data = Buffer_extend(buffer, len + 2);
+	for(size_t i = 0; i < len; i++) {
+		data[i] = 'a' + (i % 26);
+	}
+	data[len] = CR;
+	data[len + 1] = LF;
+}
+
+static void write_line(Buffer *buffer, char type, const char *line)
+{
+	char tmp[128];
+	Buffer_write(buffer, tmp, snprintf(tmp, sizeof(tmp), "%c%s\r\n", type, line));
+}
+
+static void small_bulks(Buffer *buffer, size_t *count)
+{
+	while(Buffer_position(buffer) < STREAM_SIZE) {
+		write_bulk(buffer, 3 + (*count % 30));
+		(*count)++;
+	}
+}
+
+static void large_bulks(Buffer *buffer, size_t *count)
+{
+	while(Buffer_position(buffer) < STREAM_SIZE) {
+		write_bulk(buffer, 64 * 1024);
+		(*count)++;
+	}
+}
+
+static void integers(Buffer *buffer, size_t *count)
+{
+	char tmp[32];
+	while(Buffer_position(buffer) < STREAM_SIZE) {
+		snprintf(tmp, sizeof(tmp), "%zu", *count * 7919);
+		write_line(buffer, ':', tmp);
+		(*count)++;
+	}
+}
+
+static void multibulks(Buffer *buffer, size_t *count)
+{
+	char header[32];
+	while(Buffer_position(buffer) < STREAM_SIZE) {
+		Buffer_write(buffer, header, snprintf(header, sizeof(header), "*%d\r\n", 1000));
+		for(int i = 0; i < 1000; i++) {
+			if(i % 10 == 9) {
+				write_line(buffer, '$', "-1");
+			}
+			else {
+				write_bulk(buffer, 8 + (i % 16));
+			}
+		}
+		(*count)++;
+	}
+}
+
+/**
+ * Replies nested 32 levels deep, every level has a few scalars besides the next level (like EXEC of EVALs returning
+ * tables, or XREAD).
+ */
+static void nested(Buffer *buffer, size_t *count)
+{
+	while(Buffer_position(buffer) < STREAM_SIZE) {
+		for(int level = 0; level < 32; level++) {
+			Buffer_write(buffer, "*4\r\n", 4);
+			write_bulk(buffer, 6 + (level % 8));
+			write_line(buffer, ':', "1234");
+			write_line(buffer, '$', "-1");
+		}
+		Buffer_write(buffer, "*0\r\n", 4);
+		(*count)++;
+	}
+}
+
+static void mixed(Buffer *buffer, size_t *count)
+{
+	char tmp[32];
+	while(Buffer_position(buffer) < STREAM_SIZE) {
+		switch(*count % 6) {
+		case 0:
+			write_line(buffer, '+', "OK");
+			break;
+		case 1:
+			write_line(buffer, '-', "ERR unknown command");
+			break;
+		case 2:
+			snprintf(tmp, sizeof(tmp), "%zu", *count);
+			write_line(buffer, ':', tmp);
+			break;
+		case 3:
+			write_bulk(buffer, 10 + (*count % 200));
+			break;
+		case 4:
+			write_line(buffer, '$', "-1");
+			break;
+		case 5:
+			Buffer_write(buffer, "*3\r\n", 4);
+			write_bulk(buffer, 5);
+			write_line(buffer, '$', "-1");
+			write_bulk(buffer, 40);
+			break;
+		}
+		(*count)++;
+	}
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/**
+ * Parses the stream in buffer once, if max_read > 0 it is fed to the parser in reads of random size up to max_read bytes,
+ * like it would arrive from a socket. Returns the number of replies parsed.
+ */
+static size_t parse(ReplyParser *rp, ReplyArray *replies, Buffer *buffer, size_t max_read)
+{
+	size_t size = Buffer_position(buffer);
+	size_t len = 0;
+	size_t count = 0;
+	ReplyParser_reset(rp);
+	ReplyArray_clear(replies);
+	while(len < size) {
+		if(max_read > 0) {
+			size_t read = 1 + (rand() % max_read);
+			len = MIN(size, len + read);
+		}
+		else {
+			len = size;
+		}
+		while(1) {
+			ReplyParserResult result = ReplyParser_execute(rp, buffer, len, replies);
+			if(result == RPR_REPLY) {
+				ReplyArray_commit(replies);
+				count++;
+			}
+			else if(result == RPR_MORE) {
+				break;
+			}
+			else {
+				printf("parse error at %zu\n", len);
+				exit(1);
+			}
+		}
+	}
+	return count;
+}
+
+/**
+ * Parses the stream of the generator over and over for at least min_time seconds and reports the throughput.
+ * MB/s is only reported if report_bytes is set.
+ */
+static void run(const char *name, StreamGenerator generator, size_t max_read, size_t lazy_threshold, int report_bytes,
+		double min_time)
+{
+	size_t expected = 0;
+	Buffer *buffer = Buffer_new(STREAM_SIZE);
+	generator(buffer, &expected);
+
+	ReplyParser *rp = ReplyParser_new();
+	ReplyArray replies;
+	ReplyArray_init(&replies);
+	replies.lazy_threshold = lazy_threshold;
+
+	srand(42);
+	parse(rp, &replies, buffer, max_read); //warm up
+	size_t iterations = 0;
+	double start = now();
+	double elapsed;
+	do {
+		if(parse(rp, &replies, buffer, max_read) != expected) {
+			printf("%s: unexpected number of replies\n", name);
+			exit(1);
+		}
+		iterations++;
+		elapsed = now() - start;
+	} while(elapsed < min_time);
+
+	double bytes = (double)Buffer_position(buffer) * iterations;
+	double count = (double)expected * iterations;
+	if(report_bytes) {
+		printf("%-26s %12.1f MB/s %14.0f replies/s\n", name, bytes / elapsed / (1024 * 1024), count / elapsed);
+	}
+	else {
+		printf("%-26s %17s %14.0f replies/s\n", name, "", count / elapsed);
+	}
+
+	ReplyArray_release(&replies);
+	ReplyParser_free(rp);
+	Buffer_free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+	double min_time = (argc > 1) ? atof(argv[1]) : 1.0;
+
+	Module *module = Module_new();
+	Module_init(module);
+
+	run("small bulks", small_bulks, 0, 0, 1, min_time);
+	run("large bulks", large_bulks, 0, 0, 0, min_time);
+	run("integers", integers, 0, 0, 1, min_time);
+	run("multibulk", multibulks, 0, 0, 1, min_time);
+	run("multibulk (lazy)", multibulks, 0, 64, 1, min_time);
+	run("nested multibulk", nested, 0, 0, 1, min_time);
+	run("nested multibulk (lazy)", nested, 0, 4, 1, min_time);
+	run("mixed", mixed, 0, 0, 1, min_time);
+	run("mixed (fragmented 4K)", mixed, 4096, 0, 1, min_time);
+	run("mixed (fragmented 64)", mixed, 64, 0, 1, min_time);
+	run("large bulks (fragmented)", large_bulks, 16 * 1024, 0, 0, min_time);
+
+	Module_free(module);
+
+	return 0;
+}
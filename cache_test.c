@@ -0,0 +1,536 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Tests of batches with a ReplyCache that need no Redis server. The commands written to a batch are executed by a
+ * small stand-in for the server (strings and hashes only), whose replies are parsed into the batch as
+ * Connection_read_data would. Random mixes of reads and writes are written to a batch with a cache and to one without,
+ * each executed on a server of its own, the replies must be the same.
+ * usage: ./cache_test [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "libredis/redis.h"
+#include "libredis/module.h"
+#include "libredis/batch.h"
+#include "libredis/buffer.h"
+#include "libredis/parser.h"
+#include "libredis/reply.h"
+
+#define MAX_ITEMS 256
+#define MAX_ARGS 16
+#define ITEM_SIZE 16
+#define NUM_KEYS 6
+#define NUM_FIELDS 3
+#define NUM_ROUNDS 400
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+/**
+ * A string (field is empty) or a field of a hash.
+ */
+typedef struct _Item
+{
+	char key[ITEM_SIZE];
+	char field[ITEM_SIZE];
+	char value[ITEM_SIZE];
+	int hash;
+} Item;
+
+typedef struct _Server
+{
+	Item items[MAX_ITEMS];
+	int count;
+} Server;
+
+static Item *Server_find(Server *server, const char *key, const char *field)
+{
+	for(int i = 0; i < server->count; i++) {
+		Item *item = &server->items[i];
+		if(strcmp(item->key, key) == 0 && (field == NULL || strcmp(item->field, field) == 0)) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+static void Server_remove(Server *server, Item *item)
+{
+	*item = server->items[--server->count];
+}
+
+/**
+ * Removes the key (all fields of a hash), returns whether it existed.
+ */
+static int Server_delete(Server *server, const char *key)
+{
+	int found = 0;
+	Item *item;
+	while((item = Server_find(server, key, NULL)) != NULL) {
+		Server_remove(server, item);
+		found = 1;
+	}
+	return found;
+}
+
+static void Server_set(Server *server, const char *key, const char *field, const char *value, int hash)
+{
+	Item *item = Server_find(server, key, hash ? field : NULL);
+	if(item == NULL) {
+		item = &server->items[server->count++];
+		snprintf(item->key, ITEM_SIZE, "%s", key);
+		snprintf(item->field, ITEM_SIZE, "%s", hash ? field : "");
+		item->hash = hash;
+	}
+	snprintf(item->value, ITEM_SIZE, "%s", value);
+}
+
+static void reply_bulk(Buffer *out, Item *item)
+{
+	char line[64];
+	if(item == NULL) {
+		Buffer_write(out, "$-1\r\n", 5);
+	}
+	else {
+		Buffer_write(out, line, snprintf(line, sizeof(line), "$%zu\r\n%s\r\n", strlen(item->value), item->value));
+	}
+}
+
+static void reply_line(Buffer *out, const char *line)
+{
+	Buffer_write(out, line, strlen(line));
+	Buffer_write(out, "\r\n", 2);
+}
+
+static void reply_integer(Buffer *out, int n)
+{
+	char line[32];
+	Buffer_write(out, line, snprintf(line, sizeof(line), ":%d\r\n", n));
+}
+
+#define WRONGTYPE "-WRONGTYPE Operation against a key holding the wrong kind of value"
+
+/**
+ * Executes the command and writes its reply to out.
+ */
+static void Server_execute(Server *server, int argc, char **argv, Buffer *out)
+{
+	const char *name = argv[0];
+	Item *item;
+	if(strcasecmp(name, "GET") == 0 || strcasecmp(name, "MGET") == 0) {
+		int multi = strcasecmp(name, "MGET") == 0;
+		if(multi) {
+			char line[32];
+			Buffer_write(out, line, snprintf(line, sizeof(line), "*%d\r\n", argc - 1));
+		}
+		for(int i = 1; i < argc; i++) {
+			item = Server_find(server, argv[i], NULL);
+			if(item != NULL && item->hash) {
+				if(multi) {
+					reply_bulk(out, NULL);
+				}
+				else {
+					reply_line(out, WRONGTYPE);
+				}
+			}
+			else {
+				reply_bulk(out, item);
+			}
+		}
+	}
+	else if(strcasecmp(name, "SET") == 0 || strcasecmp(name, "MSET") == 0) {
+		for(int i = 1; i + 1 < argc; i += 2) {
+			Server_delete(server, argv[i]);
+			Server_set(server, argv[i], NULL, argv[i + 1], 0);
+		}
+		reply_line(out, "+OK");
+	}
+	else if(strcasecmp(name, "DEL") == 0 || strcasecmp(name, "UNLINK") == 0) {
+		int n = 0;
+		for(int i = 1; i < argc; i++) {
+			n += Server_delete(server, argv[i]);
+		}
+		reply_integer(out, n);
+	}
+	else if(strcasecmp(name, "HGET") == 0) {
+		item = Server_find(server, argv[1], NULL);
+		if(item != NULL && !item->hash) {
+			reply_line(out, WRONGTYPE);
+		}
+		else {
+			reply_bulk(out, Server_find(server, argv[1], argv[2]));
+		}
+	}
+	else if(strcasecmp(name, "HSET") == 0) {
+		item = Server_find(server, argv[1], NULL);
+		if(item != NULL && !item->hash) {
+			reply_line(out, WRONGTYPE);
+			return;
+		}
+		int n = 0;
+		for(int i = 2; i + 1 < argc; i += 2) {
+			n += (Server_find(server, argv[1], argv[i]) == NULL);
+			Server_set(server, argv[1], argv[i], argv[i + 1], 1);
+		}
+		reply_integer(out, n);
+	}
+	else if(strcasecmp(name, "HDEL") == 0) {
+		item = Server_find(server, argv[1], NULL);
+		if(item != NULL && !item->hash) {
+			reply_line(out, WRONGTYPE);
+			return;
+		}
+		int n = 0;
+		for(int i = 2; i < argc; i++) {
+			if((item = Server_find(server, argv[1], argv[i])) != NULL) {
+				Server_remove(server, item);
+				n++;
+			}
+		}
+		reply_integer(out, n);
+	}
+	else if(strcasecmp(name, "FLUSHDB") == 0) {
+		server->count = 0;
+		reply_line(out, "+OK");
+	}
+	else {
+		reply_line(out, "-ERR unknown command");
+	}
+}
+
+/**
+ * Decodes the commands written to the batch, executes them on the server, and parses the replies into the batch.
+ */
+static void execute(Batch *batch, Server *server)
+{
+	Batch_end_run(batch);
+	Buffer *commands = Batch_write_buffer(batch);
+	Buffer *replies = Buffer_new(1024);
+	char *p = (char *)Buffer_data(commands);
+	char *end = p + Buffer_position(commands);
+	char args[MAX_ARGS][ITEM_SIZE];
+	char *argv[MAX_ARGS];
+	while(p < end) {
+		int argc = strtol(p + 1, &p, 10);
+		p += 2;
+		for(int i = 0; i < argc; i++) {
+			int len = strtol(p + 1, &p, 10);
+			snprintf(args[i], ITEM_SIZE, "%.*s", len, p + 2);
+			argv[i] = args[i];
+			p += 2 + len + 2;
+		}
+		Server_execute(server, argc, argv, replies);
+	}
+
+	ReplyParser *rp = ReplyParser_new();
+	Buffer *buffer = Batch_read_buffer(batch);
+	if(Buffer_position(replies) > 0) {
+		Buffer_write(buffer, (char *)Buffer_data(replies), Buffer_position(replies));
+	}
+	while(Batch_has_command(batch)) {
+		if(ReplyParser_execute(rp, buffer, Buffer_position(buffer), Batch_replies(batch)) != RPR_REPLY) {
+			CHECK(0, "could not parse the replies");
+			break;
+		}
+		Batch_add_reply(batch);
+	}
+	ReplyParser_free(rp);
+	Buffer_free(replies);
+}
+
+static void write_command(Batch *batch, int argc, const char *a0, const char *a1, const char *a2, const char *a3)
+{
+	const char *argv[4] = {a0, a1, a2, a3};
+	Batch_write_command(batch, argc, argv, NULL);
+}
+
+/**
+ * Compares the replies of a batch with those of the same commands on a batch without a cache.
+ */
+static void compare(Batch *batch, Batch *reference, int round)
+{
+	CHECK(Batch_reply_count(batch) == Batch_reply_count(reference), "round %d: %zu replies instead of %zu", round,
+			Batch_reply_count(batch), Batch_reply_count(reference));
+	for(size_t i = 0; i < Batch_reply_count(batch) && i < Batch_reply_count(reference); i++) {
+		ReplyType type, expected_type;
+		char *data, *expected;
+		size_t len, expected_len;
+		Batch_reply_at(batch, i, &type, &data, &len);
+		Batch_reply_at(reference, i, &expected_type, &expected, &expected_len);
+		CHECK(type == expected_type && len == expected_len && (len == 0 || memcmp(data, expected, len) == 0),
+				"round %d reply %zu: type %d '%.*s' instead of type %d '%.*s'", round, i, type, (int)len, data,
+				expected_type, (int)expected_len, expected);
+	}
+}
+
+static void check_replies(Batch *batch, const char **expected, size_t count, const char *name, int coalesce)
+{
+	for(size_t i = 0; i < count; i++) {
+		ReplyType type;
+		char *data;
+		size_t len;
+		Batch_reply_at(batch, i, &type, &data, &len);
+		if(expected[i] != NULL) {
+			CHECK(len == strlen(expected[i]) && memcmp(data, expected[i], len) == 0,
+					"%s, coalesce %d, reply %zu: '%.*s' instead of '%s'", name, coalesce, i, (int)len, data, expected[i]);
+		}
+	}
+}
+
+/**
+ * Writes then reads keys in the same batch, and reads before writing them, and checks that the values read are those
+ * written, in that batch and in the next ones that take them from the cache.
+ */
+static void test_write_read()
+{
+	Server server = {.count = 0};
+	ReplyCache *cache = ReplyCache_new(1024 * 1024, 0);
+	for(int coalesce = 0; coalesce <= 1; coalesce++) {
+		//cache the old values
+		Batch *batch = Batch_new();
+		Batch_set_cache(batch, cache);
+		Batch_set_coalesce(batch, coalesce);
+		Batch_write_set(batch, "k", 1, "old", 3);
+		write_command(batch, 4, "HSET", "h", "f", "old");
+		Batch_write_get(batch, "k", 1);
+		write_command(batch, 3, "HGET", "h", "f", NULL);
+		execute(batch, &server);
+		Batch_free(batch);
+
+		//the reads after the writes are not taken from the cache
+		batch = Batch_new();
+		Batch_set_cache(batch, cache);
+		Batch_set_coalesce(batch, coalesce);
+		Batch_write_set(batch, "k", 1, "new", 3);
+		Batch_write_get(batch, "k", 1);
+		write_command(batch, 4, "HSET", "h", "f", "new");
+		write_command(batch, 3, "HGET", "h", "f", NULL);
+		execute(batch, &server);
+		const char *written[] = {"OK", "new", NULL, "new"};
+		check_replies(batch, written, 4, "write then read", coalesce);
+		Batch_free(batch);
+
+		//the replies to reads sent before the writes are not left in the cache
+		ReplyCache_clear(cache);
+		batch = Batch_new();
+		Batch_set_cache(batch, cache);
+		Batch_set_coalesce(batch, coalesce);
+		Batch_write_get(batch, "k", 1);
+		Batch_write_set(batch, "k", 1, "newer", 5);
+		write_command(batch, 3, "HGET", "h", "f", NULL);
+		write_command(batch, 4, "HSET", "h", "f", "newer");
+		execute(batch, &server);
+		const char *read[] = {"new", "OK", "new", NULL};
+		check_replies(batch, read, 4, "read then write", coalesce);
+		Batch_free(batch);
+
+		for(int i = 0; i < 2; i++) {
+			long hits = ReplyCache_get_hits(cache);
+			batch = Batch_new();
+			Batch_set_cache(batch, cache);
+			Batch_write_get(batch, "k", 1);
+			write_command(batch, 3, "HGET", "h", "f", NULL);
+			execute(batch, &server);
+			const char *after[] = {"newer", "newer"};
+			check_replies(batch, after, 2, (i == 0) ? "after the writes" : "from the cache", coalesce);
+			CHECK(ReplyCache_get_hits(cache) == hits + ((i == 0) ? 0 : 2), "hits %ld after %ld in read %d",
+					ReplyCache_get_hits(cache), hits, i);
+			Batch_free(batch);
+		}
+
+		batch = Batch_new();
+		write_command(batch, 1, "FLUSHDB", NULL, NULL, NULL);
+		execute(batch, &server);
+		Batch_free(batch);
+	}
+	ReplyCache_free(cache);
+}
+
+/**
+ * Reads keys with prepared GET and HGET commands (with the key of the HGET constant), and checks that the replies are
+ * taken from the cache once stored, until a prepared write of the key.
+ */
+static void test_prepared()
+{
+	Server server = {.count = 0};
+	ReplyCache *cache = ReplyCache_new(1024 * 1024, 0);
+	const char *set_argv[3] = {"SET", NULL, NULL};
+	Command *set = Command_new(3, set_argv, NULL);
+	const char *hset_argv[4] = {"HSET", "h0", NULL, NULL};
+	Command *hset = Command_new(4, hset_argv, NULL);
+	const char *get_argv[2] = {"GET", NULL};
+	Command *get = Command_new(2, get_argv, NULL);
+	const char *hget_argv[3] = {"HGET", "h0", NULL};
+	Command *hget = Command_new(3, hget_argv, NULL);
+	const char *key[] = {"k"};
+	const char *field[] = {"f"};
+	const char *old[] = {"k", "old"};
+	const char *hold[] = {"f", "old"};
+	const char *new[] = {"k", "new"};
+	const char *hnew[] = {"f", "new"};
+
+	Batch *batch = Batch_new();
+	Batch_set_cache(batch, cache);
+	Batch_write_prepared(batch, set, old, NULL);
+	Batch_write_prepared(batch, hset, hold, NULL);
+	Batch_write_prepared(batch, get, key, NULL);
+	Batch_write_prepared(batch, hget, field, NULL);
+	execute(batch, &server);
+	const char *written[] = {"OK", NULL, "old", "old"};
+	check_replies(batch, written, 4, "prepared write then read", 0);
+	Batch_free(batch);
+
+	for(int i = 0; i < 2; i++) {
+		long hits = ReplyCache_get_hits(cache);
+		batch = Batch_new();
+		Batch_set_cache(batch, cache);
+		if(i == 1) {
+			Batch_write_prepared(batch, set, new, NULL);
+			Batch_write_prepared(batch, hset, hnew, NULL);
+		}
+		Batch_write_prepared(batch, get, key, NULL);
+		Batch_write_prepared(batch, hget, field, NULL);
+		execute(batch, &server);
+		const char *cached[] = {"old", "old"};
+		const char *changed[] = {"OK", NULL, "new", "new"};
+		check_replies(batch, (i == 0) ? cached : changed, (i == 0) ? 2 : 4, "prepared read", 0);
+		CHECK(ReplyCache_get_hits(cache) == hits + ((i == 0) ? 2 : 0), "hits %ld after %ld in prepared read %d",
+				ReplyCache_get_hits(cache), hits, i);
+		Batch_free(batch);
+	}
+
+	Command_free(set);
+	Command_free(hset);
+	Command_free(get);
+	Command_free(hget);
+	ReplyCache_free(cache);
+}
+
+/**
+ * Writes a random command to both batches. The prepared commands are SET key value, HSET h0 field value, GET key and
+ * HGET h0 field.
+ */
+static void write_random(Batch *batch, Batch *reference, Command *set, Command *hset, Command *get, Command *hget)
+{
+	//strings and hashes have keys of their own, as MGET (of coalesced GETs) gives nil for a hash where GET fails
+	char key[ITEM_SIZE], other[ITEM_SIZE], hash[ITEM_SIZE], field[ITEM_SIZE], value[ITEM_SIZE];
+	snprintf(key, ITEM_SIZE, "k%d", rand() % NUM_KEYS);
+	snprintf(other, ITEM_SIZE, "k%d", rand() % NUM_KEYS);
+	snprintf(hash, ITEM_SIZE, "h%d", rand() % NUM_KEYS);
+	snprintf(field, ITEM_SIZE, "f%d", rand() % NUM_FIELDS);
+	snprintf(value, ITEM_SIZE, "v%d", rand() % 1000);
+	const char *params[2] = {key, value};
+	const char *hparams[2] = {field, value};
+	int op = rand() % 100;
+	for(int i = 0; i < 2; i++) {
+		Batch *b = (i == 0) ? batch : reference;
+		if(op < 24) {
+			Batch_write_get(b, key, strlen(key));
+		}
+		else if(op < 30) {
+			Batch_write_prepared(b, get, params, NULL);
+		}
+		else if(op < 44) {
+			write_command(b, 3, "HGET", hash, field, NULL);
+		}
+		else if(op < 50) {
+			Batch_write_prepared(b, hget, hparams, NULL);
+		}
+		else if(op < 58) {
+			Batch_write_set(b, key, strlen(key), value, strlen(value));
+		}
+		else if(op < 62) {
+			const char *argv[5] = {"MSET", key, value, other, value};
+			Batch_write_command(b, 5, argv, NULL);
+		}
+		else if(op < 68) {
+			write_command(b, 3, (op < 65) ? "DEL" : "UNLINK", key, hash, NULL);
+		}
+		else if(op < 78) {
+			write_command(b, 4, "HSET", hash, field, value);
+		}
+		else if(op < 84) {
+			write_command(b, 3, "HDEL", hash, field, NULL);
+		}
+		else if(op < 90) {
+			Batch_write_prepared(b, set, params, NULL);
+		}
+		else if(op < 98) {
+			Batch_write_prepared(b, hset, hparams, NULL);
+		}
+		else {
+			write_command(b, 1, "FLUSHDB", NULL, NULL, NULL);
+		}
+	}
+}
+
+static void test_random()
+{
+	Server server = {.count = 0};
+	Server reference_server = {.count = 0};
+	ReplyCache *cache = ReplyCache_new(2048, 0); //small, so that replies are evicted too
+	const char *set_argv[3] = {"SET", NULL, NULL};
+	Command *set = Command_new(3, set_argv, NULL);
+	const char *hset_argv[4] = {"HSET", "h0", NULL, NULL};
+	Command *hset = Command_new(4, hset_argv, NULL);
+	const char *get_argv[2] = {"GET", NULL};
+	Command *get = Command_new(2, get_argv, NULL);
+	const char *hget_argv[3] = {"HGET", "h0", NULL};
+	Command *hget = Command_new(3, hget_argv, NULL);
+	for(int round = 0; round < NUM_ROUNDS; round++) {
+		Batch *batch = Batch_new();
+		Batch *reference = Batch_new();
+		Batch_set_cache(batch, cache);
+		int coalesce = rand() % 2;
+		Batch_set_coalesce(batch, coalesce);
+		Batch_set_coalesce(reference, coalesce);
+		int count = 1 + rand() % 20;
+		for(int i = 0; i < count; i++) {
+			write_random(batch, reference, set, hset, get, hget);
+		}
+		execute(batch, &server);
+		execute(reference, &reference_server);
+		compare(batch, reference, round);
+		Batch_free(batch);
+		Batch_free(reference);
+	}
+	CHECK(ReplyCache_get_hits(cache) > 0, "no replies were taken from the cache");
+	Command_free(set);
+	Command_free(hset);
+	Command_free(get);
+	Command_free(hget);
+	ReplyCache_free(cache);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = (argc > 1) ? atoi(argv[1]) : 42;
+	srand(seed);
+
+	Module *module = Module_new();
+	Module_init(module);
+
+	test_write_read();
+	test_prepared();
+	test_random();
+
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures (seed %u)\n", failures, seed);
+		return 1;
+	}
+	printf("all cache tests passed\n");
+	return 0;
+}
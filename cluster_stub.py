@@ -0,0 +1,157 @@
+"""
+A stand-in for a Redis Cluster of three nodes (127.0.0.1:17001-17003), one process each, for cluster_test.
+The nodes only know PING, GET, SET, ASKING and CLUSTER SLOTS. The slots are divided in three ranges, commands for a
+slot of another node get a MOVED redirect. The slot of the key 'askme' is being migrated to the next node: its owner
+answers with an ASK redirect while it does not have the key, and the next node takes it after ASKING.
+The first CLUSTER SLOTS reply of a node maps all slots to that node, so that the client starts out with a wrong map.
+The third node is listed without its host (an unknown endpoint), the client must use the host of the node it asked.
+usage: python3 cluster_stub.py
+"""
+
+import os
+import signal
+import socket
+import sys
+
+PORTS = [17001, 17002, 17003]
+RANGES = [(0, 5460), (5461, 10922), (10923, 16383)]
+
+
+def crc16(data):
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xffff
+    return crc
+
+
+def key_slot(key):
+    start = key.find(b"{")
+    if start >= 0:
+        end = key.find(b"}", start + 1)
+        if end > start + 1:
+            key = key[start + 1:end]
+    return crc16(key) % 16384
+
+
+def owner(slot):
+    for i, (first, last) in enumerate(RANGES):
+        if first <= slot <= last:
+            return i
+
+
+def encode(value):
+    if value is None:
+        return b"$-1\r\n"
+    if isinstance(value, int):
+        return b":%d\r\n" % value
+    if isinstance(value, bytes):
+        return b"$%d\r\n%s\r\n" % (len(value), value)
+    if isinstance(value, list):
+        return b"*%d\r\n" % len(value) + b"".join(encode(v) for v in value)
+    return value.encode() + b"\r\n"  # status or error line
+
+
+class Node:
+    def __init__(self, index):
+        self.index = index
+        self.data = {}
+        self.slots_asked = 0
+
+    def cluster_slots(self):
+        self.slots_asked += 1
+        if self.slots_asked == 1:
+            return [[0, 16383, [b"127.0.0.1", PORTS[self.index], b"node%d" % self.index]]]
+        nodes = []
+        for i, (first, last) in enumerate(RANGES):
+            host = b"" if i == 2 else b"127.0.0.1"
+            nodes.append([first, last, [host, PORTS[i], b"node%d" % i], [b"127.0.0.1", 1, b"replica%d" % i]])
+        return nodes
+
+    def execute(self, args, client):
+        name = args[0].upper()
+        asking = client.get("asking", False)
+        client["asking"] = False
+        if name == b"PING":
+            return "+PONG"
+        if name == b"ASKING":
+            client["asking"] = True
+            return "+OK"
+        if name == b"CLUSTER":
+            return self.cluster_slots()
+        if name not in (b"GET", b"SET") or len(args) < 2:
+            return "-ERR unknown command"
+        key = args[1]
+        slot = key_slot(key)
+        node = owner(slot)
+        if slot == key_slot(b"askme"):
+            target = (node + 1) % len(PORTS)
+            if self.index == node and key not in self.data:
+                return "-ASK %d 127.0.0.1:%d" % (slot, PORTS[target])
+            if self.index == target and asking:
+                node = target
+        if node != self.index:
+            return "-MOVED %d 127.0.0.1:%d" % (slot, PORTS[node])
+        if name == b"SET":
+            self.data[key] = args[2]
+            return "+OK"
+        return self.data.get(key)
+
+
+def read_command(stream):
+    line = stream.readline()
+    if not line:
+        return None
+    count = int(line[1:])
+    args = []
+    for _ in range(count):
+        length = int(stream.readline()[1:])
+        args.append(stream.read(length + 2)[:-2])
+    return args
+
+
+def serve(index):
+    node = Node(index)
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(("127.0.0.1", PORTS[index]))
+    server.listen(16)
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+    while True:
+        connection, _ = server.accept()
+        if os.fork() == 0:
+            # a process per connection, so the data is per connection too (the test uses one connection per node)
+            server.close()
+            stream = connection.makefile("rb")
+            client = {}
+            while True:
+                args = read_command(stream)
+                if args is None:
+                    break
+                connection.sendall(encode(node.execute(args, client)))
+            os._exit(0)
+        connection.close()
+
+
+def main():
+    children = []
+    for index in range(len(PORTS)):
+        pid = os.fork()
+        if pid == 0:
+            serve(index)
+        children.append(pid)
+
+    def stop(signum, frame):
+        for pid in children:
+            os.kill(pid, signal.SIGTERM)
+        sys.exit(0)
+    signal.signal(signal.SIGTERM, stop)
+    signal.signal(signal.SIGINT, stop)
+    for pid in children:
+        os.waitpid(pid, 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Test of Cluster and ClusterBatch against the stand-in cluster of cluster_stub.py (nodes 127.0.0.1:17001-17003),
+ * which redirects with MOVED and ASK, starts out with a wrong slot map and lists a node without its host.
+ * usage: python3 cluster_stub.py & ./cluster_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libredis/redis.h"
+
+#define NUM_KEYS 40
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+static void check_reply(ClusterBatch *batch, ReplyType type, const char *expected)
+{
+	ReplyType reply_type;
+	char *data;
+	size_t len;
+	int level = ClusterBatch_next_reply(batch, &reply_type, &data, &len);
+	CHECK(level == 1 && reply_type == type && len == strlen(expected) && memcmp(data, expected, len) == 0,
+			"expected '%s', got level %d type %d '%.*s'", expected, level, reply_type, (data != NULL) ? (int)len : 0,
+			(data != NULL) ? data : "");
+}
+
+int main(int argc, char *argv[])
+{
+	Module *module = Module_new();
+	Module_init(module);
+
+	Cluster *cluster = Cluster_new();
+	CHECK(Cluster_add_node(cluster, "127.0.0.1") == -1, "address without port is accepted");
+	CHECK(Cluster_add_node(cluster, "127.0.0.1:") == -1, "address with empty port is accepted");
+	CHECK(Cluster_add_node(cluster, "127.0.0.1:17001x") == -1, "address with invalid port is accepted");
+	CHECK(Cluster_add_node(cluster, "127.0.0.1:17001") == 0, "valid address is refused: %s", Module_last_error(module));
+
+	char keys[NUM_KEYS][16];
+	char values[NUM_KEYS][16];
+	for(int round = 0; round < 3; round++) {
+		ClusterBatch *batch = ClusterBatch_new(cluster);
+		for(int i = 0; i < NUM_KEYS; i++) {
+			snprintf(keys[i], sizeof(keys[i]), "key%d", i);
+			snprintf(values[i], sizeof(values[i]), "value%d.%d", i, round);
+			const char *set[] = {"SET", keys[i], values[i]};
+			ClusterBatch_write_command(batch, 3, set, NULL);
+		}
+		const char *set_ask[] = {"SET", "askme", "migrating"};
+		ClusterBatch_write_command(batch, 3, set_ask, NULL);
+		for(int i = 0; i < NUM_KEYS; i++) {
+			const char *get[] = {"GET", keys[i]};
+			ClusterBatch_write_command(batch, 2, get, NULL);
+		}
+		const char *get_ask[] = {"GET", "askme"};
+		ClusterBatch_write_command(batch, 2, get_ask, NULL);
+		const char *ping[] = {"PING"};
+		ClusterBatch_write_command(batch, 1, ping, NULL);
+
+		int res = ClusterBatch_execute(batch, 2000);
+		CHECK(res == 1, "execute in round %d: %d %s", round, res, (res == -1) ? Module_last_error(module) : "");
+		if(res == 1) {
+			for(int i = 0; i <= NUM_KEYS; i++) {
+				check_reply(batch, RT_OK, "OK");
+			}
+			for(int i = 0; i < NUM_KEYS; i++) {
+				check_reply(batch, RT_BULK, values[i]);
+			}
+			check_reply(batch, RT_BULK, "migrating");
+			check_reply(batch, RT_OK, "PONG");
+		}
+		ClusterBatch_free(batch);
+	}
+	Cluster_free(cluster);
+
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all cluster tests passed\n");
+	return 0;
+}
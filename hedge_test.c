@@ -0,0 +1,315 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Test of hedged batches (Executor_add_hedged) against the stand-in servers of redis_stub.py, the primary at
+ * 127.0.0.1:17301 and the secondary at 127.0.0.1:17302. How fast they answer is set with the DEBUG DELAY and DEBUG PAUSE
+ * commands of the stub, and nothing listens on 127.0.0.1:17309, for a primary that fails. Each test uses new
+ * connections, so that the latencies of one do not set the time to hedge in another.
+ * usage: python3 redis_stub.py 17301 17302 & ./hedge_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libredis/redis.h"
+
+#define PRIMARY "127.0.0.1:17301"
+#define SECONDARY "127.0.0.1:17302"
+#define CLOSED "127.0.0.1:17309"
+#define TIMEOUT_MS 2000
+#define LARGE_KEY_SIZE (32 * 1024 * 1024) //more than the socket buffers hold, so the batch is only sent in part
+#define LATENCY_ERROR_MS 1000.0 //as in connection.c
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+static Module *module;
+static Connection *control_primary; //for the DEBUG DELAY commands, which do not wait for the delay themselves
+static Connection *control_secondary;
+
+static double time_ms()
+{
+	struct timespec tm;
+	clock_gettime(CLOCK_MONOTONIC, &tm);
+	return tm.tv_sec * 1000.0 + tm.tv_nsec / 1000000.0;
+}
+
+/**
+ * Executes a single command on the connection, and copies its reply (if it is not an aggregate) into reply.
+ * Returns the type of the reply, RT_NONE if the command could not be executed.
+ */
+static ReplyType command(Connection *connection, int argc, const char **argv, char *reply, size_t reply_size)
+{
+	Batch *batch = Batch_new();
+	Batch_write_command(batch, argc, argv, NULL);
+	Executor *executor = Executor_new();
+	Executor_add(executor, connection, batch);
+	ReplyType type = RT_NONE;
+	char *data;
+	size_t len;
+	if(Executor_execute(executor, TIMEOUT_MS) == 1 && Batch_next_reply(batch, &type, &data, &len) == 1) {
+		if(reply != NULL) {
+			len = (data == NULL) ? 0 : (len < reply_size - 1) ? len : reply_size - 1;
+			memcpy(reply, data, len);
+			reply[len] = '\0';
+		}
+	}
+	Executor_free(executor);
+	Batch_free(batch);
+	return type;
+}
+
+static void check_get(Connection *connection, const char *key, const char *expected)
+{
+	char reply[64];
+	const char *get[] = {"GET", key};
+	ReplyType type = command(connection, 2, get, reply, sizeof(reply));
+	CHECK(type == RT_BULK && strcmp(reply, expected) == 0, "GET %s: type %d '%s' instead of '%s'", key, type,
+			(type == RT_BULK) ? reply : "", expected);
+}
+
+static long client_id(Connection *connection)
+{
+	char reply[64];
+	const char *id[] = {"CLIENT", "ID"};
+	if(command(connection, 2, id, reply, sizeof(reply)) != RT_INTEGER) {
+		return -1;
+	}
+	return atol(reply);
+}
+
+static void set_delay(Connection *control, const char *seconds)
+{
+	const char *delay[] = {"DEBUG", "DELAY", seconds};
+	CHECK(command(control, 3, delay, NULL, 0) == RT_OK, "DEBUG DELAY %s", seconds);
+}
+
+/**
+ * Executes batches on the connection, so that it has enough recent batch times for a percentile.
+ */
+static void warm_up(Connection *connection)
+{
+	for(int i = 0; i < 16; i++) {
+		const char *get[] = {"GET", "a"};
+		command(connection, 2, get, NULL, 0);
+	}
+}
+
+/**
+ * Executes a GET of the key hedged on the primary and secondary, and checks its reply (NULL for nil), and the
+ * number of copies fired and won. Returns the time it took in ms.
+ */
+static double execute_hedged(Connection *primary, Connection *secondary, const char *key, size_t key_len,
+		const char *expected, long fired, long won)
+{
+	Batch *batch = Batch_new();
+	const char *get[] = {"GET", key};
+	const size_t getlen[] = {3, key_len};
+	Batch_write_command(batch, 2, get, getlen);
+	Executor *executor = Executor_new();
+	Executor_set_hedge_percentile(executor, 50.0);
+	Executor_add_hedged(executor, primary, secondary, batch);
+	double start_ms = time_ms();
+	int res = Executor_execute(executor, TIMEOUT_MS);
+	double elapsed_ms = time_ms() - start_ms;
+	CHECK(res == 1, "hedged execute: %d %s", res, (res != 1) ? Module_last_error(module) : "");
+
+	ReplyType type;
+	char *data;
+	size_t len;
+	int level = Batch_next_reply(batch, &type, &data, &len);
+	if(expected == NULL) {
+		CHECK(level == 1 && type == RT_BULK_NIL, "hedged GET: level %d type %d instead of nil", level, type);
+	}
+	else {
+		CHECK(level == 1 && type == RT_BULK && len == strlen(expected) && memcmp(data, expected, len) == 0,
+				"hedged GET: level %d type %d '%.*s' instead of '%s'", level, type, (type == RT_BULK) ? (int)len : 0,
+				(type == RT_BULK) ? data : "", expected);
+	}
+	CHECK(Batch_next_reply(batch, &type, &data, &len) == 0, "more than one reply");
+	CHECK(Executor_get_hedges_fired(executor) == fired, "%ld hedges fired instead of %ld",
+			Executor_get_hedges_fired(executor), fired);
+	CHECK(Executor_get_hedges_won(executor) == won, "%ld hedges won instead of %ld", Executor_get_hedges_won(executor),
+			won);
+	Executor_free(executor);
+	Batch_free(batch);
+	return elapsed_ms;
+}
+
+/**
+ * The primary is slower than usual, the copy wins. The reply of the primary is dropped on its next execute, on the same
+ * connection.
+ */
+static void test_slow_primary()
+{
+	Connection *primary = Connection_new(PRIMARY);
+	Connection *secondary = Connection_new(SECONDARY);
+	warm_up(primary);
+	long id = client_id(primary);
+
+	set_delay(control_primary, "0.2");
+	double elapsed_ms = execute_hedged(primary, secondary, "a", 1, "A", 1, 1);
+	CHECK(elapsed_ms < 150.0, "slow primary: took %.1f ms", elapsed_ms);
+	set_delay(control_primary, "0");
+
+	check_get(primary, "b", "B");
+	CHECK(client_id(primary) == id, "connection of the primary was not kept");
+
+	Connection_free(primary);
+	Connection_free(secondary);
+}
+
+/**
+ * The copy is even slower than the primary, the primary wins and the copy is dropped on the secondary.
+ */
+static void test_slow_copy()
+{
+	Connection *primary = Connection_new(PRIMARY);
+	Connection *secondary = Connection_new(SECONDARY);
+	warm_up(primary);
+	long id = client_id(secondary);
+
+	set_delay(control_primary, "0.05");
+	set_delay(control_secondary, "0.3");
+	double elapsed_ms = execute_hedged(primary, secondary, "a", 1, "A", 1, 0);
+	CHECK(elapsed_ms >= 50.0 && elapsed_ms < 250.0, "slow copy: took %.1f ms", elapsed_ms);
+	set_delay(control_primary, "0");
+	set_delay(control_secondary, "0");
+
+	check_get(secondary, "b", "B");
+	CHECK(client_id(secondary) == id, "connection of the secondary was not kept");
+
+	Connection_free(primary);
+	Connection_free(secondary);
+}
+
+/**
+ * The primary fails, the copy is started at once rather than after the percentile of its (failed) batch times.
+ */
+static void test_failing_primary()
+{
+	Connection *primary = Connection_new(CLOSED);
+	Connection *secondary = Connection_new(SECONDARY);
+	warm_up(primary);
+	CHECK(Connection_get_latency_percentile(primary, 50.0) >= LATENCY_ERROR_MS, "percentile of failing primary is %.1f",
+			Connection_get_latency_percentile(primary, 50.0));
+
+	double elapsed_ms = execute_hedged(primary, secondary, "a", 1, "A", 1, 1);
+	CHECK(elapsed_ms < LATENCY_ERROR_MS / 2, "failing primary: took %.1f ms", elapsed_ms);
+
+	Connection_free(primary);
+	Connection_free(secondary);
+}
+
+/**
+ * The primary does not read the batch, which is too large to be sent at once. The copy wins, and the connection of the
+ * primary is closed as it can not be told where the next batch would start.
+ */
+static void test_half_sent()
+{
+	Connection *primary = Connection_new(PRIMARY);
+	Connection *secondary = Connection_new(SECONDARY);
+	warm_up(primary);
+	long id = client_id(primary);
+
+	const char *pause[] = {"DEBUG", "PAUSE", "0.5"};
+	CHECK(command(primary, 3, pause, NULL, 0) == RT_OK, "DEBUG PAUSE");
+	char *key = malloc(LARGE_KEY_SIZE);
+	memset(key, 'k', LARGE_KEY_SIZE);
+	execute_hedged(primary, secondary, key, LARGE_KEY_SIZE, NULL, 1, 1);
+	free(key);
+
+	check_get(primary, "a", "A");
+	long new_id = client_id(primary);
+	CHECK(new_id != id && new_id != -1, "connection of the primary was not reopened");
+
+	Connection_free(primary);
+	Connection_free(secondary);
+}
+
+/**
+ * The secondary executes another batch of the executor, so no copy is started on it.
+ */
+static void test_busy_secondary()
+{
+	Connection *primary = Connection_new(PRIMARY);
+	Connection *secondary = Connection_new(SECONDARY);
+	warm_up(primary);
+
+	set_delay(control_primary, "0.2");
+	set_delay(control_secondary, "0.1");
+	Batch *batch = Batch_new();
+	const char *get_a[] = {"GET", "a"};
+	Batch_write_command(batch, 2, get_a, NULL);
+	Batch *other = Batch_new();
+	const char *get_b[] = {"GET", "b"};
+	Batch_write_command(other, 2, get_b, NULL);
+	Executor *executor = Executor_new();
+	Executor_set_hedge_percentile(executor, 50.0);
+	Executor_add_hedged(executor, primary, secondary, batch);
+	Executor_add(executor, secondary, other);
+	double start_ms = time_ms();
+	CHECK(Executor_execute(executor, TIMEOUT_MS) == 1, "execute: %s", Module_last_error(module));
+	double elapsed_ms = time_ms() - start_ms;
+	CHECK(elapsed_ms >= 200.0, "busy secondary: took %.1f ms", elapsed_ms);
+	CHECK(Executor_get_hedges_fired(executor) == 0, "%ld hedges fired", Executor_get_hedges_fired(executor));
+	CHECK(Executor_get_hedges_won(executor) == 0, "%ld hedges won", Executor_get_hedges_won(executor));
+
+	ReplyType type;
+	char *data;
+	size_t len;
+	CHECK(Batch_next_reply(batch, &type, &data, &len) == 1 && type == RT_BULK && len == 1 && data[0] == 'A',
+			"reply of the hedged batch");
+	CHECK(Batch_next_reply(other, &type, &data, &len) == 1 && type == RT_BULK && len == 1 && data[0] == 'B',
+			"reply of the other batch");
+	Executor_free(executor);
+	Batch_free(batch);
+	Batch_free(other);
+	set_delay(control_primary, "0");
+	set_delay(control_secondary, "0");
+
+	Connection_free(primary);
+	Connection_free(secondary);
+}
+
+int main(int argc, char *argv[])
+{
+	module = Module_new();
+	Module_init(module);
+
+	control_primary = Connection_new(PRIMARY);
+	control_secondary = Connection_new(SECONDARY);
+	Connection *controls[] = {control_primary, control_secondary};
+	for(int i = 0; i < 2; i++) {
+		const char *set_a[] = {"SET", "a", "A"};
+		const char *set_b[] = {"SET", "b", "B"};
+		CHECK(command(controls[i], 3, set_a, NULL, 0) == RT_OK && command(controls[i], 3, set_b, NULL, 0) == RT_OK,
+				"SET on %s", (i == 0) ? PRIMARY : SECONDARY);
+	}
+
+	test_slow_primary();
+	test_slow_copy();
+	test_failing_primary();
+	test_half_sent();
+	test_busy_secondary();
+
+	Connection_free(control_primary);
+	Connection_free(control_secondary);
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all hedge tests passed\n");
+	return 0;
+}
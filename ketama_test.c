@@ -0,0 +1,701 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Tests of the ketama hash-ring that need no Redis server: the batched lookups must give the same servers as looking
+ * up the keys one at a time, for both hashes and for keys of any length.
+ * Rings that are updated as servers are added, removed and reweighted must give the same servers as a ring created
+ * from scratch, and as a reference ring built and searched like classic ketama (with a binary search, without the
+ * index). Also tests the diffs between rings, bounded loads and saving and loading rings, and the JumpHash and
+ * Rendezvous distributors.
+ * usage: ./ketama_test [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "libredis/redis.h"
+#include "libredis/module.h"
+#include "libredis/hash.h"
+#include "libredis/md5.h"
+
+#define NUM_KEYS 1000
+#define MAX_KEY_LEN 200
+#define NUM_RING_KEYS 100000
+#define MAX_SERVERS 16
+#define RING_CACHE_SIZE 8 //as in ketama.c
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+static const char *hash_names[] = {"md5", "murmur3"};
+
+typedef struct _Point
+{
+	unsigned int point;
+	int ordinal;
+} Point;
+
+typedef struct _RingServer
+{
+	char addr[32];
+	unsigned long weight;
+	int removed;
+} RingServer;
+
+/**
+ * A reference ring, built from its servers on every change and searched like classic ketama did.
+ */
+typedef struct _Ring
+{
+	KetamaHash hash;
+	RingServer servers[MAX_SERVERS];
+	int num_servers;
+	Point *points;
+	int num_points;
+} Ring;
+
+/**
+ * Fills keys with n random keys, of every length up to MAX_KEY_LEN in turn, so that keys that fit in a single MD5
+ * block and keys that do not are mixed.
+ */
+static char *random_keys(const char **keys, size_t *key_lens, size_t n)
+{
+	char *data = malloc(n * MAX_KEY_LEN + 1);
+	for(size_t i = 0; i < n; i++) {
+		keys[i] = data + i * MAX_KEY_LEN;
+		key_lens[i] = i % (MAX_KEY_LEN + 1);
+		for(size_t j = 0; j < key_lens[i]; j++) {
+			data[i * MAX_KEY_LEN + j] = (char)(rand() % 256);
+		}
+	}
+	return data;
+}
+
+/**
+ * The digests of Hash_md5_many must be those of md5.c, for every number of keys that fills the lanes of a group
+ * partially or completely.
+ */
+static void test_md5_many()
+{
+	const char *keys[3 * HASH_MAX_LANES];
+	size_t key_lens[3 * HASH_MAX_LANES];
+	unsigned char digests[3 * HASH_MAX_LANES][16];
+	char *data = random_keys(keys, key_lens, 3 * HASH_MAX_LANES);
+	for(size_t len = 0; len <= 2 * 64; len++) {
+		for(size_t n = 1; n <= 3 * HASH_MAX_LANES; n++) {
+			for(size_t i = 0; i < n; i++) {
+				key_lens[i] = (len + i * 7) % (2 * 64 + 1);
+			}
+			Hash_md5_many(keys, key_lens, digests, n);
+			for(size_t i = 0; i < n; i++) {
+				md5_state_t state;
+				unsigned char expected[16];
+				md5_init(&state);
+				md5_append(&state, (const md5_byte_t *)keys[i], key_lens[i]);
+				md5_finish(&state, expected);
+				CHECK(memcmp(digests[i], expected, 16) == 0, "md5 of key %zu of %zu (length %zu) differs", i, n,
+						key_lens[i]);
+			}
+		}
+	}
+	free(data);
+}
+
+/**
+ * Ketama_get_server_ordinals must give the same servers as Ketama_get_server_ordinal.
+ */
+static void test_batched(KetamaHash hash)
+{
+	Ketama *ketama = Ketama_new();
+	Ketama_set_hash(ketama, hash);
+	for(int i = 0; i < 7; i++) {
+		Ketama_add_server(ketama, "10.0.0.1", 6379 + i, 100 + i * 20);
+	}
+	Ketama_create_continuum(ketama);
+
+	const char *keys[NUM_KEYS];
+	size_t key_lens[NUM_KEYS];
+	int ordinals[NUM_KEYS];
+	char *data = random_keys(keys, key_lens, NUM_KEYS);
+	//also a number of keys that is not a multiple of the chunks and lanes
+	for(size_t n = NUM_KEYS - 3; n <= NUM_KEYS; n += 3) {
+		Ketama_get_server_ordinals(ketama, keys, key_lens, ordinals, n);
+		int differences = 0;
+		for(size_t i = 0; i < n; i++) {
+			differences += (ordinals[i] != Ketama_get_server_ordinal(ketama, keys[i], key_lens[i]));
+		}
+		CHECK(differences == 0, "%s: %d of %zu keys on another server than looked up one at a time", hash_names[hash],
+				differences, n);
+	}
+	free(data);
+	Ketama_free(ketama);
+}
+
+static unsigned int md5_hash(const char *key, size_t key_len)
+{
+	md5_state_t state;
+	unsigned char digest[16];
+	md5_init(&state);
+	md5_append(&state, (const md5_byte_t *)key, key_len);
+	md5_finish(&state, digest);
+	return ((unsigned int)digest[3] << 24) | ((unsigned int)digest[2] << 16) | ((unsigned int)digest[1] << 8) | digest[0];
+}
+
+static unsigned int key_hash(KetamaHash hash, const char *key, size_t key_len)
+{
+	return (hash == KETAMA_HASH_MURMUR3) ? Hash_murmur3(key, key_len, 0) : md5_hash(key, key_len);
+}
+
+static int compare_points(const void *a, const void *b)
+{
+	const Point *pa = a;
+	const Point *pb = b;
+	if(pa->point != pb->point) {
+		return (pa->point < pb->point) ? -1 : 1;
+	}
+	return pa->ordinal - pb->ordinal;
+}
+
+/**
+ * Builds the continuum of the ring from scratch: 40 hashes of 4 points per server, times its share of the weight.
+ */
+static void Ring_build(Ring *ring)
+{
+	unsigned long memory = 0;
+	int num_active = 0;
+	for(int i = 0; i < ring->num_servers; i++) {
+		if(!ring->servers[i].removed) {
+			memory += ring->servers[i].weight;
+			num_active++;
+		}
+	}
+	free(ring->points);
+	ring->points = malloc(sizeof(Point) * (40 * 4 * num_active + 1));
+	ring->num_points = 0;
+	for(int i = 0; i < ring->num_servers; i++) {
+		RingServer *server = &ring->servers[i];
+		if(server->removed || memory == 0) {
+			continue;
+		}
+		float pct = (float)server->weight / (float)memory;
+		unsigned int entries = floorf(pct * 40.0 * (float)num_active);
+		for(unsigned int k = 0; k < entries; k++) {
+			char ss[64];
+			int len = snprintf(ss, sizeof(ss), "%s-%u", server->addr, k);
+			unsigned char digest[16];
+			md5_state_t state;
+			if(ring->hash == KETAMA_HASH_MD5) {
+				md5_init(&state);
+				md5_append(&state, (const md5_byte_t *)ss, len);
+				md5_finish(&state, digest);
+			}
+			for(int h = 0; h < 4; h++) {
+				Point *point = &ring->points[ring->num_points++];
+				if(ring->hash == KETAMA_HASH_MURMUR3) {
+					point->point = Hash_murmur3(ss, len, h);
+				}
+				else {
+					point->point = ((unsigned int)digest[3 + h * 4] << 24) | ((unsigned int)digest[2 + h * 4] << 16) |
+							((unsigned int)digest[1 + h * 4] << 8) | digest[h * 4];
+				}
+				point->ordinal = i;
+			}
+		}
+	}
+	qsort(ring->points, ring->num_points, sizeof(Point), compare_points);
+}
+
+/**
+ * The binary search of classic ketama, for the server with the first point at or after the hash of the key.
+ */
+static int Ring_lookup(Ring *ring, const char *key, size_t key_len)
+{
+	unsigned int h = key_hash(ring->hash, key, key_len);
+	Point *points = ring->points;
+	int highp = ring->num_points;
+	int lowp = 0, midp;
+	unsigned int midval, midval1;
+	while(1) {
+		midp = (lowp + highp) / 2;
+		if(midp == ring->num_points) {
+			return points[0].ordinal;
+		}
+		midval = points[midp].point;
+		midval1 = (midp == 0) ? 0 : points[midp - 1].point;
+		if(h <= midval && h > midval1) {
+			return points[midp].ordinal;
+		}
+		if(midval < h) {
+			lowp = midp + 1;
+		}
+		else {
+			highp = midp - 1;
+		}
+		if(lowp > highp) {
+			return points[0].ordinal;
+		}
+	}
+}
+
+/**
+ * Adds a server to both the ketama and the reference ring.
+ */
+static void add_server(Ketama *ketama, Ring *ring, int port, unsigned long weight)
+{
+	RingServer *server = &ring->servers[ring->num_servers++];
+	snprintf(server->addr, sizeof(server->addr), "10.0.1.%d:%d", port % 7, port);
+	server->weight = weight;
+	server->removed = 0;
+	char addr[32];
+	snprintf(addr, sizeof(addr), "10.0.1.%d", port % 7);
+	Ketama_add_server(ketama, addr, port, weight);
+}
+
+/**
+ * Counts the keys for which the ketama gives another server than the reference ring.
+ */
+static int count_differences(Ketama *ketama, Ring *ring, const char **keys, const size_t *key_lens, size_t n)
+{
+	Ring_build(ring);
+	int differences = 0;
+	for(size_t i = 0; i < n; i++) {
+		differences += (Ketama_get_server_ordinal(ketama, keys[i], key_lens[i]) != Ring_lookup(ring, keys[i], key_lens[i]));
+	}
+	return differences;
+}
+
+static int compare_ranges(const void *key, const void *range)
+{
+	unsigned int h = *(const unsigned int *)key;
+	const KetamaRange *r = range;
+	return (h < r->start) ? -1 : ((h > r->end) ? 1 : 0);
+}
+
+/**
+ * The ranges of the diff between the rings must be sorted, and a key must be in a range (from its server in the one
+ * ring to its server in the other) exactly when it changes server.
+ */
+static void check_diff(KetamaRing *from, KetamaRing *to, KetamaHash hash, const char **keys, const size_t *key_lens,
+		size_t n, const char *what)
+{
+	KetamaRange *ranges;
+	size_t num_ranges;
+	if(Ketama_diff_rings(from, to, &ranges, &num_ranges) == -1) {
+		CHECK(0, "%s: could not diff the rings: %s", what, Module_last_error(GET_MODULE()));
+		return;
+	}
+	CHECK(num_ranges > 0, "%s: no ranges changed", what);
+	for(size_t i = 1; i < num_ranges; i++) {
+		CHECK(ranges[i - 1].end < ranges[i].start, "%s: range %zu is not after range %zu", what, i, i - 1);
+	}
+	int moved = 0;
+	int wrong = 0;
+	for(size_t i = 0; i < n; i++) {
+		unsigned int h = key_hash(hash, keys[i], key_lens[i]);
+		int before = KetamaRing_get_server_ordinal(from, keys[i], key_lens[i]);
+		int after = KetamaRing_get_server_ordinal(to, keys[i], key_lens[i]);
+		KetamaRange *range = bsearch(&h, ranges, num_ranges, sizeof(KetamaRange), compare_ranges);
+		if(before == after) {
+			wrong += (range != NULL);
+		}
+		else {
+			moved++;
+			wrong += (range == NULL || range->from != before || range->to != after);
+		}
+	}
+	CHECK(moved > 0, "%s: no keys moved", what);
+	CHECK(wrong == 0, "%s: %d of %zu keys are not in the right range", what, wrong, n);
+	Ketama_free_ranges(ranges, num_ranges);
+}
+
+/**
+ * Fills the cache of rings with rings of other servers, so that the next ring is built from scratch.
+ */
+static void flush_ring_cache()
+{
+	for(int i = 0; i < RING_CACHE_SIZE; i++) {
+		Ketama *other = Ketama_new();
+		Ketama_add_server(other, "10.0.2.1", 1000 + i, 100);
+		Ketama_create_continuum(other);
+		Ketama_free(other);
+	}
+}
+
+/**
+ * Applies a change to the servers and checks the updated ring against the reference ring and the diff with the ring
+ * before.
+ */
+#define UPDATE(what, change) do { \
+		KetamaRing *before = Ketama_acquire_ring(ketama); \
+		change; \
+		KetamaRing *after = Ketama_acquire_ring(ketama); \
+		int differences = count_differences(ketama, &ring, keys, key_lens, NUM_RING_KEYS); \
+		CHECK(differences == 0, "%s, %s: %d keys on another server than in the reference ring", hash_names[hash], what, \
+				differences); \
+		check_diff(before, after, hash, keys, key_lens, NUM_RING_KEYS, what); \
+		KetamaRing_release(before); \
+		KetamaRing_release(after); \
+	} while(0)
+
+static void test_update(KetamaHash hash, const char **keys, const size_t *key_lens)
+{
+	Ring ring = {.hash = hash, .num_servers = 0, .points = NULL};
+	Ketama *ketama = Ketama_new();
+	Ketama_set_hash(ketama, hash);
+	for(int i = 0; i < 3; i++) {
+		add_server(ketama, &ring, 6379 + i, 100);
+	}
+	Ketama_create_continuum(ketama);
+	int differences = count_differences(ketama, &ring, keys, key_lens, NUM_RING_KEYS);
+	CHECK(differences == 0, "%s: %d keys on another server than in the reference ring", hash_names[hash], differences);
+
+	UPDATE("add", add_server(ketama, &ring, 6382, 100));
+	UPDATE("add with another weight", add_server(ketama, &ring, 6383, 250));
+	UPDATE("remove", Ketama_remove_server(ketama, 1); ring.servers[1].removed = 1);
+	UPDATE("reweight", Ketama_set_server_weight(ketama, 3, 40); ring.servers[3].weight = 40);
+
+	//the same servers, in a ring created from scratch
+	flush_ring_cache();
+	Ketama *fresh = Ketama_new();
+	Ketama_set_hash(fresh, hash);
+	Ring copy = {.hash = hash, .num_servers = 0, .points = NULL};
+	for(int i = 0; i < ring.num_servers; i++) {
+		add_server(fresh, &copy, 6379 + i, ring.servers[i].weight);
+	}
+	Ketama_remove_server(fresh, 1);
+	Ketama_create_continuum(fresh);
+	differences = 0;
+	for(size_t i = 0; i < NUM_RING_KEYS; i++) {
+		differences += (Ketama_get_server_ordinal(ketama, keys[i], key_lens[i]) !=
+				Ketama_get_server_ordinal(fresh, keys[i], key_lens[i]));
+	}
+	CHECK(differences == 0, "%s: %d keys on another server than in a ring created from scratch", hash_names[hash],
+			differences);
+
+	Ketama_free(fresh);
+	Ketama_free(ketama);
+	free(ring.points);
+	free(copy.points);
+}
+
+/**
+ * With bounded loads no server gets more than (1 + epsilon) times its share of the keys in use, and the first key goes
+ * to its server on the ring.
+ */
+static void test_load_bound(const char **keys, const size_t *key_lens)
+{
+	const double epsilon = 0.25;
+	const unsigned long weights[] = {100, 100, 200, 50, 150};
+	const int num_servers = sizeof(weights) / sizeof(weights[0]);
+	const size_t n = 20000;
+	unsigned long memory = 0;
+	Ketama *ketama = Ketama_new();
+	for(int i = 0; i < num_servers; i++) {
+		Ketama_add_server(ketama, "10.0.3.1", 6379 + i, weights[i]);
+		memory += weights[i];
+	}
+	Ketama_create_continuum(ketama);
+
+	//without a bound each key goes to its server on the ring
+	int differences = 0;
+	for(size_t i = 0; i < 1000; i++) {
+		int ordinal = Ketama_acquire_server(ketama, keys[i], key_lens[i]);
+		differences += (ordinal != Ketama_get_server_ordinal(ketama, keys[i], key_lens[i]));
+		Ketama_release_server(ketama, ordinal);
+	}
+	CHECK(differences == 0, "%d keys on another server without bounded loads", differences);
+
+	Ketama_set_load_bound(ketama, epsilon);
+	int *ordinals = malloc(n * sizeof(int));
+	int over = 0;
+	int moved = 0;
+	for(size_t i = 0; i < n; i++) {
+		ordinals[i] = Ketama_acquire_server(ketama, keys[i], key_lens[i]);
+		moved += (ordinals[i] != Ketama_get_server_ordinal(ketama, keys[i], key_lens[i]));
+		double capacity = (1.0 + epsilon) * (double)(i + 1) / (double)memory;
+		over += (Ketama_get_server_load(ketama, ordinals[i]) > ceil(capacity * (double)weights[ordinals[i]]));
+	}
+	CHECK(ordinals[0] == Ketama_get_server_ordinal(ketama, keys[0], key_lens[0]), "the first key was moved");
+	CHECK(over == 0, "%d keys went to a server over its bound", over);
+	CHECK(moved > 0 && moved < n / 2, "%d of %zu keys moved with bounded loads", moved, n);
+	long total = 0;
+	for(int i = 0; i < num_servers; i++) {
+		total += Ketama_get_server_load(ketama, i);
+	}
+	CHECK(total == n, "the loads add up to %ld instead of %zu", total, n);
+	for(size_t i = 0; i < n; i++) {
+		Ketama_release_server(ketama, ordinals[i]);
+	}
+	for(int i = 0; i < num_servers; i++) {
+		CHECK(Ketama_get_server_load(ketama, i) == 0, "server %d has a load of %ld after releasing all keys", i,
+				Ketama_get_server_load(ketama, i));
+	}
+	free(ordinals);
+	Ketama_free(ketama);
+}
+
+/**
+ * A saved ring must load with the same servers and keys, be updated like the original, and a damaged file must be
+ * rejected.
+ */
+static void test_save_load(KetamaHash hash, const char **keys, const size_t *key_lens)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/ketama_test.%d", (int)getpid());
+	Ring ring = {.hash = hash, .num_servers = 0, .points = NULL};
+	Ketama *ketama = Ketama_new();
+	Ketama_set_hash(ketama, hash);
+	for(int i = 0; i < 4; i++) {
+		add_server(ketama, &ring, 7379 + i, 100 + 10 * i);
+	}
+	Ketama_remove_server(ketama, 2);
+	ring.servers[2].removed = 1;
+	Ketama_create_continuum(ketama);
+	CHECK(Ketama_save_continuum(ketama, path) == 0, "%s: could not save: %s", hash_names[hash],
+			Module_last_error(GET_MODULE()));
+
+	Ketama *loaded = Ketama_new();
+	if(Ketama_load_continuum(loaded, path) == -1) {
+		CHECK(0, "%s: could not load: %s", hash_names[hash], Module_last_error(GET_MODULE()));
+	}
+	else {
+		CHECK(Ketama_get_server_count(loaded) == 4, "%s: %d servers loaded", hash_names[hash],
+				Ketama_get_server_count(loaded));
+		for(int i = 0; i < 4; i++) {
+			CHECK(strcmp(Ketama_get_server_address(loaded, i), Ketama_get_server_address(ketama, i)) == 0,
+					"%s: server %d loaded as %s", hash_names[hash], i, Ketama_get_server_address(loaded, i));
+		}
+		int differences = count_differences(loaded, &ring, keys, key_lens, NUM_RING_KEYS);
+		CHECK(differences == 0, "%s: %d keys on another server in the loaded ring", hash_names[hash], differences);
+		add_server(loaded, &ring, 7383, 100);
+		differences = count_differences(loaded, &ring, keys, key_lens, NUM_RING_KEYS);
+		CHECK(differences == 0, "%s: %d keys on another server in the loaded ring after adding a server",
+				hash_names[hash], differences);
+	}
+	Ketama_free(loaded);
+
+	//a continuum whose index does not end at its last point, and a truncated file
+	FILE *f = fopen(path, "r+b");
+	unsigned int bad = 0xFFFFFFFFU;
+	fseek(f, -(long)sizeof(bad), SEEK_END);
+	fwrite(&bad, sizeof(bad), 1, f);
+	fclose(f);
+	loaded = Ketama_new();
+	CHECK(Ketama_load_continuum(loaded, path) == -1, "%s: a file with a bad index was loaded", hash_names[hash]);
+	Ketama_free(loaded);
+	CHECK(truncate(path, 100) == 0, "could not truncate %s", path);
+	loaded = Ketama_new();
+	CHECK(Ketama_load_continuum(loaded, path) == -1, "%s: a truncated file was loaded", hash_names[hash]);
+	Ketama_free(loaded);
+
+	unlink(path);
+	Ketama_free(ketama);
+	free(ring.points);
+}
+
+/**
+ * Jump consistent hash as published by Lamping and Veach.
+ */
+static int32_t jump_consistent_hash(uint64_t key, int32_t num_buckets)
+{
+	int64_t b = -1, j = 0;
+	while(j < num_buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+	}
+	return b;
+}
+
+/**
+ * The key of the jump hash for a key, the finalizer of splitmix64 applied to its MurmurHash3 (as in distributor.c).
+ */
+static uint64_t jump_key(const char *key, size_t key_len)
+{
+	uint64_t x = Hash_murmur3(key, key_len, 0);
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/**
+ * Checks that the keys are spread over the servers following their weights, within 5% of their share.
+ */
+static void check_spread(const int *ordinals, size_t n, const unsigned long *weights, int num_servers, const char *what)
+{
+	unsigned long total = 0;
+	size_t counts[MAX_SERVERS] = {0};
+	for(int i = 0; i < num_servers; i++) {
+		total += weights[i];
+	}
+	for(size_t i = 0; i < n; i++) {
+		if(ordinals[i] < 0 || ordinals[i] >= num_servers) {
+			CHECK(0, "%s: key %zu on server %d", what, i, ordinals[i]);
+			return;
+		}
+		counts[ordinals[i]]++;
+	}
+	for(int i = 0; i < num_servers; i++) {
+		double expected = (double)n * weights[i] / total;
+		CHECK(fabs(counts[i] - expected) <= 0.05 * expected + 1, "%s: server %d has %zu keys, expected %.0f", what, i,
+				counts[i], expected);
+	}
+}
+
+/**
+ * Checks that the keys that moved between before and after all moved to (or away from) the given server.
+ */
+static void check_moves(const int *before, const int *after, size_t n, int server, int to, const char *what)
+{
+	size_t moved = 0;
+	size_t wrong = 0;
+	for(size_t i = 0; i < n; i++) {
+		if(before[i] != after[i]) {
+			moved++;
+			wrong += to ? (after[i] != server) : (before[i] != server);
+		}
+	}
+	CHECK(moved > 0, "%s: no keys moved", what);
+	CHECK(wrong == 0, "%s: %zu of %zu keys moved %s another server", what, wrong, moved, to ? "to" : "away from");
+}
+
+static void test_jump_hash(const char **keys, const size_t *key_lens)
+{
+	//the examples of the reference implementation
+	CHECK(jump_consistent_hash(1, 1) == 0, "jump hash of 1 over 1 bucket");
+	CHECK(jump_consistent_hash(42, 57) == 43, "jump hash of 42 over 57 buckets");
+	CHECK(jump_consistent_hash(0xDEAD10CC, 1) == 0, "jump hash of 0xDEAD10CC over 1 bucket");
+	CHECK(jump_consistent_hash(0xDEAD10CC, 666) == 361, "jump hash of 0xDEAD10CC over 666 buckets");
+	CHECK(jump_consistent_hash(256, 1024) == 520, "jump hash of 256 over 1024 buckets");
+
+	JumpHash *jump = JumpHash_new();
+	CHECK(JumpHash_get_server_ordinal(jump, "foo", 3) == -1, "a key has a server without servers");
+	int *before = malloc(NUM_RING_KEYS * sizeof(int));
+	int *after = malloc(NUM_RING_KEYS * sizeof(int));
+	unsigned long weights[MAX_SERVERS];
+	for(int num_servers = 1; num_servers <= 9; num_servers++) {
+		JumpHash_add_server(jump, "10.0.4.1", 6379 + num_servers);
+		int differences = 0;
+		for(size_t i = 0; i < NUM_RING_KEYS; i++) {
+			after[i] = JumpHash_get_server_ordinal(jump, keys[i], key_lens[i]);
+			differences += (after[i] != jump_consistent_hash(jump_key(keys[i], key_lens[i]), num_servers));
+		}
+		CHECK(differences == 0, "jump hash over %d servers: %d keys differ from the reference", num_servers,
+				differences);
+		weights[num_servers - 1] = 1;
+		check_spread(after, NUM_RING_KEYS, weights, num_servers, "jump hash");
+		if(num_servers > 1) {
+			check_moves(before, after, NUM_RING_KEYS, num_servers - 1, 1, "jump hash, adding a server");
+		}
+		memcpy(before, after, NUM_RING_KEYS * sizeof(int));
+	}
+	free(before);
+	free(after);
+	JumpHash_free(jump);
+}
+
+static void rendezvous_ordinals(Rendezvous *rendezvous, const char **keys, const size_t *key_lens, int *ordinals)
+{
+	for(size_t i = 0; i < NUM_RING_KEYS; i++) {
+		ordinals[i] = Rendezvous_get_server_ordinal(rendezvous, keys[i], key_lens[i]);
+	}
+}
+
+static void test_rendezvous(const char **keys, const size_t *key_lens)
+{
+	unsigned long weights[MAX_SERVERS] = {100, 200, 300, 400};
+	int num_servers = 4;
+	Rendezvous *rendezvous = Rendezvous_new();
+	CHECK(Rendezvous_get_server_ordinal(rendezvous, "foo", 3) == -1, "a key has a server without servers");
+	for(int i = 0; i < num_servers; i++) {
+		Rendezvous_add_server(rendezvous, "10.0.5.1", 6379 + i, weights[i]);
+	}
+	int *before = malloc(NUM_RING_KEYS * sizeof(int));
+	int *after = malloc(NUM_RING_KEYS * sizeof(int));
+	rendezvous_ordinals(rendezvous, keys, key_lens, before);
+	check_spread(before, NUM_RING_KEYS, weights, num_servers, "rendezvous");
+
+	weights[num_servers] = 250;
+	Rendezvous_add_server(rendezvous, "10.0.5.1", 6379 + num_servers, weights[num_servers]);
+	num_servers++;
+	rendezvous_ordinals(rendezvous, keys, key_lens, after);
+	check_spread(after, NUM_RING_KEYS, weights, num_servers, "rendezvous, adding a server");
+	check_moves(before, after, NUM_RING_KEYS, num_servers - 1, 1, "rendezvous, adding a server");
+
+	memcpy(before, after, NUM_RING_KEYS * sizeof(int));
+	weights[0] = 500;
+	CHECK(Rendezvous_set_server_weight(rendezvous, 0, weights[0]) == 0, "could not reweight");
+	rendezvous_ordinals(rendezvous, keys, key_lens, after);
+	check_spread(after, NUM_RING_KEYS, weights, num_servers, "rendezvous, raising a weight");
+	check_moves(before, after, NUM_RING_KEYS, 0, 1, "rendezvous, raising a weight");
+
+	memcpy(before, after, NUM_RING_KEYS * sizeof(int));
+	weights[2] = 0;
+	CHECK(Rendezvous_remove_server(rendezvous, 2) == 0, "could not remove");
+	rendezvous_ordinals(rendezvous, keys, key_lens, after);
+	check_spread(after, NUM_RING_KEYS, weights, num_servers, "rendezvous, removing a server");
+	check_moves(before, after, NUM_RING_KEYS, 2, 0, "rendezvous, removing a server");
+
+	CHECK(Rendezvous_remove_server(rendezvous, 2) == -1, "removed a server twice");
+	CHECK(Rendezvous_set_server_weight(rendezvous, 2, 100) == -1, "reweighted a removed server");
+	CHECK(Rendezvous_set_server_weight(rendezvous, num_servers, 100) == -1, "reweighted a server that does not exist");
+	CHECK(strcmp(Rendezvous_get_server_address(rendezvous, 2), "10.0.5.1:6381") == 0, "removed server has address %s",
+			Rendezvous_get_server_address(rendezvous, 2));
+	free(before);
+	free(after);
+	Rendezvous_free(rendezvous);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = (argc > 1) ? atoi(argv[1]) : 42;
+	srand(seed);
+
+	Module *module = Module_new();
+	Module_init(module);
+
+	test_md5_many();
+	test_batched(KETAMA_HASH_MD5);
+	test_batched(KETAMA_HASH_MURMUR3);
+
+	const char **keys = malloc(NUM_RING_KEYS * sizeof(char *));
+	size_t *key_lens = malloc(NUM_RING_KEYS * sizeof(size_t));
+	char *data = malloc(NUM_RING_KEYS * 16);
+	for(size_t i = 0; i < NUM_RING_KEYS; i++) {
+		keys[i] = data + i * 16;
+		key_lens[i] = snprintf(data + i * 16, 16, "key:%d", rand());
+	}
+	for(KetamaHash hash = KETAMA_HASH_MD5; hash <= KETAMA_HASH_MURMUR3; hash++) {
+		test_update(hash, keys, key_lens);
+		test_save_load(hash, keys, key_lens);
+	}
+	test_load_bound(keys, key_lens);
+	test_jump_hash(keys, key_lens);
+	test_rendezvous(keys, key_lens);
+	free(keys);
+	free(key_lens);
+	free(data);
+
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures (seed %u)\n", failures, seed);
+		return 1;
+	}
+	printf("all ketama tests passed\n");
+	return 0;
+}
@@ -7,17 +7,20 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 
 #include "common.h"
 #include "alloc.h"
 #include "batch.h"
 #include "list.h"
 #include "reply.h"
+#include "parser.h"
 #include "connection.h"
-
-#define BATCH_REPLY_ITERATOR_STACK_SIZE 2
+#include "cache.h"
 
 struct _Batch
 {
@@ -26,232 +29,991 @@ struct _Batch
 #endif
 
     int num_commands;
-    struct list_head reply_queue; //finished commands that have replies set
+    int may_write; //whether a command was written that is not known to be read-only
+    ReplyArray replies; //finished commands that have replies set
 
     Buffer *write_buffer;
     Buffer *read_buffer;
+    Buffer *local_buffer; //data for replies that did not come from the read buffer (e.g. errors)
+
+    //iterator state
+    size_t current_top; //index of the next top-level reply
+    size_t current; //index of the next record to return
+    size_t current_end; //end of the records of the current top-level reply
+    int current_depth; //depth of the current top-level reply
+    size_t pushes_current; //index of the next push reply
+    size_t lazy_pos; //position in read buffer of next child of current lazy aggregate reply
+    size_t *lazy_remaining; //number of children still to be decoded, for the lazy reply and its nested aggregates
+    size_t lazy_size; //size of lazy_remaining, it is allocated on first use and kept when the batch is re-used
+    int lazy_depth; //number of entries in lazy_remaining, 0 if not iterating a lazy reply
+    int lazy_level; //level of the children of the lazy reply
+
+    //position after the last child looked up in a lazy aggregate reply, so that walking its children is linear
+    size_t lazy_cursor_index;
+    size_t lazy_cursor_child;
+    size_t lazy_cursor_pos;
 
-    //simple stack for iterating results
-    int current_reply_sp;
-    struct list_head *current_reply[BATCH_REPLY_ITERATOR_STACK_SIZE * 2];
+    //coalescing of runs of GET/SET commands into MGET/MSET
+    int coalesce;
+    int run_kind; //RUN_NONE if there is no pending run
+    size_t run_start; //position in write buffer of the arguments of the pending run, its header is inserted there
+    size_t run_count; //number of GET/SET commands in the pending run
+    size_t num_replied; //number of replies received so far for the commands as sent
+    Buffer *plan; //a BatchPlanEntry for each command that replaces several commands, in order
+    size_t plan_current; //index of the plan entry for the next coalesced reply
+
+    //replies of GET/HGET commands that are taken from a ReplyCache instead of sending the command
+    ReplyCache *cache;
+    Buffer *cached; //a BatchCachedEntry for each reply from the cache, in order
+    size_t cached_current; //index of the next cached reply to add to the replies
+    Buffer *misses; //a BatchMissEntry for each GET/HGET that was sent, and for each key written after one, in order
+    size_t misses_current; //index of the next miss whose reply is to be stored in the cache
+
+    //push replies, they are among the records of the replies, but not among the top-level replies (those are the
+    //replies to the commands)
+    Buffer *pushes; //a BatchPushEntry for each push reply, in the order received
 
     //error for aborted batch
-    Buffer *error;
+    int aborted;
+    size_t error_offset; //offset of error message in local buffer
 };
 
-struct _Reply
+ALLOC_LIST_T(Batch, list)
+
+#define RUN_NONE 0
+#define RUN_GET 1
+#define RUN_SET 2
+
+typedef struct _BatchPlanEntry
 {
-    struct list_head list;
+    size_t index; //index of the command (e.g. MGET) among the commands as sent
+    size_t count; //number of commands it replaces, and therefore number of replies it expands to
+} BatchPlanEntry;
 
+typedef struct _BatchCachedEntry
+{
+    size_t after; //number of commands as sent whose replies go before it
     ReplyType type;
+    size_t offset; //of the data in the local buffer
+    size_t len;
+} BatchCachedEntry;
 
-    Buffer *buffer;
-    size_t offset;
+//what is done with the cache when the reply to the command of a BatchMissEntry comes in
+#define MISS_STORE 0 //the reply to the GET/HGET is stored
+#define MISS_INVALIDATE 1 //the replies of the key written by the command are removed (again)
+#define MISS_CLEAR 2 //all replies are removed (again), the command changed the whole database
+
+typedef struct _BatchMissEntry
+{
+    size_t index; //index of the command among the commands as sent
+    size_t sub; //index of the GET in the coalesced run that was sent as the command, 0 if it was sent by itself
+    int action;
+    size_t key_offset; //of the cache key in the local buffer, for MISS_INVALIDATE of the key written
+    size_t key_len;
+    size_t group_len; //of the cache key, see ReplyCache_write_key
+} BatchMissEntry;
+
+typedef struct _BatchPushEntry
+{
+    size_t after; //number of top-level replies that were received before it
+    size_t index; //of its record
+} BatchPushEntry;
+
+typedef struct _CommandArg
+{
+    int param; //index of the parameter, -1 for a constant argument
+    size_t offset; //of the data of a constant argument in the data of the command
     size_t len;
+} CommandArg;
 
-    struct list_head children;
+struct _Command
+{
+    Byte *data; //encoded constant parts of the command
+    size_t size;
+    int argc;
+    int num_params;
+    int keys; //the keys written by the command, see Batch_written_keys
+    int cacheable; //GET or HGET, whose reply may come from the cache of the batch
+    size_t *segments; //end in data of the constant part before each parameter, the last entry is size
+    CommandArg *key_args; //the keys written by the command, or the key and field of a cacheable one, NULL if none
+    int num_key_args;
 };
 
-ALLOC_LIST_T(Reply, list)
+Batch *Batch_new()
+{
+    Batch *batch;
+    if(Batch_list_alloc(&batch)) {
+        batch->read_buffer = Buffer_new(DEFAULT_READ_BUFF_SIZE);
+        batch->write_buffer = Buffer_new(DEFAULT_WRITE_BUFF_SIZE);
+        batch->local_buffer = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+        ReplyArray_init(&batch->replies);
+        batch->lazy_remaining = NULL;
+        batch->lazy_size = 0;
+        batch->plan = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+        batch->cached = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+        batch->misses = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+        batch->pushes = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    }
+    batch->num_commands = 0;
+    batch->may_write = 0;
+
+    batch->current_top = 0;
+    batch->current = 0;
+    batch->current_end = 0;
+    batch->current_depth = 0;
+    batch->pushes_current = 0;
+    batch->lazy_pos = 0;
+    batch->lazy_depth = 0;
+    batch->lazy_level = 0;
+    batch->lazy_cursor_index = (size_t)-1;
+
+    batch->coalesce = 0;
+    batch->run_kind = RUN_NONE;
+    batch->run_start = 0;
+    batch->run_count = 0;
+    batch->num_replied = 0;
+    batch->plan_current = 0;
+
+    batch->cache = NULL;
+    batch->cached_current = 0;
+    batch->misses_current = 0;
+
+    batch->aborted = 0;
+    batch->error_offset = 0;
+
+    return batch;
+}
 
-Reply *Reply_new(ReplyType type, Buffer *buffer, size_t offset, size_t len)
+void _Batch_free(Batch *batch, int final)
 {
-    Reply *reply;
-    Reply_list_alloc(&reply);
-    DEBUG(("Reply_new, type: %d\n", type));
-    reply->type = type;
-    reply->buffer = buffer;
-    reply->offset = offset;
-    reply->len = len;
-    INIT_LIST_HEAD(&reply->children);
-    return reply;
+    DEBUG(("_Batch_free\n"));
+    if(final) {
+        DEBUG(("_Batch_free final\n"));
+        Buffer_free(batch->read_buffer);
+        Buffer_free(batch->write_buffer);
+        Buffer_free(batch->local_buffer);
+        Buffer_free(batch->plan);
+        Buffer_free(batch->cached);
+        Buffer_free(batch->misses);
+        Buffer_free(batch->pushes);
+        ReplyArray_release(&batch->replies);
+        if(batch->lazy_remaining != NULL) {
+            Alloc_free(batch->lazy_remaining, sizeof(size_t) * batch->lazy_size);
+        }
+    }
+    else {
+        DEBUG(("_Batch_free re-use\n"));
+        //give the chunks back to the pool, a re-used batch will borrow again on first write/read
+        Buffer_clear(batch->read_buffer);
+        Buffer_clear(batch->write_buffer);
+        Buffer_clear(batch->local_buffer);
+        Buffer_clear(batch->plan);
+        Buffer_clear(batch->cached);
+        Buffer_clear(batch->misses);
+        Buffer_clear(batch->pushes);
+        ReplyArray_clear(&batch->replies);
+    }
+    Batch_list_free(batch, final);
 }
 
-void _Reply_free(Reply *reply, int final)
+//the keys written by a command, whose replies are removed from the cache of the batch
+#define KEYS_NONE 0 //none, the command only reads
+#define KEYS_FIRST 1 //the first argument, as most commands that write
+#define KEYS_TWO 2 //the first two arguments (e.g. RENAME)
+#define KEYS_ALL 3 //all arguments (e.g. DEL)
+#define KEYS_PAIRS 4 //every other argument, starting with the first (e.g. MSET)
+#define KEYS_DATABASE 5 //any key (e.g. FLUSHDB, or EVAL as its keys are not known)
+
+#define COMMAND(name, keys) {name, sizeof(name) - 1, keys}
+
+/**
+ * Commands that never write, a batch with only these commands may be executed on a replica, and the commands that
+ * write other keys than their first argument. Their lengths are recorded, so that looking up a name mostly compares
+ * lengths and first letters.
+ */
+static const struct
+{
+    const char *name;
+    size_t len;
+    int keys;
+} COMMANDS[] = {
+    COMMAND("GET", KEYS_NONE), COMMAND("MGET", KEYS_NONE), COMMAND("EXISTS", KEYS_NONE), COMMAND("TTL", KEYS_NONE),
+    COMMAND("PTTL", KEYS_NONE), COMMAND("TYPE", KEYS_NONE), COMMAND("STRLEN", KEYS_NONE),
+    COMMAND("GETRANGE", KEYS_NONE), COMMAND("GETBIT", KEYS_NONE), COMMAND("BITCOUNT", KEYS_NONE),
+    COMMAND("BITPOS", KEYS_NONE),
+    COMMAND("HGET", KEYS_NONE), COMMAND("HMGET", KEYS_NONE), COMMAND("HGETALL", KEYS_NONE),
+    COMMAND("HEXISTS", KEYS_NONE), COMMAND("HLEN", KEYS_NONE), COMMAND("HKEYS", KEYS_NONE), COMMAND("HVALS", KEYS_NONE),
+    COMMAND("HSTRLEN", KEYS_NONE), COMMAND("HSCAN", KEYS_NONE),
+    COMMAND("LRANGE", KEYS_NONE), COMMAND("LLEN", KEYS_NONE), COMMAND("LINDEX", KEYS_NONE), COMMAND("LPOS", KEYS_NONE),
+    COMMAND("SMEMBERS", KEYS_NONE), COMMAND("SISMEMBER", KEYS_NONE), COMMAND("SMISMEMBER", KEYS_NONE),
+    COMMAND("SCARD", KEYS_NONE), COMMAND("SRANDMEMBER", KEYS_NONE), COMMAND("SINTER", KEYS_NONE),
+    COMMAND("SUNION", KEYS_NONE), COMMAND("SDIFF", KEYS_NONE), COMMAND("SSCAN", KEYS_NONE),
+    COMMAND("ZRANGE", KEYS_NONE), COMMAND("ZRANGEBYSCORE", KEYS_NONE), COMMAND("ZRANGEBYLEX", KEYS_NONE),
+    COMMAND("ZREVRANGE", KEYS_NONE), COMMAND("ZREVRANGEBYSCORE", KEYS_NONE), COMMAND("ZREVRANGEBYLEX", KEYS_NONE),
+    COMMAND("ZSCORE", KEYS_NONE), COMMAND("ZMSCORE", KEYS_NONE), COMMAND("ZCARD", KEYS_NONE),
+    COMMAND("ZCOUNT", KEYS_NONE), COMMAND("ZLEXCOUNT", KEYS_NONE), COMMAND("ZRANK", KEYS_NONE),
+    COMMAND("ZREVRANK", KEYS_NONE), COMMAND("ZSCAN", KEYS_NONE),
+    COMMAND("XRANGE", KEYS_NONE), COMMAND("XREVRANGE", KEYS_NONE), COMMAND("XLEN", KEYS_NONE),
+    COMMAND("GEOPOS", KEYS_NONE), COMMAND("GEODIST", KEYS_NONE), COMMAND("GEOHASH", KEYS_NONE),
+    COMMAND("SCAN", KEYS_NONE), COMMAND("KEYS", KEYS_NONE), COMMAND("DBSIZE", KEYS_NONE),
+    COMMAND("RANDOMKEY", KEYS_NONE), COMMAND("DUMP", KEYS_NONE), COMMAND("PING", KEYS_NONE),
+    COMMAND("ECHO", KEYS_NONE), COMMAND("TIME", KEYS_NONE),
+    COMMAND("DEL", KEYS_ALL), COMMAND("UNLINK", KEYS_ALL), COMMAND("MSET", KEYS_PAIRS), COMMAND("MSETNX", KEYS_PAIRS),
+    COMMAND("RENAME", KEYS_TWO), COMMAND("RENAMENX", KEYS_TWO), COMMAND("COPY", KEYS_TWO), COMMAND("SMOVE", KEYS_TWO),
+    COMMAND("LMOVE", KEYS_TWO), COMMAND("RPOPLPUSH", KEYS_TWO),
+    COMMAND("FLUSHDB", KEYS_DATABASE), COMMAND("FLUSHALL", KEYS_DATABASE), COMMAND("SWAPDB", KEYS_DATABASE),
+    COMMAND("SELECT", KEYS_DATABASE), COMMAND("EVAL", KEYS_DATABASE), COMMAND("EVALSHA", KEYS_DATABASE),
+    COMMAND("FCALL", KEYS_DATABASE),
+};
+
+#define NUM_COMMANDS (sizeof(COMMANDS) / sizeof(COMMANDS[0]))
+
+/**
+ * Returns the keys written by the command with the given name (KEYS_NONE if it only reads), a command that is not
+ * known is taken to write its first argument.
+ */
+static int Batch_written_keys(const char *name, size_t name_len)
 {
-    if(!final) {
-        while(!list_empty(&reply->children)) {
-            Reply *child = list_pop_T(Reply, list, &reply->children);
-            Reply_free(child);
+    if(name_len == 0) {
+        return KEYS_FIRST;
+    }
+    char first = toupper((unsigned char)name[0]);
+    for(size_t i = 0; i < NUM_COMMANDS; i++) {
+        if(COMMANDS[i].len == name_len && COMMANDS[i].name[0] == first &&
+           strncasecmp(COMMANDS[i].name + 1, name + 1, name_len - 1) == 0) {
+            return COMMANDS[i].keys;
         }
     }
-    Reply_list_free(reply, final);
+    return KEYS_FIRST;
 }
 
-void Reply_add_child(Reply *reply, Reply *child)
+void Batch_set_cache(Batch *batch, ReplyCache *cache)
 {
-    list_add_tail(&child->list, &reply->children);
+    batch->cache = cache;
 }
 
-int Reply_has_child(Reply *reply)
+/**
+ * Whether the command is a GET or HGET, whose reply can be taken from the cache of the batch.
+ */
+static int Batch_is_cacheable(int argc, const char **argv, const size_t *argvlen)
 {
-    return !list_empty(&reply->children);
+    size_t name_len = (argvlen != NULL) ? argvlen[0] : strlen(argv[0]);
+    if(argc == 2) {
+        return name_len == 3 && strncasecmp(argv[0], "GET", 3) == 0;
+    }
+    if(argc == 3) {
+        return name_len == 4 && strncasecmp(argv[0], "HGET", 4) == 0;
+    }
+    return 0;
 }
 
-Reply *Reply_pop_child(Reply *reply)
+/**
+ * Adds the replies from the cache that go after the replies to the commands as sent so far.
+ */
+static void Batch_add_cached(Batch *batch)
 {
-    return list_pop_T(Reply, list, &reply->children);
+    BatchCachedEntry *entries = (BatchCachedEntry *)Buffer_data(batch->cached);
+    size_t count = Buffer_position(batch->cached) / sizeof(BatchCachedEntry);
+    while(batch->cached_current < count && entries[batch->cached_current].after == batch->num_replied) {
+        BatchCachedEntry *entry = &entries[batch->cached_current++];
+        size_t index = ReplyArray_add(&batch->replies, entry->type, entry->offset, entry->len, 0);
+        ReplyArray_get(&batch->replies, index)->flags |= REPLY_LOCAL;
+        ReplyArray_commit(&batch->replies);
+    }
 }
 
-size_t Reply_length(Reply *reply)
+/**
+ * Looks up the reply to GET key (field is NULL) or HGET key field in the cache of the batch. On a hit the reply is
+ * copied and put in the batch after the replies of the commands written before, instead of sending the command, and 1
+ * is returned. On a miss 0 is returned, the cache key is left in the local buffer at key_offset (with the length of
+ * its group in group_len), for Batch_add_miss.
+ */
+static int Batch_lookup(Batch *batch, const char *key, size_t key_len, const char *field, size_t field_len,
+        size_t *key_offset, size_t *group_len)
 {
-    return reply->len;
+    Buffer *local = batch->local_buffer;
+    *key_offset = Buffer_position(local);
+    *group_len = ReplyCache_write_key(local, key, key_len, field, field_len);
+
+    ReplyType type;
+    char *data;
+    size_t len;
+    if(!ReplyCache_lookup(batch->cache, Buffer_data(local) + *key_offset, Buffer_position(local) - *key_offset,
+            &type, &data, &len)) {
+        return 0;
+    }
+    Buffer_set_position(local, *key_offset);
+    Batch_end_run(batch);
+    BatchCachedEntry *entry = (BatchCachedEntry *)Buffer_extend(batch->cached, sizeof(BatchCachedEntry));
+    entry->after = batch->num_replied + batch->num_commands;
+    entry->type = type;
+    entry->offset = Buffer_position(local);
+    entry->len = len;
+    if(len > 0) {
+        Buffer_write(local, data, len);
+    }
+    //if no command goes before it, it is a reply right away
+    Batch_add_cached(batch);
+    return 1;
 }
 
-Byte *Reply_data(Reply *reply)
+/**
+ * Records that the GET/HGET that was just written was not found in the cache, so that its reply is stored.
+ */
+static void Batch_add_miss(Batch *batch, size_t key_offset, size_t group_len)
 {
-    assert(reply->buffer != NULL);
-    return Buffer_data(reply->buffer) + reply->offset;
+    BatchMissEntry *entry = (BatchMissEntry *)Buffer_extend(batch->misses, sizeof(BatchMissEntry));
+    entry->index = batch->num_replied + batch->num_commands - 1;
+    entry->sub = (batch->run_kind == RUN_GET) ? batch->run_count - 1 : 0;
+    entry->action = MISS_STORE;
+    entry->key_offset = key_offset;
+    entry->key_len = Buffer_position(batch->local_buffer) - key_offset;
+    entry->group_len = group_len;
 }
 
-ReplyType Reply_type(Reply *reply)
+/**
+ * Removes the replies of the key (or of all keys if key is NULL) from the cache, as the command that was just written
+ * writes it. Replies to GET/HGET commands sent before it are only stored when they come in, so if any are due the
+ * replies are removed again when the reply to this command comes in.
+ */
+static void Batch_invalidate_key(Batch *batch, const char *key, size_t key_len)
 {
-    return reply->type;
+    if(key != NULL) {
+        ReplyCache_invalidate(batch->cache, key, key_len);
+    }
+    else {
+        ReplyCache_clear(batch->cache);
+    }
+    if(Buffer_position(batch->misses) == 0) {
+        return;
+    }
+    size_t key_offset = Buffer_position(batch->local_buffer);
+    if(key != NULL) {
+        Buffer_write(batch->local_buffer, key, key_len);
+    }
+    BatchMissEntry *entry = (BatchMissEntry *)Buffer_extend(batch->misses, sizeof(BatchMissEntry));
+    entry->index = batch->num_replied + batch->num_commands - 1;
+    entry->sub = 0;
+    entry->action = (key != NULL) ? MISS_INVALIDATE : MISS_CLEAR;
+    entry->key_offset = key_offset;
+    entry->key_len = key_len;
+    entry->group_len = 0;
 }
 
-void Reply_dump(Reply *reply) {
-    ReplyType reply_type = reply->type;
-    switch(reply_type) {
-    case RT_OK: {
-        printf("ok reply: %.*s\n", (int)reply->len, Reply_data(reply));
+/**
+ * The arguments of a command of argc arguments that are the keys it writes (keys as returned by Batch_written_keys) are
+ * those from 1 up to *end, every *step. None for KEYS_NONE and KEYS_DATABASE.
+ */
+static void Batch_written_args(int keys, int argc, int *end, int *step)
+{
+    *end = argc;
+    *step = 1;
+    switch(keys) {
+    case KEYS_NONE:
+    case KEYS_DATABASE:
+        *end = 1;
         break;
-    }
-    case RT_BULK: {
-        printf("bulk reply: %.*s\n", (int)reply->len, Reply_data(reply));
+    case KEYS_FIRST:
+        *end = MIN(argc, 2);
         break;
-    }
-    case RT_BULK_NIL: {
-        printf("bulk nil\n");
+    case KEYS_TWO:
+        *end = MIN(argc, 3);
         break;
-    }
-    case RT_MULTIBULK: {
-        printf("multi bulk reply, count: %d\n", (int)reply->len);
-        Reply *child;
-        list_for_each_entry(child, &reply->children, list) {
-            assert(child != NULL);
-            ReplyType child_type = child->type;
-            if(RT_BULK == child_type) {
-                printf("\tbulk reply: %.*s\n", (int)child->len, Reply_data(child));
-            }
-            else if(RT_BULK_NIL == child_type) {
-                printf("\tbulk nil\n");
-            }
-            else {
-                assert(0);
-            }
-        }
+    case KEYS_PAIRS:
+        *step = 2;
         break;
     }
-    default:
-        printf("unknown reply %d\n", reply_type);
+}
+
+/**
+ * Removes the replies of the keys written by the command that was just written from the cache, keys is what
+ * Batch_written_keys returned for it.
+ */
+static void Batch_invalidate(Batch *batch, int keys, int argc, const char **argv, const size_t *argvlen)
+{
+    if(keys == KEYS_DATABASE) {
+        Batch_invalidate_key(batch, NULL, 0);
+        return;
+    }
+    int end, step;
+    Batch_written_args(keys, argc, &end, &step);
+    for(int i = 1; i < end; i += step) {
+        Batch_invalidate_key(batch, argv[i], (argvlen != NULL) ? argvlen[i] : strlen(argv[i]));
     }
 }
 
-ALLOC_LIST_T(Batch, list)
+void Batch_write(Batch *batch, const char *str, size_t str_len, int num_commands)
+{
+    Batch_end_run(batch);
+    if(num_commands > 0) {
+        batch->may_write = 1; //the commands are not looked at
+    }
+    if(str != NULL && str_len > 0) {
+        Buffer_write(batch->write_buffer, str, str_len);
+    }
+    batch->num_commands += num_commands;
+}
 
-Batch *Batch_new()
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/**
+ * Number of decimal digits of n.
+ */
+static inline int Batch_decimal_length(size_t n)
 {
-    Batch *batch;
-    if(Batch_list_alloc(&batch)) {
-        batch->read_buffer = Buffer_new(DEFAULT_READ_BUFF_SIZE);
-        batch->write_buffer = Buffer_new(DEFAULT_WRITE_BUFF_SIZE);
+    int len = 1;
+    for(;;) {
+        if(n < 10) return len;
+        if(n < 100) return len + 1;
+        if(n < 1000) return len + 2;
+        if(n < 10000) return len + 3;
+        n /= 10000;
+        len += 4;
     }
-    batch->num_commands = 0;
-    INIT_LIST_HEAD(&batch->reply_queue);
+}
+
+/**
+ * Writes the len decimal digits of n at p (len as returned by Batch_decimal_length), two digits at a time.
+ * Returns the position after the digits.
+ */
+static inline Byte *Batch_format_decimal(Byte *p, size_t n, int len)
+{
+    Byte *end = p + len;
+    p = end;
+    while(n >= 100) {
+        const char *pair = DIGIT_PAIRS + (n % 100) * 2;
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if(n >= 10) {
+        const char *pair = DIGIT_PAIRS + n * 2;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    else {
+        *--p = '0' + n;
+    }
+    return end;
+}
 
-    batch->current_reply_sp = 0;
-    batch->current_reply[0] = &batch->reply_queue;
-    batch->current_reply[1] = &batch->reply_queue;
+/**
+ * Size of a bulk argument of len bytes in the multibulk format.
+ */
+static inline size_t Batch_bulk_size(size_t len)
+{
+    return 1 + Batch_decimal_length(len) + 2 + len + 2;
+}
 
-    batch->error = NULL;
+/**
+ * Encodes a bulk argument at p, returns the position after it.
+ */
+static inline Byte *Batch_encode_bulk(Byte *p, const char *str, size_t len)
+{
+    *p++ = '$';
+    p = Batch_format_decimal(p, len, Batch_decimal_length(len));
+    *p++ = CR;
+    *p++ = LF;
+    memcpy(p, str, len);
+    p += len;
+    *p++ = CR;
+    *p++ = LF;
+    return p;
+}
 
-    return batch;
+void Batch_write_decimal(Batch *batch, long decimal)
+{
+    Batch_end_run(batch);
+    size_t n = (decimal < 0) ? -(size_t)decimal : (size_t)decimal;
+    int len = Batch_decimal_length(n);
+    Byte *p = Buffer_extend(batch->write_buffer, len + (decimal < 0 ? 1 : 0));
+    if(decimal < 0) {
+        *p++ = '-';
+    }
+    Batch_format_decimal(p, n, len);
 }
 
-void _Batch_free(Batch *batch, int final)
+void Batch_write_command(Batch *batch, int argc, const char **argv, const size_t *argvlen)
 {
-    DEBUG(("_Batch_free\n"));
-    while(!list_empty(&batch->reply_queue)) {
-        Reply *reply = list_pop_T(Reply, list, &batch->reply_queue);
-        Reply_free(reply);
+    Batch_end_run(batch);
+    size_t key_offset = 0;
+    size_t group_len = 0;
+    int cacheable = batch->cache != NULL && Batch_is_cacheable(argc, argv, argvlen);
+    if(cacheable && Batch_lookup(batch, argv[1], (argvlen != NULL) ? argvlen[1] : strlen(argv[1]),
+            (argc == 3) ? argv[2] : NULL, (argc == 3) ? ((argvlen != NULL) ? argvlen[2] : strlen(argv[2])) : 0,
+            &key_offset, &group_len)) {
+        return;
     }
-    if(final) {
-        DEBUG(("_Batch_free final\n"));
-        Buffer_free(batch->read_buffer);
-        Buffer_free(batch->write_buffer);
+    //once the batch may write, the names are only looked at for the cache
+    int keys = KEYS_NONE;
+    if(argc > 0 && !cacheable && (!batch->may_write || batch->cache != NULL)) {
+        keys = Batch_written_keys(argv[0], (argvlen != NULL) ? argvlen[0] : strlen(argv[0]));
+        if(keys != KEYS_NONE) {
+            batch->may_write = 1;
+        }
+    }
+
+    //determine the exact size of the encoded command, so that we reserve space in the write buffer only once
+    int argc_len = Batch_decimal_length(argc);
+    size_t size = 1 + argc_len + 2;
+    for(int i = 0; i < argc; i++) {
+        size += Batch_bulk_size((argvlen != NULL) ? argvlen[i] : strlen(argv[i]));
+    }
+
+    Byte *p = Buffer_extend(batch->write_buffer, size);
+    *p++ = '*';
+    p = Batch_format_decimal(p, argc, argc_len);
+    *p++ = CR;
+    *p++ = LF;
+    for(int i = 0; i < argc; i++) {
+        p = Batch_encode_bulk(p, argv[i], (argvlen != NULL) ? argvlen[i] : strlen(argv[i]));
+    }
+    batch->num_commands += 1;
+    if(cacheable) {
+        Batch_add_miss(batch, key_offset, group_len);
+    }
+    else if(batch->cache != NULL) {
+        Batch_invalidate(batch, keys, argc, argv, argvlen);
+    }
+}
+
+Command *Command_new(int argc, const char **argv, const size_t *argvlen)
+{
+    if(argc < 1 || argv == NULL || argv[0] == NULL) {
+        Module_set_error(GET_MODULE(), "Command needs at least a constant command name");
+        return NULL;
+    }
+
+    //encode the header and all constant arguments, the parameters are left as gaps
+    int num_params = 0;
+    int argc_len = Batch_decimal_length(argc);
+    size_t size = 1 + argc_len + 2;
+    for(int i = 0; i < argc; i++) {
+        if(argv[i] == NULL) {
+            num_params++;
+        }
+        else {
+            size += Batch_bulk_size((argvlen != NULL) ? argvlen[i] : strlen(argv[i]));
+        }
+    }
+
+    //the arguments that are looked at when it is written, the key and field of a GET/HGET or the keys written
+    int cacheable = Batch_is_cacheable(argc, argv, argvlen);
+    int keys = Batch_written_keys(argv[0], (argvlen != NULL) ? argvlen[0] : strlen(argv[0]));
+    int end = argc;
+    int step = 1;
+    if(!cacheable) {
+        Batch_written_args(keys, argc, &end, &step);
+    }
+    int num_key_args = (end > 1) ? (end - 2) / step + 1 : 0;
+
+    Command *command = Alloc_alloc_T(Command);
+    if(command == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating Command");
+        return NULL;
+    }
+    command->data = Alloc_alloc(size);
+    command->segments = Alloc_alloc(sizeof(size_t) * (num_params + 1));
+    command->key_args = (num_key_args > 0) ? Alloc_alloc(sizeof(CommandArg) * num_key_args) : NULL;
+    if(command->data == NULL || command->segments == NULL || (num_key_args > 0 && command->key_args == NULL)) {
+        if(command->data != NULL) Alloc_free(command->data, size);
+        if(command->segments != NULL) Alloc_free(command->segments, sizeof(size_t) * (num_params + 1));
+        if(command->key_args != NULL) Alloc_free(command->key_args, sizeof(CommandArg) * num_key_args);
+        Alloc_free_T(command, Command);
+        Module_set_error(GET_MODULE(), "Out of memory while allocating Command");
+        return NULL;
+    }
+    command->size = size;
+    command->argc = argc;
+    command->num_params = num_params;
+    command->keys = keys;
+    command->cacheable = cacheable;
+    command->num_key_args = num_key_args;
+
+    Byte *p = command->data;
+    *p++ = '*';
+    p = Batch_format_decimal(p, argc, argc_len);
+    *p++ = CR;
+    *p++ = LF;
+    int param = 0;
+    for(int i = 0; i < argc; i++) {
+        size_t len = (argv[i] != NULL) ? ((argvlen != NULL) ? argvlen[i] : strlen(argv[i])) : 0;
+        if(i >= 1 && i < end && (i - 1) % step == 0) {
+            CommandArg *key = &command->key_args[(i - 1) / step];
+            key->param = (argv[i] == NULL) ? param : -1;
+            key->offset = (p - command->data) + Batch_bulk_size(len) - len - 2; //after the length line
+            key->len = len;
+        }
+        if(argv[i] == NULL) {
+            command->segments[param++] = p - command->data;
+            continue;
+        }
+        p = Batch_encode_bulk(p, argv[i], len);
+    }
+    command->segments[param] = size;
+    assert(p - command->data == size);
+
+    return command;
+}
+
+void Command_free(Command *command)
+{
+    Alloc_free(command->data, command->size);
+    Alloc_free(command->segments, sizeof(size_t) * (command->num_params + 1));
+    if(command->key_args != NULL) {
+        Alloc_free(command->key_args, sizeof(CommandArg) * command->num_key_args);
+    }
+    Alloc_free_T(command, Command);
+}
+
+int Command_num_params(Command *command)
+{
+    return command->num_params;
+}
+
+/**
+ * The i-th key argument of a prepared command as written with the given parameters, from the constant parts of the
+ * command or from the parameters.
+ */
+static inline void Command_key_arg(Command *command, int i, const char **params, const size_t *paramslen,
+        const char **arg, size_t *arg_len)
+{
+    CommandArg *key = &command->key_args[i];
+    if(key->param >= 0) {
+        *arg = params[key->param];
+        *arg_len = (paramslen != NULL) ? paramslen[key->param] : strlen(params[key->param]);
     }
     else {
-        DEBUG(("_Batch_free re-use\n"));
-        Buffer_clear(batch->read_buffer);
-        Buffer_clear(batch->write_buffer);
-#ifndef NDEBUG
-        Buffer_fill(batch->read_buffer, (Byte)0xEA);
-        Buffer_fill(batch->write_buffer, (Byte)0xEA);
-#else
-        Buffer_fill(batch->read_buffer, 0);
-        Buffer_fill(batch->write_buffer, 0);
-#endif
+        *arg = (const char *)command->data + key->offset;
+        *arg_len = key->len;
     }
-    if (batch->error) {
-        Buffer_free(batch->error);
-        batch->error = NULL;
+}
+
+/**
+ * Removes the replies of the keys written by the prepared command that was just written from the cache.
+ */
+static void Batch_invalidate_prepared(Batch *batch, Command *command, const char **params, const size_t *paramslen)
+{
+    if(command->keys == KEYS_DATABASE) {
+        Batch_invalidate_key(batch, NULL, 0);
+        return;
+    }
+    for(int i = 0; i < command->num_key_args; i++) {
+        const char *key;
+        size_t key_len;
+        Command_key_arg(command, i, params, paramslen, &key, &key_len);
+        Batch_invalidate_key(batch, key, key_len);
     }
-    Batch_list_free(batch, final);
 }
 
-void Batch_write(Batch *batch, const char *str, size_t str_len, int num_commands)
+void Batch_write_prepared(Batch *batch, Command *command, const char **params, const size_t *paramslen)
 {
-    if(str != NULL && str_len > 0) {
-        Buffer_write(batch->write_buffer, str, str_len);
+    Batch_end_run(batch);
+    size_t key_offset = 0;
+    size_t group_len = 0;
+    int cacheable = batch->cache != NULL && command->cacheable;
+    if(cacheable) {
+        const char *key, *field = NULL;
+        size_t key_len, field_len = 0;
+        Command_key_arg(command, 0, params, paramslen, &key, &key_len);
+        if(command->num_key_args == 2) {
+            Command_key_arg(command, 1, params, paramslen, &field, &field_len);
+        }
+        if(Batch_lookup(batch, key, key_len, field, field_len, &key_offset, &group_len)) {
+            return;
+        }
+    }
+    if(command->keys != KEYS_NONE) {
+        batch->may_write = 1;
+    }
+
+    size_t size = command->size;
+    for(int i = 0; i < command->num_params; i++) {
+        size += Batch_bulk_size((paramslen != NULL) ? paramslen[i] : strlen(params[i]));
+    }
+
+    //copy the constant parts in between the encoded parameters
+    Byte *p = Buffer_extend(batch->write_buffer, size);
+    size_t start = 0;
+    for(int i = 0; i < command->num_params; i++) {
+        size_t end = command->segments[i];
+        memcpy(p, command->data + start, end - start);
+        p += end - start;
+        start = end;
+        p = Batch_encode_bulk(p, params[i], (paramslen != NULL) ? paramslen[i] : strlen(params[i]));
+    }
+    memcpy(p, command->data + start, command->size - start);
+    batch->num_commands += 1;
+    if(cacheable) {
+        Batch_add_miss(batch, key_offset, group_len);
+    }
+    else if(batch->cache != NULL && command->keys != KEYS_NONE) {
+        Batch_invalidate_prepared(batch, command, params, paramslen);
     }
-    batch->num_commands += num_commands;
 }
 
-void Batch_write_decimal(Batch *batch, long decimal)
+void Batch_set_coalesce(Batch *batch, int coalesce)
 {
-    char buff[32];
-    int buff_len = snprintf(buff, 32, "%ld", decimal);
-    Batch_write(batch, buff, buff_len, 0);
+    if(!coalesce) {
+        Batch_end_run(batch);
+    }
+    batch->coalesce = coalesce;
 }
 
-void Batch_write_set(Batch *batch, const char *key, int key_len, const char *value, int value_len)
+/**
+ * Adds a GET or SET command to the pending run of commands of that kind, starting a new run if needed. Only the
+ * arguments are written here, the header of the run is inserted when the run ends.
+ */
+static inline void Batch_add_to_run(Batch *batch, int kind)
 {
-    Batch_write(batch, "SET ", 4, 0);
-    Batch_write(batch, key, key_len, 0);
-    Batch_write(batch, " ", 1, 0);
-    Batch_write_decimal(batch, value_len);
-    Batch_write(batch, "\r\n", 2, 0);
-    Batch_write(batch, value, value_len, 0);
-    Batch_write(batch, "\r\n", 2, 1);
+    if(batch->run_kind != kind) {
+        Batch_end_run(batch);
+        batch->run_kind = kind;
+        batch->run_start = Buffer_position(batch->write_buffer);
+        batch->run_count = 0;
+        batch->num_commands += 1; //the whole run is sent as 1 command
+    }
+    batch->run_count += 1;
 }
 
-void Batch_write_get(Batch *batch, const char *key, int key_len)
+/**
+ * Ends the pending run of GET or SET commands (if any) by inserting the header of the command that is sent for it;
+ * the command itself for a run of 1, otherwise MGET or MSET. For the latter an entry is added to the plan, so that the
+ * reply can be expanded into a reply for each command of the run.
+ * This is called before anything else is written and before the batch is executed.
+ */
+void Batch_end_run(Batch *batch)
 {
-    Batch_write(batch, "GET ", 4, 0);
-    Batch_write(batch, key, key_len, 0);
-    Batch_write(batch, "\r\n", 2, 1);
+    if(batch->run_kind == RUN_NONE) {
+        return;
+    }
+
+    int multi = batch->run_count > 1;
+    const char *name;
+    size_t argc;
+    if(batch->run_kind == RUN_GET) {
+        name = multi ? "MGET" : "GET";
+        argc = 1 + batch->run_count;
+    }
+    else {
+        name = multi ? "MSET" : "SET";
+        argc = 1 + 2 * batch->run_count;
+    }
+    size_t name_len = strlen(name);
+    int argc_len = Batch_decimal_length(argc);
+    size_t header_size = 1 + argc_len + 2 + Batch_bulk_size(name_len);
+
+    //make room for the header in front of the arguments
+    size_t end = Buffer_position(batch->write_buffer);
+    Buffer_extend(batch->write_buffer, header_size);
+    Byte *p = Buffer_data(batch->write_buffer) + batch->run_start;
+    memmove(p + header_size, p, end - batch->run_start);
+    *p++ = '*';
+    p = Batch_format_decimal(p, argc, argc_len);
+    *p++ = CR;
+    *p++ = LF;
+    Batch_encode_bulk(p, name, name_len);
+
+    if(multi) {
+        BatchPlanEntry *entry = (BatchPlanEntry *)Buffer_extend(batch->plan, sizeof(BatchPlanEntry));
+        entry->index = batch->num_replied + batch->num_commands - 1;
+        entry->count = batch->run_count;
+    }
+    batch->run_kind = RUN_NONE;
 }
 
+void Batch_write_set(Batch *batch, const char *key, int key_len, const char *value, int value_len)
+{
+    if(batch->coalesce) {
+        Batch_add_to_run(batch, RUN_SET);
+        batch->may_write = 1;
+        Byte *p = Buffer_extend(batch->write_buffer, Batch_bulk_size(key_len) + Batch_bulk_size(value_len));
+        p = Batch_encode_bulk(p, key, key_len);
+        Batch_encode_bulk(p, value, value_len);
+        if(batch->cache != NULL) {
+            Batch_invalidate_key(batch, key, key_len);
+        }
+        return;
+    }
+    const char *argv[3] = {"SET", key, value};
+    size_t argvlen[3] = {3, key_len, value_len};
+    Batch_write_command(batch, 3, argv, argvlen);
+}
 
+void Batch_write_get(Batch *batch, const char *key, int key_len)
+{
+    if(batch->coalesce) {
+        size_t key_offset = 0;
+        size_t group_len = 0;
+        if(batch->cache != NULL && Batch_lookup(batch, key, key_len, NULL, 0, &key_offset, &group_len)) {
+            return;
+        }
+        Batch_add_to_run(batch, RUN_GET);
+        Batch_encode_bulk(Buffer_extend(batch->write_buffer, Batch_bulk_size(key_len)), key, key_len);
+        if(batch->cache != NULL) {
+            Batch_add_miss(batch, key_offset, group_len);
+        }
+        return;
+    }
+    const char *argv[2] = {"GET", key};
+    size_t argvlen[2] = {3, key_len};
+    Batch_write_command(batch, 2, argv, argvlen);
+}
 
 int Batch_has_command(Batch *batch)
 {
     return batch->num_commands > 0;
 }
 
+int Batch_is_read_only(Batch *batch)
+{
+    return !batch->may_write;
+}
+
+ReplyArray *Batch_replies(Batch *batch)
+{
+    return &batch->replies;
+}
+
+/**
+ * Expands the reply of a command that replaced count commands into a reply for each of them. A multibulk reply
+ * (of MGET) is split into its children, any other reply (the status reply of MSET, or an error) is repeated.
+ */
+static void Batch_expand_reply(Batch *batch, size_t count)
+{
+    ReplyArray *replies = &batch->replies;
+    Reply reply = *ReplyArray_get(replies, replies->committed);
+    if(!Reply_is_aggregate(reply.type) || reply.len != count) {
+        ReplyArray_commit(replies);
+        if(Reply_is_aggregate(reply.type)) {
+            return; //not the expected reply, leave it as is
+        }
+        for(size_t i = 1; i < count; i++) {
+            size_t index = ReplyArray_add(replies, reply.type, reply.offset, reply.len, 0);
+            ReplyArray_get(replies, index)->flags = reply.flags;
+            ReplyArray_commit(replies);
+        }
+    }
+    else if(reply.flags & REPLY_LAZY) {
+        //the children were not recorded, decode them now (any aggregate child stays lazy)
+        ReplyArray_rollback(replies);
+        Byte *data = Buffer_data(batch->read_buffer);
+        size_t pos = reply.offset;
+        for(size_t i = 0; i < count; i++) {
+            ReplyType type;
+            size_t offset, len;
+            ReplyParser_decode(data, &pos, &type, &offset, &len);
+            size_t index;
+            if(Reply_is_aggregate(type) && len > 0) {
+                index = ReplyArray_add(replies, type, pos, len, 0);
+                ReplyArray_get(replies, index)->flags |= REPLY_LAZY;
+                for(size_t j = 0; j < len; j++) {
+                    ReplyParser_skip(data, &pos);
+                }
+            }
+            else {
+                ReplyArray_add(replies, type, offset, len, 0);
+            }
+            ReplyArray_commit(replies);
+        }
+    }
+    else {
+        ReplyArray_commit_children(replies);
+    }
+}
+
+static inline Byte *Batch_reply_data(Batch *batch, Reply *reply)
+{
+    Buffer *buffer = (reply->flags & REPLY_LOCAL) ? batch->local_buffer : batch->read_buffer;
+    return Buffer_data(buffer) + reply->offset;
+}
+
+/**
+ * Stores the replies to the GET/HGET commands that were sent for the command with index num_replied in the cache, or
+ * removes the replies of the keys it wrote, first is the index of its (first) top-level reply.
+ */
+static void Batch_store_misses(Batch *batch, size_t first)
+{
+    ReplyArray *replies = &batch->replies;
+    BatchMissEntry *entries = (BatchMissEntry *)Buffer_data(batch->misses);
+    size_t count = Buffer_position(batch->misses) / sizeof(BatchMissEntry);
+    while(batch->misses_current < count && entries[batch->misses_current].index == batch->num_replied) {
+        BatchMissEntry *entry = &entries[batch->misses_current++];
+        if(entry->action == MISS_INVALIDATE) {
+            ReplyCache_invalidate(batch->cache, Buffer_data(batch->local_buffer) + entry->key_offset, entry->key_len);
+            continue;
+        }
+        if(entry->action == MISS_CLEAR) {
+            ReplyCache_clear(batch->cache);
+            continue;
+        }
+        if(first + entry->sub >= ReplyArray_top_count(replies)) {
+            continue; //not expanded, e.g. an unexpected reply to MGET
+        }
+        Reply *reply = ReplyArray_get(replies, ReplyArray_top(replies, first + entry->sub));
+        if(reply->type == RT_BULK || reply->type == RT_BULK_NIL || reply->type == RT_NIL) {
+            int has_data = Reply_has_data(reply->type);
+            ReplyCache_store(batch->cache, Buffer_data(batch->local_buffer) + entry->key_offset, entry->key_len,
+                    entry->group_len, reply->type, has_data ? Batch_reply_data(batch, reply) : NULL,
+                    has_data ? reply->len : 0);
+        }
+    }
+}
 
-void Batch_add_reply(Batch *batch, Reply *reply)
+/**
+ * Called when the parser has added the reply for the next command to the batch's replies.
+ */
+void Batch_add_reply(Batch *batch)
 {
-    DEBUG(("pop cmd from command queue\n"));
-    DEBUG(("add reply/cmd back to reply queue\n"));
+    DEBUG(("add reply to batch\n"));
     batch->num_commands -= 1;
-    list_add_tail(&reply->list, &batch->reply_queue);
+    size_t first = ReplyArray_top_count(&batch->replies);
+    BatchPlanEntry *entry = NULL;
+    if(batch->plan_current < Buffer_position(batch->plan) / sizeof(BatchPlanEntry)) {
+        entry = (BatchPlanEntry *)Buffer_data(batch->plan) + batch->plan_current;
+    }
+    if(entry != NULL && entry->index == batch->num_replied) {
+        Batch_expand_reply(batch, entry->count);
+        batch->plan_current += 1;
+    }
+    else {
+        ReplyArray_commit(&batch->replies);
+    }
+    if(batch->cache != NULL) {
+        Batch_store_misses(batch, first);
+    }
+    batch->num_replied += 1;
+    if(batch->cache != NULL) {
+        Batch_add_cached(batch);
+    }
+}
+
+/**
+ * Called when the parser has added a (RESP3) push reply to the batch's replies. It is not the reply to a command, so
+ * it is kept aside: Batch_next_reply returns it in the order received, but it is not counted or indexed as a reply.
+ */
+void Batch_add_push(Batch *batch)
+{
+    DEBUG(("add push reply to batch\n"));
+    BatchPushEntry *entry = (BatchPushEntry *)Buffer_extend(batch->pushes, sizeof(BatchPushEntry));
+    entry->after = ReplyArray_top_count(&batch->replies);
+    entry->index = ReplyArray_commit_aside(&batch->replies);
 }
 
 char *Batch_error(Batch *batch)
 {
-    if(batch->error) {
-        return Buffer_data(batch->error);
+    if(batch->aborted) {
+        return Buffer_data(batch->local_buffer) + batch->error_offset;
     }
     else {
         return NULL;
@@ -261,16 +1023,62 @@ char *Batch_error(Batch *batch)
 void Batch_abort(Batch *batch, const char *error)
 {
     DEBUG(("Batch abort\n"));
-    assert(batch->error == NULL);
-    int length = strlen(error) + 1; //include terminating null character
-    batch->error = Buffer_new(length);
-    Buffer_write(batch->error, error, length);
+    assert(!batch->aborted);
+    Batch_end_run(batch);
+    size_t length = strlen(error);
+    batch->aborted = 1;
+    batch->error_offset = Buffer_position(batch->local_buffer);
+    Buffer_write(batch->local_buffer, error, length + 1); //include terminating null character
+    //discard any partially parsed reply
+    ReplyArray_rollback(&batch->replies);
     while(Batch_has_command(batch)) {
         DEBUG(("Batch abort, adding error reply\n"));
-        Batch_add_reply(batch, Reply_new(RT_ERROR, batch->error, 0, length));
+        size_t index = ReplyArray_add(&batch->replies, RT_ERROR, batch->error_offset, length, 0);
+        ReplyArray_get(&batch->replies, index)->flags |= REPLY_LOCAL;
+        Batch_add_reply(batch);
     }
 }
 
+static inline void Batch_decode_reply(Batch *batch, size_t *pos, ReplyType *reply_type, char **data, size_t *len)
+{
+    size_t offset;
+    ReplyParser_decode(Buffer_data(batch->read_buffer), pos, reply_type, &offset, len);
+    *data = Reply_has_data(*reply_type) ? Buffer_data(batch->read_buffer) + offset : NULL;
+}
+
+static inline void Batch_get_reply(Batch *batch, Reply *reply, ReplyType *reply_type, char **data, size_t *len)
+{
+    *reply_type = reply->type;
+    if(Reply_has_data(reply->type)) {
+        *data = Batch_reply_data(batch, reply);
+    }
+    else {
+        *data = NULL;
+    }
+    *len = reply->len;
+}
+
+/**
+ * Makes sure the stack of lazy children counts can hold size entries.
+ */
+static int Batch_reserve_lazy(Batch *batch, size_t size)
+{
+    if(size <= batch->lazy_size) {
+        return 0;
+    }
+    size_t lazy_size = batch->lazy_size > 0 ? batch->lazy_size * 2 : REPLY_STACK_SIZE;
+    while(lazy_size < size) {
+        lazy_size *= 2;
+    }
+    size_t *lazy_remaining = Alloc_realloc(batch->lazy_remaining, sizeof(size_t) * lazy_size, sizeof(size_t) * batch->lazy_size);
+    if(lazy_remaining == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while reading nested reply");
+        return -1;
+    }
+    batch->lazy_remaining = lazy_remaining;
+    batch->lazy_size = lazy_size;
+    return 0;
+}
 
 int Batch_next_reply(Batch *batch, ReplyType *reply_type, char **data, size_t *len)
 {
@@ -285,68 +1093,210 @@ int Batch_next_reply(Batch *batch, ReplyType *reply_type, char **data, size_t *l
     *data = NULL;
     *len = 0;
 
-    struct list_head *current = batch->current_reply[batch->current_reply_sp];
-    struct list_head *last = batch->current_reply[batch->current_reply_sp + 1];
-
-    current = current->next;
-
-    batch->current_reply[batch->current_reply_sp] = current;
-
-    if(current == last) {
-        if(batch->current_reply_sp > 0) {
-            DEBUG(("Batch_next_reply, current == last, pop\n"));
-            batch->current_reply_sp -= 2;
-            assert(batch->current_reply_sp >= 0);
-            current = batch->current_reply[batch->current_reply_sp];
-            last = batch->current_reply[batch->current_reply_sp + 1];
-            if(current == last) {
-                //ok were also at the end at this level
-                return 0;
+    if(batch->lazy_depth > 0) {
+        //decode next child of lazy aggregate reply (or of an aggregate nested in it)
+        int level = batch->lazy_level + batch->lazy_depth - 1;
+        Batch_decode_reply(batch, &batch->lazy_pos, reply_type, data, len);
+        batch->lazy_remaining[batch->lazy_depth - 1] -= 1;
+        if(Reply_is_aggregate(*reply_type) && *len > 0) {
+            if(-1 == Batch_reserve_lazy(batch, batch->lazy_depth + 1)) {
+                return -1;
             }
+            batch->lazy_remaining[batch->lazy_depth] = *len;
+            batch->lazy_depth += 1;
         }
         else {
-            DEBUG(("Batch_next_reply, current == last, end\n"));
+            while(batch->lazy_depth > 0 && batch->lazy_remaining[batch->lazy_depth - 1] == 0) {
+                batch->lazy_depth -= 1;
+            }
+        }
+        return level;
+    }
+
+    ReplyArray *replies = &batch->replies;
+    if(batch->current == batch->current_end) {
+        //start at next top-level reply, or at a push reply that was received before it
+        BatchPushEntry *push = NULL;
+        if(batch->pushes_current < Buffer_position(batch->pushes) / sizeof(BatchPushEntry)) {
+            push = (BatchPushEntry *)Buffer_data(batch->pushes) + batch->pushes_current;
+        }
+        if(push != NULL && push->after <= batch->current_top) {
+            batch->current = push->index;
+            batch->pushes_current += 1;
+        }
+        else if(batch->current_top == ReplyArray_top_count(replies)) {
+            DEBUG(("Batch_next_reply, end\n"));
             return 0;
         }
+        else {
+            batch->current = ReplyArray_top(replies, batch->current_top);
+            batch->current_top += 1;
+        }
+        Reply *reply = ReplyArray_get(replies, batch->current);
+        batch->current_end = batch->current + reply->span;
+        batch->current_depth = reply->depth;
     }
 
-    int level = (batch->current_reply_sp / 2) + 1;
-    Reply *current_reply = list_entry(current, Reply, list);
-    *reply_type = current_reply->type;
-//		RT_NONE = 0,
-//	    RT_OK = 1,
-//		RT_ERROR = 2,
-//	    RT_BULK_NIL = 3,
-//	    RT_BULK = 4,
-//	    RT_MULTIBULK_NIL = 5,
-//	    RT_MULTIBULK = 6
-//		RT_INTEGER = 7
-    if(current_reply->type == RT_OK ||
-       current_reply->type == RT_ERROR ||
-       current_reply->type == RT_BULK ||
-       current_reply->type == RT_INTEGER) {
-        *data = Reply_data(current_reply);
-    }
-    else if(current_reply->type == RT_MULTIBULK) {
-        *data = NULL;
-        batch->current_reply[batch->current_reply_sp] = current->next;
-        batch->current_reply_sp += 2;
-        assert(batch->current_reply_sp <= (BATCH_REPLY_ITERATOR_STACK_SIZE * 2));
-        batch->current_reply[batch->current_reply_sp] = &current_reply->children;
-        batch->current_reply[batch->current_reply_sp + 1] = &current_reply->children;
-    }
-    else if(current_reply->type == RT_NONE ||
-             current_reply->type == RT_BULK_NIL ||
-             current_reply->type == RT_MULTIBULK_NIL) {
+    Reply *reply = ReplyArray_get(replies, batch->current);
+    batch->current += 1;
+    Batch_get_reply(batch, reply, reply_type, data, len);
+    int level = reply->depth - batch->current_depth + 1;
+    if(reply->flags & REPLY_LAZY) {
+        if(-1 == Batch_reserve_lazy(batch, 1)) {
+            return -1;
+        }
+        batch->lazy_pos = reply->offset;
+        batch->lazy_remaining[0] = reply->len;
+        batch->lazy_depth = 1;
+        batch->lazy_level = level + 1;
+    }
+    return level;
+}
+
+/**
+ * Positions the reply iterator, so that the next call to Batch_next_reply returns the top-level reply at index (push
+ * replies received before it are skipped).
+ */
+void Batch_seek_reply(Batch *batch, size_t index)
+{
+    BatchPushEntry *pushes = (BatchPushEntry *)Buffer_data(batch->pushes);
+    size_t num_pushes = Buffer_position(batch->pushes) / sizeof(BatchPushEntry);
+    batch->pushes_current = 0;
+    while(batch->pushes_current < num_pushes && pushes[batch->pushes_current].after <= index) {
+        batch->pushes_current += 1;
+    }
+    batch->current_top = index;
+    batch->current = 0;
+    batch->current_end = 0;
+    batch->lazy_depth = 0;
+}
+
+size_t Batch_reply_count(Batch *batch)
+{
+    return ReplyArray_top_count(&batch->replies);
+}
+
+int Batch_reply_at(Batch *batch, size_t index, ReplyType *reply_type, char **data, size_t *len)
+{
+    if(reply_type == NULL || data == NULL || len == NULL) {
+        Module_set_error(GET_MODULE(), "Invalid argument");
+        return -1;
+    }
+
+    ReplyArray *replies = &batch->replies;
+    if(index >= ReplyArray_top_count(replies)) {
+        *reply_type = RT_NONE;
         *data = NULL;
+        *len = 0;
+        return 0;
+    }
+
+    Batch_get_reply(batch, ReplyArray_get(replies, ReplyArray_top(replies, index)), reply_type, data, len);
+    return 1;
+}
+
+int Batch_reply_child_at(Batch *batch, size_t index, size_t child, ReplyType *reply_type, char **data, size_t *len)
+{
+    if(reply_type == NULL || data == NULL || len == NULL) {
+        Module_set_error(GET_MODULE(), "Invalid argument");
+        return -1;
+    }
+
+    *reply_type = RT_NONE;
+    *data = NULL;
+    *len = 0;
+
+    ReplyArray *replies = &batch->replies;
+    if(index >= ReplyArray_top_count(replies)) {
+        return 0;
+    }
+    size_t parent = ReplyArray_top(replies, index);
+    Reply *reply = ReplyArray_get(replies, parent);
+    if(!Reply_is_aggregate(reply->type) || child >= reply->len) {
+        return 0;
+    }
+    if(reply->flags & REPLY_LAZY) {
+        //decode children up to the requested one, continuing from the last lookup if possible
+        if(batch->lazy_cursor_index != parent || batch->lazy_cursor_child > child) {
+            batch->lazy_cursor_index = parent;
+            batch->lazy_cursor_child = 0;
+            batch->lazy_cursor_pos = reply->offset;
+        }
+        size_t pos = batch->lazy_cursor_pos;
+        for(size_t i = batch->lazy_cursor_child; i < child; i++) {
+            ReplyParser_skip(Buffer_data(batch->read_buffer), &pos);
+        }
+        size_t next = pos;
+        Batch_decode_reply(batch, &pos, reply_type, data, len);
+        if(Reply_is_aggregate(*reply_type)) {
+            ReplyParser_skip(Buffer_data(batch->read_buffer), &next);
+            pos = next;
+        }
+        batch->lazy_cursor_child = child + 1;
+        batch->lazy_cursor_pos = pos;
+        return 1;
+    }
+    if(reply->span == reply->len + 1) {
+        //children are all single records, so we can index directly
+        reply = ReplyArray_get(replies, parent + 1 + child);
     }
     else {
-        assert(0);
+        //skip over the preceding siblings and their children
+        reply = ReplyArray_get(replies, parent + 1);
+        while(child--) {
+            reply += reply->span;
+        }
     }
-    *len = current_reply->len;
-    return level;
+    Batch_get_reply(batch, reply, reply_type, data, len);
+    return 1;
 }
 
+Batch *Batch_duplicate(Batch *batch)
+{
+    Batch *copy = Batch_new();
+    //the write buffer of an executing batch is flipped, its limit is the end of the commands
+    Buffer *buffer = batch->write_buffer;
+    Buffer_write(copy->write_buffer, (char *)Buffer_data(buffer), Buffer_position(buffer) + Buffer_remaining(buffer));
+    if(Buffer_position(batch->plan) > 0) {
+        Buffer_write(copy->plan, (char *)Buffer_data(batch->plan), Buffer_position(batch->plan));
+    }
+    copy->num_commands = batch->num_commands + batch->num_replied;
+    copy->may_write = batch->may_write;
+    copy->replies.lazy_threshold = batch->replies.lazy_threshold;
+    if(batch->cache != NULL) {
+        //the replies from the cache and the cache keys of the misses are in the local buffer
+        copy->cache = batch->cache;
+        if(Buffer_position(batch->local_buffer) > 0) {
+            Buffer_write(copy->local_buffer, (char *)Buffer_data(batch->local_buffer), Buffer_position(batch->local_buffer));
+        }
+        if(Buffer_position(batch->cached) > 0) {
+            Buffer_write(copy->cached, (char *)Buffer_data(batch->cached), Buffer_position(batch->cached));
+        }
+        if(Buffer_position(batch->misses) > 0) {
+            Buffer_write(copy->misses, (char *)Buffer_data(batch->misses), Buffer_position(batch->misses));
+        }
+        Batch_add_cached(copy);
+    }
+    return copy;
+}
+
+void Batch_swap(Batch *batch, Batch *other)
+{
+    Batch tmp = *batch;
+    *batch = *other;
+    *other = tmp;
+#ifdef SINGLETHREADED
+    //the list links stay with the structs
+    struct list_head list = batch->list;
+    batch->list = other->list;
+    other->list = list;
+#endif
+}
+
+void Batch_set_lazy_threshold(Batch *batch, size_t min_children)
+{
+    batch->replies.lazy_threshold = min_children;
+}
 
 Buffer *Batch_read_buffer(Batch *batch)
 {
@@ -357,4 +1307,3 @@ Buffer *Batch_write_buffer(Batch *batch)
 {
     return batch->write_buffer;
 }
-
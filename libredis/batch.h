@@ -20,12 +20,20 @@ void Batch_free_final();
 int Batch_has_command(Batch *batch);
 
 //replies
-void Batch_add_reply(Batch *batch, Reply *reply);
+ReplyArray *Batch_replies(Batch *batch);
+void Batch_seek_reply(Batch *batch, size_t index);
+void Batch_add_reply(Batch *batch);
+void Batch_add_push(Batch *batch);
 
 //buffers (private interface to connection)
+void Batch_end_run(Batch *batch);
 Buffer *Batch_read_buffer(Batch *batch);
 Buffer *Batch_write_buffer(Batch *batch);
 
 void Batch_abort(Batch *batch, const char *error);
 
+//hedging (private interface to executor)
+Batch *Batch_duplicate(Batch *batch);
+void Batch_swap(Batch *batch, Batch *other);
+
 #endif
@@ -13,6 +13,9 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#ifndef SINGLETHREADED
+#include <pthread.h>
+#endif
 
 #include "common.h"
 #include "alloc.h"
@@ -21,46 +24,146 @@
 
 struct _Buffer
 {
-    Byte *data; //the current data (at first points to buff, but by enlargement might point to some enlarged buffer
-    Byte *buff; //the original buffer as allocated when buffer created
-    size_t buff_size; //original buffer size
+    Byte *data; //the current chunk, NULL until the buffer is first written to or read into
+    size_t size; //initial chunk size for this buffer
     size_t position;
     size_t limit;
-    size_t capacity; //current capacity
+    size_t capacity; //current capacity (size of the chunk)
 };
 
+/**
+ * Buffers borrow their memory from a pool of power-of-2 sized chunks. When a buffer is cleared or freed
+ * its chunk is given back to the pool, so that batches can re-use memory without going to the allocator
+ * for every request. The pool is per thread, so no locking is needed. Chunks larger than the largest size class
+ * are not pooled. The chunks in the pool of a thread are freed when the thread exits, and those of the thread that
+ * frees the module by Buffer_free_final.
+ */
+#define POOL_NUM_CLASSES (POOL_MAX_CHUNK_SHIFT - POOL_MIN_CHUNK_SHIFT + 1)
+
+typedef struct _Chunk
+{
+    struct _Chunk *next;
+} Chunk;
+
+static THREADLOCAL Chunk *pool_chunks[POOL_NUM_CLASSES]; //free list per size class
+static THREADLOCAL size_t pool_num_chunks[POOL_NUM_CLASSES];
+static THREADLOCAL size_t pool_bytes; //total bytes retained in free lists
+
+#ifndef SINGLETHREADED
+static pthread_key_t pool_key; //only used for its destructor, which runs when a thread that pooled chunks exits
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static THREADLOCAL int pool_registered;
+
+static void Buffer_pool_thread_exit(void *value)
+{
+    Buffer_free_final();
+}
+
+static void Buffer_pool_create_key()
+{
+    pthread_key_create(&pool_key, Buffer_pool_thread_exit);
+}
+
+static inline void Buffer_pool_register()
+{
+    if(!pool_registered) {
+        pthread_once(&pool_key_once, Buffer_pool_create_key);
+        pthread_setspecific(pool_key, &pool_registered);
+        pool_registered = 1;
+    }
+}
+#endif
+
+static inline int Buffer_pool_class(size_t size)
+{
+    int shift = POOL_MIN_CHUNK_SHIFT;
+    while(((size_t)1 << shift) < size) {
+        shift++;
+    }
+    return shift - POOL_MIN_CHUNK_SHIFT;
+}
+
+static Byte *Buffer_pool_acquire(size_t size, size_t *capacity)
+{
+    int cls = Buffer_pool_class(size);
+    *capacity = (size_t)1 << (cls + POOL_MIN_CHUNK_SHIFT);
+    if(cls < POOL_NUM_CLASSES && pool_chunks[cls] != NULL) {
+        DEBUG(("pool alloc chunk of %d\n", *capacity));
+        Chunk *chunk = pool_chunks[cls];
+        pool_chunks[cls] = chunk->next;
+        pool_num_chunks[cls] -= 1;
+        pool_bytes -= *capacity;
+        return (Byte *)chunk;
+    }
+    DEBUG(("real alloc chunk of %d\n", *capacity));
+    return Alloc_alloc(*capacity);
+}
+
+static void Buffer_pool_release(Byte *data, size_t capacity)
+{
+    int cls = Buffer_pool_class(capacity);
+    Module *module = GET_MODULE();
+    if(cls < POOL_NUM_CLASSES &&
+       pool_num_chunks[cls] < module->pool_max_chunks &&
+       pool_bytes + capacity <= module->pool_max_bytes) {
+        DEBUG(("pool free chunk of %d\n", capacity));
+#ifndef SINGLETHREADED
+        Buffer_pool_register();
+#endif
+        Chunk *chunk = (Chunk *)data;
+        chunk->next = pool_chunks[cls];
+        pool_chunks[cls] = chunk;
+        pool_num_chunks[cls] += 1;
+        pool_bytes += capacity;
+    }
+    else {
+        DEBUG(("real free chunk of %d\n", capacity));
+        Alloc_free(data, capacity);
+    }
+}
+
+void Buffer_free_final()
+{
+    DEBUG(("Buffer pool free final\n"));
+    for(int cls = 0; cls < POOL_NUM_CLASSES; cls++) {
+        size_t capacity = (size_t)1 << (cls + POOL_MIN_CHUNK_SHIFT);
+        while(pool_chunks[cls] != NULL) {
+            Chunk *chunk = pool_chunks[cls];
+            pool_chunks[cls] = chunk->next;
+            Alloc_free(chunk, capacity);
+        }
+        pool_num_chunks[cls] = 0;
+    }
+    pool_bytes = 0;
+}
+
 Buffer *Buffer_new(size_t size)
 {
     Buffer *buffer = Alloc_alloc_T(Buffer);
-    buffer->buff_size = size;
-    buffer->buff = Alloc_alloc(size);
-    buffer->data = buffer->buff;
+    buffer->size = size;
+    buffer->data = NULL;
     buffer->position = 0;
-    buffer->capacity = size;
-    buffer->limit = buffer->capacity;
-#ifndef NDEBUG
-    Buffer_fill(buffer, (Byte)0xEA);
-#else
-    Buffer_fill(buffer, 0);
-#endif
+    buffer->capacity = 0;
+    buffer->limit = 0;
     return buffer;
 }
 
 void Buffer_fill(Buffer *buffer, Byte b)
 {
-    memset(buffer->buff, b, buffer->capacity);
+    if(buffer->data != NULL) {
+        memset(buffer->data, b, buffer->capacity);
+    }
 }
 
 void Buffer_clear(Buffer *buffer)
 {
-    if(buffer->capacity > buffer->buff_size) {
-        DEBUG(("Clearing enlarged buffer\n"));
-        Alloc_free(buffer->data, buffer->capacity);
+    if(buffer->data != NULL) {
+        Buffer_pool_release(buffer->data, buffer->capacity);
+        buffer->data = NULL;
     }
-    buffer->data = buffer->buff;
     buffer->position = 0;
-    buffer->limit = buffer->buff_size;
-    buffer->capacity = buffer->buff_size;
+    buffer->limit = 0;
+    buffer->capacity = 0;
 
     DEBUG(("Buffer_clear %p done position: %d, limit: %d, cap: %d\n", (void *)buffer, buffer->position, buffer->limit, buffer->capacity));
 }
@@ -68,11 +171,7 @@ void Buffer_clear(Buffer *buffer)
 
 void Buffer_free(Buffer *buffer)
 {
-    Alloc_free(buffer->buff, buffer->buff_size);
-    if(buffer->capacity > buffer->buff_size) {
-        DEBUG(("Clearing enlarged buffer\n"));
-        Alloc_free(buffer->data, buffer->capacity);
-    }
+    Buffer_clear(buffer);
     DEBUG(("dealloc Buffer\n"));
     Alloc_free_T(buffer, Buffer);
 }
@@ -86,7 +185,7 @@ Byte *Buffer_data(Buffer *buffer)
 void Buffer_dump(Buffer *buffer, size_t limit)
 {
     int i, j;
-    if(limit == -1) {
+    if(limit == -1 || limit > buffer->capacity) {
         limit = buffer->capacity;
     }
     printf("buffer cap: %d, limit: %d, pos: %d\n", (int)buffer->capacity, (int)buffer->limit, (int)buffer->position);
@@ -131,21 +230,24 @@ void Buffer_ensure_remaining(Buffer *buffer, int min_remaining)
 {
     DEBUG(("Buffer %p ensure remaining: position: %d, limit: %d, cap: %d\n", (void *)buffer, buffer->position, buffer->limit, buffer->capacity));
     assert(buffer->limit == buffer->capacity);
-    while(Buffer_remaining(buffer) < min_remaining) {
-        buffer->limit *= 2;
+    if(buffer->data == NULL) {
+        //first use, borrow a chunk from the pool
+        buffer->data = Buffer_pool_acquire(buffer->size > min_remaining ? buffer->size : min_remaining, &buffer->capacity);
+        buffer->limit = buffer->capacity;
+#ifndef NDEBUG
+        Buffer_fill(buffer, (Byte)0xEA);
+#endif
     }
-    assert(buffer->limit >= buffer->capacity);
-    if(buffer->limit > buffer->capacity) {
-        if(buffer->capacity == buffer->buff_size) {
-            DEBUG(("growing buffer first time, new cap: %d, old cap: %d\n", buffer->limit, buffer->capacity));
-            buffer->data = Alloc_alloc(buffer->limit);
-            memcpy(buffer->data, buffer->buff, buffer->capacity);
-        }
-        else {
-            DEBUG(("growing buffer second or more time, new cap: %d, old cap: %d\n", buffer->limit, buffer->capacity));
-            buffer->data = Alloc_realloc(buffer->data, buffer->limit, buffer->capacity);
-        }
-        buffer->capacity = buffer->limit;
+    else if(Buffer_remaining(buffer) < min_remaining) {
+        //swap current chunk for a larger one
+        size_t capacity;
+        Byte *data = Buffer_pool_acquire(buffer->position + min_remaining, &capacity);
+        DEBUG(("growing buffer, new cap: %d, old cap: %d\n", capacity, buffer->capacity));
+        memcpy(data, buffer->data, buffer->position);
+        Buffer_pool_release(buffer->data, buffer->capacity);
+        buffer->data = data;
+        buffer->capacity = capacity;
+        buffer->limit = capacity;
     }
     assert(buffer->limit == buffer->capacity);
 }
@@ -183,8 +285,18 @@ void Buffer_flip(Buffer *buffer)
 void Buffer_write(Buffer *buffer, const char *data, size_t len)
 {
     DEBUG(("Buffer_write %d bytes\n", len));
+    memcpy(Buffer_extend(buffer, len), data, len);
+}
+
+/**
+ * Makes room for len more bytes at the current position and returns a pointer to them.
+ * The position is advanced past the new bytes, which are left for the caller to fill in.
+ */
+Byte *Buffer_extend(Buffer *buffer, size_t len)
+{
     Buffer_ensure_remaining(buffer, len);
-    memcpy(buffer->data + buffer->position, data, len);
+    Byte *data = buffer->data + buffer->position;
     buffer->position += len;
+    return data;
 }
 
@@ -17,6 +17,7 @@ typedef struct _Buffer Buffer;
 
 Buffer *Buffer_new(size_t size);
 void Buffer_free(Buffer *buffer);
+void Buffer_free_final();
 Byte *Buffer_data(Buffer *buffer);
 void Buffer_dump(Buffer *buffer, size_t limit);
 void Buffer_flip(Buffer *buffer);
@@ -27,6 +28,7 @@ void Buffer_set_position(Buffer *buffer, size_t position);
 void Buffer_set_limit(Buffer *buffer, size_t limit);
 size_t Buffer_remaining(Buffer *buffer);
 void Buffer_write(Buffer *buffer, const char *data, size_t len);
+Byte *Buffer_extend(Buffer *buffer, size_t len);
 size_t Buffer_recv(Buffer *buffer, int fd);
 size_t Buffer_send(Buffer *buffer, int fd);
 
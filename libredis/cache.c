@@ -0,0 +1,426 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * In-process store of values by key, for client side caching. A hash table (chained, the number of buckets doubles
+ * when there are more entries than buckets) with the entries in a list by last use. When the memory used by the
+ * entries exceeds the maximum, the least recently used entries are evicted. Entries can expire a fixed time after they
+ * were stored, they are removed when they are looked up after that (or evicted before).
+ * Entries can be put in a group, named by the start of their key, so that they can be removed together. The group is
+ * an entry of its own (that is not evicted by itself) with a list of its members, it is removed with its last member.
+ *
+ * A ReplyCache is a store of the replies to GET and HGET commands, for batches (see Batch_set_cache). The replies of
+ * HGET are grouped by key, so that a write of the key removes the replies of all its fields.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "list.h"
+#include "hash.h"
+#include "buffer.h"
+#include "cache.h"
+
+#define INIT_BUCKETS 64
+#define CACHE_GROUP -1 //type of the entry of a group
+
+typedef struct _CacheEntry
+{
+    struct _CacheEntry *next; //next entry in the bucket
+    struct list_head lru; //most recently used first, groups are not in this list
+    struct list_head members; //of a group its members, of a member its link in that list
+    struct _CacheEntry *group; //of a member, NULL for other entries
+    unsigned int hash;
+    int type; //of the value, as given to Cache_put, CACHE_GROUP for a group
+    double expires_ms; //time after which the entry is no longer returned, 0 if it does not expire
+    size_t key_len;
+    size_t value_len;
+    //followed by the key and the value
+} CacheEntry;
+
+struct _Cache
+{
+    CacheEntry **buckets;
+    size_t num_buckets; //power of 2
+    size_t num_entries;
+    struct list_head lru;
+    size_t memory; //of the entries
+    size_t max_memory;
+    int ttl_ms; //time an entry is kept after it was stored, 0 for no expiry
+};
+
+struct _ReplyCache
+{
+    Cache *cache;
+    Buffer *keys; //to build the cache keys of a written key in
+    long hits;
+    long misses;
+};
+
+static double Cache_time_ms()
+{
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * 1000.0 + tm.tv_nsec / 1000000.0;
+}
+
+static inline char *CacheEntry_key(CacheEntry *entry)
+{
+    return (char *)(entry + 1);
+}
+
+static inline char *CacheEntry_value(CacheEntry *entry)
+{
+    return (char *)(entry + 1) + entry->key_len;
+}
+
+static inline size_t CacheEntry_size(CacheEntry *entry)
+{
+    return sizeof(CacheEntry) + entry->key_len + entry->value_len;
+}
+
+Cache *Cache_new(size_t max_memory, int ttl_ms)
+{
+    Cache *cache = Alloc_alloc_T(Cache);
+    if(cache == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating Cache");
+        return NULL;
+    }
+    cache->num_buckets = INIT_BUCKETS;
+    cache->buckets = Alloc_alloc(sizeof(CacheEntry *) * cache->num_buckets);
+    if(cache->buckets == NULL) {
+        Alloc_free_T(cache, Cache);
+        Module_set_error(GET_MODULE(), "Out of memory while allocating Cache");
+        return NULL;
+    }
+    memset(cache->buckets, 0, sizeof(CacheEntry *) * cache->num_buckets);
+    cache->num_entries = 0;
+    INIT_LIST_HEAD(&cache->lru);
+    cache->memory = 0;
+    cache->max_memory = max_memory;
+    cache->ttl_ms = (ttl_ms > 0) ? ttl_ms : 0;
+    return cache;
+}
+
+void Cache_free(Cache *cache)
+{
+    if(cache == NULL) {
+        return;
+    }
+    Cache_clear(cache);
+    Alloc_free(cache->buckets, sizeof(CacheEntry *) * cache->num_buckets);
+    Alloc_free_T(cache, Cache);
+}
+
+/**
+ * Returns the link to the entry (group is 0) or the group (group is 1) with the key in its bucket, the link is NULL if
+ * there is no such entry.
+ */
+static CacheEntry **Cache_find(Cache *cache, unsigned int hash, const char *key, size_t key_len, int group)
+{
+    CacheEntry **link = &cache->buckets[hash & (cache->num_buckets - 1)];
+    while(*link != NULL) {
+        CacheEntry *entry = *link;
+        if(entry->hash == hash && entry->key_len == key_len && (entry->type == CACHE_GROUP) == group &&
+           memcmp(CacheEntry_key(entry), key, key_len) == 0) {
+            break;
+        }
+        link = &entry->next;
+    }
+    return link;
+}
+
+static void Cache_delete(Cache *cache, CacheEntry **link)
+{
+    CacheEntry *entry = *link;
+    *link = entry->next;
+    cache->num_entries -= 1;
+    cache->memory -= CacheEntry_size(entry);
+    Alloc_free(entry, CacheEntry_size(entry));
+}
+
+/**
+ * Removes the entry at link. Removing a group removes all its members, removing the last member of a group removes
+ * the group.
+ */
+static void Cache_unlink(Cache *cache, CacheEntry **link)
+{
+    CacheEntry *entry = *link;
+    if(entry->type == CACHE_GROUP) {
+        //the group itself goes with its last member
+        int last;
+        do {
+            CacheEntry *member = list_entry(entry->members.next, CacheEntry, members);
+            last = (member->members.next == &entry->members);
+            Cache_unlink(cache, Cache_find(cache, member->hash, CacheEntry_key(member), member->key_len, 0));
+        } while(!last);
+        return;
+    }
+    CacheEntry *group = entry->group;
+    list_del(&entry->lru);
+    if(group != NULL) {
+        list_del(&entry->members);
+    }
+    Cache_delete(cache, link);
+    if(group != NULL && list_empty(&group->members)) {
+        Cache_delete(cache, Cache_find(cache, group->hash, CacheEntry_key(group), group->key_len, 1));
+    }
+}
+
+static void Cache_grow(Cache *cache)
+{
+    size_t num_buckets = cache->num_buckets * 2;
+    CacheEntry **buckets = Alloc_alloc(sizeof(CacheEntry *) * num_buckets);
+    if(buckets == NULL) {
+        return; //the old table is kept, its chains just get longer
+    }
+    memset(buckets, 0, sizeof(CacheEntry *) * num_buckets);
+    for(size_t i = 0; i < cache->num_buckets; i++) {
+        CacheEntry *entry = cache->buckets[i];
+        while(entry != NULL) {
+            CacheEntry *next = entry->next;
+            CacheEntry **bucket = &buckets[entry->hash & (num_buckets - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    Alloc_free(cache->buckets, sizeof(CacheEntry *) * cache->num_buckets);
+    cache->buckets = buckets;
+    cache->num_buckets = num_buckets;
+}
+
+int Cache_get(Cache *cache, const char *key, size_t key_len, int *type, char **value, size_t *value_len)
+{
+    CacheEntry **link = Cache_find(cache, Hash_murmur3(key, key_len, 0), key, key_len, 0);
+    CacheEntry *entry = *link;
+    if(entry == NULL) {
+        return 0;
+    }
+    if(entry->expires_ms > 0.0 && entry->expires_ms < Cache_time_ms()) {
+        Cache_unlink(cache, link);
+        return 0;
+    }
+    list_move(&entry->lru, &cache->lru);
+    *type = entry->type;
+    *value = CacheEntry_value(entry);
+    *value_len = entry->value_len;
+    return 1;
+}
+
+/**
+ * Adds the entry to the hash table, growing it if needed.
+ */
+static void Cache_insert(Cache *cache, CacheEntry *entry)
+{
+    if(cache->num_entries >= cache->num_buckets) {
+        Cache_grow(cache);
+    }
+    CacheEntry **bucket = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache->num_entries += 1;
+    cache->memory += CacheEntry_size(entry);
+}
+
+void Cache_put(Cache *cache, const char *key, size_t key_len, size_t group_len, int type, const char *value,
+        size_t value_len)
+{
+    unsigned int hash = Hash_murmur3(key, key_len, 0);
+    CacheEntry **link = Cache_find(cache, hash, key, key_len, 0);
+    if(*link != NULL) {
+        Cache_unlink(cache, link);
+    }
+    if(value == NULL) {
+        value_len = 0;
+    }
+    size_t size = sizeof(CacheEntry) + key_len + value_len;
+    //room is made for the group as well, in case it is not there (anymore)
+    size_t group_size = (group_len > 0) ? sizeof(CacheEntry) + group_len : 0;
+    if(size + group_size > cache->max_memory) {
+        return;
+    }
+    //make room by evicting the least recently used entries
+    while(cache->memory + size + group_size > cache->max_memory) {
+        CacheEntry *last = list_entry(list_last(&cache->lru), CacheEntry, lru);
+        Cache_unlink(cache, Cache_find(cache, last->hash, CacheEntry_key(last), last->key_len, 0));
+    }
+
+    //if the memory runs out the value is not cached
+    CacheEntry *entry = Alloc_alloc(size);
+    if(entry == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while caching a value");
+        return;
+    }
+    CacheEntry *group = NULL;
+    if(group_len > 0) {
+        unsigned int group_hash = Hash_murmur3(key, group_len, 0);
+        group = *Cache_find(cache, group_hash, key, group_len, 1);
+        if(group == NULL) {
+            group = Alloc_alloc(group_size);
+            if(group == NULL) {
+                Alloc_free(entry, size);
+                Module_set_error(GET_MODULE(), "Out of memory while caching a value");
+                return;
+            }
+            group->hash = group_hash;
+            group->type = CACHE_GROUP;
+            group->group = NULL;
+            group->expires_ms = 0.0;
+            group->key_len = group_len;
+            group->value_len = 0;
+            memcpy(CacheEntry_key(group), key, group_len);
+            INIT_LIST_HEAD(&group->members);
+            Cache_insert(cache, group);
+        }
+    }
+
+    entry->hash = hash;
+    entry->type = type;
+    entry->group = group;
+    entry->expires_ms = (cache->ttl_ms > 0) ? Cache_time_ms() + cache->ttl_ms : 0.0;
+    entry->key_len = key_len;
+    entry->value_len = value_len;
+    memcpy(CacheEntry_key(entry), key, key_len);
+    if(value_len > 0) {
+        memcpy(CacheEntry_value(entry), value, value_len);
+    }
+    if(group != NULL) {
+        list_add(&entry->members, &group->members);
+    }
+    list_add(&entry->lru, &cache->lru);
+    Cache_insert(cache, entry);
+}
+
+void Cache_remove(Cache *cache, const char *key, size_t key_len)
+{
+    CacheEntry **link = Cache_find(cache, Hash_murmur3(key, key_len, 0), key, key_len, 0);
+    if(*link != NULL) {
+        Cache_unlink(cache, link);
+    }
+}
+
+void Cache_remove_group(Cache *cache, const char *group, size_t group_len)
+{
+    CacheEntry **link = Cache_find(cache, Hash_murmur3(group, group_len, 0), group, group_len, 1);
+    if(*link != NULL) {
+        Cache_unlink(cache, link);
+    }
+}
+
+void Cache_clear(Cache *cache)
+{
+    for(size_t i = 0; i < cache->num_buckets; i++) {
+        while(cache->buckets[i] != NULL) {
+            Cache_unlink(cache, &cache->buckets[i]);
+        }
+    }
+    assert(cache->num_entries == 0 && cache->memory == 0);
+}
+
+size_t Cache_memory(Cache *cache)
+{
+    return cache->memory;
+}
+
+ReplyCache *ReplyCache_new(size_t max_memory, int ttl_ms)
+{
+    ReplyCache *reply_cache = Alloc_alloc_T(ReplyCache);
+    if(reply_cache == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating ReplyCache");
+        return NULL;
+    }
+    reply_cache->cache = Cache_new(max_memory, ttl_ms);
+    if(reply_cache->cache == NULL) {
+        Alloc_free_T(reply_cache, ReplyCache);
+        return NULL;
+    }
+    reply_cache->keys = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    reply_cache->hits = 0;
+    reply_cache->misses = 0;
+    return reply_cache;
+}
+
+void ReplyCache_free(ReplyCache *reply_cache)
+{
+    if(reply_cache == NULL) {
+        return;
+    }
+    Cache_free(reply_cache->cache);
+    Buffer_free(reply_cache->keys);
+    Alloc_free_T(reply_cache, ReplyCache);
+}
+
+void ReplyCache_clear(ReplyCache *reply_cache)
+{
+    Cache_clear(reply_cache->cache);
+}
+
+/**
+ * Writes the cache key of GET key (field is NULL) or HGET key field to the buffer, and returns the length of the start
+ * of it that names the group of the reply (0 for GET). The cache key is the key after a 'G' for GET, and for HGET the
+ * length of the key, the key and the field after an 'H', the replies of HGET are grouped by all but the field.
+ */
+size_t ReplyCache_write_key(Buffer *buffer, const char *key, size_t key_len, const char *field, size_t field_len)
+{
+    size_t start = Buffer_position(buffer);
+    if(field == NULL) {
+        Buffer_write(buffer, "G", 1);
+        Buffer_write(buffer, key, key_len);
+        return 0;
+    }
+    char prefix[32];
+    Buffer_write(buffer, prefix, snprintf(prefix, sizeof(prefix), "H%zu:", key_len));
+    Buffer_write(buffer, key, key_len);
+    size_t group_len = Buffer_position(buffer) - start;
+    Buffer_write(buffer, field, field_len);
+    return group_len;
+}
+
+int ReplyCache_lookup(ReplyCache *reply_cache, const char *key, size_t key_len, ReplyType *type, char **data, size_t *len)
+{
+    int value_type;
+    if(!Cache_get(reply_cache->cache, key, key_len, &value_type, data, len)) {
+        reply_cache->misses++;
+        return 0;
+    }
+    reply_cache->hits++;
+    *type = (ReplyType)value_type;
+    return 1;
+}
+
+void ReplyCache_store(ReplyCache *reply_cache, const char *key, size_t key_len, size_t group_len, ReplyType type,
+        const char *data, size_t len)
+{
+    Cache_put(reply_cache->cache, key, key_len, group_len, type, data, len);
+}
+
+void ReplyCache_invalidate(ReplyCache *reply_cache, const char *key, size_t key_len)
+{
+    Buffer *keys = reply_cache->keys;
+    Buffer_set_position(keys, 0);
+    ReplyCache_write_key(keys, key, key_len, NULL, 0);
+    Cache_remove(reply_cache->cache, Buffer_data(keys), Buffer_position(keys));
+    Buffer_set_position(keys, 0);
+    size_t group_len = ReplyCache_write_key(keys, key, key_len, "", 0);
+    Cache_remove_group(reply_cache->cache, Buffer_data(keys), group_len);
+}
+
+long ReplyCache_get_hits(ReplyCache *reply_cache)
+{
+    return reply_cache->hits;
+}
+
+long ReplyCache_get_misses(ReplyCache *reply_cache)
+{
+    return reply_cache->misses;
+}
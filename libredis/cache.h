@@ -0,0 +1,39 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <stddef.h>
+
+#include "redis.h"
+#include "common.h"
+#include "buffer.h"
+
+typedef struct _Cache Cache;
+
+Cache *Cache_new(size_t max_memory, int ttl_ms);
+void Cache_free(Cache *cache);
+int Cache_get(Cache *cache, const char *key, size_t key_len, int *type, char **value, size_t *value_len);
+//the first group_len bytes of the key name the group of the entry, 0 to put it in no group
+void Cache_put(Cache *cache, const char *key, size_t key_len, size_t group_len, int type, const char *value,
+        size_t value_len);
+void Cache_remove(Cache *cache, const char *key, size_t key_len);
+void Cache_remove_group(Cache *cache, const char *group, size_t group_len);
+void Cache_clear(Cache *cache);
+size_t Cache_memory(Cache *cache);
+
+//replies of GET and HGET (private interface to batch)
+size_t ReplyCache_write_key(Buffer *buffer, const char *key, size_t key_len, const char *field, size_t field_len);
+int ReplyCache_lookup(ReplyCache *reply_cache, const char *key, size_t key_len, ReplyType *type, char **data, size_t *len);
+void ReplyCache_store(ReplyCache *reply_cache, const char *key, size_t key_len, size_t group_len, ReplyType type,
+        const char *data, size_t len);
+//removes the replies of GET key and of HGET key for all fields
+void ReplyCache_invalidate(ReplyCache *reply_cache, const char *key, size_t key_len);
+
+#endif
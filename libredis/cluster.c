@@ -0,0 +1,531 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "batch.h"
+#include "buffer.h"
+#include "reply.h"
+#include "sharded.h"
+
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_NO_NODE 0xFFFF
+#define CLUSTER_MAX_NODES (CLUSTER_NO_NODE - 1)
+#define CLUSTER_INIT_NODES 8
+#define CLUSTER_MAX_REDIRECTS 5 //max number of times a command is re-executed because of MOVED/ASK within one execute
+#define CLUSTER_ADDR_SIZE (ADDR_SIZE + SERV_SIZE + 2)
+
+typedef struct _ClusterNode
+{
+    char addr[CLUSTER_ADDR_SIZE]; //"host:port"
+    Connection *connection;
+} ClusterNode;
+
+struct _Cluster
+{
+    ClusterNode *nodes;
+    int num_nodes;
+    int max_nodes;
+    unsigned short slots[CLUSTER_SLOTS]; //node for each slot, CLUSTER_NO_NODE if not known
+    int stale; //whether the slot map needs to be refreshed (e.g. after a MOVED redirect)
+    int mapped; //whether the slot map was ever read
+};
+
+typedef struct _ClusterCommand
+{
+    size_t offset; //the encoded command in the write buffer of the encoder
+    size_t size;
+    int slot; //-1 for commands without key
+    int node; //node to send the command to after an ASK redirect
+    int asking; //whether the command is to be preceded by ASKING
+    Batch *batch; //batch holding the reply, NULL while the command is still to be (re-)executed
+    size_t index; //index of the reply in batch
+} ClusterCommand;
+
+struct _ClusterBatch
+{
+    Cluster *cluster;
+    Batch *encoder; //only used for encoding the commands, it is never executed
+    Buffer *commands; //a ClusterCommand for each command, in order
+    Buffer *batches; //all batches used, they are kept because they hold the replies
+
+    //iterator state
+    size_t current;
+    Batch *forward_batch; //batch of the reply whose children are being returned, NULL if none
+    size_t forward_pending; //number of replies still to be returned from forward_batch
+};
+
+static const unsigned short CRC16_TABLE[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+int Cluster_key_slot(const char *key, size_t key_len)
+{
+    key = Sharded_hash_tag(key, &key_len);
+    unsigned short crc = 0;
+    for(size_t i = 0; i < key_len; i++) {
+        crc = (crc << 8) ^ CRC16_TABLE[((crc >> 8) ^ (unsigned char)key[i]) & 0xFF];
+    }
+    return crc & (CLUSTER_SLOTS - 1);
+}
+
+Cluster *Cluster_new()
+{
+    Cluster *cluster = Alloc_alloc_T(Cluster);
+    if(cluster == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating Cluster");
+        return NULL;
+    }
+    cluster->nodes = NULL;
+    cluster->num_nodes = 0;
+    cluster->max_nodes = 0;
+    for(int i = 0; i < CLUSTER_SLOTS; i++) {
+        cluster->slots[i] = CLUSTER_NO_NODE;
+    }
+    cluster->stale = 1;
+    cluster->mapped = 0;
+    return cluster;
+}
+
+void Cluster_free(Cluster *cluster)
+{
+    for(int i = 0; i < cluster->num_nodes; i++) {
+        Connection_free(cluster->nodes[i].connection);
+    }
+    if(cluster->nodes != NULL) {
+        Alloc_free(cluster->nodes, sizeof(ClusterNode) * cluster->max_nodes);
+    }
+    Alloc_free_T(cluster, Cluster);
+}
+
+/**
+ * Whether addr is "host:port", the port of a cluster node can not be left out (the address of a node is also used to
+ * tell its host, see Cluster_read_slots).
+ */
+static int Cluster_is_node_addr(const char *addr, size_t addr_len)
+{
+    const char *port = memchr(addr, ':', addr_len);
+    if(port == NULL || port == addr || port + 1 == addr + addr_len) {
+        return 0;
+    }
+    for(port += 1; port < addr + addr_len; port++) {
+        if(*port < '0' || *port > '9') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Returns the index of the node with the given address, the node is added if it is not known yet.
+ * Returns -1 on error.
+ */
+static int Cluster_get_node(Cluster *cluster, const char *addr, size_t addr_len)
+{
+    for(int i = 0; i < cluster->num_nodes; i++) {
+        if(strlen(cluster->nodes[i].addr) == addr_len && memcmp(cluster->nodes[i].addr, addr, addr_len) == 0) {
+            return i;
+        }
+    }
+    if(addr_len >= CLUSTER_ADDR_SIZE || !Cluster_is_node_addr(addr, addr_len)) {
+        Module_set_error(GET_MODULE(), "Invalid address for cluster node");
+        return -1;
+    }
+    if(cluster->num_nodes == CLUSTER_MAX_NODES) {
+        Module_set_error(GET_MODULE(), "Too many cluster nodes");
+        return -1;
+    }
+    if(cluster->num_nodes == cluster->max_nodes) {
+        int max_nodes = cluster->max_nodes > 0 ? cluster->max_nodes * 2 : CLUSTER_INIT_NODES;
+        ClusterNode *nodes = Alloc_realloc(cluster->nodes, sizeof(ClusterNode) * max_nodes, sizeof(ClusterNode) * cluster->max_nodes);
+        if(nodes == NULL) {
+            Module_set_error(GET_MODULE(), "Out of memory while adding cluster node");
+            return -1;
+        }
+        cluster->nodes = nodes;
+        cluster->max_nodes = max_nodes;
+    }
+    ClusterNode *node = &cluster->nodes[cluster->num_nodes];
+    memcpy(node->addr, addr, addr_len);
+    node->addr[addr_len] = '\0';
+    node->connection = Connection_new(node->addr);
+    if(node->connection == NULL) {
+        return -1;
+    }
+    return cluster->num_nodes++;
+}
+
+int Cluster_add_node(Cluster *cluster, const char *addr)
+{
+    return Cluster_get_node(cluster, addr, strlen(addr)) == -1 ? -1 : 0;
+}
+
+/**
+ * Updates the slot map from the reply to CLUSTER SLOTS, each element of which is [start, end, [host, port, ...], replicas...].
+ */
+static int Cluster_read_slots(Cluster *cluster, Batch *batch, int queried)
+{
+    ReplyType reply_type;
+    char *data;
+    size_t len;
+    if(1 != Batch_next_reply(batch, &reply_type, &data, &len) || reply_type != RT_MULTIBULK) {
+        Module_set_error(GET_MODULE(), "Unexpected reply to CLUSTER SLOTS: %.*s", (int)MIN(len, 128), data != NULL ? data : "");
+        return -1;
+    }
+    long start = 0, end = 0;
+    size_t child = 0; //index of the current child of the range
+    size_t master = 0; //index of the current child of the master node
+    char host[CLUSTER_ADDR_SIZE];
+    size_t host_len = 0;
+    int level;
+    while((level = Batch_next_reply(batch, &reply_type, &data, &len)) > 0) {
+        if(level == 2) {
+            child = 0;
+        }
+        else if(level == 3) {
+            if(child == 0 && reply_type == RT_INTEGER) {
+                start = strtol(data, NULL, 10);
+            }
+            else if(child == 1 && reply_type == RT_INTEGER) {
+                end = strtol(data, NULL, 10);
+            }
+            master = 0;
+            child++;
+        }
+        else if(level == 4 && child == 3) {
+            //master node of the range
+            if(master == 0) {
+                host_len = 0;
+                if(reply_type == RT_BULK && len > 0 && len < ADDR_SIZE && !(len == 1 && data[0] == '?')) {
+                    memcpy(host, data, len);
+                    host_len = len;
+                }
+                else {
+                    //unknown endpoint, it is the host of the node we asked (nodes always have a port)
+                    const char *addr = cluster->nodes[queried].addr;
+                    host_len = strchr(addr, ':') - addr;
+                    memcpy(host, addr, host_len);
+                }
+            }
+            else if(master == 1 && reply_type == RT_INTEGER && host_len + 1 + len < CLUSTER_ADDR_SIZE) {
+                host[host_len] = ':';
+                memcpy(host + host_len + 1, data, len);
+                int node = Cluster_get_node(cluster, host, host_len + 1 + len);
+                if(node == -1) {
+                    return -1;
+                }
+                for(long slot = (start < 0 ? 0 : start); slot <= end && slot < CLUSTER_SLOTS; slot++) {
+                    cluster->slots[slot] = node;
+                }
+            }
+            master++;
+        }
+    }
+    return level;
+}
+
+int Cluster_refresh(Cluster *cluster, int timeout_ms)
+{
+    if(cluster->num_nodes == 0) {
+        Module_set_error(GET_MODULE(), "No nodes in cluster");
+        return -1;
+    }
+    //ask the nodes in turn until one of them answers, note that more nodes might be added while doing so
+    for(int i = 0; i < cluster->num_nodes; i++) {
+        Batch *batch = Batch_new();
+        const char *argv[] = {"CLUSTER", "SLOTS"};
+        Batch_write_command(batch, 2, argv, NULL);
+        Executor *executor = Executor_new();
+        Executor_add(executor, cluster->nodes[i].connection, batch);
+        int res = Executor_execute(executor, timeout_ms);
+        Executor_free(executor);
+        if(res == 1) {
+            res = Cluster_read_slots(cluster, batch, i);
+        }
+        else {
+            res = -1;
+        }
+        Batch_free(batch);
+        if(res == 0) {
+            cluster->stale = 0;
+            cluster->mapped = 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+ClusterBatch *ClusterBatch_new(Cluster *cluster)
+{
+    ClusterBatch *batch = Alloc_alloc_T(ClusterBatch);
+    if(batch == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating ClusterBatch");
+        return NULL;
+    }
+    batch->cluster = cluster;
+    batch->encoder = Batch_new();
+    batch->commands = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    batch->batches = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    batch->current = 0;
+    batch->forward_batch = NULL;
+    batch->forward_pending = 0;
+    return batch;
+}
+
+void ClusterBatch_free(ClusterBatch *batch)
+{
+    Batch **batches = (Batch **)Buffer_data(batch->batches);
+    for(size_t i = 0; i < Buffer_position(batch->batches) / sizeof(Batch *); i++) {
+        Batch_free(batches[i]);
+    }
+    Batch_free(batch->encoder);
+    Buffer_free(batch->commands);
+    Buffer_free(batch->batches);
+    Alloc_free_T(batch, ClusterBatch);
+}
+
+void ClusterBatch_write_command(ClusterBatch *batch, int argc, const char **argv, const size_t *argvlen)
+{
+    Buffer *buffer = Batch_write_buffer(batch->encoder);
+    ClusterCommand *command = (ClusterCommand *)Buffer_extend(batch->commands, sizeof(ClusterCommand));
+    command->offset = Buffer_position(buffer);
+    Batch_write_command(batch->encoder, argc, argv, argvlen);
+    command->size = Buffer_position(buffer) - command->offset;
+    if(argc > 1) {
+        command->slot = Cluster_key_slot(argv[1], (argvlen != NULL) ? argvlen[1] : strlen(argv[1]));
+    }
+    else {
+        command->slot = -1;
+    }
+    command->node = -1;
+    command->asking = 0;
+    command->batch = NULL;
+    command->index = 0;
+}
+
+/**
+ * Checks whether the reply to a command is a MOVED or ASK redirect. If so the command is set up to be executed again
+ * on the node it was redirected to. Returns 1 if the command was redirected, 0 if not and -1 on error.
+ */
+static int ClusterBatch_redirect(ClusterBatch *batch, ClusterCommand *command)
+{
+    ReplyType reply_type;
+    char *data;
+    size_t len;
+    Batch_reply_at(command->batch, command->index, &reply_type, &data, &len);
+    if(reply_type != RT_ERROR) {
+        return 0;
+    }
+    int ask;
+    if(len > 6 && memcmp(data, "MOVED ", 6) == 0) {
+        ask = 0;
+    }
+    else if(len > 4 && memcmp(data, "ASK ", 4) == 0) {
+        ask = 1;
+    }
+    else {
+        if(len > 17 && memcmp(data, "Connection error ", 17) == 0) {
+            batch->cluster->stale = 1; //the node might have failed over
+        }
+        return 0;
+    }
+    //MOVED <slot> <host>:<port> or ASK <slot> <host>:<port>
+    char *slot = memchr(data, ' ', len);
+    char *addr = memchr(slot + 1, ' ', len - (slot + 1 - data));
+    if(addr == NULL) {
+        return 0;
+    }
+    addr += 1;
+    int node = Cluster_get_node(batch->cluster, addr, len - (addr - data));
+    if(node == -1) {
+        return -1;
+    }
+    if(ask) {
+        command->node = node;
+        command->asking = 1;
+    }
+    else {
+        long moved = strtol(slot + 1, NULL, 10);
+        if(moved >= 0 && moved < CLUSTER_SLOTS) {
+            batch->cluster->slots[moved] = node;
+        }
+        batch->cluster->stale = 1;
+        command->node = -1;
+        command->asking = 0;
+    }
+    command->batch = NULL;
+    return 1;
+}
+
+int ClusterBatch_execute(ClusterBatch *batch, int timeout_ms)
+{
+    Cluster *cluster = batch->cluster;
+    //a stale map is still better than none, the redirects will get us to the right nodes
+    if(cluster->stale && -1 == Cluster_refresh(cluster, timeout_ms) && !cluster->mapped) {
+        return -1;
+    }
+
+    Byte *encoded = Buffer_data(Batch_write_buffer(batch->encoder));
+    ClusterCommand *commands = (ClusterCommand *)Buffer_data(batch->commands);
+    size_t num_commands = Buffer_position(batch->commands) / sizeof(ClusterCommand);
+    int res = 1;
+    for(int round = 0; round <= CLUSTER_MAX_REDIRECTS; round++) {
+        //group the commands still to be executed by node
+        int num_nodes = cluster->num_nodes;
+        Batch **node_batches = Alloc_alloc(sizeof(Batch *) * num_nodes);
+        size_t *node_replies = Alloc_alloc(sizeof(size_t) * num_nodes);
+        if(node_batches == NULL || node_replies == NULL) {
+            if(node_batches != NULL) {
+                Alloc_free(node_batches, sizeof(Batch *) * num_nodes);
+            }
+            if(node_replies != NULL) {
+                Alloc_free(node_replies, sizeof(size_t) * num_nodes);
+            }
+            Module_set_error(GET_MODULE(), "Out of memory while executing ClusterBatch");
+            return -1;
+        }
+        for(int i = 0; i < num_nodes; i++) {
+            node_batches[i] = NULL;
+            node_replies[i] = 0;
+        }
+        int pending = 0;
+        for(size_t i = 0; i < num_commands; i++) {
+            ClusterCommand *command = &commands[i];
+            if(command->batch != NULL) {
+                continue;
+            }
+            int node = command->asking ? command->node : (command->slot >= 0 ? cluster->slots[command->slot] : 0);
+            if(node == CLUSTER_NO_NODE) {
+                node = 0; //slot not covered, the node will redirect us if needed
+            }
+            if(node_batches[node] == NULL) {
+                node_batches[node] = Batch_new();
+                Buffer_write(batch->batches, (const Byte *)&node_batches[node], sizeof(Batch *));
+            }
+            if(command->asking) {
+                const char *argv[] = {"ASKING"};
+                Batch_write_command(node_batches[node], 1, argv, NULL);
+                node_replies[node] += 1;
+            }
+            Batch_write(node_batches[node], encoded + command->offset, command->size, 1);
+            command->batch = node_batches[node];
+            command->index = node_replies[node]++;
+            pending++;
+        }
+
+        if(pending > 0) {
+            Executor *executor = Executor_new();
+            for(int i = 0; i < num_nodes; i++) {
+                if(node_batches[i] != NULL) {
+                    Executor_add(executor, cluster->nodes[i].connection, node_batches[i]);
+                }
+            }
+            res = Executor_execute(executor, timeout_ms);
+            Executor_free(executor);
+        }
+        Alloc_free(node_batches, sizeof(Batch *) * num_nodes);
+        Alloc_free(node_replies, sizeof(size_t) * num_nodes);
+        if(pending == 0 || res != 1 || round == CLUSTER_MAX_REDIRECTS) {
+            break;
+        }
+
+        int redirected = 0;
+        for(size_t i = 0; i < num_commands; i++) {
+            int r = ClusterBatch_redirect(batch, &commands[i]);
+            if(r == -1) {
+                return -1;
+            }
+            redirected += r;
+        }
+        if(redirected == 0) {
+            break;
+        }
+    }
+    return res;
+}
+
+int ClusterBatch_next_reply(ClusterBatch *batch, ReplyType *reply_type, char **data, size_t *len)
+{
+    if(reply_type == NULL || data == NULL || len == NULL) {
+        Module_set_error(GET_MODULE(), "Invalid argument");
+        return -1;
+    }
+
+    *reply_type = RT_NONE;
+    *data = NULL;
+    *len = 0;
+
+    int level;
+    if(batch->forward_batch != NULL) {
+        //children of the current reply
+        level = Batch_next_reply(batch->forward_batch, reply_type, data, len);
+    }
+    else {
+        if(batch->current == Buffer_position(batch->commands) / sizeof(ClusterCommand)) {
+            return 0;
+        }
+        ClusterCommand *command = ((ClusterCommand *)Buffer_data(batch->commands)) + batch->current;
+        batch->current += 1;
+        if(command->batch == NULL) {
+            Module_set_error(GET_MODULE(), "ClusterBatch was not executed");
+            return -1;
+        }
+        Batch_seek_reply(command->batch, command->index);
+        batch->forward_batch = command->batch;
+        batch->forward_pending = 1;
+        level = Batch_next_reply(batch->forward_batch, reply_type, data, len);
+    }
+    if(level <= 0) {
+        Module_set_error(GET_MODULE(), "Missing reply in ClusterBatch");
+        return -1;
+    }
+    batch->forward_pending -= 1;
+    if(Reply_is_aggregate(*reply_type)) {
+        batch->forward_pending += *len;
+    }
+    if(batch->forward_pending == 0) {
+        batch->forward_batch = NULL;
+    }
+    return level;
+}
@@ -10,9 +10,16 @@
 #define __COMMON_H
 
 #define DEFAULT_WRITE_BUFF_SIZE (1024 * 4)
-#define DEFAULT_READ_BUFF_SIZE (1024 * 12)
+#define DEFAULT_READ_BUFF_SIZE (1024 * 16)
 #define DEFAULT_COMMAND_BUFF_SIZE 64
+#define DEFAULT_REPLY_BUFF_SIZE (1024 * 2)
 #define MAX_BUFF_SIZE (1024 * 1024 * 4)
+
+//buffer pool, chunks are powers of 2 between 64 bytes and MAX_BUFF_SIZE
+#define POOL_MIN_CHUNK_SHIFT 6
+#define POOL_MAX_CHUNK_SHIFT 22
+#define DEFAULT_POOL_MAX_CHUNKS 16 //max free chunks retained per size class
+#define DEFAULT_POOL_MAX_BYTES (1024 * 1024 * 4) //max free bytes retained in total
 #define MAX_CONNECTIONS 1024
 
 #define ADDR_SIZE 255
@@ -47,7 +54,6 @@ typedef char Byte;
 
 //#include "alloc.h"
 
-typedef struct _Command Command;
 typedef struct _Reply Reply;
 
 #endif
@@ -58,6 +58,13 @@ int clock_gettime(clockid_t clk_id, struct timespec *tp) {
 #endif
 
 
+#define TIMESPEC_TO_MS(tm) (((double)tm.tv_sec) * 1000.0) + (((double)tm.tv_nsec) / 1000000.0)
+
+#define LATENCY_WEIGHT 0.2 //weight of a new sample in the moving average of the latency
+#define LATENCY_ERROR_MS 1000.0 //added to the time of a batch that was aborted, so that reads avoid the connection
+#define LATENCY_SAMPLES 64 //number of recent batch times kept for percentiles
+#define LATENCY_MIN_SAMPLES 8 //no percentile is given before this many batches were executed
+
 typedef enum _ConnectionState
 {
     CS_CLOSED = 0,
@@ -84,6 +91,21 @@ struct _Connection
 	Batch *current_batch;
 	Executor *current_executor;
 	ReplyParser *parser;
+
+	int protocol; //RESP version negotiated on connect
+	Buffer *handshake; //commands written on every new socket, before the commands of the batch
+	int handshake_commands; //number of commands in the handshake
+	int handshake_pending; //number of handshake replies still to be read on the current socket
+	long tracking_redirect; //client id to send invalidations to, to enable CLIENT TRACKING on connect, -1 if off
+	unsigned int connects; //number of sockets created
+
+	double start_tm_ms; //time the current batch was started
+	double latency_ms; //exponentially weighted moving average of the time batches took, 0 if none was executed yet
+	double samples_ms[LATENCY_SAMPLES]; //the times of the most recent batches, circular
+	int num_samples;
+
+	Batch *drain; //hedged batch that lost, its replies are read and dropped before those of the current batch
+	Batch *pushes; //replies that arrived outside of any batch, see Connection_read_pushes
 };
 
 //forward decls.
@@ -106,6 +128,19 @@ Connection *Connection_new(const char *in_addr)
 	connection->state = CS_CLOSED;
 	connection->current_batch = NULL;
 	connection->current_executor = NULL;
+	connection->protocol = 2;
+	connection->handshake = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+	connection->handshake_commands = 0;
+	connection->handshake_pending = 0;
+	connection->tracking_redirect = -1;
+	connection->connects = 0;
+	connection->start_tm_ms = 0.0;
+	connection->latency_ms = 0.0;
+	connection->num_samples = 0;
+	connection->drain = NULL;
+	connection->pushes = NULL;
+	connection->sockfd = 0;
+	connection->addrinfo = NULL;
 	connection->parser = ReplyParser_new();
 	if(connection->parser == NULL) {
 		Connection_free(connection);
@@ -136,9 +171,6 @@ Connection *Connection_new(const char *in_addr)
 	}
 	DEBUG(("Connection address: '%s', service: '%s'\n", connection->addr, connection->serv));
 
-	connection->addrinfo = NULL;
-	connection->sockfd = 0;
-
 	return connection;
 }
 
@@ -150,12 +182,121 @@ void Connection_free(Connection *connection)
 	if(connection->parser != NULL) {
 		ReplyParser_free(connection->parser);
 	}
+	Buffer_free(connection->handshake);
 	Connection_close(connection);
 
 	DEBUG(("dealloc Connection\n"));
 	Alloc_free_T(connection, Connection);
 }
 
+/**
+ * (Re)creates the commands that are written first on every new socket.
+ */
+void Connection_build_handshake(Connection *connection)
+{
+	Buffer *buffer = connection->handshake;
+	Buffer_clear(buffer);
+	connection->handshake_commands = 0;
+	if(connection->protocol == 3) {
+		const char *hello = "*2\r\n$5\r\nHELLO\r\n$1\r\n3\r\n";
+		Buffer_write(buffer, hello, strlen(hello));
+		connection->handshake_commands += 1;
+	}
+	if(connection->tracking_redirect >= 0) {
+		char redirect[32];
+		int redirect_len = snprintf(redirect, sizeof(redirect), "%ld", connection->tracking_redirect);
+		char tracking[96];
+		int tracking_len = snprintf(tracking, sizeof(tracking),
+				"*5\r\n$6\r\nCLIENT\r\n$8\r\nTRACKING\r\n$2\r\nON\r\n$8\r\nREDIRECT\r\n$%d\r\n%s\r\n", redirect_len, redirect);
+		Buffer_write(buffer, tracking, tracking_len);
+		connection->handshake_commands += 1;
+	}
+	Buffer_flip(buffer);
+}
+
+int Connection_set_protocol(Connection *connection, int protocol)
+{
+	if(protocol != 2 && protocol != 3) {
+		Module_set_error(GET_MODULE(), "Unsupported protocol version: %d", protocol);
+		return -1;
+	}
+	connection->protocol = protocol;
+	Connection_build_handshake(connection);
+	if(CS_CONNECTED == connection->state || CS_CONNECTING == connection->state) {
+		Connection_close(connection);
+		connection->state = CS_CLOSED;
+	}
+	return 0;
+}
+
+static double Connection_time_ms()
+{
+	struct timespec tm;
+	clock_gettime(CLOCK_MONOTONIC, &tm);
+	return TIMESPEC_TO_MS(tm);
+}
+
+/**
+ * Adds the time the current batch took (plus a penalty if it failed) to the moving average of the latency.
+ */
+static void Connection_add_latency(Connection *connection, double penalty_ms)
+{
+	double sample_ms = Connection_time_ms() - connection->start_tm_ms + penalty_ms;
+	connection->samples_ms[connection->num_samples % LATENCY_SAMPLES] = sample_ms;
+	connection->num_samples++;
+	if(connection->latency_ms == 0.0) {
+		connection->latency_ms = sample_ms;
+	}
+	else {
+		connection->latency_ms += LATENCY_WEIGHT * (sample_ms - connection->latency_ms);
+	}
+}
+
+double Connection_get_latency(Connection *connection)
+{
+	return connection->latency_ms;
+}
+
+static int Connection_compare_samples(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+double Connection_get_latency_percentile(Connection *connection, double percentile)
+{
+	if(connection->num_samples < LATENCY_MIN_SAMPLES) {
+		return 0.0;
+	}
+	int n = MIN(connection->num_samples, LATENCY_SAMPLES);
+	double samples_ms[LATENCY_SAMPLES];
+	memcpy(samples_ms, connection->samples_ms, n * sizeof(double));
+	qsort(samples_ms, n, sizeof(double), Connection_compare_samples);
+	int index = MIN((int)((percentile / 100.0) * n + 0.5), n) - 1;
+	return samples_ms[(index < 0) ? 0 : index];
+}
+
+void Connection_set_tracking(Connection *connection, long redirect)
+{
+	connection->tracking_redirect = redirect;
+	Connection_build_handshake(connection);
+	if(CS_CONNECTED == connection->state || CS_CONNECTING == connection->state) {
+		Connection_close(connection);
+		connection->state = CS_CLOSED;
+	}
+}
+
+unsigned int Connection_get_connects(Connection *connection)
+{
+	return connection->connects;
+}
+
+int Connection_is_connected(Connection *connection)
+{
+	return CS_CONNECTED == connection->state;
+}
+
 //TODO make connection close public?, in that case make sure
 //state is CS_CLOSE after the method is finished
 void Connection_close(Connection *connection)
@@ -168,6 +309,16 @@ void Connection_close(Connection *connection)
 		connection->sockfd = 0;
 	}
 
+	//replies still to be dropped will not come anymore
+	if(connection->drain != NULL) {
+		Batch_free(connection->drain);
+		connection->drain = NULL;
+	}
+	if(connection->pushes != NULL) {
+		Batch_free(connection->pushes);
+		connection->pushes = NULL;
+	}
+
 	if (connection->addrinfo != NULL) {
 		freeaddrinfo(connection->addrinfo);
 		connection->addrinfo = NULL;
@@ -197,6 +348,11 @@ int Connection_create_socket(Connection *connection)
 		return -1;
 	}
 
+	//a new socket starts with the handshake
+	connection->connects += 1;
+	Buffer_set_position(connection->handshake, 0);
+	connection->handshake_pending = connection->handshake_commands;
+
 	//set socket in non-blocking mode
 	int flags;
 	if ((flags = fcntl(connection->sockfd, F_GETFL, 0)) < 0)
@@ -229,6 +385,10 @@ void Connection_abort(Connection *connection, const char *format,  ...)
 
 	DEBUG(("Connection aborting: %s\n", error2));
 
+	if(connection->current_executor != NULL) {
+		Connection_add_latency(connection, LATENCY_ERROR_MS);
+	}
+
 	Batch_abort(connection->current_batch, error2);
 	connection->current_batch = NULL;
 	connection->current_executor = NULL;
@@ -240,18 +400,49 @@ void Connection_abort(Connection *connection, const char *format,  ...)
 	DEBUG(("Connection aborted\n"));
 }
 
+/**
+ * Moves the data that was read into the read buffer of from, but not parsed yet, to batch. The parser must be idle,
+ * it continues with batch.
+ */
+static void Connection_carry_over(Connection *connection, Batch *from, Batch *batch)
+{
+	Buffer *buffer = Batch_read_buffer(from);
+	size_t position = ReplyParser_position(connection->parser);
+	if(Buffer_position(buffer) > position) {
+		Buffer_write(Batch_read_buffer(batch), (char *)Buffer_data(buffer) + position, Buffer_position(buffer) - position);
+	}
+	ReplyParser_reset(connection->parser);
+}
+
 void Connection_execute_start(Connection *connection, Executor *executor, Batch *batch, int ordinal)
 {
 	DEBUG(("Connection exec\n"));
 
 	connection->current_batch = batch;
 	connection->current_executor = executor;
+	connection->start_tm_ms = Connection_time_ms();
 
 	if(CS_ABORTED == connection->state) {
 		connection->state = CS_CLOSED;
 	}
 
-	ReplyParser_reset(connection->parser);
+	if(connection->pushes != NULL) {
+		//the replies that came in after the last read of the pushes are returned with the batch
+		if(connection->drain == NULL && ReplyParser_is_idle(connection->parser)) {
+			Connection_carry_over(connection, connection->pushes, batch);
+			Batch_free(connection->pushes);
+			connection->pushes = NULL;
+		}
+		else {
+			Connection_close(connection); //also frees the pushes
+			connection->state = CS_CLOSED;
+			ReplyParser_reset(connection->parser);
+		}
+	}
+	else if(connection->drain == NULL) {
+		ReplyParser_reset(connection->parser); //otherwise it is still reading the replies to be dropped
+	}
+	Batch_end_run(batch);
 	Buffer_flip(Batch_write_buffer(batch));
 
 	DEBUG(("Connection exec write buff:\n"));
@@ -268,6 +459,29 @@ void Connection_execute_start(Connection *connection, Executor *executor, Batch
 	}
 }
 
+/**
+ * Writes the remaining data of buffer to the socket.
+ * Returns 0 if all was written, -1 if we need to wait for the socket to become writable again (or the connection was aborted).
+ */
+int Connection_send_buffer(Connection *connection, Buffer *buffer, int ordinal)
+{
+	while(Buffer_remaining(buffer)) {
+		//still something to write
+		size_t res = Buffer_send(buffer, connection->sockfd);
+		DEBUG(("bfr send res: %d\n", res));
+		if(res == -1) {
+			if(errno == EAGAIN) {
+				Executor_notify_event(connection->current_executor, connection, EVENT_WRITE, ordinal);
+			}
+			else {
+				Connection_abort(connection, "write error, errno: [%d] %s", errno, strerror(errno));
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
 void Connection_write_data(Connection *connection, int ordinal)
 {
 	DEBUG(("connection write_data fd: %d\n", connection->sockfd));
@@ -325,49 +539,32 @@ void Connection_write_data(Connection *connection, int ordinal)
 	}
 
 	if(CS_CONNECTED == connection->state) {
-
+		//the handshake (if any) goes before the commands of the batch
+		if(-1 == Connection_send_buffer(connection, connection->handshake, ordinal)) {
+			return;
+		}
 		Buffer *buffer = Batch_write_buffer(connection->current_batch);
 		assert(buffer != NULL);
-		while(Buffer_remaining(buffer)) {
-			//still something to write
-			size_t res = Buffer_send(buffer, connection->sockfd);
-			DEBUG(("bfr send res: %d\n", res));
-			if(res == -1) {
-				if(errno == EAGAIN) {
-					Executor_notify_event(connection->current_executor, connection, EVENT_WRITE, ordinal);
-					return;
-				}
-				else {
-					Connection_abort(connection, "write error, errno: [%d] %s", errno, strerror(errno));
-					return;
-				}
-			}
-		}
+		Connection_send_buffer(connection, buffer, ordinal);
 	}
 }
 
-void Connection_read_data(Connection *connection, int ordinal)
+/**
+ * Reads replies into batch until it has all of its replies.
+ * Returns 0 if it has, -1 if we need to wait for the socket to become readable again (or the connection was aborted).
+ */
+static int Connection_read_replies(Connection *connection, Batch *batch, int ordinal)
 {
-	if(CS_ABORTED == connection->state) {
-		return;
-	}
-
-	DEBUG(("connection read data fd: %d\n", connection->sockfd));
-	assert(connection->current_batch != NULL);
-	assert(connection->current_executor != NULL);
-	assert(CS_CONNECTED == connection->state);
-
-	Buffer *buffer = Batch_read_buffer(connection->current_batch);
+	Buffer *buffer = Batch_read_buffer(batch);
 	assert(buffer != NULL);
 
-	while(Batch_has_command(connection->current_batch)) {
+	while(Batch_has_command(batch)) {
 		DEBUG(("exec rp\n"));
-		Reply *reply = NULL;
-		ReplyParserResult rp_res = ReplyParser_execute(connection->parser, buffer, Buffer_position(buffer), &reply);
+		ReplyParserResult rp_res = ReplyParser_execute(connection->parser, buffer, Buffer_position(buffer), Batch_replies(batch));
 		switch(rp_res) {
 		case RPR_ERROR: {
 			Connection_abort(connection, "result parse error");
-			return;
+			return -1;
 		}
 		case RPR_MORE: {
 			DEBUG(("read data RPR_MORE buf recv\n"));
@@ -379,28 +576,158 @@ void Connection_read_data(Connection *connection, int ordinal)
 				if(errno == EAGAIN) {
  					DEBUG(("read data expecting more data in future, adding event\n"));
 					Executor_notify_event(connection->current_executor, connection, EVENT_READ, ordinal);
-					return;
+					return -1;
 				}
 				else {
 					Connection_abort(connection, "read error, errno: [%d] %s", errno, strerror(errno));
-					return;
+					return -1;
 				}
 			}
 			else if(res == 0) {
 				Connection_abort(connection, "read eof");
-				return;
+				return -1;
 			}
 			break;
 		}
 		case RPR_REPLY: {
 			DEBUG(("read data RPR_REPLY batch add reply\n"));
-			Batch_add_reply(connection->current_batch, reply);
+			ReplyArray *replies = Batch_replies(batch);
+			Reply *reply = ReplyArray_get(replies, replies->committed);
+			if(connection->handshake_pending > 0) {
+				//reply to the handshake, not for the batch
+				connection->handshake_pending -= 1;
+				if(reply->type == RT_ERROR) {
+					Connection_abort(connection, "handshake error: %.*s", (int)MIN(reply->len, 128),
+							Buffer_data(buffer) + reply->offset);
+					return -1;
+				}
+				ReplyArray_rollback(replies);
+			}
+			else if(reply->type == RT_PUSH) {
+				Batch_add_push(batch);
+			}
+			else {
+				Batch_add_reply(batch);
+			}
 			break;
 		}
 		default:
 			Connection_abort(connection, "unexpected result parser result, rpres: %d", rp_res);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void Connection_read_data(Connection *connection, int ordinal)
+{
+	if(CS_ABORTED == connection->state) {
+		return;
+	}
+
+	DEBUG(("connection read data fd: %d\n", connection->sockfd));
+	assert(connection->current_batch != NULL);
+	assert(connection->current_executor != NULL);
+	assert(CS_CONNECTED == connection->state);
+
+	if(connection->drain != NULL) {
+		//first the replies to the hedged batch that lost, they are dropped
+		if(-1 == Connection_read_replies(connection, connection->drain, ordinal)) {
 			return;
 		}
+		//the data after them is for the current batch
+		Connection_carry_over(connection, connection->drain, connection->current_batch);
+		Batch_free(connection->drain);
+		connection->drain = NULL;
+	}
+
+	if(-1 == Connection_read_replies(connection, connection->current_batch, ordinal)) {
+		return;
+	}
+	//all replies are in
+	Connection_add_latency(connection, 0.0);
+}
+
+/**
+ * Reads the replies that the server sent outside of any batch (e.g. RESP3 push replies with invalidations for client
+ * side caching) and that arrived by now, without waiting for more. They are added to the returned batch, after the ones
+ * returned by the previous call, so iterating it continues with the new replies. The batch is owned by the connection
+ * and is valid until the next call (or execute) on the connection.
+ * The first call must be made while the batch executed last on the connection has not been freed yet.
+ * Returns NULL if the connection is not open, or was closed (by the server).
+ */
+Batch *Connection_read_pushes(Connection *connection)
+{
+	if(CS_CONNECTED != connection->state) {
+		return NULL;
+	}
+	if(connection->drain != NULL) {
+		//the replies of a lost hedge are still due, a push could not be told apart from them
+		Connection_close(connection);
+		connection->state = CS_CLOSED;
+		return NULL;
+	}
+	if(connection->pushes == NULL || ReplyParser_is_idle(connection->parser)) {
+		//start with a new batch, so that its buffers do not keep growing
+		Batch *pushes = Batch_new();
+		Batch *from = (connection->pushes != NULL) ? connection->pushes : connection->current_batch;
+		if(from != NULL && ReplyParser_is_idle(connection->parser)) {
+			Connection_carry_over(connection, from, pushes);
+		}
+		else {
+			ReplyParser_reset(connection->parser);
+		}
+		if(connection->pushes != NULL) {
+			Batch_free(connection->pushes);
+		}
+		connection->pushes = pushes;
+		connection->current_batch = NULL;
+		connection->current_executor = NULL;
+	}
+
+	Batch *batch = connection->pushes;
+	Buffer *buffer = Batch_read_buffer(batch);
+	while(1) {
+		ReplyParserResult rp_res = ReplyParser_execute(connection->parser, buffer, Buffer_position(buffer), Batch_replies(batch));
+		if(rp_res == RPR_REPLY) {
+			Batch_add_push(batch);
+		}
+		else if(rp_res == RPR_MORE) {
+			size_t res = Buffer_recv(buffer, connection->sockfd);
+			if(res == -1 && errno == EAGAIN) {
+				return batch;
+			}
+			if(res == -1 || res == 0) {
+				break;
+			}
+		}
+		else {
+			break;
+		}
+	}
+	Connection_close(connection);
+	connection->state = CS_CLOSED;
+	return NULL;
+}
+
+/**
+ * Gives up on the current batch, whose copy on another connection was faster (or the other way around). If all of it
+ * was sent, its replies are dropped when they come in, before those of the next batch. Otherwise the connection is
+ * closed. Takes ownership of the batch.
+ */
+static void Connection_lose(Connection *connection, Batch *batch)
+{
+	Connection_add_latency(connection, 0.0); //at least this slow
+	connection->current_batch = NULL;
+	connection->current_executor = NULL;
+	if(CS_CONNECTED == connection->state && connection->handshake_pending == 0 && connection->drain == NULL &&
+			Buffer_remaining(Batch_write_buffer(batch)) == 0) {
+		connection->drain = batch;
+	}
+	else {
+		Batch_free(batch);
+		Connection_close(connection);
+		connection->state = CS_CLOSED;
 	}
 }
 
@@ -441,11 +768,15 @@ void Connection_handle_event(Connection *connection, EventType event, int ordina
 /************************************ EXECUTOR ***************************************/
 
 #define MAX_PAIRS 1024
+#define DEFAULT_HEDGE_PERCENTILE 95.0
 
 struct _Pair
 {
 	Batch *batch;
 	Connection *connection;
+	Connection *secondary; //connection to execute a copy of the batch on if this one is slow, NULL if not hedged
+	double hedge_tm_ms; //time to start the copy, 0 if none is to be started
+	int hedged_by; //index of the pair executing the copy, -1 if none
 };
 
 struct _Executor
@@ -455,6 +786,10 @@ struct _Executor
 	struct pollfd fds[MAX_PAIRS];
 	struct _Pair pairs[MAX_PAIRS];
 	double end_tm_ms;
+
+	double hedge_percentile;
+	long hedges_fired;
+	long hedges_won;
 };
 
 Executor *Executor_new()
@@ -467,6 +802,9 @@ Executor *Executor_new()
 	}
 	executor->numpairs = 0;
 	executor->numevents = 0;
+	executor->hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+	executor->hedges_fired = 0;
+	executor->hedges_won = 0;
 	return executor;
 }
 
@@ -492,6 +830,9 @@ int Executor_add(Executor *executor, Connection *connection, Batch *batch)
 	struct _Pair *pair = &executor->pairs[executor->numpairs];
 	pair->batch = batch;
 	pair->connection = connection;
+	pair->secondary = NULL;
+	pair->hedge_tm_ms = 0.0;
+	pair->hedged_by = -1;
 	struct pollfd *fd = &executor->fds[executor->numpairs];
 	fd->fd = 0;
 	fd->events = fd->revents = 0;
@@ -500,7 +841,161 @@ int Executor_add(Executor *executor, Connection *connection, Batch *batch)
 	return 0;
 }
 
-#define TIMESPEC_TO_MS(tm) (((double)tm.tv_sec) * 1000.0) + (((double)tm.tv_nsec) / 1000000.0)
+int Executor_add_hedged(Executor *executor, Connection *connection, Connection *secondary, Batch *batch)
+{
+	if(-1 == Executor_add(executor, connection, batch)) {
+		return -1;
+	}
+	if(secondary != connection) {
+		executor->pairs[executor->numpairs - 1].secondary = secondary;
+	}
+	return 0;
+}
+
+void Executor_set_hedge_percentile(Executor *executor, double percentile)
+{
+	executor->hedge_percentile = percentile;
+}
+
+long Executor_get_hedges_fired(Executor *executor)
+{
+	return executor->hedges_fired;
+}
+
+long Executor_get_hedges_won(Executor *executor)
+{
+	return executor->hedges_won;
+}
+
+/**
+ * Starts executing a copy of the batch of the pair at index on its secondary connection, as a new pair.
+ */
+static void Executor_start_hedge(Executor *executor, int index)
+{
+	struct _Pair *pair = &executor->pairs[index];
+	if(executor->numpairs >= MAX_PAIRS) {
+		return;
+	}
+	for(int i = 0; i < executor->numpairs; i++) {
+		struct _Pair *other = &executor->pairs[i];
+		if(other->connection == pair->secondary && other->batch != NULL && Batch_has_command(other->batch)) {
+			return; //the secondary is busy with another batch
+		}
+	}
+	int hedge_index = executor->numpairs;
+	struct _Pair *hedge = &executor->pairs[hedge_index];
+	hedge->batch = Batch_duplicate(pair->batch);
+	hedge->connection = pair->secondary;
+	hedge->secondary = NULL;
+	hedge->hedge_tm_ms = 0.0;
+	hedge->hedged_by = -1;
+	struct pollfd *fd = &executor->fds[hedge_index];
+	fd->fd = 0;
+	fd->events = fd->revents = 0;
+	executor->numpairs += 1;
+	pair->hedged_by = hedge_index;
+	executor->hedges_fired += 1;
+	DEBUG(("Executor hedge pair %d on pair %d\n", index, hedge_index));
+	Connection_execute_start(hedge->connection, executor, hedge->batch, hedge_index);
+}
+
+/**
+ * Stops waiting for the connection of the pair at index, giving the batch that lost to it.
+ */
+static void Executor_drop(Executor *executor, int index, Batch *batch)
+{
+	struct pollfd *fd = &executor->fds[index];
+	if(fd->events & POLLIN) {
+		executor->numevents -= 1;
+	}
+	if(fd->events & POLLOUT) {
+		executor->numevents -= 1;
+	}
+	fd->fd = -1;
+	fd->events = fd->revents = 0;
+	if(Batch_has_command(batch)) {
+		Connection_lose(executor->pairs[index].connection, batch);
+	}
+	else {
+		Batch_free(batch);
+	}
+}
+
+/**
+ * Checks whether the batch of the pair at index or its copy completed. The first to complete without error wins, the
+ * replies of a winning copy are swapped into the batch of the pair. The batch that lost is dropped.
+ * Returns 1 if settled, 0 if there is nothing to decide yet.
+ */
+static int Executor_settle_hedge(Executor *executor, int index)
+{
+	struct _Pair *pair = &executor->pairs[index];
+	struct _Pair *hedge = &executor->pairs[pair->hedged_by];
+	Batch *batch = pair->batch;
+	Batch *copy = hedge->batch;
+	if(!Batch_has_command(batch) && Batch_error(batch) == NULL) {
+		Executor_drop(executor, pair->hedged_by, copy);
+	}
+	else if(!Batch_has_command(copy) && Batch_error(copy) == NULL) {
+		executor->hedges_won += 1;
+		Batch_swap(batch, copy);
+		hedge->connection->current_batch = batch;
+		if(pair->connection->current_batch == batch) {
+			pair->connection->current_batch = copy;
+		}
+		Executor_drop(executor, index, copy);
+	}
+	else if(!Batch_has_command(copy)) {
+		//the copy failed, the original may still complete
+		Executor_drop(executor, pair->hedged_by, copy);
+	}
+	else {
+		return 0;
+	}
+	hedge->batch = NULL;
+	pair->hedged_by = -1;
+	return 1;
+}
+
+/**
+ * Starts the copies of the hedged batches that did not complete in time, or that failed, and settles the ones started.
+ */
+static void Executor_hedge(Executor *executor)
+{
+	double now_ms = Connection_time_ms();
+	int numpairs = executor->numpairs;
+	for(int i = 0; i < numpairs; i++) {
+		struct _Pair *pair = &executor->pairs[i];
+		if(pair->hedge_tm_ms > 0.0) {
+			int pending = Batch_has_command(pair->batch);
+			if(!pending && Batch_error(pair->batch) == NULL) {
+				pair->hedge_tm_ms = 0.0; //completed
+			}
+			else if(!pending || now_ms >= pair->hedge_tm_ms) {
+				pair->hedge_tm_ms = 0.0;
+				Executor_start_hedge(executor, i);
+			}
+		}
+		if(pair->hedged_by != -1) {
+			Executor_settle_hedge(executor, i);
+		}
+	}
+}
+
+/**
+ * Returns the timeout for the next poll, the time left or the time until the next copy of a batch is to be started.
+ */
+static int Executor_hedge_timeout(Executor *executor, int timeout)
+{
+	double now_ms = Connection_time_ms();
+	for(int i = 0; i < executor->numpairs; i++) {
+		double hedge_tm_ms = executor->pairs[i].hedge_tm_ms;
+		if(hedge_tm_ms > 0.0) {
+			int left = (hedge_tm_ms > now_ms) ? (int)(hedge_tm_ms - now_ms) + 1 : 0;
+			timeout = MIN(timeout, left);
+		}
+	}
+	return timeout;
+}
 
 int Executor_current_timeout(Executor *executor, int *timeout)
 {
@@ -530,10 +1025,25 @@ int Executor_execute(Executor *executor, int timeout_ms)
 	DEBUG(("Executor end_tm_ms: %3.2f\n", executor->end_tm_ms));
 
 	executor->numevents = 0;
-	for(int i = 0; i < executor->numpairs; i++) {
+	int numpairs = executor->numpairs;
+	for(int i = 0; i < numpairs; i++) {
 		struct _Pair *pair = &executor->pairs[i];
+		pair->hedged_by = -1;
+		pair->hedge_tm_ms = 0.0;
+		if(!Batch_has_command(pair->batch)) {
+			executor->fds[i].fd = -1; //nothing to send, e.g. all of its replies came from a cache
+			continue;
+		}
+		if(pair->secondary != NULL && Batch_is_read_only(pair->batch)) {
+			//start a copy on the secondary when this takes longer than most batches on the connection did
+			double delay_ms = Connection_get_latency_percentile(pair->connection, executor->hedge_percentile);
+			if(delay_ms > 0.0) {
+				pair->hedge_tm_ms = TIMESPEC_TO_MS(tm) + delay_ms;
+			}
+		}
 		Connection_execute_start(pair->connection, executor, pair->batch, i);
 	}
+	Executor_hedge(executor);
 
 	int poll_result = 1;
 	//for as long there are outstanding events and no error or timeout occurred:
@@ -546,7 +1056,11 @@ int Executor_execute(Executor *executor, int timeout_ms)
 		} else {
 			//do the poll
 			DEBUG(("Executor start poll num_events: %d\n", executor->numevents));
-			poll_result = poll(executor->fds, executor->numpairs, timeout);
+			int poll_timeout = Executor_hedge_timeout(executor, timeout);
+			poll_result = poll(executor->fds, executor->numpairs, poll_timeout);
+			if(poll_result == 0 && poll_timeout < timeout) {
+				poll_result = 1; //time to start a copy, not a timeout
+			}
 
 			DEBUG(("Executor select res %d\n", poll_result));
 		}
@@ -579,12 +1093,27 @@ int Executor_execute(Executor *executor, int timeout_ms)
 				event = EVENT_ERROR;
 			}
 
-			if(event > 0 && Batch_has_command(batch)) {
+			if(event > 0 && batch != NULL && Batch_has_command(batch)) {
 				//there is an event, and batch is not finished
 				Connection_handle_event(connection, event, i);
 			}
 		}
+
+		if(poll_result > 0) {
+			Executor_hedge(executor);
+		}
+	}
+
+	//all batches completed or were aborted, settle the hedged ones and remove their copies
+	for(int i = 0; i < numpairs; i++) {
+		struct _Pair *pair = &executor->pairs[i];
+		pair->hedge_tm_ms = 0.0;
+		if(pair->hedged_by != -1 && !Executor_settle_hedge(executor, i)) {
+			Executor_drop(executor, pair->hedged_by, executor->pairs[pair->hedged_by].batch);
+			pair->hedged_by = -1;
+		}
 	}
+	executor->numpairs = numpairs;
 
 	if(poll_result > 1) {
 		poll_result = 1;
@@ -13,5 +13,11 @@
 #include "common.h"
 #include "buffer.h"
 
+//client side caching (private interface to the client cache)
+void Connection_set_tracking(Connection *connection, long redirect);
+unsigned int Connection_get_connects(Connection *connection);
+int Connection_is_connected(Connection *connection);
+Batch *Connection_read_pushes(Connection *connection);
+
 #endif
 
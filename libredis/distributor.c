@@ -0,0 +1,240 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Distributors that map keys to servers like Ketama does, with the same ordinal/address interface:
+ * - JumpHash, jump consistent hash (Lamping & Veach), O(ln n) time per key and no memory besides the server list.
+ *   Servers have no weight, and servers can only be added, at the end of the list.
+ * - Rendezvous, weighted rendezvous (highest random weight) hashing. Each key goes to the server with the highest score
+ *   -weight / ln(h), h being a hash of the key and the server in (0, 1). O(n) time per key, but the load follows the
+ *   weights closely. Adding a server (or raising its weight) only moves keys to that server, removing a server (or
+ *   lowering its weight) only moves keys away from it.
+ * Keys are hashed with MurmurHash3, so neither places keys like Ketama does.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "hash.h"
+
+#define INIT_MAX_SERVERS 4
+
+typedef struct
+{
+    char addr[ADDR_SIZE];
+    unsigned long weight;
+    int removed; //removed servers keep their ordinal, but get no keys
+    unsigned int seed; //hash of addr
+} DistributorServer;
+
+typedef struct
+{
+    DistributorServer *servers;
+    int num_servers;
+    int max_servers;
+} DistributorServers;
+
+struct _JumpHash
+{
+    DistributorServers servers;
+};
+
+struct _Rendezvous
+{
+    DistributorServers servers;
+};
+
+static void DistributorServers_init(DistributorServers *servers)
+{
+    servers->servers = NULL;
+    servers->num_servers = 0;
+    servers->max_servers = 0;
+}
+
+static void DistributorServers_release(DistributorServers *servers)
+{
+    if(servers->servers != NULL) {
+        Alloc_free(servers->servers, servers->max_servers * sizeof(DistributorServer));
+        servers->servers = NULL;
+    }
+}
+
+static void DistributorServers_add(DistributorServers *servers, const char *addr, int port, unsigned long weight)
+{
+    assert(servers->num_servers <= servers->max_servers);
+    if(servers->servers == NULL) {
+        servers->max_servers = INIT_MAX_SERVERS;
+        servers->servers = Alloc_alloc(servers->max_servers * sizeof(DistributorServer));
+    }
+    if(servers->num_servers >= servers->max_servers) {
+        int old_max_servers = servers->max_servers;
+        servers->max_servers *= 2;
+        servers->servers = Alloc_realloc(servers->servers, servers->max_servers * sizeof(DistributorServer),
+                                         old_max_servers * sizeof(DistributorServer));
+    }
+    DistributorServer *server = &(servers->servers[servers->num_servers]);
+    snprintf(server->addr, sizeof(server->addr), "%s:%d", addr, port);
+    server->weight = weight;
+    server->removed = 0;
+    server->seed = Hash_murmur3(server->addr, strlen(server->addr), 0);
+    servers->num_servers += 1;
+}
+
+static char *DistributorServers_address(DistributorServers *servers, int ordinal)
+{
+    if(ordinal < 0 || ordinal >= servers->num_servers) {
+        DEBUG(("Incorrect call to get server address\n"));
+        return "";
+    }
+    return servers->servers[ordinal].addr;
+}
+
+/**
+ * Finalizer of splitmix64, mixes all bits of x into all bits of the result.
+ */
+static inline uint64_t Distributor_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+JumpHash *JumpHash_new()
+{
+    JumpHash *jump = Alloc_alloc_T(JumpHash);
+    DistributorServers_init(&jump->servers);
+    return jump;
+}
+
+void JumpHash_free(JumpHash *jump)
+{
+    DistributorServers_release(&jump->servers);
+    Alloc_free_T(jump, JumpHash);
+}
+
+int JumpHash_add_server(JumpHash *jump, const char *addr, int port)
+{
+    DistributorServers_add(&jump->servers, addr, port, 1);
+    return 0;
+}
+
+int JumpHash_get_server_ordinal(JumpHash *jump, const char *key, size_t key_len)
+{
+    int num_buckets = jump->servers.num_servers;
+    if(num_buckets == 0) {
+        return -1;
+    }
+    uint64_t k = Distributor_mix(Hash_murmur3(key, key_len, 0));
+    int64_t b = -1;
+    int64_t j = 0;
+    while(j < num_buckets) {
+        b = j;
+        k = k * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((k >> 33) + 1)));
+    }
+    return (int)b;
+}
+
+char *JumpHash_get_server_address(JumpHash *jump, int ordinal)
+{
+    return DistributorServers_address(&jump->servers, ordinal);
+}
+
+int JumpHash_get_server_count(JumpHash *jump)
+{
+    return jump->servers.num_servers;
+}
+
+Rendezvous *Rendezvous_new()
+{
+    Rendezvous *rendezvous = Alloc_alloc_T(Rendezvous);
+    DistributorServers_init(&rendezvous->servers);
+    return rendezvous;
+}
+
+void Rendezvous_free(Rendezvous *rendezvous)
+{
+    DistributorServers_release(&rendezvous->servers);
+    Alloc_free_T(rendezvous, Rendezvous);
+}
+
+int Rendezvous_add_server(Rendezvous *rendezvous, const char *addr, int port, unsigned long weight)
+{
+    DistributorServers_add(&rendezvous->servers, addr, port, weight);
+    return 0;
+}
+
+static DistributorServer *Rendezvous_get_active_server(Rendezvous *rendezvous, int ordinal)
+{
+    if(ordinal < 0 || ordinal >= rendezvous->servers.num_servers || rendezvous->servers.servers[ordinal].removed) {
+        Module_set_error(GET_MODULE(), "No rendezvous server with ordinal: %d", ordinal);
+        return NULL;
+    }
+    return &(rendezvous->servers.servers[ordinal]);
+}
+
+int Rendezvous_remove_server(Rendezvous *rendezvous, int ordinal)
+{
+    DistributorServer *server = Rendezvous_get_active_server(rendezvous, ordinal);
+    if(server == NULL) {
+        return -1;
+    }
+    server->weight = 0;
+    server->removed = 1;
+    return 0;
+}
+
+int Rendezvous_set_server_weight(Rendezvous *rendezvous, int ordinal, unsigned long weight)
+{
+    DistributorServer *server = Rendezvous_get_active_server(rendezvous, ordinal);
+    if(server == NULL) {
+        return -1;
+    }
+    server->weight = weight;
+    return 0;
+}
+
+int Rendezvous_get_server_ordinal(Rendezvous *rendezvous, const char *key, size_t key_len)
+{
+    uint64_t key_hash = (uint64_t)Hash_murmur3(key, key_len, 0) << 32;
+    int best = -1;
+    double best_score = 0.0;
+    for(int i = 0; i < rendezvous->servers.num_servers; i++) {
+        DistributorServer *server = &(rendezvous->servers.servers[i]);
+        if(server->weight == 0) {
+            continue; //removed, or weight 0
+        }
+        // the top 53 bits of the hash of key and server, as a double in (0, 1)
+        uint64_t h = Distributor_mix(key_hash | server->seed);
+        double u = ((double)(h >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+        double score = -(double)server->weight / log(u);
+        if(score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+char *Rendezvous_get_server_address(Rendezvous *rendezvous, int ordinal)
+{
+    return DistributorServers_address(&rendezvous->servers, ordinal);
+}
+
+int Rendezvous_get_server_count(Rendezvous *rendezvous)
+{
+    return rendezvous->servers.num_servers;
+}
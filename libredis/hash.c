@@ -0,0 +1,277 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Hashing of many (short) keys at once, as used by Ketama for looking up the servers of a batch of keys.
+ * MD5 is computed for several keys in parallel, one key in each lane of a vector: 8 lanes with AVX2 (picked at runtime
+ * by Hash_init, called from Module_init) and 4 lanes otherwise. Keys that do not fit in a single MD5 block
+ * (more than 55 bytes) are hashed one at a time by md5.c.
+ * The vector code uses the GCC vector extensions, so that the same MD5 steps serve all widths.
+ * Also has MurmurHash3 (x86_32), a much faster, non-cryptographic hash for rings that do not need to be compatible with
+ * classic ketama.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "md5.h"
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HASH_X86
+#endif
+
+#define MD5_MAX_SINGLE_BLOCK 55 //longest message that fits in 1 block together with the padding and length
+
+typedef unsigned int v4ui __attribute__((vector_size(16)));
+#ifdef HASH_X86
+typedef unsigned int v8ui __attribute__((vector_size(32)));
+#endif
+
+#define MD5_F(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define MD5_G(b, c, d) ((c) ^ ((d) & ((b) ^ (c))))
+#define MD5_H(b, c, d) ((b) ^ (c) ^ (d))
+#define MD5_I(b, c, d) ((c) ^ ((b) | ~(d)))
+
+#define MD5_STEP(f, a, b, c, d, m, t, s) \
+    a += f(b, c, d) + (m) + (t); \
+    a = ((a << (s)) | (a >> (32 - (s)))) + b;
+
+#define MD5_ROUNDS(a, b, c, d, M) \
+    MD5_STEP(MD5_F, a, b, c, d, M[ 0], 0xd76aa478U,  7); \
+    MD5_STEP(MD5_F, d, a, b, c, M[ 1], 0xe8c7b756U, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, M[ 2], 0x242070dbU, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, M[ 3], 0xc1bdceeeU, 22); \
+    MD5_STEP(MD5_F, a, b, c, d, M[ 4], 0xf57c0fafU,  7); \
+    MD5_STEP(MD5_F, d, a, b, c, M[ 5], 0x4787c62aU, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, M[ 6], 0xa8304613U, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, M[ 7], 0xfd469501U, 22); \
+    MD5_STEP(MD5_F, a, b, c, d, M[ 8], 0x698098d8U,  7); \
+    MD5_STEP(MD5_F, d, a, b, c, M[ 9], 0x8b44f7afU, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, M[10], 0xffff5bb1U, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, M[11], 0x895cd7beU, 22); \
+    MD5_STEP(MD5_F, a, b, c, d, M[12], 0x6b901122U,  7); \
+    MD5_STEP(MD5_F, d, a, b, c, M[13], 0xfd987193U, 12); \
+    MD5_STEP(MD5_F, c, d, a, b, M[14], 0xa679438eU, 17); \
+    MD5_STEP(MD5_F, b, c, d, a, M[15], 0x49b40821U, 22); \
+    MD5_STEP(MD5_G, a, b, c, d, M[ 1], 0xf61e2562U,  5); \
+    MD5_STEP(MD5_G, d, a, b, c, M[ 6], 0xc040b340U,  9); \
+    MD5_STEP(MD5_G, c, d, a, b, M[11], 0x265e5a51U, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, M[ 0], 0xe9b6c7aaU, 20); \
+    MD5_STEP(MD5_G, a, b, c, d, M[ 5], 0xd62f105dU,  5); \
+    MD5_STEP(MD5_G, d, a, b, c, M[10], 0x02441453U,  9); \
+    MD5_STEP(MD5_G, c, d, a, b, M[15], 0xd8a1e681U, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, M[ 4], 0xe7d3fbc8U, 20); \
+    MD5_STEP(MD5_G, a, b, c, d, M[ 9], 0x21e1cde6U,  5); \
+    MD5_STEP(MD5_G, d, a, b, c, M[14], 0xc33707d6U,  9); \
+    MD5_STEP(MD5_G, c, d, a, b, M[ 3], 0xf4d50d87U, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, M[ 8], 0x455a14edU, 20); \
+    MD5_STEP(MD5_G, a, b, c, d, M[13], 0xa9e3e905U,  5); \
+    MD5_STEP(MD5_G, d, a, b, c, M[ 2], 0xfcefa3f8U,  9); \
+    MD5_STEP(MD5_G, c, d, a, b, M[ 7], 0x676f02d9U, 14); \
+    MD5_STEP(MD5_G, b, c, d, a, M[12], 0x8d2a4c8aU, 20); \
+    MD5_STEP(MD5_H, a, b, c, d, M[ 5], 0xfffa3942U,  4); \
+    MD5_STEP(MD5_H, d, a, b, c, M[ 8], 0x8771f681U, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, M[11], 0x6d9d6122U, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, M[14], 0xfde5380cU, 23); \
+    MD5_STEP(MD5_H, a, b, c, d, M[ 1], 0xa4beea44U,  4); \
+    MD5_STEP(MD5_H, d, a, b, c, M[ 4], 0x4bdecfa9U, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, M[ 7], 0xf6bb4b60U, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, M[10], 0xbebfbc70U, 23); \
+    MD5_STEP(MD5_H, a, b, c, d, M[13], 0x289b7ec6U,  4); \
+    MD5_STEP(MD5_H, d, a, b, c, M[ 0], 0xeaa127faU, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, M[ 3], 0xd4ef3085U, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, M[ 6], 0x04881d05U, 23); \
+    MD5_STEP(MD5_H, a, b, c, d, M[ 9], 0xd9d4d039U,  4); \
+    MD5_STEP(MD5_H, d, a, b, c, M[12], 0xe6db99e5U, 11); \
+    MD5_STEP(MD5_H, c, d, a, b, M[15], 0x1fa27cf8U, 16); \
+    MD5_STEP(MD5_H, b, c, d, a, M[ 2], 0xc4ac5665U, 23); \
+    MD5_STEP(MD5_I, a, b, c, d, M[ 0], 0xf4292244U,  6); \
+    MD5_STEP(MD5_I, d, a, b, c, M[ 7], 0x432aff97U, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, M[14], 0xab9423a7U, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, M[ 5], 0xfc93a039U, 21); \
+    MD5_STEP(MD5_I, a, b, c, d, M[12], 0x655b59c3U,  6); \
+    MD5_STEP(MD5_I, d, a, b, c, M[ 3], 0x8f0ccc92U, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, M[10], 0xffeff47dU, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, M[ 1], 0x85845dd1U, 21); \
+    MD5_STEP(MD5_I, a, b, c, d, M[ 8], 0x6fa87e4fU,  6); \
+    MD5_STEP(MD5_I, d, a, b, c, M[15], 0xfe2ce6e0U, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, M[ 6], 0xa3014314U, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, M[13], 0x4e0811a1U, 21); \
+    MD5_STEP(MD5_I, a, b, c, d, M[ 4], 0xf7537e82U,  6); \
+    MD5_STEP(MD5_I, d, a, b, c, M[11], 0xbd3af235U, 10); \
+    MD5_STEP(MD5_I, c, d, a, b, M[ 2], 0x2ad7d2bbU, 15); \
+    MD5_STEP(MD5_I, b, c, d, a, M[ 9], 0xeb86d391U, 21); \
+
+/**
+ * Defines a function that computes the MD5 digests of 'lanes' keys of at most MD5_MAX_SINGLE_BLOCK bytes in parallel.
+ */
+#define HASH_MD5_LANES(name, vtype, lanes, attr) \
+attr static void name(const char **keys, const size_t *key_lens, unsigned char (*digests)[16]) \
+{ \
+    union { \
+        vtype v[16]; \
+        unsigned int w[16][lanes]; \
+    } block; \
+    memset(&block, 0, sizeof(block)); \
+    for(int l = 0; l < lanes; l++) { \
+        const unsigned char *key = (const unsigned char *)keys[l]; \
+        size_t len = key_lens[l]; \
+        for(size_t i = 0; i < len; i++) { \
+            block.w[i >> 2][l] |= (unsigned int)key[i] << ((i & 3) * 8); \
+        } \
+        block.w[len >> 2][l] |= 0x80U << ((len & 3) * 8); \
+        block.w[14][l] = (unsigned int)(len << 3); \
+    } \
+    vtype *M = block.v; \
+    vtype zero = {0}; \
+    vtype a = zero + 0x67452301U; \
+    vtype b = zero + 0xefcdab89U; \
+    vtype c = zero + 0x98badcfeU; \
+    vtype d = zero + 0x10325476U; \
+    MD5_ROUNDS(a, b, c, d, M) \
+    union { \
+        vtype v[4]; \
+        unsigned int w[4][lanes]; \
+    } state; \
+    state.v[0] = a + 0x67452301U; \
+    state.v[1] = b + 0xefcdab89U; \
+    state.v[2] = c + 0x98badcfeU; \
+    state.v[3] = d + 0x10325476U; \
+    for(int l = 0; l < lanes; l++) { \
+        for(int i = 0; i < 4; i++) { \
+            unsigned int word = state.w[i][l]; \
+            digests[l][i * 4] = word; \
+            digests[l][i * 4 + 1] = word >> 8; \
+            digests[l][i * 4 + 2] = word >> 16; \
+            digests[l][i * 4 + 3] = word >> 24; \
+        } \
+    } \
+}
+
+HASH_MD5_LANES(Hash_md5_lanes4, v4ui, 4, )
+#ifdef HASH_X86
+HASH_MD5_LANES(Hash_md5_lanes8, v8ui, 8, __attribute__((target("avx2"))))
+#endif
+
+static int Hash_lanes = 4;
+
+void Hash_init()
+{
+#ifdef HASH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        DEBUG(("Hash using avx2\n"));
+        Hash_lanes = 8;
+    }
+#endif
+}
+
+static void Hash_md5_single(const char *key, size_t key_len, unsigned char digest[16])
+{
+    md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *)key, key_len);
+    md5_finish(&state, digest);
+}
+
+static void Hash_md5_group(const char **keys, const size_t *key_lens, unsigned char (*digests)[16])
+{
+#ifdef HASH_X86
+    if(Hash_lanes == 8) {
+        Hash_md5_lanes8(keys, key_lens, digests);
+        return;
+    }
+#endif
+    Hash_md5_lanes4(keys, key_lens, digests);
+}
+
+void Hash_md5_many(const char **keys, const size_t *key_lens, unsigned char (*digests)[16], size_t n)
+{
+    //gather the keys that fit in a single block into groups of Hash_lanes, the others are hashed right away
+    const char *lane_keys[HASH_MAX_LANES];
+    size_t lane_lens[HASH_MAX_LANES];
+    size_t lane_index[HASH_MAX_LANES];
+    unsigned char lane_digests[HASH_MAX_LANES][16];
+    int used = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(key_lens[i] > MD5_MAX_SINGLE_BLOCK) {
+            Hash_md5_single(keys[i], key_lens[i], digests[i]);
+            continue;
+        }
+        lane_keys[used] = keys[i];
+        lane_lens[used] = key_lens[i];
+        lane_index[used] = i;
+        if(++used == Hash_lanes) {
+            Hash_md5_group(lane_keys, lane_lens, lane_digests);
+            for(int l = 0; l < used; l++) {
+                memcpy(digests[lane_index[l]], lane_digests[l], 16);
+            }
+            used = 0;
+        }
+    }
+    if(used > 0) {
+        //fill the unused lanes of the last group with empty keys
+        for(int l = used; l < Hash_lanes; l++) {
+            lane_keys[l] = "";
+            lane_lens[l] = 0;
+        }
+        Hash_md5_group(lane_keys, lane_lens, lane_digests);
+        for(int l = 0; l < used; l++) {
+            memcpy(digests[lane_index[l]], lane_digests[l], 16);
+        }
+    }
+}
+
+static inline unsigned int Hash_rotl32(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int Hash_murmur3(const char *key, size_t key_len, unsigned int seed)
+{
+    const unsigned char *data = (const unsigned char *)key;
+    const unsigned int c1 = 0xcc9e2d51U;
+    const unsigned int c2 = 0x1b873593U;
+    unsigned int h = seed;
+    size_t nblocks = key_len / 4;
+    for(size_t i = 0; i < nblocks; i++) {
+        const unsigned char *p = data + i * 4;
+        unsigned int k = (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+        k *= c1;
+        k = Hash_rotl32(k, 15);
+        k *= c2;
+        h ^= k;
+        h = Hash_rotl32(h, 13);
+        h = h * 5 + 0xe6546b64U;
+    }
+    const unsigned char *tail = data + nblocks * 4;
+    unsigned int k = 0;
+    switch(key_len & 3) {
+    case 3:
+        k ^= (unsigned int)tail[2] << 16;
+        /* no break */
+    case 2:
+        k ^= (unsigned int)tail[1] << 8;
+        /* no break */
+    case 1:
+        k ^= tail[0];
+        k *= c1;
+        k = Hash_rotl32(k, 15);
+        k *= c2;
+        h ^= k;
+    }
+    h ^= (unsigned int)key_len;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
@@ -0,0 +1,24 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define HASH_MAX_LANES 8
+
+void Hash_init();
+
+void Hash_md5_many(const char **keys, const size_t *key_lens, unsigned char (*digests)[16], size_t n);
+
+unsigned int Hash_murmur3(const char *key, size_t key_len, unsigned int seed);
+
+#endif
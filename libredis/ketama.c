@@ -28,6 +28,7 @@
 
 #include "ketama.h"
 #include "md5.h"
+#include "hash.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -35,12 +36,30 @@
 #include <string.h>
 #include <math.h>           /* floor & floorf                       */
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "alloc.h"
+#include "module.h"
 #include "list.h"
+#include "buffer.h"
 
 #define INIT_MAX_SERVERS 1
+#define MIN_INDEX_BITS 8
+#define MAX_INDEX_BITS 20
+#define RING_CACHE_SIZE 8
+#define RADIX_BITS 11
+#define DIGESTS_CHUNK 64
+
+#define CONTINUUM_MAGIC "LRKETAMA"
+#define CONTINUUM_VERSION 1
+#define CONTINUUM_BYTE_ORDER 0x01020304U
+#define CONTINUUM_ALIGN(n) (((n) + 7) & ~(unsigned long long)7)
 
 typedef struct
 {
@@ -52,47 +71,305 @@ typedef struct
 {
     char addr[ADDR_SIZE];
     unsigned long memory;
+    int removed; // removed servers keep their ordinal, but get no points
+    unsigned int entries; // number of hashes (of 4 points each) of this server in the continuum
 } serverinfo;
 
-struct _Ketama
+/**
+ * The continuum and everything needed for lookups in it. A ring is not changed after it has been published, changes to
+ * the servers build a new ring which is then swapped in. Readers holding a reference keep using the old one until they
+ * release it. Releasing only drops the reference, rings that are no longer referenced are freed by the next thread that
+ * creates or updates a continuum, so that readers never call into the allocator.
+ * Rings are also cached, creating the continuum for the same servers again (e.g. in the next request of a PHP process)
+ * takes a reference to the cached ring instead of building a new one.
+ */
+struct _KetamaRing
 {
+    int refcount;
+    KetamaRing *next; //next in the list of all rings
+    int cached; //the cache holds a reference to this ring
+    unsigned long last_used; //for evicting the least recently used ring from the cache
+    KetamaHash hash;
     int numpoints;
+    unsigned int numservers;
+    mcs* continuum; //array of numpoints mcs structs, sorted by point
+    serverinfo *servers; //copy of the servers the continuum was built from
+    unsigned int *index; //for each bucket (top index_bits of a hash), the first point in the continuum in that bucket or after it
+    int index_bits;
+    void *map; //the file the arrays above are mapped from, NULL if they were allocated
+    size_t map_size;
+};
+
+/**
+ * Header of a continuum file, as written by Ketama_save_continuum. It is followed by the servers, the continuum and
+ * the index of the ring, each at the given offset (aligned to 8 bytes) and stored exactly as in memory, so that the
+ * file can be mapped and used as is. The sizes and the byte order are recorded to reject files written on a machine
+ * with a different layout.
+ */
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int byte_order;
+    unsigned int header_size;
+    unsigned int server_size;
+    unsigned int point_size;
+    unsigned int hash;
+    unsigned int numservers;
+    unsigned int numpoints;
+    unsigned int index_bits;
+    unsigned int reserved;
+    unsigned long long servers_offset;
+    unsigned long long continuum_offset;
+    unsigned long long index_offset;
+    unsigned long long size; //of the whole file
+} continuum_header;
+
+struct _Ketama
+{
     unsigned int numservers;
     unsigned int maxservers;
+    unsigned int numactive; //servers that were not removed
     unsigned long memory;
-    mcs* continuum; //array of mcs structs
     serverinfo *servers; //array of numservers serverinfo structs
+    KetamaHash hash;
+    KetamaRing *ring; //current ring, NULL until the continuum is created
+    int ring_lock; //taken while taking a reference to ring, or swapping it
+    double load_bound; //epsilon of bounded loads, 0 if disabled
+    long *loads; //for each server, the number of keys acquired and not yet released
+    long total_load;
 };
 
-typedef int (*compfn)( const void*, const void* );
+static KetamaRing *g_rings = NULL; //all rings, referenced or not
+static int g_rings_lock = 0;
+static unsigned long g_rings_clock = 0;
+
 int Ketama_compare( mcs *a, mcs *b );
 
+static inline void Ketama_lock(int *lock)
+{
+	while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+		}
+	}
+}
+
+static inline void Ketama_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 Ketama *Ketama_new()
 {
 	Ketama *ketama = Alloc_alloc_T(Ketama);
-	ketama->numpoints = 0;
 	ketama->numservers = 0;
 	ketama->maxservers = 0;
+	ketama->numactive = 0;
 	ketama->memory = 0;
-	ketama->continuum = NULL;
 	ketama->servers = NULL;
+	ketama->hash = KETAMA_HASH_MD5;
+	ketama->ring = NULL;
+	ketama->ring_lock = 0;
+	ketama->load_bound = 0.0;
+	ketama->loads = NULL;
+	ketama->total_load = 0;
 	return ketama;
 }
 
-void Ketama_free(Ketama *ketama)
+/**
+ * Adds ring to the list of all rings.
+ */
+static void KetamaRing_track(KetamaRing *ring)
+{
+	Ketama_lock(&g_rings_lock);
+	ring->next = g_rings;
+	g_rings = ring;
+	Ketama_unlock(&g_rings_lock);
+}
+
+static KetamaRing *KetamaRing_new(Ketama *ketama, int numpoints)
+{
+	KetamaRing *ring = Alloc_alloc_T(KetamaRing);
+	ring->refcount = 1;
+	ring->cached = 0;
+	ring->last_used = 0;
+	ring->hash = ketama->hash;
+	ring->numpoints = numpoints;
+	ring->numservers = ketama->numservers;
+	ring->continuum = Alloc_alloc(numpoints * sizeof(mcs));
+	ring->servers = Alloc_alloc(ketama->numservers * sizeof(serverinfo));
+	memcpy(ring->servers, ketama->servers, ketama->numservers * sizeof(serverinfo));
+	ring->index = NULL;
+	ring->index_bits = 0;
+	ring->map = NULL;
+	ring->map_size = 0;
+	KetamaRing_track(ring);
+	return ring;
+}
+
+static void KetamaRing_free(KetamaRing *ring)
+{
+	if(ring->map != NULL) {
+		munmap(ring->map, ring->map_size);
+		Alloc_free_T(ring, KetamaRing);
+		return;
+	}
+	Alloc_free(ring->continuum, ring->numpoints * sizeof(mcs));
+	Alloc_free(ring->servers, ring->numservers * sizeof(serverinfo));
+	if(ring->index != NULL) {
+		Alloc_free(ring->index, ((1 << ring->index_bits) + 1) * sizeof(unsigned int));
+	}
+	Alloc_free_T(ring, KetamaRing);
+}
+
+void KetamaRing_release(KetamaRing *ring)
+{
+	__atomic_sub_fetch(&ring->refcount, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frees the rings that are no longer referenced.
+ */
+static void Ketama_free_unused_rings()
+{
+	Ketama_lock(&g_rings_lock);
+	KetamaRing **link = &g_rings;
+	while(*link != NULL) {
+		KetamaRing *ring = *link;
+		if(__atomic_load_n(&ring->refcount, __ATOMIC_ACQUIRE) == 0) {
+			DEBUG(("ketama free ring\n"));
+			*link = ring->next;
+			KetamaRing_free(ring);
+		}
+		else {
+			link = &ring->next;
+		}
+	}
+	Ketama_unlock(&g_rings_lock);
+}
+
+/**
+ * Returns a new reference to a cached ring built from the same servers as ketama has now, or NULL if there is none.
+ */
+static KetamaRing *Ketama_find_cached_ring(Ketama *ketama)
 {
-	if(ketama->continuum != NULL) {
-		Alloc_free(ketama->continuum, ketama->numservers * sizeof(mcs) * 160);
-		ketama->continuum = NULL;
+	KetamaRing *found = NULL;
+	Ketama_lock(&g_rings_lock);
+	for(KetamaRing *ring = g_rings; ring != NULL && found == NULL; ring = ring->next) {
+		if(!ring->cached || ring->hash != ketama->hash || ring->numservers != ketama->numservers) {
+			continue;
+		}
+		int i;
+		for(i = 0; i < ketama->numservers; i++) {
+			serverinfo *a = &(ring->servers[i]);
+			serverinfo *b = &(ketama->servers[i]);
+			if(a->memory != b->memory || a->removed != b->removed || strcmp(a->addr, b->addr) != 0) {
+				break;
+			}
+		}
+		if(i == ketama->numservers) {
+			__atomic_add_fetch(&ring->refcount, 1, __ATOMIC_RELAXED);
+			ring->last_used = ++g_rings_clock;
+			found = ring;
+		}
 	}
+	Ketama_unlock(&g_rings_lock);
+	return found;
+}
+
+/**
+ * Adds ring to the cache, evicting the least recently used ring if the cache is full.
+ */
+static void Ketama_cache_ring(KetamaRing *ring)
+{
+	Ketama_lock(&g_rings_lock);
+	int numcached = 0;
+	KetamaRing *oldest = NULL;
+	for(KetamaRing *r = g_rings; r != NULL; r = r->next) {
+		if(r->cached) {
+			numcached++;
+			if(oldest == NULL || r->last_used < oldest->last_used) {
+				oldest = r;
+			}
+		}
+	}
+	if(numcached >= RING_CACHE_SIZE) {
+		DEBUG(("ketama evict ring from cache\n"));
+		oldest->cached = 0;
+		KetamaRing_release(oldest);
+	}
+	__atomic_add_fetch(&ring->refcount, 1, __ATOMIC_RELAXED);
+	ring->cached = 1;
+	ring->last_used = ++g_rings_clock;
+	Ketama_unlock(&g_rings_lock);
+}
+
+/**
+ * Empties the cache of rings, and frees all rings that are no longer referenced, called from Module_free.
+ */
+void Ketama_free_final()
+{
+	Ketama_lock(&g_rings_lock);
+	for(KetamaRing *ring = g_rings; ring != NULL; ring = ring->next) {
+		if(ring->cached) {
+			ring->cached = 0;
+			KetamaRing_release(ring);
+		}
+	}
+	Ketama_unlock(&g_rings_lock);
+	Ketama_free_unused_rings();
+}
+
+KetamaRing *Ketama_acquire_ring(Ketama *ketama)
+{
+	Ketama_lock(&ketama->ring_lock);
+	KetamaRing *ring = ketama->ring;
+	if(ring != NULL) {
+		__atomic_add_fetch(&ring->refcount, 1, __ATOMIC_RELAXED);
+	}
+	Ketama_unlock(&ketama->ring_lock);
+	return ring;
+}
+
+/**
+ * Publishes ring as the current ring of ketama, and drops the reference of ketama to the previous one.
+ */
+static void Ketama_swap_ring(Ketama *ketama, KetamaRing *ring)
+{
+	Ketama_lock(&ketama->ring_lock);
+	KetamaRing *old = ketama->ring;
+	ketama->ring = ring;
+	Ketama_unlock(&ketama->ring_lock);
+	if(old != NULL) {
+		KetamaRing_release(old);
+	}
+	Ketama_free_unused_rings();
+}
+
+void Ketama_free(Ketama *ketama)
+{
+	Ketama_swap_ring(ketama, NULL);
 	if(ketama->servers != NULL) {
 		Alloc_free(ketama->servers, ketama->maxservers * sizeof(serverinfo));
+		Alloc_free(ketama->loads, ketama->maxservers * sizeof(long));
 		ketama->servers = NULL;
+		ketama->loads = NULL;
 	}
 	Alloc_free_T(ketama, Ketama);
 }
 
+int Ketama_set_hash(Ketama *ketama, KetamaHash hash)
+{
+	if(ketama->ring) {
+		Module_set_error(GET_MODULE(), "Ketama hash must be set before creating the continuum");
+		return -1;
+	}
+	ketama->hash = hash;
+	return 0;
+}
+
+static void Ketama_update_ring(Ketama *ketama);
+
 int Ketama_add_server(Ketama *ketama, const char *addr, int port, unsigned long weight)
 {
 	assert(ketama->numservers <= ketama->maxservers);
@@ -100,18 +377,72 @@ int Ketama_add_server(Ketama *ketama, const char *addr, int port, unsigned long
 		DEBUG(("ketama init server list\n"));
 		ketama->maxservers = INIT_MAX_SERVERS;
 		ketama->servers = Alloc_alloc(sizeof(serverinfo) * ketama->maxservers);
+		ketama->loads = Alloc_alloc(sizeof(long) * ketama->maxservers);
 	}
 	if(ketama->numservers >= ketama->maxservers) {
 		int oldmaxservers = ketama->maxservers;
 		ketama->maxservers *= 2;
 		DEBUG(("ketama expand server list from %d to %d entries\n", oldmaxservers, ketama->maxservers));
 		ketama->servers = Alloc_realloc(ketama->servers, sizeof(serverinfo) * ketama->maxservers, sizeof(serverinfo) * oldmaxservers);
+		ketama->loads = Alloc_realloc(ketama->loads, sizeof(long) * ketama->maxservers, sizeof(long) * oldmaxservers);
 	}
 	serverinfo *info = &(ketama->servers[ketama->numservers]);
 	snprintf(info->addr, sizeof(info->addr), "%s:%d", addr, port); //TODO check error (e.g. address too long)
 	info->memory = weight;
+	info->removed = 0;
+	info->entries = 0;
+	ketama->loads[ketama->numservers] = 0;
 	ketama->numservers += 1;
+	ketama->numactive += 1;
+	ketama->memory += weight;
+
+	if(ketama->ring) {
+		Ketama_update_ring(ketama);
+	}
+
+	return 0;
+}
+
+static serverinfo *Ketama_get_active_server(Ketama *ketama, int ordinal)
+{
+	if(ordinal < 0 || ordinal >= ketama->numservers || ketama->servers[ordinal].removed) {
+		Module_set_error(GET_MODULE(), "No ketama server with ordinal: %d", ordinal);
+		return NULL;
+	}
+	return &(ketama->servers[ordinal]);
+}
+
+int Ketama_remove_server(Ketama *ketama, int ordinal)
+{
+	serverinfo *info = Ketama_get_active_server(ketama, ordinal);
+	if(info == NULL) {
+		return -1;
+	}
+	ketama->memory -= info->memory;
+	ketama->numactive -= 1;
+	info->memory = 0;
+	info->removed = 1;
+
+	if(ketama->ring) {
+		Ketama_update_ring(ketama);
+	}
+
+	return 0;
+}
+
+int Ketama_set_server_weight(Ketama *ketama, int ordinal, unsigned long weight)
+{
+	serverinfo *info = Ketama_get_active_server(ketama, ordinal);
+	if(info == NULL) {
+		return -1;
+	}
+	ketama->memory -= info->memory;
 	ketama->memory += weight;
+	info->memory = weight;
+
+	if(ketama->ring) {
+		Ketama_update_ring(ketama);
+	}
 
 	return 0;
 }
@@ -141,10 +472,10 @@ unsigned int Ketama_hashi( const char* inString, size_t inLen )
     unsigned char digest[16];
 
     Ketama_md5_digest( inString, inLen, digest );
-    return (unsigned int)(( digest[3] << 24 )
-                        | ( digest[2] << 16 )
-                        | ( digest[1] <<  8 )
-                        |   digest[0] );
+    return ( (unsigned int)digest[3] << 24 )
+         | ( (unsigned int)digest[2] << 16 )
+         | ( (unsigned int)digest[1] <<  8 )
+         |   (unsigned int)digest[0];
 }
 
 char *Ketama_get_server_address(Ketama *ketama, int ordinal)
@@ -157,49 +488,337 @@ char *Ketama_get_server_address(Ketama *ketama, int ordinal)
 	return ketama->servers[ordinal].addr;
 }
 
+char *KetamaRing_get_server_address(KetamaRing *ring, int ordinal)
+{
+	if (ordinal < 0 || ordinal >= ring->numservers) {
+		DEBUG(("Incorrect call to KetamaRing_get_server_address"));
+		return "";
+	}
+
+	return ring->servers[ordinal].addr;
+}
 
-int Ketama_get_server_ordinal(Ketama *ketama, const char* key, size_t key_len)
+int Ketama_get_server_count(Ketama *ketama)
+{
+	return ketama->numservers;
+}
+
+int KetamaRing_get_server_count(KetamaRing *ring)
+{
+	return ring->numservers;
+}
+
+/**
+ * Returns the position in the continuum of the point of the server for hash h.
+ */
+static inline unsigned int Ketama_lookup_position(KetamaRing *ring, unsigned int h)
+{
+    mcs *mcsarr = ring->continuum;
+
+    // find server with next biggest point after what this key hashes to, the index
+    // narrows the search down to the points in the bucket of the hash
+    unsigned int bucket = h >> (32 - ring->index_bits);
+    unsigned int i = ring->index[bucket];
+    unsigned int end = ring->index[bucket + 1];
+    while ( i < end && mcsarr[i].point < h ) {
+        i++;
+    }
+    if ( i == ring->numpoints ) {
+        return 0; // if at the end, roll back to zeroth
+    }
+    return i;
+}
+
+static inline int Ketama_lookup(KetamaRing *ring, unsigned int h)
+{
+    return ring->continuum[Ketama_lookup_position(ring, h)].ordinal;
+}
+
+static inline unsigned int Ketama_hash_key(KetamaRing *ring, const char* key, size_t key_len)
+{
+    if ( ring->hash == KETAMA_HASH_MURMUR3 ) {
+        return Hash_murmur3( key, key_len, 0 );
+    }
+    return Ketama_hashi( key, key_len );
+}
+
+int KetamaRing_get_server_ordinal(KetamaRing *ring, const char* key, size_t key_len)
 {
-	if (!ketama->continuum) {
+	if (!ring || ring->numpoints == 0) {
 		return -1;
 	}
 
-    unsigned int h = Ketama_hashi( key, key_len );
-    int highp = ketama->numpoints;
-    mcs *mcsarr = ketama->continuum;
-    int lowp = 0, midp;
-    unsigned int midval, midval1;
+    return Ketama_lookup(ring, Ketama_hash_key(ring, key, key_len));
+}
 
-    // divide and conquer array search to find server with next biggest
-    // point after what this key hashes to
-    while ( 1 )
-    {
-        midp = (int)( ( lowp+highp ) / 2 );
+int Ketama_get_server_ordinal(Ketama *ketama, const char* key, size_t key_len)
+{
+	//a reference is taken, as another thread may update the ring meanwhile
+	KetamaRing *ring = Ketama_acquire_ring(ketama);
+	int ordinal = KetamaRing_get_server_ordinal(ring, key, key_len);
+	if(ring != NULL) {
+		KetamaRing_release(ring);
+	}
+	return ordinal;
+}
+
+void Ketama_set_load_bound(Ketama *ketama, double epsilon)
+{
+	ketama->load_bound = (epsilon > 0.0) ? epsilon : 0.0;
+}
+
+int Ketama_acquire_server(Ketama *ketama, const char* key, size_t key_len)
+{
+    KetamaRing *ring = Ketama_acquire_ring(ketama);
+    if ( !ring ) {
+        return -1;
+    }
+    if ( ring->numpoints == 0 ) {
+        KetamaRing_release(ring);
+        return -1;
+    }
+
+    unsigned int pos = Ketama_lookup_position(ring, Ketama_hash_key(ring, key, key_len));
+    int ordinal = ring->continuum[pos].ordinal;
+    if ( ketama->load_bound > 0.0 && ketama->memory > 0 ) {
+        // a server may take up to (1 + epsilon) times its share (by weight) of the load, including this key. If the
+        // server of the key is full, walk forward over the continuum to the first server that is not. As the
+        // capacities add up to more than the load there always is one
+        double capacity = (1.0 + ketama->load_bound) * (double)(ketama->total_load + 1) / (double)ketama->memory;
+        for ( int n = 0; n < ring->numpoints; n++ ) {
+            ordinal = ring->continuum[pos].ordinal;
+            if ( ketama->loads[ordinal] + 1 <= ceil(capacity * (double)ketama->servers[ordinal].memory) ) {
+                break;
+            }
+            pos = (pos + 1 == ring->numpoints) ? 0 : pos + 1;
+        }
+    }
+    KetamaRing_release(ring);
+    ketama->loads[ordinal] += 1;
+    ketama->total_load += 1;
+    return ordinal;
+}
+
+void Ketama_release_server(Ketama *ketama, int ordinal)
+{
+	if (ordinal < 0 || ordinal >= ketama->numservers || ketama->loads[ordinal] == 0) {
+		DEBUG(("Incorrect call to Ketama_release_server"));
+		return;
+	}
+	ketama->loads[ordinal] -= 1;
+	ketama->total_load -= 1;
+}
+
+long Ketama_get_server_load(Ketama *ketama, int ordinal)
+{
+	if (ordinal < 0 || ordinal >= ketama->numservers) {
+		return 0;
+	}
+	return ketama->loads[ordinal];
+}
+
+#define ORDINALS_CHUNK 64
+
+void KetamaRing_get_server_ordinals(KetamaRing *ring, const char **keys, const size_t *key_lens, int *ordinals, size_t n)
+{
+	if (!ring || ring->numpoints == 0) {
+		for(size_t i = 0; i < n; i++) {
+			ordinals[i] = -1;
+		}
+		return;
+	}
+
+	if (ring->hash == KETAMA_HASH_MURMUR3) {
+		for(size_t i = 0; i < n; i++) {
+			ordinals[i] = Ketama_lookup(ring, Hash_murmur3(keys[i], key_lens[i], 0));
+		}
+		return;
+	}
+
+	// the keys are hashed a chunk at a time, several keys in parallel
+	unsigned char digests[ORDINALS_CHUNK][16];
+	for(size_t start = 0; start < n; start += ORDINALS_CHUNK) {
+		size_t count = (n - start < ORDINALS_CHUNK) ? n - start : ORDINALS_CHUNK;
+		Hash_md5_many(keys + start, key_lens + start, digests, count);
+		for(size_t i = 0; i < count; i++) {
+			unsigned char *d = digests[i];
+			unsigned int h = ((unsigned int)d[3] << 24) | ((unsigned int)d[2] << 16) | ((unsigned int)d[1] << 8) | d[0];
+			ordinals[start + i] = Ketama_lookup(ring, h);
+		}
+	}
+}
+
+void Ketama_get_server_ordinals(Ketama *ketama, const char **keys, const size_t *key_lens, int *ordinals, size_t n)
+{
+	KetamaRing *ring = Ketama_acquire_ring(ketama);
+	KetamaRing_get_server_ordinals(ring, keys, key_lens, ordinals, n);
+	if(ring != NULL) {
+		KetamaRing_release(ring);
+	}
+}
 
-        if ( midp == ketama->numpoints ) {
-            return mcsarr[0].ordinal; // if at the end, roll back to zeroth
+/**
+ * Builds the index of the (sorted) continuum, with about 1 bucket per point.
+ */
+static void Ketama_create_index(KetamaRing *ring)
+{
+    int bits = MIN_INDEX_BITS;
+    while ( bits < MAX_INDEX_BITS && (1 << bits) < ring->numpoints ) {
+        bits++;
+    }
+    unsigned int buckets = 1 << bits;
+    ring->index = Alloc_alloc((buckets + 1) * sizeof(unsigned int));
+    ring->index_bits = bits;
+
+    unsigned int i = 0;
+    for ( unsigned int bucket = 0; bucket < buckets; bucket++ ) {
+        unsigned int start = bucket << (32 - bits);
+        while ( i < ring->numpoints && ring->continuum[i].point < start ) {
+            i++;
         }
+        ring->index[bucket] = i;
+    }
+    ring->index[buckets] = ring->numpoints;
+}
+
+/**
+ * Returns the number of hashes (of 4 points each) for the server, given the current servers and weights of ketama.
+ */
+static unsigned int Ketama_server_entries(Ketama *ketama, serverinfo *sinfo)
+{
+    if ( sinfo->removed || ketama->memory == 0 ) {
+        return 0;
+    }
+    float pct = (float)sinfo->memory / (float)ketama->memory;
+    unsigned int ks = floorf( pct * 40.0 * (float)ketama->numactive );
+#ifndef NDEBUG
+    int hpct = floorf( pct * 100.0 );
+    DEBUG(("Server: %s (mem: %lu = %u%% or %d of %d)\n", sinfo->addr, sinfo->memory, hpct, ks, ketama->numactive * 40 ));
+#endif
+    return ks;
+}
+
+/**
+ * Stores the points of the hashes from up to (not including) to of the server in points. Returns the number of points.
+ */
+static unsigned int Ketama_server_points(KetamaHash hash, serverinfo *sinfo, int ordinal, unsigned int from, unsigned int to, mcs *points)
+{
+    unsigned k, cont = 0;
 
-        midval = mcsarr[midp].point;
-        midval1 = midp == 0 ? 0 : mcsarr[midp-1].point;
+    /* 40 hashes, 4 numbers per hash = 160 points per server */
+    /* the hashed strings are made a chunk at a time, so that the MD5 digests can be computed several at once */
+    char ss[DIGESTS_CHUNK][ADDR_SIZE + 11];
+    const char *keys[DIGESTS_CHUNK];
+    size_t lens[DIGESTS_CHUNK];
+    unsigned char digests[DIGESTS_CHUNK][16];
 
-        if ( h <= midval && h > midval1 ) {
-            return mcsarr[midp].ordinal;
+    for( k = from; k < to; k += DIGESTS_CHUNK )
+    {
+        unsigned int count = (to - k < DIGESTS_CHUNK) ? to - k : DIGESTS_CHUNK;
+        for( unsigned int c = 0; c < count; c++ )
+        {
+            int len = snprintf( ss[c], sizeof(ss[c]), "%s-%d", sinfo->addr, k + c );
+            if (len > sizeof(ss[c]) - 1)
+                len = sizeof(ss[c]) - 1;
+            keys[c] = ss[c];
+            lens[c] = len;
         }
 
-        if ( midval < h ) {
-            lowp = midp + 1;
+        int h;
+        if ( hash == KETAMA_HASH_MURMUR3 ) {
+            /* the hash of the 4 seeds gives the 4 points of each entry */
+            for( unsigned int c = 0; c < count; c++ )
+            {
+                for( h = 0; h < 4; h++ )
+                {
+                    points[cont].point = Hash_murmur3( keys[c], lens[c], h );
+                    points[cont].ordinal = ordinal;
+                    cont++;
+                }
+            }
+            continue;
         }
-        else {
-            highp = midp - 1;
+
+        Hash_md5_many( keys, lens, digests, count );
+
+        /* Use successive 4-bytes from hash as numbers 
+         * for the points on the circle: */
+        for( unsigned int c = 0; c < count; c++ )
+        {
+            unsigned char *digest = digests[c];
+            for( h = 0; h < 4; h++ )
+            {
+                points[cont].point = ( (unsigned int)digest[3+h*4] << 24 )
+                                   | ( (unsigned int)digest[2+h*4] << 16 )
+                                   | ( (unsigned int)digest[1+h*4] <<  8 )
+                                   |   (unsigned int)digest[h*4];
+
+                points[cont].ordinal = ordinal;
+                cont++;
+            }
         }
+    }
+    return cont;
+}
 
-        if ( lowp > highp ) {
-            return mcsarr[0].ordinal;
+/**
+ * Sorts the points in ascending order of point with a (stable) LSD radix sort, RADIX_BITS at a time. The points are
+ * generated in order of ordinal, so equal points end up in order of ordinal, like Ketama_compare orders them.
+ */
+static void Ketama_sort_points(mcs *points, unsigned int n)
+{
+    if ( n < 2 ) {
+        return;
+    }
+    mcs *tmp = Alloc_alloc(n * sizeof(mcs));
+    mcs *src = points;
+    mcs *dst = tmp;
+    unsigned int counts[1 << RADIX_BITS];
+    for ( int shift = 0; shift < 32; shift += RADIX_BITS ) {
+        unsigned int mask = (1U << RADIX_BITS) - 1;
+        memset(counts, 0, sizeof(counts));
+        for ( unsigned int i = 0; i < n; i++ ) {
+            counts[(src[i].point >> shift) & mask]++;
+        }
+        if ( counts[(src[0].point >> shift) & mask] == n ) {
+            continue; // all points have the same digit, nothing to do for this pass
+        }
+        unsigned int pos = 0;
+        for ( unsigned int d = 0; d <= mask; d++ ) {
+            unsigned int count = counts[d];
+            counts[d] = pos;
+            pos += count;
+        }
+        for ( unsigned int i = 0; i < n; i++ ) {
+            dst[counts[(src[i].point >> shift) & mask]++] = src[i];
         }
+        mcs *swap = src;
+        src = dst;
+        dst = swap;
     }
+    if ( src != points ) {
+        memcpy(points, src, n * sizeof(mcs));
+    }
+    Alloc_free(tmp, n * sizeof(mcs));
 }
 
+/**
+ * Makes a cached ring for the current servers of ketama its ring, returns 0 if there is none.
+ */
+static int Ketama_use_cached_ring(Ketama *ketama)
+{
+    KetamaRing *ring = Ketama_find_cached_ring( ketama );
+    if ( ring == NULL ) {
+        return 0;
+    }
+    DEBUG(("ketama using cached ring\n"));
+    for(int i = 0; i < ketama->numservers; i++)
+    {
+        ketama->servers[i].entries = ring->servers[i].entries;
+    }
+    Ketama_swap_ring( ketama, ring );
+    return 1;
+}
 
 /** \brief Generates the continuum of servers (each server as many points on a circle).
   * \param key Shared memory key for storing the newly created continuum.
@@ -207,83 +826,433 @@ int Ketama_get_server_ordinal(Ketama *ketama, const char* key, size_t key_len)
   * \return 0 on failure, 1 on success. */
 void Ketama_create_continuum(Ketama *ketama)
 {
-	if (ketama->numservers == 0 || ketama->continuum) {
+	if (ketama->numservers == 0 || ketama->ring) {
 		DEBUG(("Ketama_create_continuum called in incorrect state"));
 		return;
 	}
 
 	DEBUG(("Server definitions read: %u servers, total memory: %lu.\n", ketama->numservers, ketama->memory ));
 
+	if (Ketama_use_cached_ring(ketama)) {
+		return;
+	}
+
     /* Continuum will hold one mcs for each point on the circle: */
-    ketama->continuum = Alloc_alloc(ketama->numservers * sizeof(mcs) * 160);
-    unsigned k, cont = 0;
+    int numpoints = 0;
+    for(int i = 0; i < ketama->numservers; i++)
+    {
+        ketama->servers[i].entries = Ketama_server_entries( ketama, &(ketama->servers[i]) );
+        numpoints += ketama->servers[i].entries * 4;
+    }
+    KetamaRing *ring = KetamaRing_new( ketama, numpoints );
+    unsigned cont = 0;
 
     for(int i = 0; i < ketama->numservers; i++)
     {
         serverinfo *sinfo = &(ketama->servers[i]);
-    	float pct = (float)sinfo->memory / (float)ketama->memory;
-        unsigned int ks = floorf( pct * 40.0 * (float)ketama->numservers );
-#ifndef NDEBUG
-        int hpct = floorf( pct * 100.0 );
-        DEBUG(("Server no. %d: %s (mem: %lu = %u%% or %d of %d)\n", i, sinfo->addr, sinfo->memory, hpct, ks, ketama->numservers * 40 ));
-#endif
+        cont += Ketama_server_points( ring->hash, sinfo, i, 0, sinfo->entries, ring->continuum + cont );
+    }
 
-        for( k = 0; k < ks; k++ )
-        {
-            /* 40 hashes, 4 numbers per hash = 160 points per server */
-            char ss[ADDR_SIZE + 11];
-            unsigned char digest[16];
-
-            int len = snprintf( ss, sizeof(ss), "%s-%d", sinfo->addr, k );
-            if (len > sizeof(ss) - 1)
-            	len = sizeof(ss) - 1;
-            Ketama_md5_digest( ss, len, digest );
-
-            /* Use successive 4-bytes from hash as numbers 
-             * for the points on the circle: */
-            int h;
-            for( h = 0; h < 4; h++ )
-            {
-                ketama->continuum[cont].point = ( digest[3+h*4] << 24 )
-                                      | ( digest[2+h*4] << 16 )
-                                      | ( digest[1+h*4] <<  8 )
-                                      |   digest[h*4];
+    DEBUG(("cont: %d\n", cont));
+    assert(cont == numpoints);
 
-				ketama->continuum[cont].ordinal = i;
-                cont++;
-            }
+    /* Sorts in ascending order of "point" */
+    Ketama_sort_points( ring->continuum, cont );
+
+    Ketama_create_index( ring );
+    Ketama_cache_ring( ring );
+    Ketama_swap_ring( ketama, ring );
+}
+
+/**
+ * Replaces the ring after a change to the servers. Only the points of the hashes that were added or removed for each
+ * server are computed, these are merged with the (sorted) points of the current ring, giving the same continuum as
+ * building it from scratch.
+ */
+static void Ketama_update_ring(Ketama *ketama)
+{
+    if ( Ketama_use_cached_ring( ketama ) ) {
+        return;
+    }
+
+    KetamaRing *old = ketama->ring;
+    int numadded = 0;
+    int numremoved = 0;
+    for(int i = 0; i < ketama->numservers; i++)
+    {
+        unsigned int before = (i < old->numservers) ? old->servers[i].entries : 0;
+        unsigned int after = Ketama_server_entries( ketama, &(ketama->servers[i]) );
+        ketama->servers[i].entries = after;
+        if ( after > before ) {
+            numadded += (after - before) * 4;
+        }
+        else {
+            numremoved += (before - after) * 4;
         }
     }
 
-    DEBUG(("cont: %d\n", cont));
-    ketama->numpoints = cont;
-    //free( slist );
+    mcs *added = Alloc_alloc(numadded * sizeof(mcs));
+    mcs *removed = Alloc_alloc(numremoved * sizeof(mcs));
+    int a = 0;
+    int r = 0;
+    for(int i = 0; i < ketama->numservers; i++)
+    {
+        serverinfo *sinfo = &(ketama->servers[i]);
+        unsigned int before = (i < old->numservers) ? old->servers[i].entries : 0;
+        if ( sinfo->entries > before ) {
+            a += Ketama_server_points( old->hash, sinfo, i, before, sinfo->entries, added + a );
+        }
+        else {
+            r += Ketama_server_points( old->hash, sinfo, i, sinfo->entries, before, removed + r );
+        }
+    }
+    assert(a == numadded && r == numremoved);
+    Ketama_sort_points( added, numadded );
+    Ketama_sort_points( removed, numremoved );
 
-    /* Sorts in ascending order of "point" */
-    qsort( (void*) ketama->continuum, cont, sizeof( mcs ), (compfn)Ketama_compare );
+    DEBUG(("ketama update, points added: %d removed: %d\n", numadded, numremoved));
+    KetamaRing *ring = KetamaRing_new( ketama, old->numpoints + numadded - numremoved );
+    mcs *out = ring->continuum;
+    a = 0;
+    r = 0;
+    for(int i = 0; i < old->numpoints; i++)
+    {
+        mcs *point = &(old->continuum[i]);
+        while ( a < numadded && Ketama_compare( &added[a], point ) < 0 ) {
+            *out++ = added[a++];
+        }
+        if ( r < numremoved && Ketama_compare( &removed[r], point ) == 0 ) {
+            r++;
+            continue;
+        }
+        *out++ = *point;
+    }
+    while ( a < numadded ) {
+        *out++ = added[a++];
+    }
+    assert(r == numremoved && out == ring->continuum + ring->numpoints);
+
+    Alloc_free(added, numadded * sizeof(mcs));
+    Alloc_free(removed, numremoved * sizeof(mcs));
 
+    Ketama_create_index( ring );
+    Ketama_cache_ring( ring );
+    Ketama_swap_ring( ketama, ring );
 }
 
 void Ketama_print_continuum( Ketama *ketama )
 {
     int a;
-    printf( "Numpoints in continuum: %d\n", ketama->numpoints );
+    KetamaRing *ring = Ketama_acquire_ring( ketama );
 
-    if ( ketama->continuum == NULL )
+    if ( ring == NULL )
     {
         printf( "Continuum empty\n" );
     }
     else
     {
-        for( a = 0; a < ketama->numpoints; a++ )
+        printf( "Numpoints in continuum: %d\n", ring->numpoints );
+        for( a = 0; a < ring->numpoints; a++ )
         {
-            printf( "%d (%u)\n", ketama->continuum[a].ordinal, ketama->continuum[a].point );
+            printf( "%d (%u)\n", ring->continuum[a].ordinal, ring->continuum[a].point );
         }
+        KetamaRing_release( ring );
     }
 }
 
+/* Orders by point, and by ordinal for equal points so that the order of the continuum does not depend on how it was
+ * built */
 int Ketama_compare( mcs *a, mcs *b )
 {
-    return ( a->point < b->point ) ?  -1 : ( ( a->point > b->point ) ? 1 : 0 );
+    if ( a->point != b->point ) {
+        return ( a->point < b->point ) ? -1 : 1;
+    }
+    return ( a->ordinal < b->ordinal ) ? -1 : ( ( a->ordinal > b->ordinal ) ? 1 : 0 );
+}
+
+static void Ketama_continuum_layout(continuum_header *header, KetamaRing *ring)
+{
+    memset(header, 0, sizeof(continuum_header));
+    memcpy(header->magic, CONTINUUM_MAGIC, sizeof(header->magic));
+    header->version = CONTINUUM_VERSION;
+    header->byte_order = CONTINUUM_BYTE_ORDER;
+    header->header_size = sizeof(continuum_header);
+    header->server_size = sizeof(serverinfo);
+    header->point_size = sizeof(mcs);
+    header->hash = ring->hash;
+    header->numservers = ring->numservers;
+    header->numpoints = ring->numpoints;
+    header->index_bits = ring->index_bits;
+    header->servers_offset = CONTINUUM_ALIGN(sizeof(continuum_header));
+    header->continuum_offset = CONTINUUM_ALIGN(header->servers_offset + (unsigned long long)ring->numservers * sizeof(serverinfo));
+    header->index_offset = CONTINUUM_ALIGN(header->continuum_offset + (unsigned long long)ring->numpoints * sizeof(mcs));
+    header->size = header->index_offset + ((1ULL << ring->index_bits) + 1) * sizeof(unsigned int);
+}
+
+static int Ketama_write_section(FILE *f, unsigned long long offset, const void *data, size_t size)
+{
+    static const char padding[8] = {0};
+    long pos = ftell(f);
+    if(pos < 0 || offset < pos || offset - pos > sizeof(padding)) {
+        return -1;
+    }
+    if(fwrite(padding, 1, offset - pos, f) != offset - pos) {
+        return -1;
+    }
+    if(size > 0 && fwrite(data, 1, size, f) != size) {
+        return -1;
+    }
+    return 0;
+}
+
+int Ketama_save_continuum(Ketama *ketama, const char *path)
+{
+    KetamaRing *ring = Ketama_acquire_ring(ketama);
+    if(ring == NULL) {
+        Module_set_error(GET_MODULE(), "No continuum to save, call Ketama_create_continuum first");
+        return -1;
+    }
+
+    continuum_header header;
+    Ketama_continuum_layout(&header, ring);
+
+    // write to a temporary file that is renamed when complete, so that other processes never map a partial file
+    size_t tmp_size = strlen(path) + 32;
+    char *tmp = Alloc_alloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.tmp.%d", path, (int)getpid());
+    int result = -1;
+    FILE *f = fopen(tmp, "wb");
+    if(f == NULL) {
+        Module_set_error(GET_MODULE(), "Could not create continuum file %s, errno: [%d] %s", tmp, errno, strerror(errno));
+    }
+    else {
+        int error = Ketama_write_section(f, 0, &header, sizeof(header)) ||
+                    Ketama_write_section(f, header.servers_offset, ring->servers, ring->numservers * sizeof(serverinfo)) ||
+                    Ketama_write_section(f, header.continuum_offset, ring->continuum, ring->numpoints * sizeof(mcs)) ||
+                    Ketama_write_section(f, header.index_offset, ring->index, ((1 << ring->index_bits) + 1) * sizeof(unsigned int));
+        if(fclose(f) != 0 || error) {
+            Module_set_error(GET_MODULE(), "Could not write continuum file %s, errno: [%d] %s", tmp, errno, strerror(errno));
+            unlink(tmp);
+        }
+        else if(rename(tmp, path) != 0) {
+            Module_set_error(GET_MODULE(), "Could not rename continuum file to %s, errno: [%d] %s", path, errno, strerror(errno));
+            unlink(tmp);
+        }
+        else {
+            result = 0;
+        }
+    }
+    Alloc_free(tmp, tmp_size);
+    KetamaRing_release(ring);
+    return result;
 }
 
+/**
+ * Checks that the header of a mapped continuum file of the given size describes a ring that can be used as is, and
+ * that its continuum and index are consistent.
+ */
+static int Ketama_check_continuum(const continuum_header *header, size_t size)
+{
+    if(size < sizeof(continuum_header) || memcmp(header->magic, CONTINUUM_MAGIC, sizeof(header->magic)) != 0) {
+        return -1;
+    }
+    if(header->version != CONTINUUM_VERSION || header->byte_order != CONTINUUM_BYTE_ORDER ||
+       header->header_size != sizeof(continuum_header) || header->server_size != sizeof(serverinfo) ||
+       header->point_size != sizeof(mcs)) {
+        return -1;
+    }
+    if(header->hash > KETAMA_HASH_MURMUR3 || header->numservers == 0 || header->numpoints > INT_MAX ||
+       header->index_bits < MIN_INDEX_BITS || header->index_bits > MAX_INDEX_BITS) {
+        return -1;
+    }
+    KetamaRing layout;
+    layout.hash = header->hash;
+    layout.numservers = header->numservers;
+    layout.numpoints = header->numpoints;
+    layout.index_bits = header->index_bits;
+    continuum_header expected;
+    Ketama_continuum_layout(&expected, &layout);
+    if(header->servers_offset != expected.servers_offset || header->continuum_offset != expected.continuum_offset ||
+       header->index_offset != expected.index_offset || header->size != expected.size || header->size != size) {
+        return -1;
+    }
+    const serverinfo *servers = (const serverinfo *)((const char *)header + header->servers_offset);
+    for(unsigned int i = 0; i < header->numservers; i++) {
+        if(memchr(servers[i].addr, '\0', ADDR_SIZE) == NULL) {
+            return -1;
+        }
+    }
+    // the lookups trust the continuum and the index, a point of a server that does not exist or an index entry past
+    // the end of the continuum would make them read out of bounds
+    const mcs *continuum = (const mcs *)((const char *)header + header->continuum_offset);
+    for(unsigned int i = 0; i < header->numpoints; i++) {
+        if(continuum[i].ordinal < 0 || continuum[i].ordinal >= header->numservers ||
+           (i > 0 && continuum[i].point < continuum[i - 1].point)) {
+            return -1;
+        }
+    }
+    const unsigned int *index = (const unsigned int *)((const char *)header + header->index_offset);
+    unsigned int buckets = 1U << header->index_bits;
+    for(unsigned int bucket = 0; bucket < buckets; bucket++) {
+        if(index[bucket] > index[bucket + 1]) {
+            return -1;
+        }
+    }
+    if(index[buckets] != header->numpoints) {
+        return -1;
+    }
+    return 0;
+}
+
+int Ketama_load_continuum(Ketama *ketama, const char *path)
+{
+    if(ketama->numservers > 0 || ketama->ring) {
+        Module_set_error(GET_MODULE(), "A continuum can only be loaded into a ketama without servers");
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        Module_set_error(GET_MODULE(), "Could not open continuum file %s, errno: [%d] %s", path, errno, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1) {
+        Module_set_error(GET_MODULE(), "Could not stat continuum file %s, errno: [%d] %s", path, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *map = (size >= sizeof(continuum_header)) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(map == MAP_FAILED || Ketama_check_continuum((const continuum_header *)map, size) == -1) {
+        Module_set_error(GET_MODULE(), "Invalid continuum file %s", path);
+        if(map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        return -1;
+    }
+
+    const continuum_header *header = (const continuum_header *)map;
+    KetamaRing *ring = Alloc_alloc_T(KetamaRing);
+    ring->refcount = 1;
+    ring->cached = 0;
+    ring->last_used = 0;
+    ring->hash = header->hash;
+    ring->numpoints = header->numpoints;
+    ring->numservers = header->numservers;
+    ring->continuum = (mcs *)((char *)map + header->continuum_offset);
+    ring->servers = (serverinfo *)((char *)map + header->servers_offset);
+    ring->index = (unsigned int *)((char *)map + header->index_offset);
+    ring->index_bits = header->index_bits;
+    ring->map = map;
+    ring->map_size = size;
+    KetamaRing_track(ring);
+
+    // the servers are copied, so that the ring can be updated like any other
+    ketama->maxservers = ring->numservers;
+    ketama->servers = Alloc_alloc(ring->numservers * sizeof(serverinfo));
+    memcpy(ketama->servers, ring->servers, ring->numservers * sizeof(serverinfo));
+    ketama->loads = Alloc_alloc(ring->numservers * sizeof(long));
+    memset(ketama->loads, 0, ring->numservers * sizeof(long));
+    ketama->numservers = ring->numservers;
+    for(int i = 0; i < ketama->numservers; i++) {
+        if(!ketama->servers[i].removed) {
+            ketama->numactive += 1;
+            ketama->memory += ketama->servers[i].memory;
+        }
+    }
+    ketama->hash = ring->hash;
+    Ketama_swap_ring(ketama, ring);
+    return 0;
+}
+
+/**
+ * Adds the range of hashes from start up to and including end to the ranges, if it changes owner, joining it with
+ * the previous range if that is adjacent and moves between the same servers.
+ */
+static void Ketama_add_range(Buffer *ranges, unsigned int start, unsigned int end, int from, int to)
+{
+    if(from == to) {
+        return;
+    }
+    size_t num_ranges = Buffer_position(ranges) / sizeof(KetamaRange);
+    if(num_ranges > 0) {
+        KetamaRange *last = ((KetamaRange *)Buffer_data(ranges)) + num_ranges - 1;
+        if(last->end + 1 == start && last->from == from && last->to == to) {
+            last->end = end;
+            return;
+        }
+    }
+    KetamaRange *range = (KetamaRange *)Buffer_extend(ranges, sizeof(KetamaRange));
+    range->start = start;
+    range->end = end;
+    range->from = from;
+    range->to = to;
+}
+
+int Ketama_diff_rings(KetamaRing *from, KetamaRing *to, KetamaRange **ranges, size_t *num_ranges)
+{
+    *ranges = NULL;
+    *num_ranges = 0;
+    if(from->hash != to->hash) {
+        Module_set_error(GET_MODULE(), "Can not compare rings that use a different hash");
+        return -1;
+    }
+    if(from->numpoints == 0 || to->numpoints == 0) {
+        Module_set_error(GET_MODULE(), "Can not compare rings without servers");
+        return -1;
+    }
+
+    // walk the points of both continuums in order, a hash belongs to the server of the first point at or after it, so
+    // between each pair of successive points (of either continuum) the owner in both rings is known
+    Buffer *buffer = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    mcs *a = from->continuum;
+    mcs *b = to->continuum;
+    int i = 0;
+    int j = 0;
+    unsigned int start = 0;
+    int wrapped = 0;
+    while ( i < from->numpoints || j < to->numpoints ) {
+        unsigned int point;
+        if ( j == to->numpoints || (i < from->numpoints && a[i].point < b[j].point) ) {
+            point = a[i].point;
+        }
+        else {
+            point = b[j].point;
+        }
+        int owner_from = (i < from->numpoints) ? a[i].ordinal : a[0].ordinal;
+        int owner_to = (j < to->numpoints) ? b[j].ordinal : b[0].ordinal;
+        Ketama_add_range(buffer, start, point, owner_from, owner_to);
+        while ( i < from->numpoints && a[i].point == point ) {
+            i++;
+        }
+        while ( j < to->numpoints && b[j].point == point ) {
+            j++;
+        }
+        if ( point == 0xFFFFFFFFU ) {
+            wrapped = 1;
+            break;
+        }
+        start = point + 1;
+    }
+    if ( !wrapped ) {
+        // the hashes after the last point belong to the first point of each continuum
+        Ketama_add_range(buffer, start, 0xFFFFFFFFU, a[0].ordinal, b[0].ordinal);
+    }
+
+    *num_ranges = Buffer_position(buffer) / sizeof(KetamaRange);
+    if(*num_ranges > 0) {
+        *ranges = Alloc_alloc(*num_ranges * sizeof(KetamaRange));
+        memcpy(*ranges, Buffer_data(buffer), *num_ranges * sizeof(KetamaRange));
+    }
+    Buffer_free(buffer);
+    return 0;
+}
+
+void Ketama_free_ranges(KetamaRange *ranges, size_t num_ranges)
+{
+    if(ranges != NULL) {
+        Alloc_free(ranges, num_ranges * sizeof(KetamaRange));
+    }
+}
@@ -35,6 +35,7 @@
 #include "common.h"
 
 void Ketama_print_continuum(Ketama *ketama);
+void Ketama_free_final();
 
 #endif
 
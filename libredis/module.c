@@ -14,8 +14,15 @@
 #include "module.h"
 #include "reply.h"
 #include "batch.h"
+#include "buffer.h"
+#include "scan.h"
+#include "hash.h"
+#include "ketama.h"
 
-Module g_module;
+Module g_module = {
+	.pool_max_chunks = DEFAULT_POOL_MAX_CHUNKS,
+	.pool_max_bytes = DEFAULT_POOL_MAX_BYTES
+};
 static THREADLOCAL char error[MAX_ERROR_SIZE];
 
 Module *Module_new()
@@ -37,6 +44,8 @@ int Module_init(Module *module)
 	if(module->alloc_free == NULL) {
 		module->alloc_free = free;
 	}
+	Scan_init();
+	Hash_init();
 	DEBUG(("start alloc: %d\n", module->allocated));
 	return 0;
 }
@@ -56,6 +65,16 @@ void Module_set_alloc_free(Module *module, void (*alloc_free)(void *))
 	module->alloc_free= alloc_free;
 }
 
+void Module_set_buffer_pool_max_chunks(Module *module, size_t max_chunks)
+{
+	module->pool_max_chunks = max_chunks;
+}
+
+void Module_set_buffer_pool_max_bytes(Module *module, size_t max_bytes)
+{
+	module->pool_max_bytes = max_bytes;
+}
+
 size_t Module_get_allocated(Module *module)
 {
 	return module->allocated;
@@ -80,9 +99,10 @@ void Module_free(Module *module)
 
 	DEBUG(("Module free\n"));
 	//release the freelists
-	Reply_free_final();
 //	Command_free_final();
 	Batch_free_final();
+	Buffer_free_final();
+	Ketama_free_final();
 
 	DEBUG(("final alloc: %d\n", module->allocated));
 }
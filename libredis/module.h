@@ -19,6 +19,8 @@ struct _Module
     void * (*alloc_realloc)(void *ptr, size_t size);
     void (*alloc_free)(void *ptr);
     size_t allocated;
+    size_t pool_max_chunks; //buffer pool retention caps
+    size_t pool_max_bytes;
 };
 
 extern Module g_module;
@@ -11,20 +11,34 @@
 #include <ctype.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "common.h"
 #include "alloc.h"
 #include "parser.h"
+#include "scan.h"
 
 #define MARK rp->mark = rp->p
+#define MAX_COUNT ((INT_MAX - 9) / 10)
+#define NO_RECORD ((size_t)-1)
+
+typedef struct _ReplyParserLevel
+{
+    size_t index; //index of the record of the aggregate reply, NO_RECORD if it is not recorded (lazy)
+    size_t remaining; //number of children still to read
+} ReplyParserLevel;
 
 struct _ReplyParser
 {
     size_t p; //position
     int cs; //state
-    int bulk_count; //number of chars to read for current binary safe bulk-value
-    int multibulk_count; //the number of bulk replies to read for the current multibulk reply
-    Reply *multibulk_reply;
+    int bulk_count; //number of chars to read for current binary safe bulk-value (or the count being read for an aggregate reply)
+    ReplyType type; //type of the reply being read
+
+    int depth; //number of aggregate replies (e.g. multibulk) we are currently in
+    int lazy_depth; //children at this depth and deeper are validated but not recorded, 0 if not in a lazy reply
+    ReplyParserLevel *stack; //the aggregate replies we are currently in, kept when the parser is reset
+    int stack_size;
 
     size_t mark; //helper to mark start of interesting data
 
@@ -35,10 +49,11 @@ void ReplyParser_reset(ReplyParser *rp)
     rp->p = 0;
     rp->cs = 0;  
     rp->bulk_count = 0;
+    rp->type = RT_NONE;
     rp->mark = 0;
 
-    rp->multibulk_count = 0;
-    rp->multibulk_reply = NULL;
+    rp->depth = 0;
+    rp->lazy_depth = 0;
 }
 
 ReplyParser *ReplyParser_new()
@@ -49,148 +64,307 @@ ReplyParser *ReplyParser_new()
 		Module_set_error(GET_MODULE(), "Out of memory while allocating ReplyParser");
 		return NULL;
 	}
+	rp->stack_size = REPLY_STACK_SIZE;
+	rp->stack = Alloc_alloc(sizeof(ReplyParserLevel) * rp->stack_size);
+	if(rp->stack == NULL) {
+		Alloc_free_T(rp, ReplyParser);
+		Module_set_error(GET_MODULE(), "Out of memory while allocating ReplyParser");
+		return NULL;
+	}
 	ReplyParser_reset(rp);
 	return rp;
 }
 
+size_t ReplyParser_position(ReplyParser *rp)
+{
+    return rp->p;
+}
+
+int ReplyParser_is_idle(ReplyParser *rp)
+{
+    //at the start of a (top-level) reply, so that parsing can continue from its position in another buffer
+    return rp->cs == 0 && rp->depth == 0;
+}
+
 void ReplyParser_free(ReplyParser *rp)
 {
 	if(rp == NULL) {
 		return;
 	}
 	DEBUG(("dealloc ReplyParser\n"));
+	Alloc_free(rp->stack, sizeof(ReplyParserLevel) * rp->stack_size);
 	Alloc_free_T(rp, ReplyParser);
 }
 
+/**
+ * Called when a reply (a scalar or an empty aggregate reply) has been read completely. Counts it as a child of the
+ * aggregate reply we are in, closing the aggregate replies that are completed by it.
+ * Returns 1 if this completed a top-level reply.
+ */
+static inline int ReplyParser_complete(ReplyParser *rp, ReplyArray *replies)
+{
+    while(rp->depth > 0) {
+        ReplyParserLevel *level = &rp->stack[rp->depth - 1];
+        level->remaining -= 1;
+        if(level->remaining > 0) {
+            return 0;
+        }
+        if(level->index != NO_RECORD) {
+            ReplyArray_close(replies, level->index);
+        }
+        rp->depth -= 1;
+        if(rp->depth < rp->lazy_depth) {
+            rp->lazy_depth = 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Records a reply that has no children (anything but a non-empty aggregate reply).
+ * Returns 1 if this completed a top-level reply.
+ */
+static inline int ReplyParser_scalar(ReplyParser *rp, ReplyArray *replies, ReplyType type, size_t offset, size_t len)
+{
+    if(!rp->lazy_depth) {
+        ReplyArray_add(replies, type, offset, len, rp->depth);
+    }
+    return ReplyParser_complete(rp, replies);
+}
+
+/**
+ * Records the start of an aggregate reply (multibulk, map, set or push) with count elements, rp->p must be at its first child.
+ * A map has 2 children (key and value) for every element.
+ * Returns 1 if this completed a top-level reply (e.g. an empty multibulk reply), 0 if not and -1 if the reply is nested too deep
+ * (more than REPLY_MAX_DEPTH) or the stack could not grow.
+ */
+static inline int ReplyParser_aggregate(ReplyParser *rp, ReplyArray *replies, ReplyType type, size_t count)
+{
+    size_t children = (type == RT_MAP) ? count * 2 : count;
+    if(children == 0) {
+        return ReplyParser_scalar(rp, replies, type, 0, 0);
+    }
+    if(rp->depth == rp->stack_size) {
+        if(rp->depth == REPLY_MAX_DEPTH) {
+            return -1;
+        }
+        //nested deeper than ever before, grow the stack
+        int stack_size = MIN(rp->stack_size * 2, REPLY_MAX_DEPTH);
+        ReplyParserLevel *stack = Alloc_realloc(rp->stack, sizeof(ReplyParserLevel) * stack_size, sizeof(ReplyParserLevel) * rp->stack_size);
+        if(stack == NULL) {
+            return -1;
+        }
+        rp->stack = stack;
+        rp->stack_size = stack_size;
+    }
+    ReplyParserLevel *level = &rp->stack[rp->depth];
+    level->remaining = children;
+    level->index = NO_RECORD;
+    if(!rp->lazy_depth) {
+        level->index = ReplyArray_add(replies, type, 0, children, rp->depth);
+        if(replies->lazy_threshold > 0 && children >= replies->lazy_threshold) {
+            //only record where the children start, they are decoded when iterated
+            Reply *reply = ReplyArray_get(replies, level->index);
+            reply->offset = rp->p;
+            reply->flags |= REPLY_LAZY;
+            rp->lazy_depth = rp->depth + 1;
+        }
+    }
+    rp->depth += 1;
+    return 0;
+}
+
+static inline ReplyType ReplyParser_line_type(Byte c)
+{
+    switch(c) {
+    case '+': return RT_OK;
+    case '-': return RT_ERROR;
+    case ':': return RT_INTEGER;
+    case ',': return RT_DOUBLE;
+    case '#': return RT_BOOLEAN;
+    case '(': return RT_BIG_NUMBER;
+    case '_': return RT_NIL;
+    default: return RT_NONE;
+    }
+}
+
+static inline ReplyType ReplyParser_bulk_type(Byte c)
+{
+    switch(c) {
+    case '$': return RT_BULK;
+    case '!': return RT_ERROR;
+    case '=': return RT_VERBATIM;
+    default: return RT_NONE;
+    }
+}
+
+static inline ReplyType ReplyParser_aggregate_type(Byte c)
+{
+    switch(c) {
+    case '*': return RT_MULTIBULK;
+    case '%': return RT_MAP;
+    case '~': return RT_SET;
+    case '>': return RT_PUSH;
+    default: return RT_NONE;
+    }
+}
 
 /**
- * A State machine for parsing Redis replies.
+ * A State machine for parsing Redis replies, both RESP2 and RESP3.
  * State is kept in the ReplyParser instance rp. The execute method can be called over and over
  * again parsing evermore Replies from the given buffer.
  * The method returns with RPR_ERROR if there is an error in the stream,
  * RPR_MORE if it is not in an end-state, but the buffer ran out, indicating that more
  * data needs to be read.
- * Finally it returns RPR_REPLY everytime a valid Redis reply is parsed from the buffer, returning an instance
- * of Reply in the 'reply' out parameter.
+ * Finally it returns RPR_REPLY everytime a valid Redis reply is parsed from the buffer. The reply (and for an aggregate reply
+ * its children) will have been added to 'replies' as the records following the last committed one.
  * 0 is the initial state, and after reading a valid reply, the machine will return to this state, ready to parse
  * a new reply.
- * states: 0->1->2 => single line positive reply (+OK\r\n)
- * 		   0->3->4 => single line negative reply (-Some error msg\r\n)
+ * states: 0->1->2 => single line reply (+OK\r\n, -Some error msg\r\n, :42\r\n, ,3.14\r\n, #t\r\n, (12345\r\n, _\r\n)
  * 	       0->5->6->7->8 => nil bulk reply ($-1\r\n)
- * 		   0->5->9->10->11->12 => bulk reply ($5\r\nblaat\r\n)
+ * 		   0->5->9->10->11->12 => bulk reply ($5\r\nblaat\r\n, also blob error !5\r\n... and verbatim =9\r\ntxt:blaat\r\n)
  * 		   0->13->14->15->16 => nil multibulk reply (*-1\r\n)
- * 		   0->13->17->18 => multibulk reply (*3\r\n (... bulk replies ...)
- * 		   0->19->20 => integer reply (:42\r\n)
+ * 		   0->13->17->18 => aggregate reply (*3\r\n, %2\r\n, ~3\r\n or >3\r\n followed by its children)
+ * The children of an aggregate reply can be any reply again, to any depth. The aggregate replies we are in are kept on a stack
+ * that grows as needed and is kept when the parser is reset, so that parsing does not allocate per level.
+ * If the replies have a lazy threshold set, the children of aggregate replies with at least that many children are validated
+ * but not recorded. Instead the aggregate reply records the offset of its first child and the children are decoded
+ * using ReplyParser_decode when they are iterated.
+ * Bulk and aggregate headers that are completely available in the buffer are parsed in one step (see Scan_length), and
+ * bulk replies that are completely available are recorded directly from state 0. The remaining states handle replies
+ * that are split over reads.
+ * RESP3 attributes and streamed strings/aggregates are not supported (Redis does not send these).
  * Note that it is not a 'pure' state machine (from a language theory perspective), e.g. some additional state is kept to
- * keep track of the number of chars to still read in a bulk reply, and some state to keep track of bulk replies that
- * belong to a multibulk reply.
+ * keep track of the number of chars to still read in a bulk reply, and some state to keep track of the aggregate
+ * replies we are in.
  */
-ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t len, Reply **reply)
+ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t len, ReplyArray *replies)
 {    
 	DEBUG(("enter rp exec, rp->p: %d, len: %d, cs: %d\n", rp->p, len, rp->cs));
 	assert(rp->p <= len);
+    Byte *data = Buffer_data(buffer);
     while((rp->p) < len) {
-    	*reply = NULL;
-    	Byte c = Buffer_data(buffer)[rp->p];
+    	Byte c = data[rp->p];
         //printf("cs: %d, char: %d\n", rp->cs, c);
         switch(rp->cs) {
             case 0: { //initial state
-                if(c == '$') { //possible start of bulk-reply
+                ReplyType type;
+                if((type = (c == '$') ? RT_BULK : ReplyParser_bulk_type(c)) != RT_NONE) { //possible start of bulk-reply
+                    long n;
+                    int l = Scan_length(data + rp->p + 1, len - rp->p - 1, &n);
+                    if(l < 0) {
+                        break;
+                    }
+                    else if(l > 0) {
+                        size_t offset = rp->p + 1 + l;
+                        if(data[rp->p + 1] == '-') { //nil bulk reply
+                            if(n != -1 || type != RT_BULK) {
+                                break;
+                            }
+                            rp->p = offset;
+                            if(ReplyParser_scalar(rp, replies, RT_BULK_NIL, 0, 0)) {
+                                return RPR_REPLY;
+                            }
+                            continue;
+                        }
+                        else if(offset + n + 2 <= len) { //complete bulk reply in buffer
+                            if(data[offset + n] != CR || data[offset + n + 1] != LF) {
+                                break;
+                            }
+                            rp->p = offset + n + 2;
+                            if(ReplyParser_scalar(rp, replies, type, offset, n)) {
+                                return RPR_REPLY;
+                            }
+                            continue;
+                        }
+                    }
+                    rp->type = type;
                     rp->p++;
                     rp->cs = 5;
                     continue;
                 }
-                else if(rp->multibulk_count == 0) { 
-                	//the replies below only match when we are NOT in a multibulk reply.
-                    if(c == '+') {
-                    	//possible start of positive single line server reply (e.g. +OK\r\n)
-                        rp->p++;
-                        rp->cs = 1;
-                        MARK;
-                        continue;
-                    }
-                    else if(c == '-') { //negative
-                    	//possible start of negative single line server reply (e.g. -Some error message\r\n)
-                    	rp->p++;
-                        rp->cs = 3;
-                        MARK;
-                        continue;
+                else if((type = ReplyParser_line_type(c)) != RT_NONE) {
+                    //possible start of single line reply (e.g. +OK\r\n)
+                    rp->type = type;
+                    rp->p++;
+                    rp->cs = 1;
+                    MARK;
+                    continue;
+                }
+                else if((type = ReplyParser_aggregate_type(c)) != RT_NONE) {
+                    //possible start of aggregate reply
+                    long n;
+                    int l = Scan_length(data + rp->p + 1, len - rp->p - 1, &n);
+                    if(l < 0) {
+                        break;
                     }
-                    else if(c == '*') {
-                    	//possible start of multibulk reply
-                        rp->p++;
-                        rp->cs = 13;
+                    else if(l > 0) {
+                        int nil = data[rp->p + 1] == '-';
+                        rp->p += 1 + l;
+                        if(nil) {
+                            if(n != -1 || type != RT_MULTIBULK) {
+                                break;
+                            }
+                            if(ReplyParser_scalar(rp, replies, RT_MULTIBULK_NIL, 0, 0)) {
+                                return RPR_REPLY;
+                            }
+                            continue;
+                        }
+                        if(n > MAX_COUNT) {
+                            break;
+                        }
+                        int res = ReplyParser_aggregate(rp, replies, type, n);
+                        if(res == -1) {
+                            break;
+                        }
+                        else if(res == 1) {
+                            return RPR_REPLY;
+                        }
                         continue;
                     }
-                    else if(c == ':') {
-                    	//possible start of integer reply
-                    	rp->p++;
-                    	rp->cs = 19;
-                    	MARK;
-                    	continue;
-                    }
+                    rp->type = type;
+                    rp->p++;
+                    rp->cs = 13;
+                    continue;
                 }
                 break; 
             }
             //term CRLF of single line reply
             case 1: {
-                if(c == CR) {
+                rp->p += Scan_find_cr(data + rp->p, len - rp->p);
+                if(rp->p < len) {
                     rp->p++;
                     rp->cs = 2;
-                    continue;
                 }
-                else {
-                    rp->p++;
-                    continue;
-                }
-                break;
+                continue;
             }
             case 2: {
                 if(c == LF) {
+                    size_t line_len = rp->p - rp->mark - 1;
+                    if(rp->type == RT_NIL && line_len != 0) {
+                        break;
+                    }
                     rp->p++;
                     rp->cs = 0;
                     //report line data
-                    *reply = Reply_new(RT_OK, buffer, rp->mark, rp->p - rp->mark - 2);
-                    return RPR_REPLY;
-                }
-                break;
-            }
-            //end term CRLF of single line reply
-
-            //term CRLF of error line reply
-            case 3: {
-                if(c == CR) {
-                    rp->p++;
-                    rp->cs = 4;
-                    continue;
-                }
-                else {
-                    rp->p++;
+                    if(ReplyParser_scalar(rp, replies, rp->type, rp->mark, line_len)) {
+                        return RPR_REPLY;
+                    }
                     continue;
                 }
                 break;
             }
-            case 4: {
-                if(c == LF) {
-                    rp->p++;
-                    rp->cs = 0;
-                    //report error line data
-                    *reply = Reply_new(RT_ERROR, buffer, rp->mark, rp->p - rp->mark - 2);
-                    return RPR_REPLY;
-                }
-                break;
-            }
             //end term CRLF of single line reply
 
             //start bulk reply
             case 5: {
-                if(c == '-') { //nill bulk reply
+                if(c == '-' && rp->type == RT_BULK) { //nill bulk reply
                     rp->p++;
                     rp->cs = 6; 
                     continue;
                 }
                 else if(isdigit(c)) { //normal bulk reply
-                    MARK;
+                    rp->bulk_count = c - '0';
                     rp->p++;
                     rp->cs = 9;
                     continue;
@@ -218,23 +392,10 @@ ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t le
                 if(c == LF) {
                     rp->p++;
                     rp->cs = 0;
-                    *reply = Reply_new(RT_BULK_NIL, buffer, 0, 0);
-                    if(rp->multibulk_count > 0) {
-                        rp->multibulk_count -= 1;
-                        assert(rp->multibulk_reply != NULL);
-                        Reply_add_child(rp->multibulk_reply, *reply);
-                        if(rp->multibulk_count == 0) {
-                        	*reply = rp->multibulk_reply;
-                        	rp->multibulk_reply = NULL;
-                        	return RPR_REPLY;
-                        }
-                        else {
-                        	continue;
-                        }
-                    }
-                    else {
+                    if(ReplyParser_scalar(rp, replies, RT_BULK_NIL, 0, 0)) {
                         return RPR_REPLY;
                     }
+                    continue;
                 }
                 break;
             }
@@ -242,12 +403,12 @@ ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t le
             //start normal bulk reply
             case 9: {
                 if(c == CR) { //end of digits
-                    rp->bulk_count = atoi(Buffer_data(buffer) + rp->mark);
                     rp->p++;
                     rp->cs = 10;
                     continue;
                 }
-                else if(isdigit(c)) { //one more digit
+                else if(isdigit(c) && rp->bulk_count <= MAX_COUNT) { //one more digit
+                    rp->bulk_count = (rp->bulk_count * 10) + (c - '0');
                     rp->p++;
                     continue;
                 }
@@ -282,35 +443,22 @@ ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t le
                     assert(rp->bulk_count == 0);
                     rp->p++;
                     rp->cs = 0;
-                    *reply = Reply_new(RT_BULK, buffer, rp->mark, rp->p - rp->mark - 2);
-                    if(rp->multibulk_count > 0) {
-                        rp->multibulk_count -= 1;
-                        assert(rp->multibulk_reply != NULL);
-                        Reply_add_child(rp->multibulk_reply, *reply);
-                        if(rp->multibulk_count == 0) {
-                        	*reply = rp->multibulk_reply;
-                        	rp->multibulk_reply = NULL;
-                        	return RPR_REPLY;
-                        }
-                        else {
-                        	continue;
-                        }
-                    }
-                    else {
+                    if(ReplyParser_scalar(rp, replies, rp->type, rp->mark, rp->p - rp->mark - 2)) {
                         return RPR_REPLY;
                     }
+                    continue;
                 }
                 break;
             }
-            //start multibulk reply
+            //start aggregate reply
             case 13: {
-                if(c == '-') { //nil multibulk reply
+                if(c == '-' && rp->type == RT_MULTIBULK) { //nil multibulk reply
                     rp->p++;
                     rp->cs = 14; 
                     continue;
                 }
-                else if(isdigit(c)) { //normal multibulk reply
-                    MARK;
+                else if(isdigit(c)) { //normal aggregate reply
+                    rp->bulk_count = c - '0';
                     rp->p++;
                     rp->cs = 17;
                     continue;
@@ -338,21 +486,22 @@ ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t le
                 if(c == LF) {
                     rp->p++;
                     rp->cs = 0;
-                    *reply = Reply_new(RT_MULTIBULK_NIL, NULL, 0, 0);
-                    return RPR_REPLY;
+                    if(ReplyParser_scalar(rp, replies, RT_MULTIBULK_NIL, 0, 0)) {
+                        return RPR_REPLY;
+                    }
+                    continue;
                 }
                 break;
             }
-            //start normal multibulk reply
+            //start normal aggregate reply
             case 17: {
                 if(c == CR) { //end of digits
-                    rp->multibulk_count = atoi(Buffer_data(buffer) + rp->mark);
-                    rp->multibulk_reply = Reply_new(RT_MULTIBULK, NULL, 0, rp->multibulk_count);
                     rp->p++;
                     rp->cs = 18;
                     continue;
                 }
-                else if(isdigit(c)) { //one more digit
+                else if(isdigit(c) && rp->bulk_count <= MAX_COUNT) { //one more digit
+                    rp->bulk_count = (rp->bulk_count * 10) + (c - '0');
                     rp->p++;
                     continue;
                 }
@@ -362,38 +511,19 @@ ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t le
                 if(c == LF) {
                     rp->p++;
                     rp->cs = 0;
-	            if(rp->multibulk_count == 0) {
-			//multi bulk reply with 0 entries
-                	*reply = rp->multibulk_reply;
-                	rp->multibulk_reply = NULL;
-                	return RPR_REPLY;
+                    int count = rp->bulk_count;
+                    rp->bulk_count = 0;
+                    int res = ReplyParser_aggregate(rp, replies, rp->type, count);
+                    if(res == -1) {
+                        break;
+                    }
+                    else if(res == 1) {
+                        //aggregate reply with 0 entries
+                        return RPR_REPLY;
                     }
                     continue;
                 }
                 break;
-            }
-			//integer reply
-            case 19: {
-                if(c == CR) {
-                    rp->p++;
-                    rp->cs = 20;
-                    continue;
-                }
-                else {
-                    rp->p++;
-                    continue;
-                }
-                break;
-            }
-            case 20: {
-                if(c == LF) {
-                    rp->p++;
-                    rp->cs = 0;
-                    //report integer data
-                    *reply = Reply_new(RT_INTEGER, buffer, rp->mark, rp->p - rp->mark - 2);
-                    return RPR_REPLY;
-                }
-                break;
             }
         }
         return RPR_ERROR;
@@ -403,3 +533,66 @@ ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t le
     return RPR_MORE;
 }
 
+
+/**
+ * Decodes the reply at position *pos in data. The reply must have been validated by ReplyParser_execute before
+ * (e.g. the children of a lazy aggregate reply). Fills in the reply type, offset and length of its data
+ * like a Reply record, and advances *pos to the next reply. For an aggregate reply that is its first child.
+ */
+void ReplyParser_decode(Byte *data, size_t *pos, ReplyType *type, size_t *offset, size_t *len)
+{
+    size_t p = *pos;
+    Byte c = data[p++];
+    ReplyType t;
+    if((t = ReplyParser_line_type(c)) != RT_NONE) {
+        *type = t;
+        *offset = p;
+        while(data[p] != CR) {
+            p++;
+        }
+        *len = p - *offset;
+        *pos = p + 2;
+        return;
+    }
+    if(data[p] == '-') { //nil bulk or multibulk (-1\r\n)
+        *type = (c == '$') ? RT_BULK_NIL : RT_MULTIBULK_NIL;
+        *offset = 0;
+        *len = 0;
+        *pos = p + 4;
+        return;
+    }
+    size_t n = 0;
+    while(data[p] != CR) {
+        n = (n * 10) + (data[p++] - '0');
+    }
+    p += 2;
+    if((t = ReplyParser_bulk_type(c)) != RT_NONE) {
+        *type = t;
+        *offset = p;
+        *len = n;
+        *pos = p + n + 2;
+        return;
+    }
+    //aggregate, the children follow
+    *type = ReplyParser_aggregate_type(c);
+    *offset = 0;
+    *len = (*type == RT_MAP) ? n * 2 : n;
+    *pos = p;
+}
+
+/**
+ * Advances *pos past the reply at *pos, including all of its children.
+ */
+void ReplyParser_skip(Byte *data, size_t *pos)
+{
+    size_t remaining = 1;
+    while(remaining > 0) {
+        ReplyType type;
+        size_t offset, len;
+        ReplyParser_decode(data, pos, &type, &offset, &len);
+        remaining -= 1;
+        if(Reply_is_aggregate(type)) {
+            remaining += len;
+        }
+    }
+}
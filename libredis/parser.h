@@ -23,7 +23,11 @@ typedef enum _ReplyParserResult
 ReplyParser *ReplyParser_new();
 void ReplyParser_reset(ReplyParser *rp);
 void ReplyParser_free(ReplyParser *rp);
+size_t ReplyParser_position(ReplyParser *rp);
+int ReplyParser_is_idle(ReplyParser *rp);
 
-ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t len, Reply **reply);
+ReplyParserResult ReplyParser_execute(ReplyParser *rp, Buffer *buffer, size_t len, ReplyArray *replies);
+void ReplyParser_decode(Byte *data, size_t *pos, ReplyType *type, size_t *offset, size_t *len);
+void ReplyParser_skip(Byte *data, size_t *pos);
 
 #endif
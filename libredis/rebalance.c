@@ -0,0 +1,388 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Moves the keys whose server changed between two ketama rings, e.g. after adding a server.
+ * Only the servers that lose hash ranges (see Ketama_diff_rings) are scanned. Each round SCANs a page of keys on all
+ * of them, and moves the keys that now belong to another server with pipelined DUMP/PTTL, RESTORE and DEL batches, the
+ * batches of each step being executed on all servers in parallel. Keys are hashed whole, like Ketama_get_server_ordinal
+ * does, or by their hash tag like ShardedBatch does, depending on how the clients place them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "batch.h"
+#include "buffer.h"
+#include "sharded.h"
+
+#define MIGRATE_DEFAULT_SCAN_COUNT 100
+
+#define KEY_PENDING 0
+#define KEY_RESTORED 1 //restored on the target
+#define KEY_EXISTS 2 //not restored because the target already has the key, which was written after the ring changed
+#define KEY_GONE 3 //expired or deleted on the source before it could be dumped
+
+typedef struct _MigrateKey
+{
+    const char *key; //points into the reply to the SCAN
+    size_t key_len;
+    int source;
+    int target;
+    size_t dump; //index of the reply to the DUMP in the batch of the source (PTTL follows)
+    size_t restore; //index of the reply to the RESTORE in the batch of the target
+    int state;
+} MigrateKey;
+
+typedef struct _Migration
+{
+    KetamaRing *from;
+    KetamaRing *to;
+    Connection **connections;
+    int hash_tags; //hash only the {hash tag} of keys that have one
+    int num_servers;
+    int scan_count;
+    int timeout_ms;
+    int *scanning; //for each server, whether it loses ranges and has not been scanned completely
+    char (*cursors)[32]; //for each server, the SCAN cursor
+    size_t *counts; //for each server, the number of commands written in the current step
+    Batch **scans; //for each server, the batch with the current page of keys
+    Batch **dumps; //for each server, the DUMP/PTTL batch of the current round
+    Batch **batches; //for each server, the batch of the RESTORE and the DEL step
+    Buffer *keys; //MigrateKey for each key to move in this round
+    long moved;
+} Migration;
+
+static Batch *Migration_batch(Batch **batches, int server)
+{
+    if(batches[server] == NULL) {
+        batches[server] = Batch_new();
+    }
+    return batches[server];
+}
+
+static void Migration_free_batches(Migration *migration, Batch **batches)
+{
+    for(int i = 0; i < migration->num_servers; i++) {
+        if(batches[i] != NULL) {
+            Batch_free(batches[i]);
+            batches[i] = NULL;
+        }
+    }
+    memset(migration->counts, 0, migration->num_servers * sizeof(size_t));
+}
+
+/**
+ * Executes the batches that have commands on their connections, returns 0 if all completed without error.
+ */
+static int Migration_execute(Migration *migration, Batch **batches)
+{
+    Executor *executor = Executor_new();
+    int num_batches = 0;
+    for(int i = 0; i < migration->num_servers; i++) {
+        if(batches[i] != NULL && Batch_has_command(batches[i])) {
+            if(-1 == Executor_add(executor, migration->connections[i], batches[i])) {
+                Executor_free(executor);
+                return -1;
+            }
+            num_batches++;
+        }
+    }
+    int res = (num_batches > 0) ? Executor_execute(executor, migration->timeout_ms) : 1;
+    Executor_free(executor);
+    if(res == 0) {
+        Module_set_error(GET_MODULE(), "Timeout while migrating keys");
+    }
+    if(res != 1) {
+        return -1;
+    }
+    for(int i = 0; i < migration->num_servers; i++) {
+        if(batches[i] != NULL && Batch_error(batches[i]) != NULL) {
+            Module_set_error(GET_MODULE(), "Error while migrating keys: %s", Batch_error(batches[i]));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int Migration_scan_error(Migration *migration, int source)
+{
+    Module_set_error(GET_MODULE(), "Unexpected reply to SCAN from %s", KetamaRing_get_server_address(migration->from, source));
+    return -1;
+}
+
+/**
+ * Reads the page of keys that the source replied to SCAN and stores the next cursor. The keys that belong to another
+ * server in the new ring are added to the keys of the round, with a DUMP and PTTL for each in the batch of the source.
+ */
+static int Migration_read_scan(Migration *migration, int source)
+{
+    Batch *scan = migration->scans[source];
+    ReplyType type;
+    char *data;
+    size_t len;
+    size_t num_keys;
+    if(Batch_next_reply(scan, &type, &data, &len) != 1 || type != RT_MULTIBULK || len != 2 ||
+       Batch_next_reply(scan, &type, &data, &len) != 2 || type != RT_BULK || len >= sizeof(migration->cursors[source])) {
+        return Migration_scan_error(migration, source);
+    }
+    memcpy(migration->cursors[source], data, len);
+    migration->cursors[source][len] = '\0';
+    if(strcmp(migration->cursors[source], "0") == 0) {
+        migration->scanning[source] = 0;
+    }
+    if(Batch_next_reply(scan, &type, &data, &num_keys) != 2 || type != RT_MULTIBULK) {
+        return Migration_scan_error(migration, source);
+    }
+    if(num_keys == 0) {
+        return 0;
+    }
+
+    //hash the keys (or their hash tags) on both rings, several at a time
+    const char **keys = Alloc_alloc(num_keys * sizeof(char *));
+    size_t *key_lens = Alloc_alloc(num_keys * sizeof(size_t));
+    const char **tags = Alloc_alloc(num_keys * sizeof(char *));
+    size_t *tag_lens = Alloc_alloc(num_keys * sizeof(size_t));
+    int *before = Alloc_alloc(num_keys * sizeof(int));
+    int *after = Alloc_alloc(num_keys * sizeof(int));
+    size_t n = 0;
+    while(n < num_keys && Batch_next_reply(scan, &type, &data, &len) == 3) {
+        if(type == RT_BULK) {
+            keys[n] = data;
+            key_lens[n] = len;
+            tag_lens[n] = len;
+            tags[n] = migration->hash_tags ? Sharded_hash_tag(data, &tag_lens[n]) : data;
+            n++;
+        }
+    }
+    KetamaRing_get_server_ordinals(migration->from, tags, tag_lens, before, n);
+    KetamaRing_get_server_ordinals(migration->to, tags, tag_lens, after, n);
+
+    Batch *dumps = Migration_batch(migration->dumps, source);
+    for(size_t i = 0; i < n; i++) {
+        //a key that the old ring does not place on the source was not moved by a previous migration, leave it
+        if(before[i] != source || after[i] == source || after[i] < 0) {
+            continue;
+        }
+        MigrateKey *key = (MigrateKey *)Buffer_extend(migration->keys, sizeof(MigrateKey));
+        key->key = keys[i];
+        key->key_len = key_lens[i];
+        key->source = source;
+        key->target = after[i];
+        key->dump = migration->counts[source];
+        key->restore = 0;
+        key->state = KEY_PENDING;
+        const char *argv[] = {"DUMP", keys[i]};
+        const size_t argvlen[] = {4, key_lens[i]};
+        Batch_write_command(dumps, 2, argv, argvlen);
+        argv[0] = "PTTL";
+        Batch_write_command(dumps, 2, argv, argvlen);
+        migration->counts[source] += 2;
+    }
+
+    Alloc_free(keys, num_keys * sizeof(char *));
+    Alloc_free(key_lens, num_keys * sizeof(size_t));
+    Alloc_free(tags, num_keys * sizeof(char *));
+    Alloc_free(tag_lens, num_keys * sizeof(size_t));
+    Alloc_free(before, num_keys * sizeof(int));
+    Alloc_free(after, num_keys * sizeof(int));
+    return 0;
+}
+
+/**
+ * Writes a RESTORE into the batch of the target for each dumped key, keeping the remaining time to live.
+ * RESTORE does not REPLACE, if a client already wrote the key on the target using the new ring, that value wins.
+ */
+static void Migration_write_restores(Migration *migration, MigrateKey *keys, size_t num_keys)
+{
+    char ttl[32];
+    for(size_t i = 0; i < num_keys; i++) {
+        MigrateKey *key = &keys[i];
+        ReplyType dump_type, pttl_type;
+        char *payload, *pttl;
+        size_t payload_len, pttl_len;
+        Batch *dumps = migration->dumps[key->source];
+        Batch_reply_at(dumps, key->dump, &dump_type, &payload, &payload_len);
+        Batch_reply_at(dumps, key->dump + 1, &pttl_type, &pttl, &pttl_len);
+        if(dump_type != RT_BULK || pttl_type != RT_INTEGER) {
+            key->state = KEY_GONE;
+            continue;
+        }
+        long ms = strtol(pttl, NULL, 10);
+        if(ms == -2) {
+            key->state = KEY_GONE; //expired in between
+            continue;
+        }
+        size_t ttl_len = snprintf(ttl, sizeof(ttl), "%ld", ms < 0 ? 0 : ms);
+        const char *argv[] = {"RESTORE", key->key, ttl, payload};
+        const size_t argvlen[] = {7, key->key_len, ttl_len, payload_len};
+        Batch_write_command(Migration_batch(migration->batches, key->target), 4, argv, argvlen);
+        key->restore = migration->counts[key->target]++;
+    }
+}
+
+/**
+ * Reads the replies to the RESTOREs, and writes a DEL into the batch of the source for each key that is now on its
+ * target. Returns -1 if a key could not be restored.
+ */
+static int Migration_read_restores(Migration *migration, MigrateKey *keys, size_t num_keys, Batch **deletes)
+{
+    for(size_t i = 0; i < num_keys; i++) {
+        MigrateKey *key = &keys[i];
+        if(key->state == KEY_GONE) {
+            continue;
+        }
+        ReplyType type;
+        char *data;
+        size_t len;
+        Batch_reply_at(migration->batches[key->target], key->restore, &type, &data, &len);
+        if(type == RT_OK) {
+            key->state = KEY_RESTORED;
+            migration->moved++;
+        }
+        else if(type == RT_ERROR && len >= 7 && strncmp(data, "BUSYKEY", 7) == 0) {
+            key->state = KEY_EXISTS;
+        }
+        else {
+            Module_set_error(GET_MODULE(), "Could not restore key on %s: %.*s",
+                    KetamaRing_get_server_address(migration->to, key->target), (int)len, data ? data : "");
+            return -1;
+        }
+        const char *argv[] = {"DEL", key->key};
+        const size_t argvlen[] = {3, key->key_len};
+        Batch_write_command(Migration_batch(deletes, key->source), 2, argv, argvlen);
+    }
+    return 0;
+}
+
+/**
+ * Executes one round of the migration: scan a page on every server that is still scanning, then move the keys found.
+ */
+static int Migration_round(Migration *migration)
+{
+    for(int i = 0; i < migration->num_servers; i++) {
+        if(migration->scanning[i]) {
+            char count[32];
+            const char *argv[] = {"SCAN", migration->cursors[i], "COUNT", count};
+            const size_t argvlen[] = {4, strlen(migration->cursors[i]), 5, snprintf(count, sizeof(count), "%d", migration->scan_count)};
+            Batch_write_command(Migration_batch(migration->scans, i), 4, argv, argvlen);
+        }
+    }
+    if(-1 == Migration_execute(migration, migration->scans)) {
+        return -1;
+    }
+
+    Buffer_clear(migration->keys);
+    for(int i = 0; i < migration->num_servers; i++) {
+        if(migration->scans[i] != NULL && -1 == Migration_read_scan(migration, i)) {
+            return -1;
+        }
+    }
+    size_t num_keys = Buffer_position(migration->keys) / sizeof(MigrateKey);
+    if(num_keys == 0) {
+        return 0;
+    }
+    MigrateKey *keys = (MigrateKey *)Buffer_data(migration->keys);
+    memset(migration->counts, 0, migration->num_servers * sizeof(size_t));
+    if(-1 == Migration_execute(migration, migration->dumps)) {
+        return -1;
+    }
+
+    Migration_write_restores(migration, keys, num_keys);
+    if(-1 == Migration_execute(migration, migration->batches)) {
+        return -1;
+    }
+
+    Batch **deletes = Alloc_alloc(migration->num_servers * sizeof(Batch *));
+    memset(deletes, 0, migration->num_servers * sizeof(Batch *));
+    int res = Migration_read_restores(migration, keys, num_keys, deletes);
+    if(res == 0) {
+        res = Migration_execute(migration, deletes);
+    }
+    Migration_free_batches(migration, deletes);
+    Alloc_free(deletes, migration->num_servers * sizeof(Batch *));
+    return res;
+}
+
+long Ketama_migrate(KetamaRing *from, KetamaRing *to, Connection **connections, int hash_tags, int scan_count,
+        int timeout_ms)
+{
+    KetamaRange *ranges;
+    size_t num_ranges;
+    if(-1 == Ketama_diff_rings(from, to, &ranges, &num_ranges)) {
+        return -1;
+    }
+
+    Migration migration;
+    memset(&migration, 0, sizeof(migration));
+    migration.from = from;
+    migration.to = to;
+    migration.connections = connections;
+    migration.hash_tags = hash_tags;
+    migration.num_servers = KetamaRing_get_server_count(from);
+    if(KetamaRing_get_server_count(to) > migration.num_servers) {
+        migration.num_servers = KetamaRing_get_server_count(to);
+    }
+    migration.scan_count = scan_count > 0 ? scan_count : MIGRATE_DEFAULT_SCAN_COUNT;
+    migration.timeout_ms = timeout_ms;
+
+    size_t n = migration.num_servers;
+    migration.scanning = Alloc_alloc(n * sizeof(int));
+    migration.cursors = Alloc_alloc(n * sizeof(migration.cursors[0]));
+    migration.counts = Alloc_alloc(n * sizeof(size_t));
+    migration.scans = Alloc_alloc(n * sizeof(Batch *));
+    migration.dumps = Alloc_alloc(n * sizeof(Batch *));
+    migration.batches = Alloc_alloc(n * sizeof(Batch *));
+    migration.keys = Buffer_new(16 * 1024);
+    memset(migration.scanning, 0, n * sizeof(int));
+    memset(migration.counts, 0, n * sizeof(size_t));
+    memset(migration.scans, 0, n * sizeof(Batch *));
+    memset(migration.dumps, 0, n * sizeof(Batch *));
+    memset(migration.batches, 0, n * sizeof(Batch *));
+    for(size_t i = 0; i < n; i++) {
+        strcpy(migration.cursors[i], "0");
+    }
+
+    int res = 0;
+    for(size_t i = 0; i < num_ranges; i++) {
+        if(connections[ranges[i].from] == NULL || connections[ranges[i].to] == NULL) {
+            Module_set_error(GET_MODULE(), "No connection for server %d", connections[ranges[i].from] == NULL ? ranges[i].from : ranges[i].to);
+            res = -1;
+            break;
+        }
+        migration.scanning[ranges[i].from] = 1;
+    }
+    Ketama_free_ranges(ranges, num_ranges);
+
+    while(res == 0) {
+        int scanning = 0;
+        for(size_t i = 0; i < n; i++) {
+            scanning |= migration.scanning[i];
+        }
+        if(!scanning) {
+            break;
+        }
+        res = Migration_round(&migration);
+        Migration_free_batches(&migration, migration.scans);
+        Migration_free_batches(&migration, migration.dumps);
+        Migration_free_batches(&migration, migration.batches);
+    }
+
+    Buffer_free(migration.keys);
+    Alloc_free(migration.scanning, n * sizeof(int));
+    Alloc_free(migration.cursors, n * sizeof(migration.cursors[0]));
+    Alloc_free(migration.counts, n * sizeof(size_t));
+    Alloc_free(migration.scans, n * sizeof(Batch *));
+    Alloc_free(migration.dumps, n * sizeof(Batch *));
+    Alloc_free(migration.batches, n * sizeof(Batch *));
+    return res == 0 ? migration.moved : -1;
+}
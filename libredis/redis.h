@@ -25,6 +25,11 @@
  *
  * One or more Redis commands can be written into the batch using the Batch_write_XXX functions:
  *
+ * const char *argv[] = {"GET", "foo"};
+ * Batch_write_command(batch, 2, argv, NULL);
+ *
+ * or by writing commands in the Redis protocol directly:
+ *
  * Batch_write(batch, "GET foo\r\n", 9, 1);
  *
  * Then we tell the library that we want to execute these commands on a specific Redis server by associating the Batch
@@ -66,7 +71,17 @@ typedef struct _Module Module;
 typedef struct _Batch Batch;
 typedef struct _Connection Connection;
 typedef struct _Ketama Ketama;
+typedef struct _KetamaRing KetamaRing;
+typedef struct _JumpHash JumpHash;
+typedef struct _Rendezvous Rendezvous;
 typedef struct _Executor Executor;
+typedef struct _ClientCache ClientCache;
+typedef struct _ReplyCache ReplyCache;
+typedef struct _Command Command;
+typedef struct _Shard Shard;
+typedef struct _ShardedBatch ShardedBatch;
+typedef struct _Cluster Cluster;
+typedef struct _ClusterBatch ClusterBatch;
 
 #define LIBREDISAPI __attribute__((visibility("default")))
 
@@ -84,6 +99,15 @@ LIBREDISAPI void Module_set_alloc_alloc(Module *module, void * (*alloc_malloc)()
 LIBREDISAPI void Module_set_alloc_realloc(Module *module, void * (*alloc_realloc)(void *, size_t));
 LIBREDISAPI void Module_set_alloc_free(Module *module, void (*alloc_free)(void *));
 
+/**
+ * Batches borrow their read and write buffers from a pool of power-of-2 sized chunks, and give them
+ * back when the batch is freed. These set how much free memory the pool may hold on to; the maximum number of free chunks
+ * kept per chunk size (default 16), and the maximum number of free bytes kept in total (default 4MB).
+ * Setting either of them to 0 disables pooling.
+ */
+LIBREDISAPI void Module_set_buffer_pool_max_chunks(Module *module, size_t max_chunks);
+LIBREDISAPI void Module_set_buffer_pool_max_bytes(Module *module, size_t max_bytes);
+
 /**
  * Initialise the libredis module once all properties have been set. The library is now ready to be used.
  * Returns -1 if there is an error, 0 if all is ok.
@@ -91,7 +115,8 @@ LIBREDISAPI void Module_set_alloc_free(Module *module, void (*alloc_free)(void *
 LIBREDISAPI int Module_init(Module *module);
 
 /**
- * Gets the amount of heap memory currently allocated by the libredis module. This should return 0 after the module has been freed.
+ * Gets the amount of heap memory currently allocated by the libredis module (including free chunks held by the buffer pool).
+ * This should return 0 after the module has been freed.
  */
 LIBREDISAPI size_t Module_get_allocated(Module *module);
 
@@ -118,8 +143,34 @@ LIBREDISAPI Connection *Connection_new(const char *addr);
  */
 LIBREDISAPI void Connection_free(Connection *connection);
 
+/**
+ * Sets the protocol version to use with the server, 2 (the default) or 3 for RESP3. For RESP3 the connection
+ * sends a HELLO 3 command whenever it (re)connects, before any commands from a batch, and its reply is not
+ * added to the batch. If the connection is open it is closed, so that the protocol is negotiated on the next execute.
+ * Returns 0 on success, -1 for an unsupported version.
+ */
+LIBREDISAPI int Connection_set_protocol(Connection *connection, int protocol);
+
+/**
+ * Returns the latency of the connection in ms, an exponentially weighted moving average of the time the batches executed
+ * on it took, from the start of execution until the last reply. A batch that failed or timed out counts as 1 second
+ * more than it took. Returns 0 if no batch was executed on the connection yet.
+ */
+LIBREDISAPI double Connection_get_latency(Connection *connection);
+
+/**
+ * Returns the given percentile (0-100) of the times the last 64 batches executed on the connection took, in ms.
+ * Returns 0 if fewer than 8 batches were executed on the connection.
+ */
+LIBREDISAPI double Connection_get_latency_percentile(Connection *connection, double percentile);
+
 /**
  * Enumerates the type of replies that can be read from a Batch.
+ * The types from RT_NIL onwards are only received when the connection uses the RESP3 protocol (see Connection_set_protocol).
+ * A RESP3 blob error is returned as RT_ERROR, RT_BOOLEAN has "t" or "f" as data, and the data of RT_VERBATIM starts with
+ * its 3 character format and a colon (e.g. "txt:some text").
+ * RT_MAP, RT_SET and RT_PUSH are aggregate replies like RT_MULTIBULK; an RT_MAP is followed by a key and a value for each
+ * of its entries.
  */
 typedef enum _ReplyType
 {
@@ -130,7 +181,15 @@ typedef enum _ReplyType
     RT_BULK = 3,
     RT_MULTIBULK_NIL = 4,
     RT_MULTIBULK = 5,
-    RT_INTEGER = 6
+    RT_INTEGER = 6,
+    RT_NIL = 7,
+    RT_DOUBLE = 8,
+    RT_BOOLEAN = 9,
+    RT_BIG_NUMBER = 10,
+    RT_VERBATIM = 11,
+    RT_MAP = 12,
+    RT_SET = 13,
+    RT_PUSH = 14
 } ReplyType;
 
 /**
@@ -158,26 +217,136 @@ LIBREDISAPI void Batch_write(Batch *batch, const char *str, size_t str_len, int
 LIBREDISAPI void Batch_write_decimal(Batch *batch, long decimal);
 
 /**
- * Writes a redis set command into the batch
+ * Writes a complete command into the batch, encoded in the (binary safe) multibulk format, and counts it as 1 command.
+ * argv holds the argc arguments of the command, starting with the command name (e.g. {"SET", "foo", "bar"}), and argvlen
+ * their lengths. If argvlen is NULL the arguments are taken to be null terminated strings.
+ * The size of the encoded command is computed upfront, so the batch grows at most once per command.
+ */
+LIBREDISAPI void Batch_write_command(Batch *batch, int argc, const char **argv, const size_t *argvlen);
+
+/**
+ * Writes a redis set command into the batch (using Batch_write_command)
  */
 LIBREDISAPI void Batch_write_set(Batch *batch, const char *key, int key_len, const char *value, int value_len);
 
 /**
- * Writes a redis get command into the batch
+ * Writes a redis get command into the batch (using Batch_write_command)
  */
 LIBREDISAPI void Batch_write_get(Batch *batch, const char *key, int key_len);
 
+/**
+ * Enables (or disables) coalescing of commands written with Batch_write_get and Batch_write_set. When enabled, a run of
+ * consecutive Batch_write_get commands is sent as a single MGET, and a run of consecutive Batch_write_set commands as a
+ * single MSET. The reply is expanded again, so that the batch still has a reply for each of the original commands.
+ * Runs are ended by any other write, so the order of the commands is kept.
+ * Note that this differs from sending the commands one by one in some cases: GET of a key holding a non-string value
+ * replies with an error, whereas MGET replies with nil for that key. An error reply for the MGET/MSET as a whole is
+ * repeated for each command.
+ */
+LIBREDISAPI void Batch_set_coalesce(Batch *batch, int coalesce);
+
+/**
+ * Returns 1 if all commands written into the batch are known to be read-only (like GET, HGETALL or ZRANGE), so that
+ * the batch may be executed on a replica. Commands written with Batch_write are never considered read-only.
+ */
+LIBREDISAPI int Batch_is_read_only(Batch *batch);
+
+/**
+ * Sets the cache to take the replies of GET and HGET commands from (NULL for none, the default). Commands written after
+ * this whose reply is in the cache are not sent, their reply is copied from the cache and returned in the order the
+ * commands were written. The replies to the others are stored in the cache when they arrive (values and nil replies,
+ * not errors). This applies to GET and HGET written with Batch_write_command, Batch_write_prepared and Batch_write_get.
+ * The commands that write (written with Batch_write_command, Batch_write_prepared and Batch_write_set) remove the
+ * replies of the keys they write from the cache, so that they are read from the server again. For DEL, UNLINK, MSET,
+ * RENAME and the like these are all the keys they write, for other commands the first argument, FLUSHDB, FLUSHALL,
+ * SELECT and scripts clear the cache. Commands written with Batch_write are not looked at.
+ */
+LIBREDISAPI void Batch_set_cache(Batch *batch, ReplyCache *cache);
+
+/**
+ * Creates a prepared command. Commands that are sent often with the same shape (e.g. HGET with a fixed hash, or SETEX
+ * with a fixed TTL) can be prepared once; the constant arguments and the multibulk header are encoded upfront and are
+ * copied as-is on every Batch_write_prepared.
+ * argv holds the argc arguments of the command like for Batch_write_command, a NULL entry marks a parameter that is given
+ * on each write. argvlen may be NULL if all constant arguments are null terminated strings.
+ * Returns NULL on error (no command name given, out of memory).
+ * A command is not tied to a batch or thread; it can be shared between threads as long as it is not freed while in use.
+ *
+ * Example:
+ *
+ * const char *argv[] = {"SETEX", NULL, "3600", NULL};
+ * Command *setex = Command_new(4, argv, NULL);
+ * ...
+ * const char *params[] = {"foo", "bar"};
+ * Batch_write_prepared(batch, setex, params, NULL);
+ */
+LIBREDISAPI Command *Command_new(int argc, const char **argv, const size_t *argvlen);
+
+/**
+ * Releases a prepared command.
+ */
+LIBREDISAPI void Command_free(Command *command);
+
+/**
+ * Returns the number of parameters (NULL arguments given to Command_new) of a prepared command.
+ */
+LIBREDISAPI int Command_num_params(Command *command);
+
+/**
+ * Writes a prepared command into the batch and counts it as 1 command. params holds the values of the parameters
+ * of the command in order (Command_num_params of them), and paramslen their lengths (or NULL for null terminated strings).
+ */
+LIBREDISAPI void Batch_write_prepared(Batch *batch, Command *command, const char **params, const size_t *paramslen);
+
+/**
+ * Large multibulk replies (e.g. LRANGE or SMEMBERS with many elements) can be stored lazily; the library will still
+ * validate them when they are received, but their children are only decoded from the received data when they
+ * are read with Batch_next_reply or Batch_reply_child_at, instead of storing a reply record for every child.
+ * Multibulk (or other aggregate) replies with at least min_children children will be stored lazily. Set to 0 (the default) to disable.
+ * Lazy children are best read in order, looking them up by Batch_reply_child_at takes time linear in the child number
+ * (unless they are looked up in increasing order).
+ */
+LIBREDISAPI void Batch_set_lazy_threshold(Batch *batch, size_t min_children);
+
 /**
  * Reads the next reply from the batch. This will return the replies in the order the commands were given.
  * Call repeatedly until all replies have been read (it will return 0 when there are no more replies left).
- * For some reply types, data will point to the content of the reply (RT_BULK, RT_OK, RT_ERROR). In that
+ * For some reply types, data will point to the content of the reply (RT_BULK, RT_OK, RT_ERROR, RT_INTEGER and the
+ * RESP3 scalar types RT_DOUBLE, RT_BOOLEAN, RT_BIG_NUMBER and RT_VERBATIM). In that
  * case the len argument will contain the length of this data (e.g. the data is NOT null terminated).
- * In the case of a multibulk reply RT_MULTIBULK, the len argument will contain the number of bulk replies that follow.
+ * In the case of an aggregate reply (RT_MULTIBULK, RT_MAP, RT_SET or RT_PUSH), the len argument will contain the number of
+ * replies that follow as its children.
+ * With RESP3, push replies (RT_PUSH) that the server sends out of band are returned among the replies, in the order
+ * they were received. They are not replies to commands, so they are not counted by Batch_reply_count and are not
+ * returned by Batch_reply_at or Batch_reply_child_at.
+ * Returns the nesting level of the reply: 1 for the reply to a command, 2 for the children of an aggregate reply, 3 for
+ * their children and so on (aggregate replies can be nested to any depth, e.g. the reply to EXEC or EVAL). Returns 0 when
+ * all replies have been read and -1 on error.
  * Note that any data pointed to by the data argument is only valid as long as the batch is not freed.
  * If you want to do something with it later on, you need to copy it yourself.
  */
 LIBREDISAPI int Batch_next_reply(Batch *batch, ReplyType *reply_type, char **data, size_t *len);
 
+/**
+ * Returns the number of (top-level) replies to commands in the batch, push replies are not counted. After a
+ * successful execute this is equal to the number of commands written into the batch.
+ */
+LIBREDISAPI size_t Batch_reply_count(Batch *batch);
+
+/**
+ * Random access alternative to Batch_next_reply. Reads the reply to the command at the given index
+ * (0 <= index < Batch_reply_count). The reply_type, data and len arguments are filled in as in Batch_next_reply.
+ * Returns 1 if the reply was found, 0 if the index was out of range.
+ */
+LIBREDISAPI int Batch_reply_at(Batch *batch, size_t index, ReplyType *reply_type, char **data, size_t *len);
+
+/**
+ * Reads child number 'child' of the aggregate (e.g. multibulk) reply at the given index. This is a constant time operation
+ * if the children are not aggregate replies themselves.
+ * Returns 1 if the child was found, 0 if the reply is not an aggregate reply or the child is out of range.
+ */
+LIBREDISAPI int Batch_reply_child_at(Batch *batch, size_t index, size_t child, ReplyType *reply_type, char **data, size_t *len);
+
 /**
  * If a batch was aborted (maybe because a connection went down or timed-out), there will be an error message
  * associated with the batch. Use this function to retrieve it.
@@ -214,6 +383,108 @@ LIBREDISAPI int Executor_add(Executor *executor, Connection *connection, Batch *
  */
 LIBREDISAPI int Executor_execute(Executor *executor, int timeout_ms);
 
+/**
+ * Like Executor_add, but with a secondary connection (e.g. another replica) to hedge a read-only batch (see
+ * Batch_is_read_only) with. If the batch did not complete on the connection after the hedge percentile of the times
+ * its recent batches took (see Executor_set_hedge_percentile and Connection_get_latency_percentile), or if it failed,
+ * a copy of the batch is executed on the secondary. The replies of the first of the two to complete without error end
+ * up in the batch. The replies still to come for the other one are read and dropped on the next execute on that
+ * connection, or its socket is closed if not all of the batch was sent yet.
+ * Batches that may write are never hedged.
+ */
+LIBREDISAPI int Executor_add_hedged(Executor *executor, Connection *connection, Connection *secondary, Batch *batch);
+
+/**
+ * Sets the percentile of the recent batch times of a connection after which a hedged batch is copied to its secondary.
+ * The default is 95, so that about 1 in 20 hedged batches are sent twice.
+ */
+LIBREDISAPI void Executor_set_hedge_percentile(Executor *executor, double percentile);
+
+/**
+ * Return the number of copies of hedged batches that were started, and the number of them that completed first.
+ */
+LIBREDISAPI long Executor_get_hedges_fired(Executor *executor);
+LIBREDISAPI long Executor_get_hedges_won(Executor *executor);
+
+/**
+* A ReplyCache keeps the replies to GET and HGET commands for a short time, for the batches it is set on (see
+* Batch_set_cache), so that reading the same keys again and again does not go to the server every time. It sees the
+* writes done through the batches that use it, but not those of other clients, so a value read from it can be up to the
+* time to live old. The least recently used replies are evicted to stay within the given memory (of the values, keys
+* and ~80 bytes per reply).
+*
+* ReplyCache *cache = ReplyCache_new(16 * 1024 * 1024, 1000);
+* Batch_set_cache(batch, cache);
+* Batch_write_get(batch, key, key_len); //only sent if not cached during the last second
+*
+* A ReplyCache must be used by 1 thread at a time.
+*/
+
+/**
+ * Creates a new cache of at most max_memory bytes, of replies that are kept for ttl_ms (0 to keep them until they are
+ * evicted). Returns NULL on error.
+ */
+LIBREDISAPI ReplyCache *ReplyCache_new(size_t max_memory, int ttl_ms);
+
+/**
+ * Frees the cache. It must not be set on any batch that is still used.
+ */
+LIBREDISAPI void ReplyCache_free(ReplyCache *cache);
+
+/**
+ * Removes all replies from the cache.
+ */
+LIBREDISAPI void ReplyCache_clear(ReplyCache *cache);
+
+/**
+ * Return the number of GET/HGET commands whose reply was found in the cache, and the number that had to be sent.
+ */
+LIBREDISAPI long ReplyCache_get_hits(ReplyCache *cache);
+LIBREDISAPI long ReplyCache_get_misses(ReplyCache *cache);
+
+/**
+* A ClientCache keeps the values of string keys read through it in memory, and only GETs the ones it does not have.
+* The server keeps it coherent: the connection that reads the values has client side caching (CLIENT TRACKING) enabled,
+* with the invalidations of the keys read on it sent to the second connection, which switches to RESP3 for that. Keys
+* that were changed are removed from the cache on the next get, after the invalidations that arrived by then are read.
+* The cache is flushed whenever either connection was lost, as the server does not track keys for a closed socket.
+* The least recently used values are evicted to stay within the given memory (of the values, keys and ~56 bytes per key).
+*
+* ClientCache *cache = ClientCache_new(Connection_new("10.0.0.1:6379"), Connection_new("10.0.0.1:6379"), 64 * 1024 * 1024);
+* ClientCache_get(cache, num_keys, keys, key_lens, values, value_lens, 500);
+*
+* The connections are not owned by the cache and must not be used for anything else while it is used (the first may be
+* used for writes).
+*/
+
+/**
+ * Creates a new cache of at most max_memory bytes, of the values read through connection, with the invalidations
+ * received on the invalidations connection. Returns NULL on error.
+ */
+LIBREDISAPI ClientCache *ClientCache_new(Connection *connection, Connection *invalidations, size_t max_memory);
+
+/**
+ * Frees the cache, and closes its connection, so that the server stops tracking the keys read on it.
+ */
+LIBREDISAPI void ClientCache_free(ClientCache *cache);
+
+/**
+ * Gets the values of the n keys, from the cache or else from the server (with a single round trip for all of them).
+ * values[i] points to the value of keys[i] with length value_lens[i], or is NULL if the key does not exist. The values
+ * are valid until the next call on the cache.
+ * Returns 0 if all ok, -1 on error (a timeout, a lost connection or a key that does not hold a string).
+ */
+LIBREDISAPI int ClientCache_get(ClientCache *cache, size_t n, const char **keys, const size_t *key_lens, char **values,
+        size_t *value_lens, int timeout_ms);
+
+/**
+ * Return the number of keys found in the cache, the number of keys that had to be read from the server, and the number
+ * of invalidations received (a key, or all of them when the server flushed its database).
+ */
+LIBREDISAPI long ClientCache_get_hits(ClientCache *cache);
+LIBREDISAPI long ClientCache_get_misses(ClientCache *cache);
+LIBREDISAPI long ClientCache_get_invalidations(ClientCache *cache);
+
 
 /**
 * Create a new ketama consistent hashing object.
@@ -240,6 +511,20 @@ LIBREDISAPI int Executor_execute(Executor *executor, int timeout_ms);
 * char *my_key = "foobar42";
 * int ordinal = Ketama_get_server_ordinal(ketama, my_key, strlen(my_key));
 * char *server_address = Ketama_get_server_address(ketama, ordinal);
+*
+* Servers can be added, removed or reweighted after the continuum was created. This updates the hash-ring in place,
+* only (re)hashing the points of the servers that changed, and gives the same result as creating it from scratch.
+* The hash-ring itself (KetamaRing) is never changed, an update builds a new one and swaps it in. The lookups on ketama
+* take a reference to the current ring for the duration of the call, but the address of a server is read from the
+* servers of ketama, which an update may change. Other threads looking up keys while the servers change should take a
+* reference to the current ring and do their lookups (and get the addresses) on that:
+*
+* KetamaRing *ring = Ketama_acquire_ring(ketama);
+* int ordinal = KetamaRing_get_server_ordinal(ring, my_key, strlen(my_key));
+* char *server_address = KetamaRing_get_server_address(ring, ordinal);
+* KetamaRing_release(ring);
+*
+* Updates of the servers themselves should be done by 1 thread at a time.
 */
 LIBREDISAPI Ketama *Ketama_new();
 
@@ -249,27 +534,414 @@ LIBREDISAPI Ketama *Ketama_new();
 LIBREDISAPI void Ketama_free(Ketama *ketama);
 
 /**
- * Add a server to the hash-ring. This must be called (repeatedly) BEFORE calling Ketama_create_continuum.
+ * The hash used for placing the servers and keys on the hash-ring.
+ * KETAMA_HASH_MD5 is the default and places keys exactly like classic (libketama) clients do.
+ * KETAMA_HASH_MURMUR3 is much faster, but places keys differently, so only use it for new clusters where all clients
+ * use it.
+ */
+typedef enum _KetamaHash
+{
+    KETAMA_HASH_MD5 = 0,
+    KETAMA_HASH_MURMUR3 = 1
+} KetamaHash;
+
+/**
+ * Set the hash used by the hash-ring. This must be called BEFORE calling Ketama_create_continuum.
+ * Returns 0 on success, -1 if the continuum was already created.
+ */
+LIBREDISAPI int Ketama_set_hash(Ketama *ketama, KetamaHash hash);
+
+/**
+ * Add a server to the hash-ring. Servers added after calling Ketama_create_continuum are added to the existing hash-ring.
  * Address must be an ip-address or hostname of a server. port is the servers port number.
  * The weight is the relative weight of this server in the ring.
  */
 LIBREDISAPI int Ketama_add_server(Ketama *ketama, const char *addr, int port, unsigned long weight);
 
+/**
+ * Remove the server with the given ordinal from the hash-ring. The ordinals of the other servers do not change, the
+ * removed server just does not get any keys anymore.
+ * Returns 0 on success, -1 if there is no such server.
+ */
+LIBREDISAPI int Ketama_remove_server(Ketama *ketama, int ordinal);
+
+/**
+ * Change the weight of the server with the given ordinal.
+ * Returns 0 on success, -1 if there is no such server.
+ */
+LIBREDISAPI int Ketama_set_server_weight(Ketama *ketama, int ordinal, unsigned long weight);
+
 /**
  * After all servers have been added call this method to finalize the hash-ring before use.
+ * Hash-rings are cached for the life of the module, so creating the continuum for the same servers again (e.g. in the
+ * next request of a PHP process) is cheap.
  */
 LIBREDISAPI void Ketama_create_continuum(Ketama *ketama);
 
+/**
+ * Write the hash-ring to a file, that other processes can load with Ketama_load_continuum. The file is written under a
+ * temporary name and renamed to path when complete.
+ * Returns 0 on success, -1 on error.
+ */
+LIBREDISAPI int Ketama_save_continuum(Ketama *ketama, const char *path);
+
+/**
+ * Use the hash-ring saved in the file at path, instead of adding servers and creating the continuum. The file is
+ * mapped read-only, so loading is cheap and all processes using the same file share a single copy of the ring in
+ * memory. The ketama gets the servers of the file, and can be updated as usual (updates are not written back).
+ * The file must have been written by a libredis of the same version on a similar machine.
+ * Returns 0 on success, -1 on error.
+ */
+LIBREDISAPI int Ketama_load_continuum(Ketama *ketama, const char *path);
+
 /**
  * Hash the given key to some server (denoted by ordinal). key_len is the length of the key in bytes.
  */
 LIBREDISAPI int Ketama_get_server_ordinal(Ketama *ketama, const char* key, size_t key_len);
 
+/**
+ * Hash n keys at once, storing the ordinal of the server of keys[i] in ordinals[i]. Gives the same result as calling
+ * Ketama_get_server_ordinal for each key, but is faster for many (short) keys as these are hashed several at a time.
+ */
+LIBREDISAPI void Ketama_get_server_ordinals(Ketama *ketama, const char **keys, const size_t *key_lens, int *ordinals, size_t n);
+
+/**
+ * Enable consistent hashing with bounded loads, epsilon > 0 (e.g. 0.25), or disable it with 0.
+ * With bounded loads the keys in use are counted per server (see Ketama_acquire_server). A server never gets more than
+ * (1 + epsilon) times its share (by weight) of the keys in use, the keys that would go over this go to the next server
+ * on the hash-ring that has room. As long as the load is balanced, keys go to the same server as without bounded loads.
+ * Note that the server of a key thus depends on the load, so this is meant for e.g. caches, where a key ending up on
+ * another server is not a problem.
+ */
+LIBREDISAPI void Ketama_set_load_bound(Ketama *ketama, double epsilon);
+
+/**
+ * Returns the ordinal of the server for the key, and counts the key as in use on that server until
+ * Ketama_release_server is called with the ordinal. If bounded loads are enabled this takes the load into account.
+ * The load counts are not thread safe, acquire and release from 1 thread.
+ */
+LIBREDISAPI int Ketama_acquire_server(Ketama *ketama, const char* key, size_t key_len);
+
+/**
+ * Ends the use of a key on the server with the ordinal returned by Ketama_acquire_server.
+ */
+LIBREDISAPI void Ketama_release_server(Ketama *ketama, int ordinal);
+
+/**
+ * Returns the number of keys in use on the server with the given ordinal.
+ */
+LIBREDISAPI long Ketama_get_server_load(Ketama *ketama, int ordinal);
+
 /**
  * Return the address of the server as a string "address:port" as passed to the original call to Ketama_add_server
  */
 LIBREDISAPI char *Ketama_get_server_address(Ketama *ketama, int ordinal);
 
+/**
+ * Returns the number of servers added to the hash-ring (including removed ones), their ordinals are 0 up to this number.
+ */
+LIBREDISAPI int Ketama_get_server_count(Ketama *ketama);
+
+/**
+ * Returns a reference to the current hash-ring, or NULL if the continuum was not created yet. The ring stays valid
+ * (and unchanged) until it is released, even if the servers of ketama change in the meantime.
+ */
+LIBREDISAPI KetamaRing *Ketama_acquire_ring(Ketama *ketama);
+
+/**
+ * Release a reference taken with Ketama_acquire_ring. All references must be released before calling Ketama_free.
+ */
+LIBREDISAPI void KetamaRing_release(KetamaRing *ring);
+
+/**
+ * Like Ketama_get_server_ordinal, Ketama_get_server_ordinals and Ketama_get_server_address, but on the given ring.
+ */
+LIBREDISAPI int KetamaRing_get_server_ordinal(KetamaRing *ring, const char* key, size_t key_len);
+LIBREDISAPI void KetamaRing_get_server_ordinals(KetamaRing *ring, const char **keys, const size_t *key_lens, int *ordinals, size_t n);
+LIBREDISAPI char *KetamaRing_get_server_address(KetamaRing *ring, int ordinal);
+LIBREDISAPI int KetamaRing_get_server_count(KetamaRing *ring);
+
+/**
+ * A range of key hashes [start, end] that is owned by the server with ordinal 'from' in one ring, and by 'to' in another.
+ */
+typedef struct _KetamaRange
+{
+    unsigned int start;
+    unsigned int end;
+    int from;
+    int to;
+} KetamaRange;
+
+/**
+ * Compare two rings of the same ketama (e.g. acquired before and after adding a server), and return the ranges of key
+ * hashes that changed server in *ranges, sorted by start. Adjacent ranges between the same servers are merged.
+ * The ranges must be freed with Ketama_free_ranges. Returns -1 on error (the rings use different hashes or are empty).
+ */
+LIBREDISAPI int Ketama_diff_rings(KetamaRing *from, KetamaRing *to, KetamaRange **ranges, size_t *num_ranges);
+LIBREDISAPI void Ketama_free_ranges(KetamaRange *ranges, size_t num_ranges);
+
+/**
+ * Move the keys that changed server between ring 'from' and ring 'to' (see Ketama_diff_rings) to their new server.
+ * connections holds a connection for each server ordinal of both rings (NULL for servers that neither lose nor gain keys).
+ * The servers that lose keys are scanned with SCAN (scan_count keys at a time, 0 for the default), and each key that
+ * moves is copied with DUMP/RESTORE (keeping its time to live) and then deleted from the old server. A key that
+ * already exists on the new server was written there after the switch to the new ring, so it is not overwritten.
+ * Keys written to the old server while migrating may be missed, so clients should use the new ring before migrating.
+ * The server of a key is found as the clients of the servers find it: with hash_tags 0 the whole key is hashed, like
+ * Ketama_get_server_ordinal does, with hash_tags 1 only the {hash tag} of a key that has one, like ShardedBatch does.
+ * Using the other one than the clients moves keys with a hash tag to the wrong server.
+ * Returns the number of keys moved, or -1 on error.
+ */
+LIBREDISAPI long Ketama_migrate(KetamaRing *from, KetamaRing *to, Connection **connections, int hash_tags, int scan_count,
+        int timeout_ms);
+
+/**
+* JumpHash and Rendezvous are alternatives to Ketama for mapping keys to servers, with the same ordinal/address
+* interface. Keys are hashed with MurmurHash3, so they do not place keys like Ketama (or each other) does.
+*
+* JumpHash implements jump consistent hash: lookups take O(ln n) time and there is no hash-ring in memory, and keys are
+* spread evenly over the servers. Servers have no weights, and servers can only be added, at the end. Adding the n-th
+* server moves 1/n of the keys to it.
+*
+* Rendezvous implements weighted rendezvous (highest random weight) hashing: each key goes to the server with the
+* highest score for that key. Lookups take O(n) time, but the keys are spread closely following the weights, also for
+* a few servers. Servers can be added, removed and reweighted like with Ketama, only the keys of the server that
+* changed move (to it, or away from it).
+*
+* Usage is like Ketama, without creating a continuum:
+*
+* JumpHash *jump = JumpHash_new();
+* JumpHash_add_server(jump, "127.0.0.1", 6379);
+* JumpHash_add_server(jump, "127.0.0.1", 6380);
+* int ordinal = JumpHash_get_server_ordinal(jump, my_key, strlen(my_key));
+* char *server_address = JumpHash_get_server_address(jump, ordinal);
+*/
+LIBREDISAPI JumpHash *JumpHash_new();
+LIBREDISAPI void JumpHash_free(JumpHash *jump);
+
+/**
+ * Add a server, it gets the next ordinal.
+ */
+LIBREDISAPI int JumpHash_add_server(JumpHash *jump, const char *addr, int port);
+
+/**
+ * Returns the ordinal of the server for the key, -1 if there are no servers.
+ */
+LIBREDISAPI int JumpHash_get_server_ordinal(JumpHash *jump, const char *key, size_t key_len);
+LIBREDISAPI char *JumpHash_get_server_address(JumpHash *jump, int ordinal);
+LIBREDISAPI int JumpHash_get_server_count(JumpHash *jump);
+
+LIBREDISAPI Rendezvous *Rendezvous_new();
+LIBREDISAPI void Rendezvous_free(Rendezvous *rendezvous);
+
+/**
+ * Add a server with the given relative weight, it gets the next ordinal. Servers with weight 0 get no keys.
+ */
+LIBREDISAPI int Rendezvous_add_server(Rendezvous *rendezvous, const char *addr, int port, unsigned long weight);
+
+/**
+ * Remove the server with the given ordinal. The ordinals of the other servers do not change, the removed server just
+ * does not get any keys anymore.
+ * Returns 0 on success, -1 if there is no such server.
+ */
+LIBREDISAPI int Rendezvous_remove_server(Rendezvous *rendezvous, int ordinal);
+
+/**
+ * Change the weight of the server with the given ordinal.
+ * Returns 0 on success, -1 if there is no such server.
+ */
+LIBREDISAPI int Rendezvous_set_server_weight(Rendezvous *rendezvous, int ordinal, unsigned long weight);
+
+/**
+ * Returns the ordinal of the server for the key, -1 if there are no servers with a weight.
+ */
+LIBREDISAPI int Rendezvous_get_server_ordinal(Rendezvous *rendezvous, const char *key, size_t key_len);
+LIBREDISAPI char *Rendezvous_get_server_address(Rendezvous *rendezvous, int ordinal);
+LIBREDISAPI int Rendezvous_get_server_count(Rendezvous *rendezvous);
+
+/**
+* A Shard is a server with replicas: a primary connection and the connections to its replicas. Read-only batches (see
+* Batch_is_read_only) are executed on the replica with the lowest latency (see Connection_get_latency), all other
+* batches on the primary. As replication is asynchronous, a read from a replica may not see a write that was just done.
+*
+* Shard *shard = Shard_new(Connection_new("10.0.0.1:6379"));
+* Shard_add_replica(shard, Connection_new("10.0.0.2:6379"));
+* ...
+* Executor_add(executor, Shard_get_connection(shard, batch), batch);
+*
+* The connections are not owned by the shard, they must stay valid while it is used.
+*/
+
+/**
+ * Creates a new shard with the given primary and no replicas yet. Returns NULL on error.
+ */
+LIBREDISAPI Shard *Shard_new(Connection *primary);
+
+/**
+ * Frees the shard, but not its connections.
+ */
+LIBREDISAPI void Shard_free(Shard *shard);
+
+/**
+ * Adds a replica to the shard. Returns 0 if all ok, -1 on error (e.g. the shard has the maximum of 16 replicas).
+ */
+LIBREDISAPI int Shard_add_replica(Shard *shard, Connection *replica);
+
+/**
+ * Returns the connection to the primary.
+ */
+LIBREDISAPI Connection *Shard_get_primary(Shard *shard);
+
+/**
+ * Returns the connection to use for a read, the replica with the lowest latency (the primary if there are no replicas).
+ * Now and then another replica is returned, so that the latency of every replica is kept up to date.
+ */
+LIBREDISAPI Connection *Shard_get_replica(Shard *shard);
+
+/**
+ * Returns the connection to execute the batch on, Shard_get_replica if the batch is read-only, the primary otherwise.
+ */
+LIBREDISAPI Connection *Shard_get_connection(Shard *shard, Batch *batch);
+
+/**
+* A ShardedBatch is like a Batch, but for a set of servers. Each command is routed to a server by its key using a Ketama
+* hash-ring, and the replies are returned in the order the commands were written.
+* If the key contains a non-empty {...} section (a hash tag), only that part of the key is hashed, so that related
+* keys can be put on the same server.
+* Multi-key commands are routed by their first key, except for MGET, DEL, UNLINK, EXISTS, TOUCH and MSET, which are split
+* into a command for each server holding some of the keys. Their reply is put back together, e.g. MGET has a single
+* multibulk reply with the values in the order of the keys, DEL replies with the total number of keys removed. If any
+* part of such a command fails, its reply is the error of that part.
+*
+* Ketama *ketama = Ketama_new();
+* ... //add servers and create continuum
+* Connection *connections[] = {Connection_new("127.0.0.1:6379"), Connection_new("127.0.0.1:6380")}; //by server ordinal
+*
+* ShardedBatch *sharded = ShardedBatch_new(ketama, connections);
+* const char *argv[] = {"MGET", "foo", "bar", "baz"};
+* ShardedBatch_write_command(sharded, 4, argv, NULL);
+* ShardedBatch_execute(sharded, 500);
+* while((level = ShardedBatch_next_reply(sharded, &reply_type, &data, &len)) > 0) {
+*   ...
+* }
+* ShardedBatch_free(sharded);
+*/
+
+/**
+ * Creates a new sharded batch. connections holds the connection for each server of the ketama, by server ordinal.
+ * The ketama and the connections are not owned by the sharded batch, they must stay valid while it is used.
+ * Returns NULL on error.
+ */
+LIBREDISAPI ShardedBatch *ShardedBatch_new(Ketama *ketama, Connection **connections);
+
+/**
+ * Like ShardedBatch_new, but with a shard (a primary and its replicas) for each server of the ketama. On execute, the
+ * batch of a server goes to the primary if any of its commands may write, otherwise to a replica (see Shard_get_connection).
+ */
+LIBREDISAPI ShardedBatch *ShardedBatch_new_replicated(Ketama *ketama, Shard **shards);
+
+/**
+ * Releases the sharded batch and the batches it used for each server.
+ */
+LIBREDISAPI void ShardedBatch_free(ShardedBatch *sharded);
+
+/**
+ * Writes a command into the sharded batch, argc, argv and argvlen are as for Batch_write_command. The key of the command
+ * must be its first argument after the command name.
+ * Returns 0 if all ok, -1 if the command could not be routed (e.g. it has no key, or there is no connection for its server).
+ */
+LIBREDISAPI int ShardedBatch_write_command(ShardedBatch *sharded, int argc, const char **argv, const size_t *argvlen);
+
+/**
+ * Executes the commands on all servers in parallel, using a single Executor. The result is as for Executor_execute.
+ */
+LIBREDISAPI int ShardedBatch_execute(ShardedBatch *sharded, int timeout_ms);
+
+/**
+ * Reads the next reply from the sharded batch, in the order the commands were written. The arguments and result are as for
+ * Batch_next_reply. Push replies are not returned.
+ * The data of the reply of a DEL (alike) command that was split over servers is only valid until the next call.
+ */
+LIBREDISAPI int ShardedBatch_next_reply(ShardedBatch *sharded, ReplyType *reply_type, char **data, size_t *len);
+
+/**
+* A Cluster keeps track of the nodes of a Redis Cluster, and of which node serves each hash slot. The slot map is read
+* with CLUSTER SLOTS from any of the known nodes. A ClusterBatch routes each command to the node serving the slot of its
+* key, executes the commands on all nodes in parallel and follows MOVED and ASK redirects by executing the redirected
+* commands again on the node they were redirected to. After a MOVED redirect the slot map is refreshed on the next execute.
+*
+* Cluster *cluster = Cluster_new();
+* Cluster_add_node(cluster, "127.0.0.1:7000"); //one or more nodes to start with, others are found through the slot map
+*
+* ClusterBatch *batch = ClusterBatch_new(cluster);
+* ClusterBatch_write_command(batch, 2, argv, NULL);
+* ...
+* ClusterBatch_execute(batch, 500);
+* while((level = ClusterBatch_next_reply(batch, &reply_type, &data, &len)) > 0) {
+*   ...
+* }
+* ClusterBatch_free(batch);
+* ...
+* Cluster_free(cluster);
+*/
+
+/**
+ * Creates a new cluster without any nodes.
+ */
+LIBREDISAPI Cluster *Cluster_new();
+
+/**
+ * Frees the cluster and the connections to its nodes.
+ */
+LIBREDISAPI void Cluster_free(Cluster *cluster);
+
+/**
+ * Adds a node ("host:port", the port can not be left out) to the cluster.
+ * Returns 0 if all ok, -1 on error (e.g. invalid address).
+ */
+LIBREDISAPI int Cluster_add_node(Cluster *cluster, const char *addr);
+
+/**
+ * Reads the slot map from the first node that answers to CLUSTER SLOTS. This is done automatically by ClusterBatch_execute
+ * when there is no slot map yet or when it is known to be out of date.
+ * Returns 0 if all ok, -1 if none of the nodes gave a slot map.
+ */
+LIBREDISAPI int Cluster_refresh(Cluster *cluster, int timeout_ms);
+
+/**
+ * Returns the hash slot of a key (CRC16 of the key, or of its {hash tag}, modulo 16384).
+ */
+LIBREDISAPI int Cluster_key_slot(const char *key, size_t key_len);
+
+/**
+ * Creates a new batch of commands for the cluster.
+ */
+LIBREDISAPI ClusterBatch *ClusterBatch_new(Cluster *cluster);
+
+/**
+ * Frees the batch.
+ */
+LIBREDISAPI void ClusterBatch_free(ClusterBatch *batch);
+
+/**
+ * Writes a command into the batch, argc, argv and argvlen are as for Batch_write_command. The command is routed by its
+ * first argument after the command name. A command with multiple keys must have all of its keys in the same slot
+ * (use hash tags), otherwise the node will reply with an error.
+ */
+LIBREDISAPI void ClusterBatch_write_command(ClusterBatch *batch, int argc, const char **argv, const size_t *argvlen);
+
+/**
+ * Executes the commands on the nodes of the cluster. Redirected commands are executed again up to 5 times, the timeout
+ * applies to each of these rounds. The result is as for Executor_execute.
+ */
+LIBREDISAPI int ClusterBatch_execute(ClusterBatch *batch, int timeout_ms);
+
+/**
+ * Reads the next reply from the batch, in the order the commands were written. The arguments and result are as for
+ * Batch_next_reply. A command that is still redirected after the last round has the MOVED or ASK error as its reply.
+ */
+LIBREDISAPI int ClusterBatch_next_reply(ClusterBatch *batch, ReplyType *reply_type, char **data, size_t *len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,114 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "reply.h"
+
+void ReplyArray_init(ReplyArray *replies)
+{
+    replies->replies = Buffer_new(DEFAULT_REPLY_BUFF_SIZE);
+    replies->top = Buffer_new(DEFAULT_REPLY_BUFF_SIZE / 4);
+    replies->committed = 0;
+    replies->lazy_threshold = 0;
+}
+
+void ReplyArray_clear(ReplyArray *replies)
+{
+    Buffer_clear(replies->replies);
+    Buffer_clear(replies->top);
+    replies->committed = 0;
+    replies->lazy_threshold = 0;
+}
+
+void ReplyArray_release(ReplyArray *replies)
+{
+    Buffer_free(replies->replies);
+    Buffer_free(replies->top);
+}
+
+/**
+ * Appends a new reply record and returns its index. The record will have a span of 1 until
+ * it is closed.
+ */
+size_t ReplyArray_add(ReplyArray *replies, ReplyType type, size_t offset, size_t len, int depth)
+{
+    size_t index = ReplyArray_count(replies);
+    Reply *reply = (Reply *)Buffer_extend(replies->replies, sizeof(Reply));
+    DEBUG(("ReplyArray_add, type: %d, index: %d\n", type, index));
+    reply->offset = offset;
+    reply->len = len;
+    reply->span = 1;
+    reply->type = type;
+    reply->flags = 0;
+    reply->depth = depth;
+    return index;
+}
+
+/**
+ * Closes the (multibulk) reply at index, all records added after it are its children.
+ */
+void ReplyArray_close(ReplyArray *replies, size_t index)
+{
+    ReplyArray_get(replies, index)->span = ReplyArray_count(replies) - index;
+}
+
+/**
+ * Marks the records added since the last commit as a complete top-level reply.
+ */
+void ReplyArray_commit(ReplyArray *replies)
+{
+    assert(replies->committed < ReplyArray_count(replies));
+    size_t *top = (size_t *)Buffer_extend(replies->top, sizeof(size_t));
+    *top = replies->committed;
+    replies->committed = ReplyArray_count(replies);
+}
+
+/**
+ * Like ReplyArray_commit, but the reply is not added to the top-level replies (e.g. a push reply, which is not the reply
+ * to a command). Returns the index of its record.
+ */
+size_t ReplyArray_commit_aside(ReplyArray *replies)
+{
+    assert(replies->committed < ReplyArray_count(replies));
+    size_t index = replies->committed;
+    replies->committed = ReplyArray_count(replies);
+    return index;
+}
+
+/**
+ * Like ReplyArray_commit, but for an aggregate reply that is replaced by its children; each child is committed as a
+ * top-level reply of its own.
+ */
+void ReplyArray_commit_children(ReplyArray *replies)
+{
+    size_t index = replies->committed;
+    size_t count = ReplyArray_count(replies) - 1; //without the aggregate record
+    Reply *records = ReplyArray_get(replies, 0);
+    memmove(records + index, records + index + 1, (count - index) * sizeof(Reply));
+    Buffer_set_position(replies->replies, count * sizeof(Reply));
+    for(size_t i = index; i < count; i++) {
+        records[i].depth -= 1;
+    }
+    for(size_t i = index; i < count; i += records[i].span) {
+        size_t *top = (size_t *)Buffer_extend(replies->top, sizeof(size_t));
+        *top = i;
+    }
+    replies->committed = count;
+}
+
+/**
+ * Discards any records added since the last commit (e.g. a partially parsed reply).
+ */
+void ReplyArray_rollback(ReplyArray *replies)
+{
+    Buffer_set_position(replies->replies, replies->committed * sizeof(Reply));
+}
@@ -13,14 +13,93 @@
 #include "common.h"
 #include "buffer.h"
 
-Reply *Reply_new(ReplyType type, Buffer *buffer, size_t offset, size_t len);
-void Reply_free(Reply *reply);
-void Reply_free_final();
+#define REPLY_LOCAL 1 //data is in the batch's local buffer instead of its read buffer
+#define REPLY_LAZY 2 //aggregate reply whose children were not recorded, offset is the start of the first child
 
-void Reply_add_child(Reply *reply, Reply *child);
-int Reply_has_child(Reply *reply);
-Reply *Reply_pop_child(Reply *reply);
+#define REPLY_MAX_DEPTH 0xFFFF //maximum nesting depth of aggregate replies (depth of a record is an unsigned short)
+#define REPLY_STACK_SIZE 8 //initial size of the stacks used for walking nested replies, they grow as needed
 
-void Reply_dump(Reply *reply);
+/**
+ * A compact reply record. The replies of a batch are stored as one contiguous array of these records.
+ * An aggregate (e.g. multibulk) reply is followed directly by the records of its children (e.g. the replies are stored in pre-order),
+ * so the children of the reply at index i are found in the range [i + 1, i + span).
+ * Data is referred to by offset (and not by pointer) because the buffer holding it might be moved when it grows.
+ */
+struct _Reply
+{
+    size_t offset; //offset of data in buffer
+    size_t len; //length of data, or number of children for aggregate replies
+    unsigned int span; //number of records taken by this reply, including its children
+    signed char type; //ReplyType
+    unsigned char flags;
+    unsigned short depth; //nesting depth, 0 for top-level replies
+};
+
+typedef struct _ReplyArray
+{
+    Buffer *replies; //the records
+    Buffer *top; //indices of the top-level replies, in the order they were committed
+    size_t committed; //number of records belonging to committed replies
+    size_t lazy_threshold; //multibulk replies with at least this many children are stored lazily, 0 disables
+} ReplyArray;
+
+void ReplyArray_init(ReplyArray *replies);
+void ReplyArray_clear(ReplyArray *replies);
+void ReplyArray_release(ReplyArray *replies);
+
+size_t ReplyArray_add(ReplyArray *replies, ReplyType type, size_t offset, size_t len, int depth);
+void ReplyArray_close(ReplyArray *replies, size_t index);
+void ReplyArray_commit(ReplyArray *replies);
+size_t ReplyArray_commit_aside(ReplyArray *replies);
+void ReplyArray_commit_children(ReplyArray *replies);
+void ReplyArray_rollback(ReplyArray *replies);
+
+/**
+ * Whether replies of this type have children (multibulk, map, set and push replies).
+ */
+static inline int Reply_is_aggregate(ReplyType type)
+{
+    return type == RT_MULTIBULK || type == RT_MAP || type == RT_SET || type == RT_PUSH;
+}
+
+/**
+ * Whether replies of this type have data (and not just a length or number of children).
+ */
+static inline int Reply_has_data(ReplyType type)
+{
+    switch(type) {
+    case RT_OK:
+    case RT_ERROR:
+    case RT_BULK:
+    case RT_INTEGER:
+    case RT_DOUBLE:
+    case RT_BOOLEAN:
+    case RT_BIG_NUMBER:
+    case RT_VERBATIM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static inline size_t ReplyArray_count(ReplyArray *replies)
+{
+    return Buffer_position(replies->replies) / sizeof(Reply);
+}
+
+static inline Reply *ReplyArray_get(ReplyArray *replies, size_t index)
+{
+    return ((Reply *)Buffer_data(replies->replies)) + index;
+}
+
+static inline size_t ReplyArray_top_count(ReplyArray *replies)
+{
+    return Buffer_position(replies->top) / sizeof(size_t);
+}
+
+static inline size_t ReplyArray_top(ReplyArray *replies, size_t index)
+{
+    return ((size_t *)Buffer_data(replies->top))[index];
+}
 
 #endif /* REPLY_H_ */
@@ -0,0 +1,166 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Helpers for scanning the protocol stream in larger steps than a byte at a time.
+ * On x86 the search for the terminating CR uses SSE2 or AVX2, picked at runtime by Scan_init (called from Module_init).
+ * Other platforms use a scalar fallback.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#define MAX_LENGTH_DIGITS 18
+
+static size_t Scan_find_cr_scalar(const Byte *data, size_t len)
+{
+    const Byte *cr = memchr(data, CR, len);
+    return cr == NULL ? len : (size_t)(cr - data);
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static size_t Scan_find_cr_sse2(const Byte *data, size_t len)
+{
+    size_t i = 0;
+    __m128i cr = _mm_set1_epi8(CR);
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for(; i < len; i++) {
+        if(data[i] == CR) {
+            return i;
+        }
+    }
+    return len;
+}
+
+__attribute__((target("avx2")))
+static size_t Scan_find_cr_avx2(const Byte *data, size_t len)
+{
+    size_t i = 0;
+    __m256i cr = _mm256_set1_epi8(CR);
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if(i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(CR)));
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    for(; i < len; i++) {
+        if(data[i] == CR) {
+            return i;
+        }
+    }
+    return len;
+}
+#endif
+
+/**
+ * Returns the offset of the first CR in data, or len if there is none.
+ */
+size_t (*Scan_find_cr)(const Byte *data, size_t len) = Scan_find_cr_scalar;
+
+void Scan_init()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        DEBUG(("Scan using avx2\n"));
+        Scan_find_cr = Scan_find_cr_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+        DEBUG(("Scan using sse2\n"));
+        Scan_find_cr = Scan_find_cr_sse2;
+    }
+#endif
+}
+
+/**
+ * Parses a length (or count) as found after '$' and '*' in the protocol, e.g. the "42\r\n" of "$42\r\n", including the
+ * terminating CRLF. -1 is accepted for nil replies.
+ * Returns the number of bytes taken, 0 if data does not yet contain the complete length, and -1 if it is not a valid length.
+ */
+int Scan_length(const Byte *data, size_t len, long *value)
+{
+    size_t i = 0;
+    int negative = 0;
+    if(len > 0 && data[0] == '-') {
+        negative = 1;
+        i = 1;
+    }
+    size_t max = MIN(len - i, MAX_LENGTH_DIGITS + 1);
+    size_t digits = Scan_find_cr(data + i, max);
+    if(digits == max) {
+        return (max == MAX_LENGTH_DIGITS + 1) ? -1 : 0;
+    }
+    if(digits == 0) {
+        return -1;
+    }
+    size_t cr = i + digits;
+    if(cr + 1 >= len) {
+        return 0;
+    }
+    if(data[cr + 1] != LF) {
+        return -1;
+    }
+
+    long n = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if(digits <= 8 && i + 8 <= len) {
+        //check and convert up to 8 digits at once, with the digits shifted up so that missing digits become leading zeros
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        int shift = (8 - digits) * 8;
+        uint64_t mask = ~0ULL << shift;
+        v <<= shift;
+        if((v & (0xF0F0F0F0F0F0F0F0ULL & mask)) != (0x3030303030303030ULL & mask) ||
+           ((v + (0x0606060606060606ULL & mask)) & (0xF0F0F0F0F0F0F0F0ULL & mask)) != (0x3030303030303030ULL & mask)) {
+            return -1;
+        }
+        v &= 0x0F0F0F0F0F0F0F0FULL;
+        v = (v * 2561) >> 8;
+        v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+        v = ((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+        n = (long)v;
+    }
+    else
+#endif
+    {
+        for(size_t j = i; j < cr; j++) {
+            Byte c = data[j];
+            if(c < '0' || c > '9') {
+                return -1;
+            }
+            n = (n * 10) + (c - '0');
+        }
+    }
+    *value = negative ? -n : n;
+    return cr + 2;
+}
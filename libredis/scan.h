@@ -0,0 +1,21 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+void Scan_init();
+
+extern size_t (*Scan_find_cr)(const Byte *data, size_t len);
+int Scan_length(const Byte *data, size_t len, long *value);
+
+#endif
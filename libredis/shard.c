@@ -0,0 +1,106 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * A Shard is a primary with its replicas. Batches that may write go to the primary, read-only batches go to the replica
+ * with the lowest latency, as measured by the executor for the batches executed on each connection (see
+ * Connection_get_latency). A replica that is slow or failing is only chosen again once its average drops below that of
+ * the others, so now and then a read goes to the next replica in turn instead, to keep the average of each up to date.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "batch.h"
+
+#define MAX_REPLICAS 16
+#define PROBE_INTERVAL 64 //every so many reads go to the next replica in turn, regardless of its latency
+
+struct _Shard
+{
+    Connection *primary;
+    Connection *replicas[MAX_REPLICAS];
+    int num_replicas;
+    unsigned int num_reads;
+};
+
+Shard *Shard_new(Connection *primary)
+{
+    if(primary == NULL) {
+        Module_set_error(GET_MODULE(), "Shard needs a primary");
+        return NULL;
+    }
+    Shard *shard = Alloc_alloc_T(Shard);
+    if(shard == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating Shard");
+        return NULL;
+    }
+    shard->primary = primary;
+    shard->num_replicas = 0;
+    shard->num_reads = 0;
+    return shard;
+}
+
+void Shard_free(Shard *shard)
+{
+    if(shard == NULL) {
+        return;
+    }
+    Alloc_free_T(shard, Shard);
+}
+
+int Shard_add_replica(Shard *shard, Connection *replica)
+{
+    if(replica == NULL) {
+        Module_set_error(GET_MODULE(), "Invalid replica");
+        return -1;
+    }
+    if(shard->num_replicas >= MAX_REPLICAS) {
+        Module_set_error(GET_MODULE(), "Shard is full, max replicas = %d", MAX_REPLICAS);
+        return -1;
+    }
+    shard->replicas[shard->num_replicas++] = replica;
+    return 0;
+}
+
+Connection *Shard_get_primary(Shard *shard)
+{
+    return shard->primary;
+}
+
+Connection *Shard_get_replica(Shard *shard)
+{
+    if(shard->num_replicas == 0) {
+        return shard->primary;
+    }
+    shard->num_reads++;
+    if(shard->num_reads % PROBE_INTERVAL == 0) {
+        return shard->replicas[(shard->num_reads / PROBE_INTERVAL) % shard->num_replicas];
+    }
+    //a replica without any batches yet has latency 0, so it is tried first
+    Connection *best = shard->replicas[0];
+    double best_latency = Connection_get_latency(best);
+    for(int i = 1; i < shard->num_replicas; i++) {
+        double latency = Connection_get_latency(shard->replicas[i]);
+        if(latency < best_latency) {
+            best = shard->replicas[i];
+            best_latency = latency;
+        }
+    }
+    return best;
+}
+
+Connection *Shard_get_connection(Shard *shard, Batch *batch)
+{
+    if(Batch_is_read_only(batch)) {
+        return Shard_get_replica(shard);
+    }
+    return shard->primary;
+}
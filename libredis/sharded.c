@@ -0,0 +1,500 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "batch.h"
+#include "buffer.h"
+#include "reply.h"
+#include "sharded.h"
+
+#define ENTRY_SIMPLE 0 //command sent as-is to 1 shard
+#define ENTRY_GATHER 1 //MGET split over shards, the reply is gathered from the replies of the parts in key order
+#define ENTRY_SUM 2 //DEL (and alike) split over shards, the reply is the sum of the integer replies of the parts
+#define ENTRY_ALL_OK 3 //MSET split over shards, the reply is OK if all parts replied OK
+
+typedef struct _ShardedEntry
+{
+    int kind;
+    int shard; //for ENTRY_SIMPLE
+    size_t parts; //offset in the parts buffer: the shard of each key for ENTRY_GATHER, the shards used otherwise
+    size_t num_parts;
+} ShardedEntry;
+
+typedef struct _ShardedReply
+{
+    ReplyType type;
+    char *data;
+    size_t len;
+} ShardedReply;
+
+struct _ShardedBatch
+{
+    Ketama *ketama;
+    Connection **connections;
+    Shard **shards; //instead of connections, if the servers have replicas
+    int num_shards;
+    Batch **batches; //batch for each shard, created when first used
+
+    Buffer *entries; //a ShardedEntry for each command, in order
+    Buffer *parts; //ints, see ShardedEntry
+
+    //iterator state
+    size_t current_entry;
+    size_t current_part; //next part of the ENTRY_GATHER being iterated
+    ShardedReply *headers; //for each shard the reply to its part of the ENTRY_GATHER being iterated
+    int forward_shard; //shard whose reply is being returned, -1 if none
+    size_t forward_pending; //number of replies still to be returned from the forward shard
+    char sum[32]; //data of the reply of an ENTRY_SUM
+};
+
+const char *Sharded_hash_tag(const char *key, size_t *key_len)
+{
+    //if the key contains a non-empty {...} section, only that part is hashed, so related keys can be kept together
+    const char *open = memchr(key, '{', *key_len);
+    if(open != NULL) {
+        const char *close = memchr(open + 1, '}', *key_len - (open + 1 - key));
+        if(close != NULL && close > open + 1) {
+            *key_len = close - (open + 1);
+            return open + 1;
+        }
+    }
+    return key;
+}
+
+static ShardedBatch *ShardedBatch_create(Ketama *ketama, Connection **connections, Shard **shards)
+{
+    int num_shards = Ketama_get_server_count(ketama);
+    if(num_shards == 0 || (connections == NULL && shards == NULL)) {
+        Module_set_error(GET_MODULE(), "ShardedBatch needs a ketama with servers and a connection for each server");
+        return NULL;
+    }
+    ShardedBatch *sharded = Alloc_alloc_T(ShardedBatch);
+    sharded->ketama = ketama;
+    sharded->connections = connections;
+    sharded->shards = shards;
+    sharded->num_shards = num_shards;
+    sharded->batches = Alloc_alloc(sizeof(Batch *) * num_shards);
+    sharded->headers = Alloc_alloc(sizeof(ShardedReply) * num_shards);
+    for(int i = 0; i < num_shards; i++) {
+        sharded->batches[i] = NULL;
+    }
+    sharded->entries = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    sharded->parts = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    sharded->current_entry = 0;
+    sharded->current_part = 0;
+    sharded->forward_shard = -1;
+    sharded->forward_pending = 0;
+    return sharded;
+}
+
+ShardedBatch *ShardedBatch_new(Ketama *ketama, Connection **connections)
+{
+    return ShardedBatch_create(ketama, connections, NULL);
+}
+
+ShardedBatch *ShardedBatch_new_replicated(Ketama *ketama, Shard **shards)
+{
+    return ShardedBatch_create(ketama, NULL, shards);
+}
+
+void ShardedBatch_free(ShardedBatch *sharded)
+{
+    for(int i = 0; i < sharded->num_shards; i++) {
+        if(sharded->batches[i] != NULL) {
+            Batch_free(sharded->batches[i]);
+        }
+    }
+    Alloc_free(sharded->batches, sizeof(Batch *) * sharded->num_shards);
+    Alloc_free(sharded->headers, sizeof(ShardedReply) * sharded->num_shards);
+    Buffer_free(sharded->entries);
+    Buffer_free(sharded->parts);
+    Alloc_free_T(sharded, ShardedBatch);
+}
+
+static int ShardedBatch_get_shard(ShardedBatch *sharded, const char *key, size_t key_len)
+{
+    const char *tag = Sharded_hash_tag(key, &key_len);
+    int shard = Ketama_get_server_ordinal(sharded->ketama, tag, key_len);
+    if(shard < 0 || shard >= sharded->num_shards) {
+        Module_set_error(GET_MODULE(), "No server for key, was the continuum created?");
+        return -1;
+    }
+    if((sharded->shards != NULL) ? sharded->shards[shard] == NULL : sharded->connections[shard] == NULL) {
+        Module_set_error(GET_MODULE(), "No connection for server: %s", Ketama_get_server_address(sharded->ketama, shard));
+        return -1;
+    }
+    return shard;
+}
+
+static Batch *ShardedBatch_get_batch(ShardedBatch *sharded, int shard)
+{
+    if(shard < 0 || shard >= sharded->num_shards) {
+        return NULL;
+    }
+    if(sharded->batches[shard] == NULL) {
+        sharded->batches[shard] = Batch_new();
+    }
+    return sharded->batches[shard];
+}
+
+Batch *ShardedBatch_get_batch_of(ShardedBatch *sharded, int shard)
+{
+    return (shard >= 0 && shard < sharded->num_shards) ? sharded->batches[shard] : NULL;
+}
+
+static void ShardedBatch_add_entry(ShardedBatch *sharded, int kind, int shard, const int *parts, size_t num_parts)
+{
+    ShardedEntry *entry = (ShardedEntry *)Buffer_extend(sharded->entries, sizeof(ShardedEntry));
+    entry->kind = kind;
+    entry->shard = shard;
+    entry->parts = Buffer_position(sharded->parts) / sizeof(int);
+    entry->num_parts = num_parts;
+    if(num_parts > 0) {
+        Buffer_write(sharded->parts, (const Byte *)parts, sizeof(int) * num_parts);
+    }
+}
+
+/**
+ * Writes a command whose arguments after the command name are groups of 'step' arguments starting with a key
+ * (e.g. keys for MGET, key value pairs for MSET). The command is split into a command for each shard holding some
+ * of the keys.
+ */
+static int ShardedBatch_write_split(ShardedBatch *sharded, int kind, int step, int argc, const char **argv, const size_t *argvlen)
+{
+    int num_groups = (argc - 1) / step;
+    if(num_groups < 1 || (argc - 1) % step != 0) {
+        Module_set_error(GET_MODULE(), "Wrong number of arguments for %.*s", (int)argvlen[0], argv[0]);
+        return -1;
+    }
+
+    //find the shard of each key, and the shards used (in order of first use)
+    int *shards = Alloc_alloc(sizeof(int) * num_groups * 2);
+    int *used = shards + num_groups;
+    int num_used = 0;
+    for(int i = 0; i < num_groups; i++) {
+        int shard = ShardedBatch_get_shard(sharded, argv[1 + i * step], argvlen[1 + i * step]);
+        if(shard == -1) {
+            Alloc_free(shards, sizeof(int) * num_groups * 2);
+            return -1;
+        }
+        shards[i] = shard;
+        int j = 0;
+        while(j < num_used && used[j] != shard) {
+            j++;
+        }
+        if(j == num_used) {
+            used[num_used++] = shard;
+        }
+    }
+
+    if(num_used == 1) {
+        Batch_write_command(ShardedBatch_get_batch(sharded, used[0]), argc, argv, argvlen);
+        ShardedBatch_add_entry(sharded, ENTRY_SIMPLE, used[0], NULL, 0);
+    }
+    else {
+        const char **part_argv = Alloc_alloc(sizeof(char *) * argc);
+        size_t *part_argvlen = Alloc_alloc(sizeof(size_t) * argc);
+        part_argv[0] = argv[0];
+        part_argvlen[0] = argvlen[0];
+        for(int j = 0; j < num_used; j++) {
+            int part_argc = 1;
+            for(int i = 0; i < num_groups; i++) {
+                if(shards[i] == used[j]) {
+                    memcpy(part_argv + part_argc, argv + 1 + i * step, sizeof(char *) * step);
+                    memcpy(part_argvlen + part_argc, argvlen + 1 + i * step, sizeof(size_t) * step);
+                    part_argc += step;
+                }
+            }
+            Batch_write_command(ShardedBatch_get_batch(sharded, used[j]), part_argc, part_argv, part_argvlen);
+        }
+        Alloc_free(part_argv, sizeof(char *) * argc);
+        Alloc_free(part_argvlen, sizeof(size_t) * argc);
+        if(kind == ENTRY_GATHER) {
+            ShardedBatch_add_entry(sharded, kind, -1, shards, num_groups);
+        }
+        else {
+            ShardedBatch_add_entry(sharded, kind, -1, used, num_used);
+        }
+    }
+
+    Alloc_free(shards, sizeof(int) * num_groups * 2);
+    return 0;
+}
+
+static inline int ShardedBatch_is_command(const char *name, size_t name_len, const char *command)
+{
+    return name_len == strlen(command) && strncasecmp(name, command, name_len) == 0;
+}
+
+int ShardedBatch_write_command(ShardedBatch *sharded, int argc, const char **argv, const size_t *argvlen)
+{
+    if(argc < 2) {
+        Module_set_error(GET_MODULE(), "Command needs a key to be routed");
+        return -1;
+    }
+
+    size_t stack_argvlen[16];
+    size_t *lens = stack_argvlen;
+    if(argvlen == NULL) {
+        if(argc > 16) {
+            lens = Alloc_alloc(sizeof(size_t) * argc);
+        }
+        for(int i = 0; i < argc; i++) {
+            lens[i] = strlen(argv[i]);
+        }
+    }
+    else {
+        lens = (size_t *)argvlen;
+    }
+
+    int res = 0;
+    if(ShardedBatch_is_command(argv[0], lens[0], "MGET")) {
+        res = ShardedBatch_write_split(sharded, ENTRY_GATHER, 1, argc, argv, lens);
+    }
+    else if(ShardedBatch_is_command(argv[0], lens[0], "DEL") ||
+            ShardedBatch_is_command(argv[0], lens[0], "UNLINK") ||
+            ShardedBatch_is_command(argv[0], lens[0], "EXISTS") ||
+            ShardedBatch_is_command(argv[0], lens[0], "TOUCH")) {
+        res = ShardedBatch_write_split(sharded, ENTRY_SUM, 1, argc, argv, lens);
+    }
+    else if(ShardedBatch_is_command(argv[0], lens[0], "MSET")) {
+        res = ShardedBatch_write_split(sharded, ENTRY_ALL_OK, 2, argc, argv, lens);
+    }
+    else {
+        int shard = ShardedBatch_get_shard(sharded, argv[1], lens[1]);
+        if(shard == -1) {
+            res = -1;
+        }
+        else {
+            Batch_write_command(ShardedBatch_get_batch(sharded, shard), argc, argv, lens);
+            ShardedBatch_add_entry(sharded, ENTRY_SIMPLE, shard, NULL, 0);
+        }
+    }
+
+    if(lens != stack_argvlen && lens != argvlen) {
+        Alloc_free(lens, sizeof(size_t) * argc);
+    }
+    return res;
+}
+
+int ShardedBatch_execute(ShardedBatch *sharded, int timeout_ms)
+{
+    Executor *executor = Executor_new();
+    for(int i = 0; i < sharded->num_shards; i++) {
+        Batch *batch = sharded->batches[i];
+        if(batch != NULL && Batch_has_command(batch)) {
+            //with replicas, a batch that only reads goes to the fastest replica of the server
+            Connection *connection = (sharded->shards != NULL) ? Shard_get_connection(sharded->shards[i], batch) : sharded->connections[i];
+            if(-1 == Executor_add(executor, connection, batch)) {
+                Executor_free(executor);
+                return -1;
+            }
+        }
+    }
+    int res = Executor_execute(executor, timeout_ms);
+    Executor_free(executor);
+    return res;
+}
+
+/**
+ * Reads the next reply (or child) from the batch of a shard, keeping track of the number of replies that still follow
+ * as children in *pending.
+ */
+static inline int ShardedBatch_read(Batch *batch, size_t *pending, ShardedReply *reply)
+{
+    int level = Batch_next_reply(batch, &reply->type, &reply->data, &reply->len);
+    if(level <= 0) {
+        Module_set_error(GET_MODULE(), "Missing reply from shard");
+        return -1;
+    }
+    *pending -= 1;
+    if(Reply_is_aggregate(reply->type)) {
+        *pending += reply->len;
+    }
+    return level;
+}
+
+/**
+ * Reads the next reply to a command from the batch of a shard, skipping any push replies, but not its children.
+ * Returns the number of children that follow.
+ */
+static int ShardedBatch_read_top(Batch *batch, ShardedReply *reply, size_t *pending)
+{
+    while(1) {
+        *pending = 1;
+        if(-1 == ShardedBatch_read(batch, pending, reply)) {
+            return -1;
+        }
+        if(reply->type != RT_PUSH) {
+            return 0;
+        }
+        ShardedReply child;
+        while(*pending > 0) {
+            if(-1 == ShardedBatch_read(batch, pending, &child)) {
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * Reads a complete reply to a command from the batch of a shard, any children are skipped.
+ */
+static int ShardedBatch_read_whole(Batch *batch, ShardedReply *reply)
+{
+    size_t pending;
+    if(-1 == ShardedBatch_read_top(batch, reply, &pending)) {
+        return -1;
+    }
+    ShardedReply child;
+    while(pending > 0) {
+        if(-1 == ShardedBatch_read(batch, &pending, &child)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline int ShardedBatch_return(ShardedReply *reply, ReplyType *reply_type, char **data, size_t *len, int level)
+{
+    *reply_type = reply->type;
+    *data = reply->data;
+    *len = reply->len;
+    return level;
+}
+
+int ShardedBatch_next_reply(ShardedBatch *sharded, ReplyType *reply_type, char **data, size_t *len)
+{
+    if(reply_type == NULL || data == NULL || len == NULL) {
+        Module_set_error(GET_MODULE(), "Invalid argument");
+        return -1;
+    }
+
+    *reply_type = RT_NONE;
+    *data = NULL;
+    *len = 0;
+
+    ShardedReply reply;
+    if(sharded->forward_shard != -1) {
+        //children of a reply that is returned as-is
+        int level = ShardedBatch_read(sharded->batches[sharded->forward_shard], &sharded->forward_pending, &reply);
+        if(level == -1) {
+            return -1;
+        }
+        if(sharded->forward_pending == 0) {
+            sharded->forward_shard = -1;
+        }
+        return ShardedBatch_return(&reply, reply_type, data, len, level);
+    }
+
+    size_t num_entries = Buffer_position(sharded->entries) / sizeof(ShardedEntry);
+    if(sharded->current_entry == num_entries) {
+        return 0;
+    }
+    ShardedEntry *entry = ((ShardedEntry *)Buffer_data(sharded->entries)) + sharded->current_entry;
+    int *parts = ((int *)Buffer_data(sharded->parts)) + entry->parts;
+
+    switch(entry->kind) {
+    case ENTRY_SIMPLE: {
+        Batch *batch = sharded->batches[entry->shard];
+        size_t pending;
+        if(-1 == ShardedBatch_read_top(batch, &reply, &pending)) {
+            return -1;
+        }
+        if(pending > 0) {
+            sharded->forward_shard = entry->shard;
+            sharded->forward_pending = pending;
+        }
+        sharded->current_entry += 1;
+        return ShardedBatch_return(&reply, reply_type, data, len, 1);
+    }
+    case ENTRY_GATHER: {
+        if(sharded->current_part == 0) {
+            //start with the multibulk header, and read the headers of the replies of all shards involved
+            for(size_t i = 0; i < entry->num_parts; i++) {
+                sharded->headers[parts[i]].type = RT_NONE;
+            }
+            for(size_t i = 0; i < entry->num_parts; i++) {
+                ShardedReply *header = &sharded->headers[parts[i]];
+                if(header->type == RT_NONE) {
+                    size_t pending;
+                    if(-1 == ShardedBatch_read_top(sharded->batches[parts[i]], header, &pending)) {
+                        return -1;
+                    }
+                }
+            }
+            sharded->current_part = 1;
+            *reply_type = RT_MULTIBULK;
+            *len = entry->num_parts;
+            return 1;
+        }
+        int shard = parts[sharded->current_part - 1];
+        sharded->current_part += 1;
+        if(sharded->current_part > entry->num_parts) {
+            sharded->current_part = 0;
+            sharded->current_entry += 1;
+        }
+        ShardedReply *header = &sharded->headers[shard];
+        if(header->type != RT_MULTIBULK) {
+            //e.g. an error, it is the reply for each key of this shard
+            return ShardedBatch_return(header, reply_type, data, len, 2);
+        }
+        size_t pending = 1;
+        int level = ShardedBatch_read(sharded->batches[shard], &pending, &reply);
+        if(level == -1) {
+            return -1;
+        }
+        if(pending > 0) {
+            sharded->forward_shard = shard;
+            sharded->forward_pending = pending;
+        }
+        return ShardedBatch_return(&reply, reply_type, data, len, level);
+    }
+    case ENTRY_SUM:
+    case ENTRY_ALL_OK: {
+        ShardedReply error = {RT_NONE, NULL, 0};
+        long sum = 0;
+        for(size_t i = 0; i < entry->num_parts; i++) {
+            if(-1 == ShardedBatch_read_whole(sharded->batches[parts[i]], &reply)) {
+                return -1;
+            }
+            if(reply.type == RT_INTEGER) {
+                sum += strtol(reply.data, NULL, 10);
+            }
+            else if(reply.type != RT_OK && error.type == RT_NONE) {
+                error = reply;
+            }
+        }
+        sharded->current_entry += 1;
+        if(error.type != RT_NONE) {
+            return ShardedBatch_return(&error, reply_type, data, len, 1);
+        }
+        if(entry->kind == ENTRY_SUM) {
+            *reply_type = RT_INTEGER;
+            *len = snprintf(sharded->sum, sizeof(sharded->sum), "%ld", sum);
+            *data = sharded->sum;
+        }
+        else {
+            *reply_type = RT_OK;
+            *len = 2;
+            *data = "OK";
+        }
+        return 1;
+    }
+    default:
+        assert(0);
+        return -1;
+    }
+}
@@ -0,0 +1,20 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+#ifndef __SHARDED_H
+#define __SHARDED_H
+
+#include "redis.h"
+#include "common.h"
+
+const char *Sharded_hash_tag(const char *key, size_t *key_len);
+
+//the batch of the commands for a shard, NULL if none were written for it (private interface to tests)
+Batch *ShardedBatch_get_batch_of(ShardedBatch *sharded, int shard);
+
+#endif
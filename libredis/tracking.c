@@ -0,0 +1,322 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Client side caching of string values, kept coherent by the server (CLIENT TRACKING). The connection that reads the
+ * values has tracking enabled on every (re)connect, with its invalidations redirected to a second connection that uses
+ * RESP3, on which the server pushes them without further commands (no SUBSCRIBE needed).
+ * The server only tracks the keys read on the current socket of the connection, so the cache is flushed whenever it
+ * reconnects, and when the invalidation connection is lost (the cache is then set up again with its new client id).
+ * Values fetched are stored before the invalidations that came in meanwhile are applied, so that an invalidation
+ * that crossed the reply to the GET is not lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+#include "alloc.h"
+#include "batch.h"
+#include "buffer.h"
+#include "connection.h"
+#include "cache.h"
+
+#define CACHE_MISS ((size_t)-1)
+#define CACHE_NIL ((size_t)-2)
+
+struct _ClientCache
+{
+    Connection *connection; //to read the values, with tracking
+    Connection *invalidations; //that the invalidations are redirected to
+    int tracking; //whether the invalidation connection is set up
+    unsigned int connects; //of the connection, when the cache was last flushed
+    Cache *cache;
+    Batch *batch; //values fetched by the last get, returned from its replies
+    Buffer *values; //values found by the last get, returned from here
+    long hits;
+    long misses;
+    long num_invalidations;
+};
+
+ClientCache *ClientCache_new(Connection *connection, Connection *invalidations, size_t max_memory)
+{
+    if(connection == NULL || invalidations == NULL || connection == invalidations) {
+        Module_set_error(GET_MODULE(), "ClientCache needs two different connections");
+        return NULL;
+    }
+    ClientCache *cc = Alloc_alloc_T(ClientCache);
+    if(cc == NULL) {
+        Module_set_error(GET_MODULE(), "Out of memory while allocating ClientCache");
+        return NULL;
+    }
+    cc->cache = Cache_new(max_memory, 0);
+    if(cc->cache == NULL) {
+        Alloc_free_T(cc, ClientCache);
+        return NULL;
+    }
+    cc->connection = connection;
+    cc->invalidations = invalidations;
+    cc->tracking = 0;
+    cc->connects = Connection_get_connects(connection);
+    cc->batch = NULL;
+    cc->values = Buffer_new(DEFAULT_COMMAND_BUFF_SIZE);
+    cc->hits = 0;
+    cc->misses = 0;
+    cc->num_invalidations = 0;
+    Connection_set_protocol(invalidations, 3);
+    return cc;
+}
+
+void ClientCache_free(ClientCache *cc)
+{
+    if(cc == NULL) {
+        return;
+    }
+    //closes the socket, so the server stops tracking for it
+    Connection_set_tracking(cc->connection, -1);
+    if(cc->batch != NULL) {
+        Batch_free(cc->batch);
+    }
+    Buffer_free(cc->values);
+    Cache_free(cc->cache);
+    Alloc_free_T(cc, ClientCache);
+}
+
+/**
+ * Asks the client id of the invalidation connection and enables tracking with redirection to it on the connection
+ * (which is closed for that, tracking is enabled when it connects again). Flushes the cache.
+ */
+static int ClientCache_track(ClientCache *cc, int timeout_ms)
+{
+    static const char client_id[] = "*2\r\n$6\r\nCLIENT\r\n$2\r\nID\r\n";
+    cc->tracking = 0;
+    Cache_clear(cc->cache);
+
+    Batch *batch = Batch_new();
+    Batch_write(batch, client_id, sizeof(client_id) - 1, 1);
+    Executor *executor = Executor_new();
+    int res = Executor_add(executor, cc->invalidations, batch);
+    if(res == 0) {
+        res = Executor_execute(executor, timeout_ms);
+    }
+    Executor_free(executor);
+
+    long id = -1;
+    ReplyType type;
+    char *data;
+    size_t len;
+    if(res == 1 && Batch_next_reply(batch, &type, &data, &len) == 1 && type == RT_INTEGER) {
+        id = strtol(data, NULL, 10); //the data is followed by CRLF
+    }
+    //from now on the replies that arrive on the invalidation connection are read as pushes
+    if(id >= 0 && Connection_read_pushes(cc->invalidations) == NULL) {
+        id = -1;
+    }
+    if(id < 0) {
+        if(res != -1) {
+            Module_set_error(GET_MODULE(), "Could not get the client id for invalidations: %s",
+                    (Batch_error(batch) != NULL) ? Batch_error(batch) : "unexpected reply to CLIENT ID");
+        }
+        Batch_free(batch);
+        return -1;
+    }
+    Batch_free(batch);
+
+    Connection_set_tracking(cc->connection, id);
+    cc->tracking = 1;
+    return 0;
+}
+
+/**
+ * Applies the invalidations that were pushed by now. An invalidation is a push of 'invalidate' with the keys, or nil
+ * when the server flushed its database (or its tracking table overflowed), in which case all keys are invalidated.
+ */
+static int ClientCache_invalidate(ClientCache *cc, int timeout_ms)
+{
+    Batch *pushes = cc->tracking ? Connection_read_pushes(cc->invalidations) : NULL;
+    if(pushes == NULL) {
+        return ClientCache_track(cc, timeout_ms);
+    }
+    int level;
+    int invalidate = 0;
+    ReplyType type;
+    char *data;
+    size_t len;
+    while((level = Batch_next_reply(pushes, &type, &data, &len)) > 0) {
+        if(level == 1) {
+            invalidate = 0;
+        }
+        else if(level == 2 && type == RT_BULK && len == 10 && memcmp(data, "invalidate", 10) == 0) {
+            invalidate = 1;
+        }
+        else if(level == 2 && invalidate && (type == RT_NIL || type == RT_BULK_NIL || type == RT_MULTIBULK_NIL)) {
+            Cache_clear(cc->cache);
+            cc->num_invalidations++;
+        }
+        else if(level == 3 && invalidate && type == RT_BULK) {
+            Cache_remove(cc->cache, data, len);
+            cc->num_invalidations++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Flushes the cache if the connection was made again since the last flush, as the server did not track the values
+ * cached before that, or if it is not connected, as the invalidations of the server stop when the connection is lost.
+ */
+static void ClientCache_check_connection(ClientCache *cc)
+{
+    unsigned int connects = Connection_get_connects(cc->connection);
+    if(connects != cc->connects || !Connection_is_connected(cc->connection)) {
+        Cache_clear(cc->cache);
+        cc->connects = connects;
+    }
+}
+
+/**
+ * Fetches the values of the keys that were not in the cache with a GET for each, and stores them in the cache.
+ */
+static int ClientCache_fetch(ClientCache *cc, const char **keys, const size_t *key_lens, size_t *offsets, size_t n,
+        int timeout_ms)
+{
+    Batch *batch = Batch_new();
+    for(size_t i = 0; i < n; i++) {
+        if(offsets[i] == CACHE_MISS) {
+            Batch_write_get(batch, keys[i], key_lens[i]);
+        }
+    }
+    Executor *executor = Executor_new();
+    int res = Executor_add(executor, cc->connection, batch);
+    if(res == 0) {
+        res = Executor_execute(executor, timeout_ms);
+    }
+    Executor_free(executor);
+    cc->batch = batch;
+    if(res == 0) {
+        Module_set_error(GET_MODULE(), "Timeout while getting values");
+    }
+    else if(res == 1 && Batch_error(batch) != NULL) {
+        Module_set_error(GET_MODULE(), "Error while getting values: %s", Batch_error(batch));
+        res = -1;
+    }
+    if(res != 1) {
+        return -1;
+    }
+
+    ClientCache_check_connection(cc);
+    ReplyType type;
+    char *data;
+    size_t len;
+    size_t index = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(offsets[i] != CACHE_MISS) {
+            continue;
+        }
+        Batch_reply_at(batch, index++, &type, &data, &len);
+        if(type == RT_BULK) {
+            Cache_put(cc->cache, keys[i], key_lens[i], 0, type, data, len);
+        }
+        else if(type == RT_BULK_NIL || type == RT_NIL) {
+            Cache_put(cc->cache, keys[i], key_lens[i], 0, type, NULL, 0);
+        }
+        else {
+            Module_set_error(GET_MODULE(), "Unexpected reply to GET %.*s: %.*s", (int)MIN(key_lens[i], 128), keys[i],
+                    (type == RT_ERROR) ? (int)MIN(len, 128) : 0, data);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ClientCache_get(ClientCache *cc, size_t n, const char **keys, const size_t *key_lens, char **values,
+        size_t *value_lens, int timeout_ms)
+{
+    if(cc->batch != NULL) {
+        Batch_free(cc->batch);
+        cc->batch = NULL;
+    }
+    Buffer_clear(cc->values);
+    if(-1 == ClientCache_invalidate(cc, timeout_ms)) {
+        return -1;
+    }
+    //before any value is taken from the cache
+    ClientCache_check_connection(cc);
+    if(n == 0) {
+        return 0;
+    }
+
+    //the values found are copied, as storing the ones fetched may evict them
+    size_t *offsets = Alloc_alloc(sizeof(size_t) * n);
+    size_t num_misses = 0;
+    for(size_t i = 0; i < n; i++) {
+        int type;
+        char *value;
+        if(Cache_get(cc->cache, keys[i], key_lens[i], &type, &value, &value_lens[i])) {
+            if(type != RT_BULK) {
+                offsets[i] = CACHE_NIL;
+            }
+            else {
+                offsets[i] = Buffer_position(cc->values);
+                Buffer_write(cc->values, value, value_lens[i]);
+            }
+        }
+        else {
+            offsets[i] = CACHE_MISS;
+            num_misses++;
+        }
+    }
+    cc->hits += n - num_misses;
+    cc->misses += num_misses;
+
+    if(num_misses > 0) {
+        if(-1 == ClientCache_fetch(cc, keys, key_lens, offsets, n, timeout_ms) ||
+                -1 == ClientCache_invalidate(cc, timeout_ms)) {
+            Alloc_free(offsets, sizeof(size_t) * n);
+            return -1;
+        }
+    }
+
+    ReplyType type;
+    size_t index = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(offsets[i] == CACHE_MISS) {
+            Batch_reply_at(cc->batch, index++, &type, &values[i], &value_lens[i]);
+            if(type != RT_BULK) {
+                values[i] = NULL;
+                value_lens[i] = 0;
+            }
+        }
+        else if(offsets[i] == CACHE_NIL) {
+            values[i] = NULL;
+            value_lens[i] = 0;
+        }
+        else {
+            values[i] = Buffer_data(cc->values) + offsets[i];
+        }
+    }
+    Alloc_free(offsets, sizeof(size_t) * n);
+    return 0;
+}
+
+long ClientCache_get_hits(ClientCache *cc)
+{
+    return cc->hits;
+}
+
+long ClientCache_get_misses(ClientCache *cc)
+{
+    return cc->misses;
+}
+
+long ClientCache_get_invalidations(ClientCache *cc)
+{
+    return cc->num_invalidations;
+}
@@ -0,0 +1,191 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Test of Ketama_migrate against the stand-in servers of redis_stub.py (127.0.0.1:17101-17104). The keys are placed
+ * on a ring of the first three servers, the fourth is added and the keys that changed server are migrated, once with
+ * the whole keys hashed and once with the hash tags hashed. Half of the keys have a hash tag, so that the two differ.
+ * usage: python3 redis_stub.py 17101 17102 17103 17104 & ./migrate_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libredis/redis.h"
+
+#define NUM_SERVERS 4
+#define NUM_PLAIN_KEYS 200
+#define NUM_USERS 40
+#define NUM_FIELDS 5
+#define NUM_KEYS (NUM_PLAIN_KEYS + NUM_USERS * NUM_FIELDS)
+#define TTL_MS 100000
+#define TIMEOUT_MS 2000
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+static Module *module;
+static Connection *connections[NUM_SERVERS];
+static char keys[NUM_KEYS][32];
+
+/**
+ * Executes a single command on the server, and copies its reply (if it is not an aggregate) into reply.
+ * Returns the type of the reply, RT_NONE if the command could not be executed.
+ */
+static ReplyType command(int server, int argc, const char **argv, char *reply, size_t reply_size)
+{
+	Batch *batch = Batch_new();
+	Batch_write_command(batch, argc, argv, NULL);
+	Executor *executor = Executor_new();
+	Executor_add(executor, connections[server], batch);
+	ReplyType type = RT_NONE;
+	char *data;
+	size_t len;
+	if(Executor_execute(executor, TIMEOUT_MS) == 1 && Batch_next_reply(batch, &type, &data, &len) == 1) {
+		if(reply != NULL) {
+			len = (data == NULL) ? 0 : (len < reply_size - 1) ? len : reply_size - 1;
+			memcpy(reply, data, len);
+			reply[len] = '\0';
+		}
+	}
+	else {
+		printf("could not execute %s on server %d: %s\n", argv[0], server, Module_last_error(module));
+	}
+	Executor_free(executor);
+	Batch_free(batch);
+	return type;
+}
+
+/**
+ * The server of the key like the clients place it, by the whole key or by its {hash tag} if it has a non empty one.
+ */
+static int place(KetamaRing *ring, const char *key, int hash_tags)
+{
+	size_t len = strlen(key);
+	const char *open = strchr(key, '{');
+	if(hash_tags && open != NULL) {
+		const char *close = strchr(open + 1, '}');
+		if(close != NULL && close > open + 1) {
+			return KetamaRing_get_server_ordinal(ring, open + 1, close - open - 1);
+		}
+	}
+	return KetamaRing_get_server_ordinal(ring, key, len);
+}
+
+static void test_migrate(int hash_tags)
+{
+	char reply[64];
+	char value[64];
+	for(int i = 0; i < NUM_SERVERS; i++) {
+		const char *flush[] = {"FLUSHDB"};
+		CHECK(command(i, 1, flush, NULL, 0) == RT_OK, "FLUSHDB on server %d", i);
+	}
+
+	Ketama *ketama = Ketama_new();
+	for(int i = 0; i < NUM_SERVERS - 1; i++) {
+		Ketama_add_server(ketama, "127.0.0.1", 17101 + i, 100);
+	}
+	Ketama_create_continuum(ketama);
+	KetamaRing *from = Ketama_acquire_ring(ketama);
+	Ketama_add_server(ketama, "127.0.0.1", 17101 + NUM_SERVERS - 1, 100);
+	KetamaRing *to = Ketama_acquire_ring(ketama);
+
+	//write the keys where the old ring puts them, every 7th with a time to live
+	int moving = 0;
+	int busy = -1;
+	for(int i = 0; i < NUM_KEYS; i++) {
+		int server = place(from, keys[i], hash_tags);
+		snprintf(value, sizeof(value), "v:%s", keys[i]);
+		const char *set[] = {"SET", keys[i], value};
+		CHECK(command(server, 3, set, reply, sizeof(reply)) == RT_OK, "SET %s", keys[i]);
+		if(i % 7 == 0) {
+			const char *pexpire[] = {"PEXPIRE", keys[i], "100000"};
+			CHECK(command(server, 3, pexpire, reply, sizeof(reply)) == RT_INTEGER && strcmp(reply, "1") == 0,
+					"PEXPIRE %s", keys[i]);
+		}
+		if(place(to, keys[i], hash_tags) != server) {
+			moving++;
+			if(busy == -1 && strchr(keys[i], '{') != NULL) {
+				busy = i;
+			}
+		}
+	}
+	CHECK(moving > 0 && busy != -1, "no keys with a hash tag move to the new server");
+	if(busy == -1) {
+		return;
+	}
+	//a client using the new ring already wrote this key on its new server, that value must be kept
+	const char *set_busy[] = {"SET", keys[busy], "newer"};
+	command(place(to, keys[busy], hash_tags), 3, set_busy, NULL, 0);
+
+	long moved = Ketama_migrate(from, to, connections, hash_tags, 16, TIMEOUT_MS);
+	CHECK(moved == moving - 1, "hash_tags %d: moved %ld keys, expected %d: %s", hash_tags, moved, moving - 1,
+			(moved == -1) ? Module_last_error(module) : "");
+
+	for(int i = 0; i < NUM_KEYS; i++) {
+		int server = place(to, keys[i], hash_tags);
+		for(int j = 0; j < NUM_SERVERS; j++) {
+			const char *exists[] = {"EXISTS", keys[i]};
+			command(j, 2, exists, reply, sizeof(reply));
+			CHECK(strcmp(reply, (j == server) ? "1" : "0") == 0, "hash_tags %d: %s %s on server %d (placed on %d)",
+					hash_tags, keys[i], (j == server) ? "missing" : "left", j, server);
+		}
+		const char *get[] = {"GET", keys[i]};
+		command(server, 2, get, reply, sizeof(reply));
+		snprintf(value, sizeof(value), "v:%s", keys[i]);
+		CHECK(strcmp(reply, (i == busy) ? "newer" : value) == 0, "hash_tags %d: %s is '%s'", hash_tags, keys[i], reply);
+		const char *pttl[] = {"PTTL", keys[i]};
+		command(server, 2, pttl, reply, sizeof(reply));
+		long ttl = atol(reply);
+		if(i % 7 == 0 && i != busy) {
+			CHECK(ttl > 0 && ttl <= TTL_MS, "hash_tags %d: time to live of %s is %ld", hash_tags, keys[i], ttl);
+		}
+		else {
+			CHECK(ttl == -1, "hash_tags %d: %s got time to live %ld", hash_tags, keys[i], ttl);
+		}
+	}
+
+	KetamaRing_release(from);
+	KetamaRing_release(to);
+	Ketama_free(ketama);
+}
+
+int main(int argc, char *argv[])
+{
+	module = Module_new();
+	Module_init(module);
+
+	char addr[32];
+	for(int i = 0; i < NUM_SERVERS; i++) {
+		snprintf(addr, sizeof(addr), "127.0.0.1:%d", 17101 + i);
+		connections[i] = Connection_new(addr);
+	}
+	for(int i = 0; i < NUM_PLAIN_KEYS; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key:%d", i);
+	}
+	for(int i = 0; i < NUM_USERS * NUM_FIELDS; i++) {
+		snprintf(keys[NUM_PLAIN_KEYS + i], sizeof(keys[0]), "{user%d}:f%d", i / NUM_FIELDS, i % NUM_FIELDS);
+	}
+
+	test_migrate(0);
+	test_migrate(1);
+
+	for(int i = 0; i < NUM_SERVERS; i++) {
+		Connection_free(connections[i]);
+	}
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all migrate tests passed\n");
+	return 0;
+}
@@ -0,0 +1,649 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Tests of the reply parser that need no Redis server. Random reply streams are generated together with the replies
+ * that Batch_next_reply should return for them, and are then parsed in one read, in reads of random size and a byte at a
+ * time, with and without lazy aggregate replies, and with the runtime picked Scan_find_cr as well as a scalar one.
+ * usage: ./parser_test [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libredis/redis.h"
+#include "libredis/module.h"
+#include "libredis/batch.h"
+#include "libredis/buffer.h"
+#include "libredis/parser.h"
+#include "libredis/reply.h"
+#include "libredis/scan.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+/**
+ * A reply stream and, one line per reply (children included), what Batch_next_reply returns for it.
+ */
+typedef struct _Stream
+{
+	Buffer *data;
+	Buffer *expected;
+	size_t count; //number of top-level replies
+} Stream;
+
+static size_t (*find_cr_runtime)(const Byte *data, size_t len);
+
+static size_t find_cr_scalar(const Byte *data, size_t len)
+{
+	for(size_t i = 0; i < len; i++) {
+		if(data[i] == CR) {
+			return i;
+		}
+	}
+	return len;
+}
+
+static void Stream_init(Stream *stream)
+{
+	stream->data = Buffer_new(1024);
+	stream->expected = Buffer_new(1024);
+	stream->count = 0;
+}
+
+static void Stream_release(Stream *stream)
+{
+	Buffer_free(stream->data);
+	Buffer_free(stream->expected);
+}
+
+static void expect(Buffer *expected, int level, ReplyType type, const char *data, size_t len)
+{
+	char tmp[64];
+	Buffer_write(expected, tmp, snprintf(tmp, sizeof(tmp), "%d %d %zu:", level, type, len));
+	if(data != NULL) {
+		Buffer_write(expected, data, len);
+	}
+	Buffer_write(expected, "\n", 1);
+}
+
+static void write_line(Stream *stream, int level, char prefix, ReplyType type, const char *line)
+{
+	char tmp[128];
+	Buffer_write(stream->data, tmp, snprintf(tmp, sizeof(tmp), "%c%s\r\n", prefix, line));
+	expect(stream->expected, level, type, (type == RT_NIL) ? NULL : line, strlen(line));
+}
+
+static void write_bulk(Stream *stream, int level, char prefix, ReplyType type, const char *data, size_t len)
+{
+	char header[32];
+	Buffer_write(stream->data, header, snprintf(header, sizeof(header), "%c%zu\r\n", prefix, len));
+	Buffer_write(stream->data, data, len);
+	Buffer_write(stream->data, "\r\n", 2);
+	expect(stream->expected, level, type, data, len);
+}
+
+static void write_aggregate(Stream *stream, int level, char prefix, ReplyType type, size_t count)
+{
+	char header[32];
+	Buffer_write(stream->data, header, snprintf(header, sizeof(header), "%c%zu\r\n", prefix, count));
+	expect(stream->expected, level, type, NULL, (type == RT_MAP) ? count * 2 : count);
+}
+
+static size_t random_length()
+{
+	switch(rand() % 4) {
+	case 0: return rand() % 4;
+	case 1: return 14 + rand() % 20; //around the width of a vector
+	case 2: return rand() % 200;
+	default: return rand() % 5000; //spans reads
+	}
+}
+
+/**
+ * Generates a random reply, with aggregate replies nested up to max_depth.
+ */
+static void generate(Stream *stream, int level, int max_depth)
+{
+	static char data[5000];
+	char line[64];
+	size_t len = random_length();
+	for(size_t i = 0; i < len; i++) {
+		data[i] = rand() % 256; //bulk data may contain CR and LF
+	}
+	int choice = rand() % ((level > max_depth) ? 14 : 18);
+	switch(choice) {
+	case 0:
+		write_line(stream, level, '+', RT_OK, "OK");
+		break;
+	case 1:
+		write_line(stream, level, '-', RT_ERROR, "ERR unknown command");
+		break;
+	case 2:
+		snprintf(line, sizeof(line), "%ld", (long)rand() - RAND_MAX / 2);
+		write_line(stream, level, ':', RT_INTEGER, line);
+		break;
+	case 3:
+	case 4:
+	case 5:
+		write_bulk(stream, level, '$', RT_BULK, data, len);
+		break;
+	case 6:
+		Buffer_write(stream->data, "$-1\r\n", 5);
+		expect(stream->expected, level, RT_BULK_NIL, NULL, 0);
+		break;
+	case 7:
+		Buffer_write(stream->data, "*-1\r\n", 5);
+		expect(stream->expected, level, RT_MULTIBULK_NIL, NULL, 0);
+		break;
+	case 8:
+		write_line(stream, level, '_', RT_NIL, "");
+		break;
+	case 9:
+		write_line(stream, level, ',', RT_DOUBLE, "-3.14e+10");
+		break;
+	case 10:
+		write_line(stream, level, '#', RT_BOOLEAN, (rand() % 2) ? "t" : "f");
+		break;
+	case 11:
+		write_line(stream, level, '(', RT_BIG_NUMBER, "3492890328409238509324850943850943825024385");
+		break;
+	case 12:
+		memcpy(data, "txt:", 4);
+		write_bulk(stream, level, '=', RT_VERBATIM, data, (len < 4) ? 4 : len);
+		break;
+	case 13:
+		write_bulk(stream, level, '!', RT_ERROR, data, len);
+		break;
+	case 14:
+	case 15: {
+		size_t count = (rand() % 2) ? rand() % 4 : rand() % 40;
+		write_aggregate(stream, level, '*', RT_MULTIBULK, count);
+		for(size_t i = 0; i < count; i++) {
+			generate(stream, level + 1, max_depth);
+		}
+		break;
+	}
+	case 16: {
+		size_t count = rand() % 8;
+		write_aggregate(stream, level, '%', RT_MAP, count);
+		for(size_t i = 0; i < count * 2; i++) {
+			generate(stream, level + 1, max_depth);
+		}
+		break;
+	}
+	case 17: {
+		size_t count = rand() % 8;
+		//pushes are only sent out of band, but nested they are parsed like any other aggregate
+		char prefix = (level > 1 && rand() % 2) ? '>' : '~';
+		write_aggregate(stream, level, prefix, (prefix == '>') ? RT_PUSH : RT_SET, count);
+		for(size_t i = 0; i < count; i++) {
+			generate(stream, level + 1, max_depth);
+		}
+		break;
+	}
+	}
+}
+
+/**
+ * Writes what Batch_next_reply returns for all replies of a batch that was not iterated yet to out, in the format of
+ * the expected replies.
+ */
+static void dump(Batch *batch, Buffer *out)
+{
+	int level;
+	ReplyType type;
+	char *data;
+	size_t len;
+	while((level = Batch_next_reply(batch, &type, &data, &len)) > 0) {
+		expect(out, level, type, data, len);
+	}
+}
+
+/**
+ * Parses count replies from the stream into the read buffer of the batch, like Connection_read_data would. The stream is
+ * fed to the parser in one read if max_read is 0, and otherwise in reads of random size up to max_read bytes.
+ * Returns 0 if all replies were parsed and -1 on a parse error (or if the stream ran out).
+ */
+static int parse(Batch *batch, Buffer *stream, size_t count, size_t max_read)
+{
+	ReplyParser *rp = ReplyParser_new();
+	Buffer *buffer = Batch_read_buffer(batch);
+	char *data = (char *)Buffer_data(stream);
+	size_t size = Buffer_position(stream);
+	size_t pos = 0;
+	int res = 0;
+	Batch_write(batch, NULL, 0, count);
+	while(Batch_has_command(batch)) {
+		ReplyParserResult result = ReplyParser_execute(rp, buffer, Buffer_position(buffer), Batch_replies(batch));
+		if(result == RPR_REPLY) {
+			ReplyArray *replies = Batch_replies(batch);
+			if(ReplyArray_get(replies, replies->committed)->type == RT_PUSH) {
+				Batch_add_push(batch);
+			}
+			else {
+				Batch_add_reply(batch);
+			}
+		}
+		else if(result == RPR_MORE && pos < size) {
+			size_t read = (max_read == 0) ? size - pos : 1 + (rand() % max_read);
+			read = MIN(read, size - pos);
+			Buffer_write(buffer, data + pos, read);
+			pos += read;
+		}
+		else {
+			res = -1;
+			break;
+		}
+	}
+	ReplyParser_free(rp);
+	return res;
+}
+
+/**
+ * Parses the stream in all the ways and compares the replies with the expected ones.
+ */
+static void check_stream(const char *name, Stream *stream)
+{
+	static const size_t max_reads[] = {0, 1, 7, 100, 4096};
+	static const size_t lazy_thresholds[] = {0, 1, 3, 16};
+	Buffer *out = Buffer_new(Buffer_position(stream->expected));
+	for(int scalar = 0; scalar < 2; scalar++) {
+		Scan_find_cr = scalar ? find_cr_scalar : find_cr_runtime;
+		for(int i = 0; i < sizeof(max_reads) / sizeof(size_t); i++) {
+			for(int j = 0; j < sizeof(lazy_thresholds) / sizeof(size_t); j++) {
+				Batch *batch = Batch_new();
+				Batch_set_lazy_threshold(batch, lazy_thresholds[j]);
+				int res = parse(batch, stream->data, stream->count, max_reads[i]);
+				CHECK(res == 0, "%s: parse error (scalar %d, max read %zu, lazy threshold %zu)", name, scalar, max_reads[i],
+						lazy_thresholds[j]);
+				Buffer_clear(out);
+				dump(batch, out);
+				CHECK(Buffer_position(out) == Buffer_position(stream->expected) &&
+						memcmp(Buffer_data(out), Buffer_data(stream->expected), Buffer_position(out)) == 0,
+						"%s: unexpected replies (scalar %d, max read %zu, lazy threshold %zu)", name, scalar, max_reads[i],
+						lazy_thresholds[j]);
+				Batch_free(batch);
+			}
+		}
+	}
+	Scan_find_cr = find_cr_runtime;
+	Buffer_free(out);
+}
+
+static void test_random(int max_depth)
+{
+	Stream stream;
+	Stream_init(&stream);
+	for(int i = 0; i < 2000; i++) {
+		generate(&stream, 1, max_depth);
+		stream.count++;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "random (depth %d)", max_depth);
+	check_stream(name, &stream);
+	Stream_release(&stream);
+}
+
+/**
+ * Walks the children of the aggregate replies with Batch_reply_child_at in a random order, the lazy ones are decoded
+ * from a cursor that must restart when going back.
+ */
+static void check_children(Batch *batch, Batch *reference)
+{
+	for(size_t index = 0; index < Batch_reply_count(batch); index++) {
+		ReplyType type;
+		char *data;
+		size_t len;
+		Batch_reply_at(batch, index, &type, &data, &len);
+		if(!Reply_is_aggregate(type) || len == 0) {
+			continue;
+		}
+		for(int i = 0; i < 20; i++) {
+			size_t child = (i % 4 == 0) ? len - 1 - (rand() % len) : rand() % len;
+			ReplyType type1, type2;
+			char *data1, *data2;
+			size_t len1, len2;
+			Batch_reply_child_at(batch, index, child, &type1, &data1, &len1);
+			Batch_reply_child_at(reference, index, child, &type2, &data2, &len2);
+			CHECK(type1 == type2 && len1 == len2 && (data1 == NULL) == (data2 == NULL) &&
+					(data1 == NULL || memcmp(data1, data2, len1) == 0), "reply %zu child %zu differs", index, child);
+		}
+	}
+}
+
+/**
+ * The read buffer of a freed batch goes back to the pool and is handed to the next batch, the lazy replies of that
+ * batch must only be decoded from its own stream.
+ */
+static void test_lazy_recycled()
+{
+	for(int round = 0; round < 20; round++) {
+		Stream stream;
+		Stream_init(&stream);
+		for(int i = 0; i < 50; i++) {
+			generate(&stream, 1, 3);
+			stream.count++;
+		}
+		Batch *lazy = Batch_new();
+		Batch_set_lazy_threshold(lazy, 1 + (round % 4));
+		CHECK(parse(lazy, stream.data, stream.count, (round % 2) ? 64 : 0) == 0, "lazy recycled: parse error");
+		Batch *eager = Batch_new();
+		CHECK(parse(eager, stream.data, stream.count, 0) == 0, "lazy recycled: parse error");
+
+		check_children(lazy, eager);
+		Buffer *out = Buffer_new(Buffer_position(stream.expected));
+		dump(lazy, out);
+		CHECK(Buffer_position(out) == Buffer_position(stream.expected) &&
+				memcmp(Buffer_data(out), Buffer_data(stream.expected), Buffer_position(out)) == 0,
+				"lazy recycled: unexpected replies in round %d", round);
+		Buffer_free(out);
+
+		Batch_free(eager);
+		Batch_free(lazy);
+		Stream_release(&stream);
+	}
+}
+
+/**
+ * Compares Scan_find_cr with the scalar search for every position of the CR (or none) in the first few vector widths,
+ * and for every alignment of the data. A CR just past the end must not be found.
+ */
+static void test_find_cr()
+{
+	Byte data[32 + 96 + 1];
+	for(size_t align = 0; align < 32; align++) {
+		Byte *p = data + align;
+		for(size_t len = 0; len <= 96; len++) {
+			for(size_t cr = 0; cr <= len; cr++) {
+				memset(data, 'x', sizeof(data));
+				p[len] = CR;
+				if(cr < len) {
+					p[cr] = CR;
+					p[len - 1] = CR;
+				}
+				size_t found = Scan_find_cr(p, len);
+				CHECK(found == find_cr_scalar(p, len), "find cr: %zu instead of %zu (align %zu, len %zu)", found,
+						find_cr_scalar(p, len), align, len);
+			}
+		}
+	}
+}
+
+/**
+ * Scan_length of "<digits>\r\n" followed by tail more bytes, with the digits converted 8 at a time or one by one
+ * depending on the number of digits and on how many bytes follow them.
+ */
+static int scan_length(const char *digits, const char *end, size_t tail, long *value)
+{
+	Byte data[64];
+	size_t len = snprintf((char *)data, sizeof(data), "%s%s", digits, end);
+	memset(data + len, CR, tail);
+	return Scan_length(data, len + tail, value);
+}
+
+static void test_scan_length()
+{
+	static const char invalid[] = "/:a +\n";
+	char digits[32];
+	for(int negative = 0; negative < 2; negative++) {
+		for(size_t n = 1; n <= 20; n++) {
+			for(int round = 0; round < 20; round++) {
+				size_t i = 0;
+				if(negative) {
+					digits[i++] = '-';
+				}
+				for(size_t j = 0; j < n; j++) {
+					//leading zeros in some rounds
+					digits[i++] = (round % 3 == 0 && j < n / 2) ? '0' : '0' + (rand() % 10);
+				}
+				digits[i] = '\0';
+				for(size_t tail = 0; tail <= 10; tail++) {
+					long value = 0;
+					int res = scan_length(digits, "\r\n", tail, &value);
+					if(n > 18) {
+						CHECK(res == -1, "scan length %s: %d instead of -1", digits, res);
+						continue;
+					}
+					CHECK(res == i + 2 && value == strtol(digits, NULL, 10), "scan length %s (tail %zu): %d, %ld", digits, tail,
+							res, value);
+					//incomplete
+					for(size_t cut = 0; cut < i + 2; cut++) {
+						Byte data[64];
+						memcpy(data, digits, i);
+						memcpy(data + i, "\r\n", 2);
+						CHECK(Scan_length(data, cut, &value) == 0, "scan length %s cut at %zu is not incomplete", digits, cut);
+					}
+					CHECK(scan_length(digits, "\rx", tail, &value) == -1, "scan length %s without LF is valid", digits);
+					//a character that is not a digit at every position
+					char wrong[32];
+					for(size_t j = negative; j < i; j++) {
+						strcpy(wrong, digits);
+						wrong[j] = invalid[(j + round) % (sizeof(invalid) - 1)];
+						CHECK(scan_length(wrong, "\r\n", tail, &value) == -1, "scan length %s is valid", wrong);
+					}
+				}
+			}
+		}
+	}
+	long value;
+	CHECK(scan_length("", "\r\n", 8, &value) == -1, "scan length of no digits is valid");
+	CHECK(scan_length("-", "\r\n", 8, &value) == -1, "scan length of - is valid");
+	CHECK(scan_length("1-2", "\r\n", 8, &value) == -1, "scan length of 1-2 is valid");
+	CHECK(scan_length("--1", "\r\n", 8, &value) == -1, "scan length of --1 is valid");
+}
+
+/**
+ * Replies whose terminating CR falls on every offset within and around a vector, and lengths written with leading
+ * zeros up to the maximum number of digits.
+ */
+static void test_boundaries()
+{
+	Stream stream;
+	Stream_init(&stream);
+	char data[100];
+	for(size_t len = 0; len <= 96; len++) {
+		for(size_t i = 0; i < len; i++) {
+			data[i] = 'a' + (i % 26);
+		}
+		data[len] = '\0';
+		write_line(&stream, 1, '+', RT_OK, data);
+		data[len / 2] = CR;
+		write_bulk(&stream, 1, '$', RT_BULK, data, len);
+		stream.count += 2;
+	}
+	char header[32];
+	for(int digits = 1; digits <= 18; digits++) {
+		memcpy(data, "0123456789abcdefghijklmnopqrstuvwxyz", 36);
+		size_t len = digits * 2;
+		Buffer_write(stream.data, header, snprintf(header, sizeof(header), "$%0*zu\r\n", digits, len));
+		Buffer_write(stream.data, data, len);
+		Buffer_write(stream.data, "\r\n", 2);
+		expect(stream.expected, 1, RT_BULK, data, len);
+		Buffer_write(stream.data, header, snprintf(header, sizeof(header), "*%0*d\r\n", digits, 1));
+		expect(stream.expected, 1, RT_MULTIBULK, NULL, 1);
+		write_line(&stream, 2, ':', RT_INTEGER, "-1");
+		stream.count += 2;
+	}
+	check_stream("boundaries", &stream);
+	Stream_release(&stream);
+
+	//lengths that are too long are refused however they arrive
+	static const char *invalid[] = {"$1000000000000000000\r\n", "*1000000000000000000\r\n", "*999999999999999999\r\n",
+			"$999999999999999999\r\n", "*-2\r\n", "$12a\r\n", "*1\r\r\n:1\r\n"};
+	Buffer *buffer = Buffer_new(64);
+	for(int i = 0; i < sizeof(invalid) / sizeof(char *); i++) {
+		Buffer_clear(buffer);
+		Buffer_write(buffer, invalid[i], strlen(invalid[i]));
+		Buffer_write(buffer, "+padding for the fragmented reads\r\n", 35);
+		static const size_t max_reads[] = {0, 1, 7};
+		for(int j = 0; j < sizeof(max_reads) / sizeof(size_t); j++) {
+			Batch *batch = Batch_new();
+			CHECK(parse(batch, buffer, 1, max_reads[j]) == -1, "invalid reply %d is parsed (max read %zu)", i, max_reads[j]);
+			Batch_free(batch);
+		}
+	}
+	Buffer_free(buffer);
+}
+
+/**
+ * Writes a reply nested depth levels deep, every level is a multibulk reply with a bulk before and after the next level.
+ */
+static void write_nested(Stream *stream, int depth)
+{
+	for(int level = 1; level <= depth; level++) {
+		write_aggregate(stream, level, '*', RT_MULTIBULK, 3);
+		write_bulk(stream, level + 1, '$', RT_BULK, "first", 5);
+	}
+	write_line(stream, depth + 1, ':', RT_INTEGER, "42");
+	for(int level = depth; level >= 1; level--) {
+		write_bulk(stream, level + 1, '$', RT_BULK, "last", 4);
+	}
+	stream->count++;
+}
+
+/**
+ * Aggregate replies nested deeper than the initial stacks of the parser and the reply iterator, and up to the maximum
+ * depth, followed by other replies that must not be taken as their children.
+ */
+static void test_nested()
+{
+	static const int depths[] = {3, 8, 9, 17, 100, 1000};
+	Stream stream;
+	Stream_init(&stream);
+	for(int i = 0; i < sizeof(depths) / sizeof(int); i++) {
+		write_nested(&stream, depths[i]);
+		write_line(&stream, 1, '+', RT_OK, "OK");
+		stream.count++;
+		generate(&stream, 1, 4);
+		stream.count++;
+	}
+	check_stream("nested", &stream);
+
+	Batch *lazy = Batch_new();
+	Batch_set_lazy_threshold(lazy, 3);
+	Batch *eager = Batch_new();
+	CHECK(parse(lazy, stream.data, stream.count, 0) == 0 && parse(eager, stream.data, stream.count, 0) == 0,
+			"nested: parse error");
+	check_children(lazy, eager);
+	Batch_free(eager);
+	Batch_free(lazy);
+	Stream_release(&stream);
+
+	//the deepest reply there can be (the depth of a reply record is an unsigned short)
+	Stream deepest;
+	Stream_init(&deepest);
+	for(int level = 1; level <= REPLY_MAX_DEPTH; level++) {
+		write_aggregate(&deepest, level, '*', RT_MULTIBULK, 1);
+	}
+	write_line(&deepest, REPLY_MAX_DEPTH + 1, ':', RT_INTEGER, "1");
+	deepest.count = 1;
+	check_stream("deepest", &deepest);
+	Stream_release(&deepest);
+
+	//one level deeper is refused
+	Buffer *buffer = Buffer_new(4 * (REPLY_MAX_DEPTH + 2));
+	for(int level = 0; level <= REPLY_MAX_DEPTH; level++) {
+		Buffer_write(buffer, "*1\r\n", 4);
+	}
+	Buffer_write(buffer, ":1\r\n", 4);
+	for(size_t max_read = 0; max_read < 2; max_read++) {
+		Batch *batch = Batch_new();
+		CHECK(parse(batch, buffer, 1, max_read) == -1, "too deep reply is parsed (max read %zu)", max_read);
+		Batch_free(batch);
+	}
+	Buffer_free(buffer);
+}
+
+static void append(Buffer *buffer, Buffer *from, size_t start)
+{
+	Buffer_write(buffer, (char *)Buffer_data(from) + start, Buffer_position(from) - start);
+}
+
+/**
+ * Push replies received between the replies to the commands are returned by Batch_next_reply in the order received,
+ * but are not counted or indexed as replies.
+ */
+static void test_pushes()
+{
+	Stream stream;
+	Stream commands;
+	Stream_init(&stream);
+	Stream_init(&commands);
+	for(int i = 0; i < 500; i++) {
+		while(rand() % 3 == 0) {
+			write_aggregate(&stream, 1, '>', RT_PUSH, 2);
+			write_bulk(&stream, 2, '$', RT_BULK, "invalidate", 10);
+			write_aggregate(&stream, 2, '*', RT_MULTIBULK, 1);
+			write_bulk(&stream, 3, '$', RT_BULK, "foo", 3);
+		}
+		size_t data_start = Buffer_position(commands.data);
+		size_t expected_start = Buffer_position(commands.expected);
+		generate(&commands, 1, 2);
+		commands.count++;
+		append(stream.data, commands.data, data_start);
+		append(stream.expected, commands.expected, expected_start);
+		stream.count++;
+	}
+	check_stream("pushes", &stream);
+
+	Batch *batch = Batch_new();
+	Batch *reference = Batch_new();
+	CHECK(parse(batch, stream.data, stream.count, 0) == 0 && parse(reference, commands.data, commands.count, 0) == 0,
+			"pushes: parse error");
+	CHECK(Batch_reply_count(batch) == commands.count, "pushes: %zu replies for %zu commands", Batch_reply_count(batch),
+			commands.count);
+	for(size_t i = 0; i < commands.count; i++) {
+		ReplyType type1, type2;
+		char *data1, *data2;
+		size_t len1, len2;
+		Batch_reply_at(batch, i, &type1, &data1, &len1);
+		Batch_reply_at(reference, i, &type2, &data2, &len2);
+		CHECK(type1 == type2 && len1 == len2 && (data1 == NULL || memcmp(data1, data2, len1) == 0),
+				"pushes: reply %zu differs", i);
+		//after a seek the reply to the command comes first
+		Batch_seek_reply(batch, i);
+		CHECK(Batch_next_reply(batch, &type1, &data1, &len1) == 1 && type1 == type2 && len1 == len2,
+				"pushes: reply %zu after seek differs", i);
+	}
+	check_children(batch, reference);
+	Batch_free(reference);
+	Batch_free(batch);
+	Stream_release(&commands);
+	Stream_release(&stream);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = (argc > 1) ? atoi(argv[1]) : 42;
+	srand(seed);
+
+	Module *module = Module_new();
+	Module_init(module);
+	find_cr_runtime = Scan_find_cr;
+
+	test_random(0);
+	test_random(2);
+	test_lazy_recycled();
+	test_find_cr();
+	test_scan_length();
+	test_boundaries();
+	test_nested();
+	test_pushes();
+
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures (seed %u)\n", failures, seed);
+		return 1;
+	}
+	printf("all parser tests passed\n");
+	return 0;
+}
@@ -80,6 +80,64 @@ PHP_METHOD(Ketama, add_server)
     Ketama_add_server(Ketama_getThis(), ip, port, weight);
 }
 
+PHP_METHOD(Ketama, remove_server)
+{
+    long ordinal;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "l", &ordinal) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    RETURN_BOOL(Ketama_remove_server(Ketama_getThis(), ordinal) == 0);
+}
+
+PHP_METHOD(Ketama, set_server_weight)
+{
+    long ordinal;
+    long weight;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "ll", &ordinal, &weight) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    RETURN_BOOL(Ketama_set_server_weight(Ketama_getThis(), ordinal, weight) == 0);
+}
+
+PHP_METHOD(Ketama, set_hash)
+{
+    long hash;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "l", &hash) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    RETURN_BOOL(Ketama_set_hash(Ketama_getThis(), (KetamaHash)hash) == 0);
+}
+
+PHP_METHOD(Ketama, save_continuum)
+{
+    char *path;
+    int path_len;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "s", &path, &path_len) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    RETURN_BOOL(Ketama_save_continuum(Ketama_getThis(), path) == 0);
+}
+
+PHP_METHOD(Ketama, load_continuum)
+{
+    char *path;
+    int path_len;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "s", &path, &path_len) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    RETURN_BOOL(Ketama_load_continuum(Ketama_getThis(), path) == 0);
+}
+
 PHP_METHOD(Ketama, get_server_ordinal)
 {
     char *key;
@@ -92,6 +150,40 @@ PHP_METHOD(Ketama, get_server_ordinal)
     RETURN_LONG(Ketama_get_server_ordinal(Ketama_getThis(), key, key_len));
 }
 
+PHP_METHOD(Ketama, set_load_bound)
+{
+    double epsilon;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "d", &epsilon) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    Ketama_set_load_bound(Ketama_getThis(), epsilon);
+}
+
+PHP_METHOD(Ketama, acquire_server)
+{
+    char *key;
+    int key_len;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "s", &key, &key_len) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    RETURN_LONG(Ketama_acquire_server(Ketama_getThis(), key, key_len));
+}
+
+PHP_METHOD(Ketama, release_server)
+{
+    long ordinal;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "l", &ordinal) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    Ketama_release_server(Ketama_getThis(), ordinal);
+}
+
 PHP_METHOD(Ketama, get_server_address)
 {
     long ordinal;
@@ -111,9 +203,17 @@ PHP_METHOD(Ketama, create_continuum)
 function_entry ketama_methods[] = {
     PHP_ME(Ketama,  __destruct,     NULL, ZEND_ACC_PUBLIC | ZEND_ACC_DTOR)
     PHP_ME(Ketama,  add_server,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  remove_server,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  set_server_weight,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  set_hash,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Ketama,  get_server_ordinal,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Ketama,  get_server_address,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  set_load_bound,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  acquire_server,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  release_server,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Ketama,  create_continuum,  NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  save_continuum,  NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Ketama,  load_continuum,  NULL, ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
@@ -315,11 +415,27 @@ PHP_METHOD(Connection, get)
 }
 
 
+PHP_METHOD(Connection, set_protocol)
+{
+    long protocol;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "l", &protocol) == FAILURE) {
+        RETURN_BOOL(0);
+    }
+
+    if(Connection_set_protocol(Connection_getThis(), protocol) == -1) {
+        set_last_error_from_global_error();
+        RETURN_BOOL(0);
+    }
+    RETURN_BOOL(1);
+}
+
 function_entry connection_methods[] = {
     PHP_ME(Connection,  __destruct,     NULL, ZEND_ACC_PUBLIC | ZEND_ACC_DTOR)
     PHP_ME(Connection,  execute,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Connection,  set,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Connection,  get,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Connection,  set_protocol,           NULL, ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
@@ -390,15 +506,22 @@ void Batch_cmd(Batch *batch, int num_args, zval ***varargs)
         }
     }
     // all ok, write the multibulk command
-    Batch_write(batch, "*", 1, 1);
-    Batch_write_decimal(batch, num_args);
-    Batch_write(batch, "\r\n", 2, 0);
+    const char *argv_stack[16];
+    size_t argvlen_stack[16];
+    const char **argv = argv_stack;
+    size_t *argvlen = argvlen_stack;
+    if(num_args > 16) {
+        argv = safe_emalloc(num_args, sizeof(char *), 0);
+        argvlen = safe_emalloc(num_args, sizeof(size_t), 0);
+    }
     for (int i = 0; i < num_args; i++) {
-        Batch_write(batch, "$", 1, 0);
-        Batch_write_decimal(batch, Z_STRLEN_PP(varargs[i]));
-        Batch_write(batch, "\r\n", 2, 0);
-        Batch_write(batch, Z_STRVAL_PP(varargs[i]), Z_STRLEN_PP(varargs[i]), 0);
-        Batch_write(batch, "\r\n", 2, 0);
+        argv[i] = Z_STRVAL_PP(varargs[i]);
+        argvlen[i] = Z_STRLEN_PP(varargs[i]);
+    }
+    Batch_write_command(batch, num_args, argv, argvlen);
+    if(num_args > 16) {
+        efree(argv);
+        efree(argvlen);
     }
 }
 
@@ -417,30 +540,78 @@ PHP_METHOD(Batch, cmd)
     }
 }
 
-PHP_METHOD(Batch, next_reply)
+void Batch_set_reply_zvals(ReplyType c_reply_type, char *c_reply_value, size_t c_reply_length, zval *reply_type, zval *reply_value, zval *reply_length)
 {
-    zval *reply_type;
-    zval *reply_value;
-    zval *reply_length;
+    ZVAL_LONG(reply_type, c_reply_type);
 
-    //not using parameters_ex because of byref args
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "zzz", &reply_type, &reply_value, &reply_length) == FAILURE) {
-        RETURN_NULL();
+    zval_dtor(reply_value); //make sure any previous result is discarded (otherwise we would leak memory here)
+
+    if(c_reply_type == RT_OK ||
+       c_reply_type == RT_ERROR ||
+       c_reply_type == RT_BULK ||
+       c_reply_type == RT_BIG_NUMBER ||
+       c_reply_type == RT_VERBATIM) {
+        if(c_reply_value != NULL && c_reply_length > 0) {
+            ZVAL_STRINGL(reply_value, c_reply_value, c_reply_length, 1);
+        }
+        else {
+            ZVAL_EMPTY_STRING(reply_value);
+        }
+    }
+    else if(c_reply_type == RT_INTEGER) {
+        char *end_value = c_reply_value + c_reply_length;
+        ZVAL_LONG(reply_value, strtol(c_reply_value, &end_value, 10));
+    }
+    else if(c_reply_type == RT_DOUBLE) {
+        //data is not null terminated
+        char buff[64];
+        size_t n = (c_reply_length < sizeof(buff)) ? c_reply_length : sizeof(buff) - 1;
+        memcpy(buff, c_reply_value, n);
+        buff[n] = '\0';
+        ZVAL_DOUBLE(reply_value, zend_strtod(buff, NULL));
     }
+    else if(c_reply_type == RT_BOOLEAN) {
+        ZVAL_BOOL(reply_value, c_reply_length > 0 && c_reply_value[0] == 't');
+    }
+    else {
+        ZVAL_NULL(reply_value);
+    }
+
+    ZVAL_LONG(reply_length, c_reply_length);
+}
 
+int Batch_check_reply_refs(zval *reply_type, zval *reply_value, zval *reply_length)
+{
     if (!PZVAL_IS_REF(reply_type))
     {
        zend_error(E_ERROR, "Parameter wasn't passed by reference (reply_type)");
-       RETURN_NULL();
+       return 0;
     }
     if (!PZVAL_IS_REF(reply_value))
     {
         zend_error(E_ERROR, "Parameter wasn't passed by reference (reply_value)");
-        RETURN_NULL();
+        return 0;
     }
     if (!PZVAL_IS_REF(reply_length))
     {
         zend_error(E_ERROR, "Parameter wasn't passed by reference (reply_length)");
+        return 0;
+    }
+    return 1;
+}
+
+PHP_METHOD(Batch, next_reply)
+{
+    zval *reply_type;
+    zval *reply_value;
+    zval *reply_length;
+
+    //not using parameters_ex because of byref args
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "zzz", &reply_type, &reply_value, &reply_length) == FAILURE) {
+        RETURN_NULL();
+    }
+
+    if (!Batch_check_reply_refs(reply_type, reply_value, reply_length)) {
         RETURN_NULL();
     }
 
@@ -450,31 +621,72 @@ PHP_METHOD(Batch, next_reply)
 
     int res = Batch_next_reply(Batch_getThis(), &c_reply_type, &c_reply_value, &c_reply_length);
 
-    ZVAL_LONG(reply_type, c_reply_type);
+    Batch_set_reply_zvals(c_reply_type, c_reply_value, c_reply_length, reply_type, reply_value, reply_length);
 
-    zval_dtor(reply_value); //make sure any previous result is discarded (otherwise we would leak memory here)
+    RETURN_LONG(res);
+}
 
-    if(c_reply_type == RT_OK ||
-       c_reply_type == RT_ERROR ||
-       c_reply_type == RT_BULK) {
-        if(c_reply_value != NULL && c_reply_length > 0) {
-            ZVAL_STRINGL(reply_value, c_reply_value, c_reply_length, 1);
-        }
-        else {
-            ZVAL_EMPTY_STRING(reply_value);
-        }
+PHP_METHOD(Batch, set_lazy_threshold)
+{
+    long min_children;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "l", &min_children) == FAILURE) {
+        RETURN_NULL();
     }
-    else if(c_reply_type == RT_INTEGER) {
-        char *end_value = c_reply_value + c_reply_length;
-        ZVAL_LONG(reply_value, strtol(c_reply_value, &end_value, 10));
+
+    Batch_set_lazy_threshold(Batch_getThis(), min_children > 0 ? min_children : 0);
+
+    RETURN_ZVAL(getThis(), 1, 0);
+}
+
+PHP_METHOD(Batch, set_coalesce)
+{
+    zend_bool coalesce;
+
+    if (zend_parse_parameters_ex(0, ZEND_NUM_ARGS() TSRMLS_CC, "b", &coalesce) == FAILURE) {
+        RETURN_NULL();
     }
-    else {
-        ZVAL_NULL(reply_value);
+
+    Batch_set_coalesce(Batch_getThis(), coalesce);
+
+    RETURN_ZVAL(getThis(), 1, 0);
+}
+
+PHP_METHOD(Batch, reply_count)
+{
+    RETURN_LONG(Batch_reply_count(Batch_getThis()));
+}
+
+PHP_METHOD(Batch, reply_at)
+{
+    long index;
+    zval *reply_type;
+    zval *reply_value;
+    zval *reply_length;
+
+    //not using parameters_ex because of byref args
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "lzzz", &index, &reply_type, &reply_value, &reply_length) == FAILURE) {
+        RETURN_NULL();
     }
 
-    ZVAL_LONG(reply_length, c_reply_length);
+    if (!Batch_check_reply_refs(reply_type, reply_value, reply_length)) {
+        RETURN_NULL();
+    }
 
-    RETURN_LONG(res);
+    ReplyType c_reply_type;
+    char *c_reply_value;
+    size_t c_reply_length;
+
+    int res = index < 0 ? 0 : Batch_reply_at(Batch_getThis(), index, &c_reply_type, &c_reply_value, &c_reply_length);
+    if(res <= 0) {
+        c_reply_type = RT_NONE;
+        c_reply_value = NULL;
+        c_reply_length = 0;
+    }
+
+    Batch_set_reply_zvals(c_reply_type, c_reply_value, c_reply_length, reply_type, reply_value, reply_length);
+
+    RETURN_BOOL(res > 0);
 }
 
 PHP_METHOD(Batch, execute)
@@ -497,6 +709,13 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_batch_next_rely, 0, 0, 3)
     ZEND_ARG_INFO(1, reply_length)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_batch_reply_at, 0, 0, 4)
+    ZEND_ARG_INFO(0, index)
+    ZEND_ARG_INFO(1, reply_type)
+    ZEND_ARG_INFO(1, reply_value)
+    ZEND_ARG_INFO(1, reply_length)
+ZEND_END_ARG_INFO()
+
 function_entry batch_methods[] = {
     PHP_ME(Batch,  __destruct,     NULL, ZEND_ACC_PUBLIC | ZEND_ACC_DTOR)
     PHP_ME(Batch,  write,           NULL, ZEND_ACC_PUBLIC)
@@ -505,6 +724,10 @@ function_entry batch_methods[] = {
     PHP_ME(Batch,  cmd,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Batch,  execute,           NULL, ZEND_ACC_PUBLIC)
     PHP_ME(Batch,  next_reply,           arginfo_batch_next_rely, ZEND_ACC_PUBLIC)
+    PHP_ME(Batch,  set_lazy_threshold,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Batch,  set_coalesce,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Batch,  reply_count,           NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(Batch,  reply_at,           arginfo_batch_reply_at, ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
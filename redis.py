@@ -43,6 +43,9 @@ class Connection(object):
     def __init__(self, addr):
         self._connection = libredis.Connection_new(addr)
 
+    def set_protocol(self, protocol):
+        libredis.Connection_set_protocol(self._connection, protocol)
+
     def get(self, key, timeout_ms = DEFAULT_TIMEOUT_MS):
         batch = Batch()
         batch.write("GET %s\r\n" % key, 1)
@@ -80,13 +83,21 @@ class Reply(object):
     RT_MULTIBULK_NIL = 4
     RT_MULTIBULK = 5
     RT_INTEGER = 6
+    RT_NIL = 7
+    RT_DOUBLE = 8
+    RT_BOOLEAN = 9
+    RT_BIG_NUMBER = 10
+    RT_VERBATIM = 11
+    RT_MAP = 12
+    RT_SET = 13
+    RT_PUSH = 14
 
     def __init__(self, type, value):
         self.type = type
         self.value = value
         
     def is_multibulk(self):
-        return self.type == self.RT_MULTIBULK
+        return self.type in [self.RT_MULTIBULK, self.RT_MAP, self.RT_SET, self.RT_PUSH]
     
     @classmethod
     def from_next(cls, batch, raise_exception_on_error = True):
@@ -96,11 +107,19 @@ class Reply(object):
         libredis.Batch_next_reply(batch._batch, byref(rt),byref(data), byref(len))
         type = rt.value
         #print repr(type)
-        if type in [cls.RT_OK, cls.RT_ERROR, cls.RT_BULK]:
+        if type in [cls.RT_OK, cls.RT_ERROR, cls.RT_BULK, cls.RT_BIG_NUMBER, cls.RT_VERBATIM]:
             value = string_at(data, len)
             if type == cls.RT_ERROR and raise_exception_on_error:
                 raise RedisError(value)
-        elif type in [cls.RT_MULTIBULK]:
+        elif type == cls.RT_INTEGER:
+            value = int(string_at(data, len))
+        elif type == cls.RT_DOUBLE:
+            value = float(string_at(data, len))
+        elif type == cls.RT_BOOLEAN:
+            value = string_at(data, len) == 't'
+        elif type in [cls.RT_BULK_NIL, cls.RT_MULTIBULK_NIL, cls.RT_NIL]:
+            value = None
+        elif type in [cls.RT_MULTIBULK, cls.RT_MAP, cls.RT_SET, cls.RT_PUSH]:
             value = len
         else:
             assert False
@@ -0,0 +1,285 @@
+"""
+A stand-in for Redis servers, one for each port given, for the tests that need servers (migrate_test, shard_test,
+hedge_test, tracking_test). The servers keep strings in memory and know the commands the tests use: PING, GET, SET,
+DEL, EXISTS, PEXPIRE, PTTL, SCAN, DUMP, RESTORE, FLUSHDB, HELLO, CLIENT ID, CLIENT KILL ID, CLIENT TRACKING ON/OFF
+REDIRECT, CLIENT TRACKINGINFO and DEBUG SLEEP, which delays the reply without blocking the other clients.
+Two commands only the stub has control how fast it answers:
+DEBUG DELAY seconds: delay the replies to all commands of all clients of the server by seconds (0 to stop)
+DEBUG PAUSE seconds: reply, then stop reading from this client for seconds
+SCAN returns the keys in the order they were created, the cursor being the number of the next key, so that deleting
+keys while scanning does not make it skip others. DUMP gives the value with a prefix, that RESTORE checks.
+Client side caching is tracked per key (no BCAST or prefixes), the invalidations are pushed to the redirect client
+as RESP3 'invalidate' pushes, with nil for FLUSHDB.
+usage: python3 redis_stub.py port...
+"""
+
+import socket
+import socketserver
+import sys
+import threading
+import time
+
+DUMP_PREFIX = b"stub-dump:"
+WRITES = (b"SET", b"DEL", b"PEXPIRE", b"RESTORE")
+
+
+class Push(list):
+    """An out of band RESP3 push"""
+
+
+class Nil:
+    """The RESP3 null, e.g. in the invalidation push of a flush"""
+
+
+def encode(value):
+    if value is None:
+        return b"$-1\r\n"
+    if value is Nil:
+        return b"_\r\n"
+    if isinstance(value, int):
+        return b":%d\r\n" % value
+    if isinstance(value, bytes):
+        return b"$%d\r\n%s\r\n" % (len(value), value)
+    if isinstance(value, Push):
+        return b">%d\r\n" % len(value) + b"".join(encode(v) for v in value)
+    if isinstance(value, list):
+        return b"*%d\r\n" % len(value) + b"".join(encode(v) for v in value)
+    if isinstance(value, dict):
+        return b"%%%d\r\n" % len(value) + b"".join(encode(k) + encode(v) for k, v in value.items())
+    return value.encode() + b"\r\n"  # status or error line
+
+
+def read_command(stream):
+    line = stream.readline()
+    if not line:
+        return None
+    count = int(line[1:])
+    args = []
+    for _ in range(count):
+        line = stream.readline()
+        if not line:
+            return None  # the client closed the connection halfway through the command
+        length = int(line[1:])
+        arg = stream.read(length + 2)
+        if len(arg) < length + 2:
+            return None
+        args.append(arg[:-2])
+    return args
+
+
+def now_ms():
+    return int(time.monotonic() * 1000)
+
+
+class Entry:
+    def __init__(self, value, number):
+        self.value = value
+        self.number = number  # order of creation, for SCAN
+        self.expires = None  # in ms, None if the key does not expire
+
+
+class Client:
+    def __init__(self, client_id, sock, wfile):
+        self.id = client_id
+        self.sock = sock
+        self.wfile = wfile
+        self.wlock = threading.Lock()  # pushes are written by the threads of other clients
+        self.protocol = 2
+        self.redirect = None  # client id to send the invalidations to, None if not tracking
+
+    def send(self, value):
+        with self.wlock:
+            try:
+                self.wfile.write(encode(value))
+            except OSError:
+                pass  # it is gone, its own thread sees that
+
+
+class Server:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.data = {}
+        self.created = 0
+        self.next_client_id = 1
+        self.clients = {}  # by id
+        self.tracked = {}  # key -> ids of the clients that read it with tracking on
+        self.delay = 0.0
+
+    def get(self, key):
+        entry = self.data.get(key)
+        if entry is not None and entry.expires is not None and entry.expires <= now_ms():
+            del self.data[key]
+            return None
+        return entry
+
+    def set(self, key, value):
+        self.created += 1
+        self.data[key] = Entry(value, self.created)
+        return self.data[key]
+
+    def invalidate(self, keys):
+        for key in keys:
+            for client_id in self.tracked.pop(key, ()):
+                client = self.clients.get(client_id)
+                target = self.clients.get(client.redirect) if client and client.redirect is not None else None
+                if target is not None:
+                    target.send(Push([b"invalidate", [key]]))
+
+    def flush(self):
+        self.data.clear()
+        self.tracked.clear()
+        for client_id in {c.redirect for c in self.clients.values() if c.redirect is not None}:
+            target = self.clients.get(client_id)
+            if target is not None:
+                target.send(Push([b"invalidate", Nil]))
+
+    def execute_client(self, client, args):
+        sub = args[1].upper() if len(args) > 1 else b""
+        if sub == b"ID":
+            return client.id
+        if sub == b"KILL" and len(args) == 4 and args[2].upper() == b"ID":
+            other = self.clients.get(int(args[3]))
+            if other is None:
+                return "-ERR No such client"
+            other.sock.shutdown(socket.SHUT_RDWR)
+            return "+OK"
+        if sub == b"TRACKING" and len(args) >= 3:
+            if args[2].upper() == b"OFF":
+                client.redirect = None
+                return "+OK"
+            if len(args) == 5 and args[3].upper() == b"REDIRECT":
+                if int(args[4]) not in self.clients:
+                    return "-ERR The client ID you want redirect to does not exist"
+                client.redirect = int(args[4])
+                return "+OK"
+        if sub == b"TRACKINGINFO":
+            flags = [b"on"] if client.redirect is not None else [b"off"]
+            redirect = client.redirect if client.redirect is not None else -1
+            return [b"flags", flags, b"redirect", redirect, b"prefixes", []]
+        return "-ERR unknown subcommand '%s'" % sub.decode(errors="replace")
+
+    def execute(self, args, client):
+        name = args[0].upper()
+        if name == b"PING":
+            return "+PONG"
+        if name == b"FLUSHDB":
+            self.flush()
+            return "+OK"
+        if name == b"CLIENT":
+            return self.execute_client(client, args)
+        if len(args) < 2:
+            return "-ERR wrong number of arguments"
+        if name == b"HELLO":
+            if args[1] not in (b"2", b"3"):
+                return "-NOPROTO unsupported protocol version"
+            client.protocol = int(args[1])
+            return {b"server": b"redis", b"proto": client.protocol}
+        key = args[1]
+        entry = self.get(key)
+        if name in WRITES:
+            self.invalidate(args[1:] if name == b"DEL" else args[1:2])
+        if name == b"GET":
+            if client.redirect is not None:
+                self.tracked.setdefault(key, set()).add(client.id)
+            return entry.value if entry else None
+        if name == b"SET" and len(args) == 3:
+            self.set(key, args[2])
+            return "+OK"
+        if name in (b"DEL", b"EXISTS"):
+            count = 0
+            for k in args[1:]:
+                if self.get(k) is not None:
+                    count += 1
+                    if name == b"DEL":
+                        del self.data[k]
+            return count
+        if name == b"PEXPIRE" and len(args) == 3:
+            if entry is None:
+                return 0
+            entry.expires = now_ms() + int(args[2])
+            return 1
+        if name == b"PTTL":
+            if entry is None:
+                return -2
+            return -1 if entry.expires is None else max(entry.expires - now_ms(), 0)
+        if name == b"DUMP":
+            return DUMP_PREFIX + entry.value if entry else None
+        if name == b"RESTORE" and len(args) >= 4:
+            if entry is not None and b"REPLACE" not in [a.upper() for a in args[4:]]:
+                return "-BUSYKEY Target key name already exists."
+            if not args[3].startswith(DUMP_PREFIX):
+                return "-ERR DUMP payload version or checksum are wrong"
+            entry = self.set(key, args[3][len(DUMP_PREFIX):])
+            if int(args[2]) > 0:
+                entry.expires = now_ms() + int(args[2])
+            return "+OK"
+        if name == b"SCAN":
+            cursor = int(key)
+            count = 10
+            for i in range(2, len(args) - 1):
+                if args[i].upper() == b"COUNT":
+                    count = int(args[i + 1])
+            keys = sorted((e.number, k) for k, e in self.data.items() if e.number >= cursor and self.get(k))
+            page = keys[:count]
+            next_cursor = page[-1][0] + 1 if len(keys) > count else 0
+            return [b"%d" % next_cursor, [k for _, k in page]]
+        return "-ERR unknown command '%s'" % name.decode(errors="replace")
+
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        server = self.server.stub
+        with server.lock:
+            client = Client(server.next_client_id, self.request, self.wfile)
+            server.next_client_id += 1
+            server.clients[client.id] = client
+        try:
+            while True:
+                args = read_command(self.rfile)
+                if args is None:
+                    break
+                pause = 0.0
+                name = args[0].upper()
+                sub = args[1].upper() if len(args) > 1 else b""
+                if name == b"DEBUG" and len(args) == 3 and sub in (b"SLEEP", b"DELAY", b"PAUSE"):
+                    if sub == b"SLEEP":
+                        time.sleep(float(args[2]))
+                    elif sub == b"DELAY":
+                        server.delay = float(args[2])
+                    else:
+                        pause = float(args[2])
+                    reply = "+OK"
+                else:
+                    if server.delay > 0.0:
+                        time.sleep(server.delay)
+                    with server.lock:
+                        reply = server.execute(args, client)
+                client.send(reply)
+                time.sleep(pause)
+        except (ConnectionError, ValueError):
+            pass  # the client gave up on the connection, e.g. after a timeout, or was killed
+        finally:
+            with server.lock:
+                del server.clients[client.id]
+
+
+class TCPServer(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    servers = []
+    for port in sys.argv[1:]:
+        tcp = TCPServer(("127.0.0.1", int(port)), Handler)
+        tcp.stub = Server()
+        servers.append(tcp)
+        threading.Thread(target=tcp.serve_forever, daemon=True).start()
+    try:
+        threading.Event().wait()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,179 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Test of the replica selection of Shard against the stand-in servers of redis_stub.py (127.0.0.1:17201-17204), the
+ * first being the primary. The latencies of the replicas are set by executing batches with DEBUG SLEEP on them.
+ * usage: python3 redis_stub.py 17201 17202 17203 17204 & ./shard_test
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libredis/redis.h"
+
+#define NUM_REPLICAS 3
+#define PROBE_INTERVAL 64 //as in shard.c
+#define LATENCY_ERROR_MS 1000.0 //as in connection.c
+#define LATENCY_WEIGHT 0.2 //as in connection.c
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+static Module *module;
+static Connection *primary;
+static Connection *replicas[NUM_REPLICAS];
+
+static int replica_number(Connection *connection)
+{
+	for(int i = 0; i < NUM_REPLICAS; i++) {
+		if(connection == replicas[i]) {
+			return i;
+		}
+	}
+	return (connection == primary) ? -1 : -2;
+}
+
+/**
+ * Executes a single command on the connection, returns the result of Executor_execute.
+ */
+static int execute(Connection *connection, int argc, const char **argv, int timeout_ms)
+{
+	Batch *batch = Batch_new();
+	Batch_write_command(batch, argc, argv, NULL);
+	Executor *executor = Executor_new();
+	Executor_add(executor, connection, batch);
+	int res = Executor_execute(executor, timeout_ms);
+	Executor_free(executor);
+	Batch_free(batch);
+	return res;
+}
+
+static void sleep_on(Connection *connection, const char *seconds)
+{
+	const char *sleep[] = {"DEBUG", "SLEEP", seconds};
+	CHECK(execute(connection, 3, sleep, 1000) == 1, "DEBUG SLEEP %s: %s", seconds, Module_last_error(module));
+}
+
+static void test_connection()
+{
+	Shard *shard = Shard_new(primary);
+	Batch *read = Batch_new();
+	const char *get[] = {"GET", "foo"};
+	Batch_write_command(read, 2, get, NULL);
+	Batch *write = Batch_new();
+	const char *set[] = {"SET", "foo", "bar"};
+	Batch_write_command(write, 2, get, NULL);
+	Batch_write_command(write, 3, set, NULL);
+
+	CHECK(Shard_get_connection(shard, read) == primary, "read without replicas not on the primary");
+	for(int i = 0; i < NUM_REPLICAS; i++) {
+		Shard_add_replica(shard, replicas[i]);
+	}
+	CHECK(replica_number(Shard_get_connection(shard, read)) >= 0, "read not on a replica");
+	for(int i = 0; i < 2 * PROBE_INTERVAL; i++) {
+		CHECK(Shard_get_connection(shard, write) == primary, "batch with a write not on the primary");
+	}
+
+	Batch_free(read);
+	Batch_free(write);
+	Shard_free(shard);
+}
+
+static void test_latency()
+{
+	Shard *shard = Shard_new(primary);
+	for(int i = 0; i < NUM_REPLICAS; i++) {
+		Shard_add_replica(shard, replicas[i]);
+	}
+	//replicas that did not execute anything yet are tried first
+	CHECK(Shard_get_replica(shard) == replicas[0], "first read not on the first replica");
+	sleep_on(replicas[0], "0.05");
+	sleep_on(replicas[2], "0.02");
+	const char *ping[] = {"PING"};
+	CHECK(execute(replicas[1], 1, ping, 1000) == 1, "PING: %s", Module_last_error(module));
+	CHECK(Connection_get_latency(replicas[1]) < Connection_get_latency(replicas[2]) &&
+			Connection_get_latency(replicas[2]) < Connection_get_latency(replicas[0]),
+			"latencies %.1f %.1f %.1f", Connection_get_latency(replicas[0]), Connection_get_latency(replicas[1]),
+			Connection_get_latency(replicas[2]));
+
+	//all reads go to the fastest replica, but for one in every PROBE_INTERVAL that goes to the next one in turn
+	int probed[NUM_REPLICAS] = {0};
+	int last_probe = -1;
+	int reads = 1; //the first read above
+	for(int i = 0; i < NUM_REPLICAS * PROBE_INTERVAL; i++) {
+		int replica = replica_number(Shard_get_replica(shard));
+		reads++;
+		if(reads % PROBE_INTERVAL == 0) {
+			CHECK(replica >= 0, "probe read %d not on a replica", reads);
+			if(replica >= 0) {
+				probed[replica]++;
+				CHECK(last_probe == -1 || replica == (last_probe + 1) % NUM_REPLICAS, "probe went to replica %d after %d",
+						replica, last_probe);
+				last_probe = replica;
+			}
+		}
+		else {
+			CHECK(replica == 1, "read %d went to replica %d instead of the fastest", reads, replica);
+		}
+	}
+	for(int i = 0; i < NUM_REPLICAS; i++) {
+		CHECK(probed[i] == 1, "replica %d was probed %d times", i, probed[i]);
+	}
+
+	//the fastest replica times out, the penalty makes the reads go to the next fastest
+	const char *sleep[] = {"DEBUG", "SLEEP", "0.3"};
+	CHECK(execute(replicas[1], 3, sleep, 50) != 1, "DEBUG SLEEP did not time out");
+	double latency = Connection_get_latency(replicas[1]);
+	CHECK(latency > LATENCY_WEIGHT * LATENCY_ERROR_MS, "latency after abort is %.1f", latency);
+	for(int i = 0; i < PROBE_INTERVAL; i++) {
+		int replica = replica_number(Shard_get_replica(shard));
+		reads++;
+		if(reads % PROBE_INTERVAL != 0) {
+			CHECK(replica == 2, "read %d after abort went to replica %d", reads, replica);
+		}
+	}
+	//the aborted replica is chosen again once its average drops below that of the others
+	for(int i = 0; i < 30 && Connection_get_latency(replicas[1]) >= Connection_get_latency(replicas[2]); i++) {
+		execute(replicas[1], 1, ping, 1000);
+	}
+	CHECK(replica_number(Shard_get_replica(shard)) == 1, "recovered replica not chosen, latency %.1f",
+			Connection_get_latency(replicas[1]));
+
+	Shard_free(shard);
+}
+
+int main(int argc, char *argv[])
+{
+	module = Module_new();
+	Module_init(module);
+
+	primary = Connection_new("127.0.0.1:17201");
+	char addr[32];
+	for(int i = 0; i < NUM_REPLICAS; i++) {
+		snprintf(addr, sizeof(addr), "127.0.0.1:%d", 17202 + i);
+		replicas[i] = Connection_new(addr);
+	}
+
+	test_connection();
+	test_latency();
+
+	Connection_free(primary);
+	for(int i = 0; i < NUM_REPLICAS; i++) {
+		Connection_free(replicas[i]);
+	}
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all shard tests passed\n");
+	return 0;
+}
@@ -0,0 +1,410 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Tests of ShardedBatch that need no Redis server. The commands written to the batch of each shard are executed by a
+ * small stand-in for the server of that shard (strings only), whose replies are parsed into the batch as
+ * Connection_read_data would. Random commands are written to a sharded batch and to a plain batch executed on a single
+ * server, the replies must be the same. A shard can be made to fail every command, or to send push replies.
+ * usage: ./sharded_test [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "libredis/redis.h"
+#include "libredis/module.h"
+#include "libredis/batch.h"
+#include "libredis/buffer.h"
+#include "libredis/parser.h"
+#include "libredis/reply.h"
+#include "libredis/sharded.h"
+
+#define NUM_SHARDS 3
+#define MAX_ITEMS 64
+#define MAX_ARGS 16
+#define ITEM_SIZE 16
+#define NUM_KEYS 12
+#define NUM_TAGGED 4
+#define NUM_ROUNDS 300
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+typedef struct _Item
+{
+	char key[ITEM_SIZE];
+	char value[ITEM_SIZE];
+} Item;
+
+typedef struct _Server
+{
+	Item items[MAX_ITEMS];
+	int count;
+	int down; //replies with an error to every command
+	int pushes; //sends a push reply before every reply
+} Server;
+
+static Item *Server_find(Server *server, const char *key)
+{
+	for(int i = 0; i < server->count; i++) {
+		if(strcmp(server->items[i].key, key) == 0) {
+			return &server->items[i];
+		}
+	}
+	return NULL;
+}
+
+static void reply_bulk(Buffer *out, const char *value)
+{
+	char line[64];
+	if(value == NULL) {
+		Buffer_write(out, "$-1\r\n", 5);
+	}
+	else {
+		Buffer_write(out, line, snprintf(line, sizeof(line), "$%zu\r\n%s\r\n", strlen(value), value));
+	}
+}
+
+static void reply_line(Buffer *out, const char *line)
+{
+	Buffer_write(out, line, strlen(line));
+	Buffer_write(out, "\r\n", 2);
+}
+
+/**
+ * Executes the command and writes its reply to out.
+ */
+static void Server_execute(Server *server, int argc, char **argv, Buffer *out)
+{
+	static const char push[] = ">2\r\n$10\r\ninvalidate\r\n*1\r\n$1\r\nx\r\n";
+	char line[32];
+	const char *name = argv[0];
+	Item *item;
+	if(server->pushes) {
+		Buffer_write(out, push, sizeof(push) - 1);
+	}
+	if(server->down) {
+		reply_line(out, "-ERR down");
+	}
+	else if(strcasecmp(name, "GET") == 0) {
+		item = Server_find(server, argv[1]);
+		reply_bulk(out, (item != NULL) ? item->value : NULL);
+	}
+	else if(strcasecmp(name, "MGET") == 0) {
+		Buffer_write(out, line, snprintf(line, sizeof(line), "*%d\r\n", argc - 1));
+		for(int i = 1; i < argc; i++) {
+			item = Server_find(server, argv[i]);
+			reply_bulk(out, (item != NULL) ? item->value : NULL);
+		}
+	}
+	else if(strcasecmp(name, "SET") == 0 || strcasecmp(name, "MSET") == 0) {
+		for(int i = 1; i + 1 < argc; i += 2) {
+			if((item = Server_find(server, argv[i])) == NULL) {
+				item = &server->items[server->count++];
+				snprintf(item->key, ITEM_SIZE, "%s", argv[i]);
+			}
+			snprintf(item->value, ITEM_SIZE, "%s", argv[i + 1]);
+		}
+		reply_line(out, "+OK");
+	}
+	else if(strcasecmp(name, "DEL") == 0 || strcasecmp(name, "EXISTS") == 0) {
+		int del = strcasecmp(name, "DEL") == 0;
+		int n = 0;
+		for(int i = 1; i < argc; i++) {
+			if((item = Server_find(server, argv[i])) != NULL) {
+				n++;
+				if(del) {
+					*item = server->items[--server->count];
+				}
+			}
+		}
+		Buffer_write(out, line, snprintf(line, sizeof(line), ":%d\r\n", n));
+	}
+	else if(strcasecmp(name, "LRANGE") == 0) {
+		//a nested reply, that is returned as-is with all of its children
+		item = Server_find(server, argv[1]);
+		reply_line(out, "*2");
+		reply_bulk(out, argv[1]);
+		reply_line(out, "*2");
+		reply_bulk(out, (item != NULL) ? item->value : NULL);
+		reply_line(out, ":7");
+	}
+	else {
+		reply_line(out, "-ERR unknown command");
+	}
+}
+
+/**
+ * Decodes the commands written to the batch, executes them on the server, and parses the replies into the batch.
+ */
+static void execute(Batch *batch, Server *server)
+{
+	Buffer *commands = Batch_write_buffer(batch);
+	Buffer *replies = Buffer_new(1024);
+	char *p = (char *)Buffer_data(commands);
+	char *end = p + Buffer_position(commands);
+	char args[MAX_ARGS][ITEM_SIZE];
+	char *argv[MAX_ARGS];
+	while(p < end) {
+		int argc = strtol(p + 1, &p, 10);
+		p += 2;
+		for(int i = 0; i < argc; i++) {
+			int len = strtol(p + 1, &p, 10);
+			snprintf(args[i], ITEM_SIZE, "%.*s", len, p + 2);
+			argv[i] = args[i];
+			p += 2 + len + 2;
+		}
+		Server_execute(server, argc, argv, replies);
+	}
+
+	ReplyParser *rp = ReplyParser_new();
+	Buffer *buffer = Batch_read_buffer(batch);
+	Buffer_write(buffer, (char *)Buffer_data(replies), Buffer_position(replies));
+	while(Batch_has_command(batch)) {
+		ReplyArray *array = Batch_replies(batch);
+		if(ReplyParser_execute(rp, buffer, Buffer_position(buffer), array) != RPR_REPLY) {
+			CHECK(0, "could not parse the replies");
+			break;
+		}
+		if(ReplyArray_get(array, array->committed)->type == RT_PUSH) {
+			Batch_add_push(batch);
+		}
+		else {
+			Batch_add_reply(batch);
+		}
+	}
+	ReplyParser_free(rp);
+	Buffer_free(replies);
+}
+
+static void execute_sharded(ShardedBatch *sharded, Server *servers)
+{
+	for(int i = 0; i < NUM_SHARDS; i++) {
+		Batch *batch = ShardedBatch_get_batch_of(sharded, i);
+		if(batch != NULL) {
+			execute(batch, &servers[i]);
+		}
+	}
+}
+
+/**
+ * Compares all replies of the sharded batch with those of the reference batch.
+ */
+static void compare(ShardedBatch *sharded, Batch *reference, int round)
+{
+	for(int i = 0; ; i++) {
+		ReplyType type, expected_type;
+		char *data, *expected;
+		size_t len, expected_len;
+		int level = ShardedBatch_next_reply(sharded, &type, &data, &len);
+		int expected_level = Batch_next_reply(reference, &expected_type, &expected, &expected_len);
+		int scalar = !Reply_is_aggregate(type) && type != RT_BULK_NIL;
+		CHECK(level == expected_level && type == expected_type && len == expected_len &&
+				(!scalar || len == 0 || memcmp(data, expected, len) == 0),
+				"round %d reply %d: level %d type %d '%.*s' instead of level %d type %d '%.*s'", round, i, level, type,
+				scalar ? (int)len : 0, data, expected_level, expected_type,
+				(!Reply_is_aggregate(expected_type) && expected_type != RT_BULK_NIL) ? (int)expected_len : 0, expected);
+		if(level <= 0 || level != expected_level) {
+			break;
+		}
+	}
+}
+
+static void random_key(char *key)
+{
+	int n = rand() % (NUM_KEYS + NUM_TAGGED);
+	if(n < NUM_KEYS) {
+		snprintf(key, ITEM_SIZE, "k%d", n);
+	}
+	else {
+		snprintf(key, ITEM_SIZE, "{t}%d", n - NUM_KEYS); //all on the same shard
+	}
+}
+
+/**
+ * Writes a random command to both batches.
+ */
+static void write_random(ShardedBatch *sharded, Batch *reference)
+{
+	static const char *names[] = {"GET", "SET", "MGET", "MSET", "DEL", "EXISTS", "LRANGE"};
+	char args[MAX_ARGS][ITEM_SIZE];
+	const char *argv[MAX_ARGS];
+	int op = rand() % 7;
+	int argc = 1;
+	argv[0] = names[op];
+	if(op == 0 || op == 6) {
+		random_key(args[argc++]);
+	}
+	else if(op == 1 || op == 3) {
+		int pairs = (op == 1) ? 1 : 1 + rand() % 4;
+		for(int i = 0; i < pairs; i++) {
+			random_key(args[argc++]);
+			snprintf(args[argc++], ITEM_SIZE, "v%d", rand() % 1000);
+		}
+	}
+	else {
+		int keys = 1 + rand() % 6;
+		for(int i = 0; i < keys; i++) {
+			random_key(args[argc++]);
+		}
+	}
+	for(int i = 1; i < argc; i++) {
+		argv[i] = args[i];
+	}
+	CHECK(ShardedBatch_write_command(sharded, argc, argv, NULL) == 0, "could not write %s: %s", argv[0],
+			Module_last_error(GET_MODULE()));
+	Batch_write_command(reference, argc, argv, NULL);
+}
+
+static void test_random(Ketama *ketama, Connection **connections)
+{
+	Server servers[NUM_SHARDS];
+	Server reference_server;
+	memset(servers, 0, sizeof(servers));
+	memset(&reference_server, 0, sizeof(reference_server));
+	int used[NUM_SHARDS] = {0};
+	for(int round = 0; round < NUM_ROUNDS; round++) {
+		for(int i = 0; i < NUM_SHARDS; i++) {
+			servers[i].pushes = (rand() % 4 == 0);
+		}
+		ShardedBatch *sharded = ShardedBatch_new(ketama, connections);
+		Batch *reference = Batch_new();
+		int count = 1 + rand() % 12;
+		for(int i = 0; i < count; i++) {
+			write_random(sharded, reference);
+		}
+		for(int i = 0; i < NUM_SHARDS; i++) {
+			used[i] |= (ShardedBatch_get_batch_of(sharded, i) != NULL);
+		}
+		execute_sharded(sharded, servers);
+		execute(reference, &reference_server);
+		compare(sharded, reference, round);
+		ShardedBatch_free(sharded);
+		Batch_free(reference);
+	}
+	for(int i = 0; i < NUM_SHARDS; i++) {
+		CHECK(used[i], "no commands for shard %d", i);
+	}
+}
+
+static void check_reply(ShardedBatch *sharded, int level, ReplyType type, const char *expected, const char *what)
+{
+	ReplyType reply_type;
+	char *data;
+	size_t len;
+	int reply_level = ShardedBatch_next_reply(sharded, &reply_type, &data, &len);
+	CHECK(reply_level == level && reply_type == type && len == strlen(expected) &&
+			(len == 0 || memcmp(data, expected, len) == 0), "%s: level %d type %d '%.*s' instead of level %d type %d '%s'", what, reply_level, reply_type,
+			(data != NULL) ? (int)len : 0, (data != NULL) ? data : "", level, type, expected);
+}
+
+/**
+ * A shard that fails: its error is the reply of each of its keys of an MGET, and of DEL and MSET as a whole.
+ */
+static void test_error(Ketama *ketama, Connection **connections)
+{
+	Server servers[NUM_SHARDS];
+	memset(servers, 0, sizeof(servers));
+	const char *keys[NUM_KEYS];
+	char names[NUM_KEYS][ITEM_SIZE];
+	const char *mset[1 + 2 * NUM_KEYS] = {"MSET"};
+	for(int i = 0; i < NUM_KEYS; i++) {
+		snprintf(names[i], ITEM_SIZE, "k%d", i);
+		keys[i] = names[i];
+		mset[1 + 2 * i] = names[i];
+		mset[2 + 2 * i] = names[i]; //the value is the key
+	}
+	ShardedBatch *sharded = ShardedBatch_new(ketama, connections);
+	ShardedBatch_write_command(sharded, 1 + 2 * NUM_KEYS, mset, NULL);
+	execute_sharded(sharded, servers);
+	check_reply(sharded, 1, RT_OK, "OK", "MSET");
+	ShardedBatch_free(sharded);
+
+	int down = Ketama_get_server_ordinal(ketama, keys[0], strlen(keys[0]));
+	int up = -1;
+	servers[down].down = 1;
+	const char *mget[1 + NUM_KEYS] = {"MGET"};
+	memcpy(mget + 1, keys, sizeof(keys));
+	sharded = ShardedBatch_new(ketama, connections);
+	ShardedBatch_write_command(sharded, 1 + NUM_KEYS, mget, NULL);
+	mget[0] = "DEL";
+	ShardedBatch_write_command(sharded, 1 + NUM_KEYS, mget, NULL);
+	ShardedBatch_write_command(sharded, 1 + 2 * NUM_KEYS, mset, NULL);
+	for(int i = 0; i < NUM_KEYS; i++) {
+		const char *get[] = {"GET", keys[i]};
+		ShardedBatch_write_command(sharded, 2, get, NULL);
+	}
+	execute_sharded(sharded, servers);
+
+	ReplyType type;
+	char *data;
+	size_t len;
+	int level = ShardedBatch_next_reply(sharded, &type, &data, &len);
+	CHECK(level == 1 && type == RT_MULTIBULK && len == NUM_KEYS, "MGET: level %d type %d len %zu", level, type, len);
+	for(int i = 0; i < NUM_KEYS; i++) {
+		if(Ketama_get_server_ordinal(ketama, keys[i], strlen(keys[i])) == down) {
+			check_reply(sharded, 2, RT_ERROR, "ERR down", "MGET of a key on the failing shard");
+		}
+		else {
+			check_reply(sharded, 2, RT_BULK, keys[i], "MGET of a key on another shard");
+			up = i;
+		}
+	}
+	CHECK(up != -1, "all keys are on the same shard");
+	check_reply(sharded, 1, RT_ERROR, "ERR down", "DEL");
+	check_reply(sharded, 1, RT_ERROR, "ERR down", "MSET");
+	for(int i = 0; i < NUM_KEYS; i++) {
+		if(Ketama_get_server_ordinal(ketama, keys[i], strlen(keys[i])) == down) {
+			check_reply(sharded, 1, RT_ERROR, "ERR down", "GET of a key on the failing shard");
+		}
+		else {
+			check_reply(sharded, 1, RT_BULK, keys[i], "GET of a key on another shard (set again by the MSET)");
+		}
+	}
+	CHECK(ShardedBatch_next_reply(sharded, &type, &data, &len) == 0, "more replies than commands");
+	ShardedBatch_free(sharded);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = (argc > 1) ? atoi(argv[1]) : 42;
+	srand(seed);
+
+	Module *module = Module_new();
+	Module_init(module);
+
+	Ketama *ketama = Ketama_new();
+	Connection *connections[NUM_SHARDS];
+	for(int i = 0; i < NUM_SHARDS; i++) {
+		char addr[32];
+		snprintf(addr, sizeof(addr), "127.0.0.1:%d", 6379 + i);
+		Ketama_add_server(ketama, "127.0.0.1", 6379 + i, 100);
+		connections[i] = Connection_new(addr); //not connected, the commands are executed by the stand-ins
+	}
+	Ketama_create_continuum(ketama);
+
+	test_random(ketama, connections);
+	test_error(ketama, connections);
+
+	for(int i = 0; i < NUM_SHARDS; i++) {
+		Connection_free(connections[i]);
+	}
+	Ketama_free(ketama);
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures (seed %u)\n", failures, seed);
+		return 1;
+	}
+	printf("all sharded tests passed\n");
+	return 0;
+}
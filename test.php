@@ -8,6 +8,14 @@ define("RT_BULK", 3);
 define("RT_MULTIBULK_NIL", 4);
 define("RT_MULTIBULK", 5);
 define("RT_INTEGER", 6);
+define("RT_NIL", 7);
+define("RT_DOUBLE", 8);
+define("RT_BOOLEAN", 9);
+define("RT_BIG_NUMBER", 10);
+define("RT_VERBATIM", 11);
+define("RT_MAP", 12);
+define("RT_SET", 13);
+define("RT_PUSH", 14);
 
 define("EOL", "\r\n");
 
@@ -0,0 +1,264 @@
+/**
+* Copyright (C) 2010, Hyves (Startphone Ltd.)
+*
+* This module is part of Libredis (http://github.com/toymachine/libredis) and is released under
+* the New BSD License: http://www.opensource.org/licenses/bsd-license.php
+*
+*/
+
+/*
+ * Test of ClientCache against the stand-in server of redis_stub.py (127.0.0.1:17401), which tracks the keys read with
+ * CLIENT TRACKING on and pushes their invalidations to the redirect client. The keys are written on a third connection,
+ * and the connections of the cache are killed with CLIENT KILL to see that it does not keep values it is not told about.
+ * usage: python3 redis_stub.py 17401 & ./tracking_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libredis/redis.h"
+
+#define ADDR "127.0.0.1:17401"
+#define TIMEOUT_MS 1000
+#define PUSH_WAIT_US 100000 //time for an invalidation to arrive
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { if(!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); failures++; } } while(0)
+
+static Module *module;
+static Connection *writer;
+static Connection *connection; //of the cache, reads the values
+static ClientCache *cache;
+static long hits = 0;
+static long misses = 0;
+static long invalidations = 0;
+
+/**
+ * Executes a single command on the connection, returns the batch with its reply (to be freed), or NULL on error.
+ */
+static Batch *execute(Connection *conn, int argc, const char **argv)
+{
+	Batch *batch = Batch_new();
+	Batch_write_command(batch, argc, argv, NULL);
+	Executor *executor = Executor_new();
+	Executor_add(executor, conn, batch);
+	int res = Executor_execute(executor, TIMEOUT_MS);
+	Executor_free(executor);
+	if(res != 1 || Batch_error(batch) != NULL) {
+		printf("could not execute %s: %s\n", argv[0], (res != 1) ? Module_last_error(module) : Batch_error(batch));
+		Batch_free(batch);
+		return NULL;
+	}
+	return batch;
+}
+
+/**
+ * Writes with the writer and waits for the invalidations to arrive.
+ */
+static void write_command(int argc, const char **argv)
+{
+	Batch *batch = execute(writer, argc, argv);
+	CHECK(batch != NULL, "%s failed", argv[0]);
+	if(batch != NULL) {
+		Batch_free(batch);
+	}
+	usleep(PUSH_WAIT_US);
+}
+
+static void set(const char *key, const char *value)
+{
+	const char *argv[] = {"SET", key, value};
+	write_command(3, argv);
+}
+
+/**
+ * Returns the integer reply to a command, or the integer following the bulk 'name' in an array reply, -1 on error.
+ */
+static long integer_reply(Connection *conn, int argc, const char **argv, const char *name)
+{
+	Batch *batch = execute(conn, argc, argv);
+	if(batch == NULL) {
+		return -1;
+	}
+	long result = -1;
+	int found = (name == NULL);
+	int level;
+	ReplyType type;
+	char *data;
+	size_t len;
+	while((level = Batch_next_reply(batch, &type, &data, &len)) > 0) {
+		if(found && type == RT_INTEGER) {
+			result = atol(data);
+			break;
+		}
+		found = (name != NULL && level == 2 && type == RT_BULK && len == strlen(name) && memcmp(data, name, len) == 0);
+	}
+	Batch_free(batch);
+	return result;
+}
+
+static long redirect_id()
+{
+	const char *argv[] = {"CLIENT", "TRACKINGINFO"};
+	return integer_reply(connection, 2, argv, "redirect");
+}
+
+/**
+ * Gets the keys through the cache and checks their values (NULL for a key that does not exist), and the statistics
+ * of the cache, after adding the given numbers to them.
+ */
+static void check_get(int line, size_t n, const char **keys, const char **expected, int add_hits, int add_misses,
+		int add_invalidations)
+{
+	size_t key_lens[8];
+	char *values[8];
+	size_t value_lens[8];
+	for(size_t i = 0; i < n; i++) {
+		key_lens[i] = strlen(keys[i]);
+	}
+	hits += add_hits;
+	misses += add_misses;
+	invalidations += add_invalidations;
+	int res = ClientCache_get(cache, n, keys, key_lens, values, value_lens, TIMEOUT_MS);
+	CHECK(res == 0, "line %d: get failed: %s", line, Module_last_error(module));
+	for(size_t i = 0; res == 0 && i < n; i++) {
+		if(expected[i] == NULL) {
+			CHECK(values[i] == NULL, "line %d: %s is '%.*s' instead of nil", line, keys[i], (int)value_lens[i], values[i]);
+		}
+		else {
+			CHECK(values[i] != NULL && value_lens[i] == strlen(expected[i]) && memcmp(values[i], expected[i], value_lens[i]) == 0,
+					"line %d: %s is '%.*s' instead of '%s'", line, keys[i], values[i] ? (int)value_lens[i] : 3,
+					values[i] ? values[i] : "nil", expected[i]);
+		}
+	}
+	CHECK(ClientCache_get_hits(cache) == hits && ClientCache_get_misses(cache) == misses &&
+			ClientCache_get_invalidations(cache) == invalidations,
+			"line %d: %ld hits, %ld misses, %ld invalidations instead of %ld, %ld, %ld", line,
+			ClientCache_get_hits(cache), ClientCache_get_misses(cache), ClientCache_get_invalidations(cache), hits,
+			misses, invalidations);
+}
+
+#define CHECK_GET(n, keys, expected, add_hits, add_misses, add_invalidations) \
+	check_get(__LINE__, n, keys, expected, add_hits, add_misses, add_invalidations)
+
+static void test_hit_miss()
+{
+	set("k1", "v1");
+	set("k2", "v2");
+	const char *keys[] = {"k1", "k2", "k3"};
+	const char *expected[] = {"v1", "v2", NULL};
+	CHECK_GET(3, keys, expected, 0, 3, 0);
+	CHECK_GET(3, keys, expected, 3, 0, 0);
+}
+
+static void test_invalidate()
+{
+	set("k1", "v1b");
+	const char *keys[] = {"k1", "k2"};
+	const char *expected[] = {"v1b", "v2"};
+	CHECK_GET(2, keys, expected, 1, 1, 1);
+	CHECK_GET(2, keys, expected, 2, 0, 0);
+	const char *del[] = {"DEL", "k2"};
+	write_command(2, del);
+	const char *expected_del[] = {"v1b", NULL};
+	CHECK_GET(2, keys, expected_del, 1, 1, 1);
+}
+
+static void test_flush()
+{
+	const char *flush[] = {"FLUSHDB"};
+	write_command(1, flush);
+	set("k1", "v1c");
+	const char *keys[] = {"k1", "k2", "k3"};
+	const char *expected[] = {"v1c", NULL, NULL};
+	CHECK_GET(3, keys, expected, 0, 3, 1);
+	CHECK_GET(3, keys, expected, 3, 0, 0);
+}
+
+/**
+ * The connection that reads the values is lost, so the server stops tracking its keys. Once that is noticed, on the
+ * next get, the cache is flushed, and tracking is on again when it reconnects.
+ */
+static void test_reconnect()
+{
+	const char *id[] = {"CLIENT", "ID"};
+	long client_id = integer_reply(connection, 2, id, NULL);
+	char client_id_str[32];
+	snprintf(client_id_str, sizeof(client_id_str), "%ld", client_id);
+	const char *kill[] = {"CLIENT", "KILL", "ID", client_id_str};
+	write_command(4, kill);
+	set("k1", "v1d"); //not pushed, the server does not track k1 for the killed connection
+
+	const char *missing[] = {"k4"};
+	size_t key_len = 2;
+	char *value;
+	size_t value_len;
+	misses += 1;
+	CHECK(ClientCache_get(cache, 1, missing, &key_len, &value, &value_len, TIMEOUT_MS) == -1, "get on killed connection");
+	const char *keys[] = {"k1"};
+	const char *expected[] = {"v1d"};
+	CHECK_GET(1, keys, expected, 0, 1, 0);
+	set("k1", "v1e");
+	const char *expected_tracked[] = {"v1e"};
+	CHECK_GET(1, keys, expected_tracked, 0, 1, 1);
+	CHECK(integer_reply(connection, 2, id, NULL) != client_id, "connection was not made again");
+}
+
+/**
+ * The invalidation connection is lost, the cache gets a new client id for it, and tracking is enabled again with that.
+ */
+static void test_lost_invalidations()
+{
+	long redirect = redirect_id();
+	CHECK(redirect > 0, "tracking is off: %ld", redirect);
+	char redirect_str[32];
+	snprintf(redirect_str, sizeof(redirect_str), "%ld", redirect);
+	const char *kill[] = {"CLIENT", "KILL", "ID", redirect_str};
+	write_command(4, kill);
+	set("k1", "v1f"); //not pushed, the client to redirect to is gone
+
+	const char *keys[] = {"k1"};
+	const char *expected[] = {"v1f"};
+	CHECK_GET(1, keys, expected, 0, 1, 0);
+	long new_redirect = redirect_id();
+	CHECK(new_redirect > 0 && new_redirect != redirect, "redirect %ld after losing %ld", new_redirect, redirect);
+	set("k1", "v1g");
+	const char *expected_tracked[] = {"v1g"};
+	CHECK_GET(1, keys, expected_tracked, 0, 1, 1);
+	CHECK_GET(1, keys, expected_tracked, 1, 0, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	module = Module_new();
+	Module_init(module);
+
+	writer = Connection_new(ADDR);
+	connection = Connection_new(ADDR);
+	Connection *invalidation_connection = Connection_new(ADDR);
+	cache = ClientCache_new(connection, invalidation_connection, 1024 * 1024);
+	const char *flush[] = {"FLUSHDB"};
+	write_command(1, flush);
+
+	test_hit_miss();
+	test_invalidate();
+	test_flush();
+	test_reconnect();
+	test_lost_invalidations();
+
+	ClientCache_free(cache);
+	Connection_free(connection);
+	Connection_free(invalidation_connection);
+	Connection_free(writer);
+	Module_free(module);
+
+	if(failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all tracking tests passed\n");
+	return 0;
+}